@@ -0,0 +1,351 @@
+//
+// mtpng - a multithreaded parallel PNG encoder in Rust
+// benches/mtpng.rs - timings of each encoding stage and whole images
+//
+// Copyright (c) 2018-2024 Brooke Vibber
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+//
+
+//
+// Run with:
+//
+//   cargo bench --features bench [-- name-filter]
+//
+// Each benchmark prints one JSON object per line on stdout, with a
+// readable summary on stderr, so results can be saved and compared:
+//
+//   cargo bench --features bench > baseline.jsonl
+//   MTPNG_BENCH_BASELINE=baseline.jsonl cargo bench --features bench
+//
+// With a baseline, any benchmark whose median is more than
+// MTPNG_BENCH_THRESHOLD percent (default 10) slower fails the run.
+// MTPNG_BENCH_TIME sets the seconds spent on each (default 1).
+//
+
+use std::collections::HashMap;
+use std::convert::TryFrom;
+use std::env;
+use std::fs;
+use std::fs::File;
+use std::hint::black_box;
+use std::io;
+use std::path::Path;
+use std::process;
+use std::sync::Arc;
+use std::time::{Duration, Instant};
+
+extern crate png;
+
+extern crate rayon;
+use rayon::ThreadPoolBuilder;
+
+extern crate mtpng;
+use mtpng::{Backend, ColorType, CompressionLevel, Filter, Header, Heuristic, Strategy};
+use mtpng::Mode::{Adaptive, Fixed};
+use mtpng::bench;
+use mtpng::encoder::{Encoder, Options};
+
+// Enough samples for a stable median.
+const MIN_SAMPLES: usize = 10;
+
+struct Result {
+    name: String,
+    median_ns: f64,
+    min_ns: f64,
+    iterations: u64,
+    bytes: usize,
+}
+
+struct Bench {
+    pattern: Option<String>,
+    time: Duration,
+    results: Vec<Result>,
+}
+
+impl Bench {
+    fn new() -> Bench {
+        // cargo passes --bench; anything else is a name filter.
+        let pattern = env::args().skip(1).find(|arg| !arg.starts_with('-'));
+        let seconds = env::var("MTPNG_BENCH_TIME").ok()
+                                                  .and_then(|s| s.parse::<f64>().ok())
+                                                  .unwrap_or(1.0);
+        Bench {
+            pattern,
+            time: Duration::from_secs_f64(seconds),
+            results: Vec::new(),
+        }
+    }
+
+    //
+    // Time func, which processes the given number of bytes per call.
+    // Calls are batched so each sample takes a measurable time, and
+    // the median of the samples is reported.
+    //
+    fn run<F: FnMut()>(&mut self, name: &str, bytes: usize, mut func: F) {
+        if let Some(ref pattern) = self.pattern {
+            if !name.contains(pattern.as_str()) {
+                return;
+            }
+        }
+
+        // Warm up caches and thread pools, and size the batches.
+        let start = Instant::now();
+        func();
+        let once = start.elapsed().max(Duration::from_nanos(1));
+        let per_sample = self.time / MIN_SAMPLES as u32;
+        let batch = (per_sample.as_secs_f64() / once.as_secs_f64()).max(1.0) as u64;
+
+        let mut samples = Vec::new();
+        let mut iterations = 0;
+        let start = Instant::now();
+        while samples.len() < MIN_SAMPLES || start.elapsed() < self.time {
+            let sample_start = Instant::now();
+            for _i in 0 .. batch {
+                func();
+            }
+            samples.push(sample_start.elapsed().as_secs_f64() * 1e9 / batch as f64);
+            iterations += batch;
+        }
+        samples.sort_by(|a, b| a.partial_cmp(b).unwrap());
+
+        let result = Result {
+            name: name.to_string(),
+            median_ns: samples[samples.len() / 2],
+            min_ns: samples[0],
+            iterations,
+            bytes,
+        };
+        let mib_per_s = result.bytes as f64 / result.median_ns * 1e9 / (1024.0 * 1024.0);
+        println!("{{\"name\":\"{}\",\"median_ns\":{:.0},\"min_ns\":{:.0},\"iterations\":{},\"bytes\":{},\"mib_per_s\":{:.1}}}",
+                 result.name, result.median_ns, result.min_ns, result.iterations, result.bytes, mib_per_s);
+        eprintln!("{:<56} {:>14.0} ns {:>10.1} MiB/s", result.name, result.median_ns, mib_per_s);
+        self.results.push(result);
+    }
+
+    //
+    // Compare against a saved run, returning whether anything got
+    // slower than the threshold allows.
+    //
+    fn compare(&self, baseline: &str, threshold: f64) -> io::Result<bool> {
+        let mut medians = HashMap::new();
+        for line in fs::read_to_string(baseline)?.lines() {
+            if let (Some(name), Some(median)) = (field(line, "name"), field(line, "median_ns")) {
+                if let Ok(median) = median.parse::<f64>() {
+                    medians.insert(name.to_string(), median);
+                }
+            }
+        }
+
+        let mut regressed = false;
+        for result in &self.results {
+            if let Some(&old) = medians.get(&result.name) {
+                let change = (result.median_ns / old - 1.0) * 100.0;
+                if change > threshold {
+                    eprintln!("REGRESSION {:<45} {:>+13.1} %", result.name, change);
+                    regressed = true;
+                }
+            }
+        }
+        Ok(regressed)
+    }
+}
+
+//
+// Pull a field's value out of one of our own JSON lines.
+//
+fn field<'a>(line: &'a str, key: &str) -> Option<&'a str> {
+    let pattern = format!("\"{}\":", key);
+    let start = line.find(&pattern)? + pattern.len();
+    let rest = &line[start ..];
+    if let Some(rest) = rest.strip_prefix('"') {
+        rest.find('"').map(|end| &rest[.. end])
+    } else {
+        let end = rest.find(|c| c == ',' || c == '}').unwrap_or(rest.len());
+        Some(&rest[.. end])
+    }
+}
+
+//
+// Rows of noise with some gradient to them, so the filters
+// and compressor see something like photographic data.
+//
+fn synthetic(len: usize, seed: u32) -> Vec<u8> {
+    let mut state = seed;
+    (0 .. len).map(|i| {
+        state = state.wrapping_mul(1103515245).wrapping_add(12345);
+        ((i / 7) as u32 + (state >> 28)) as u8
+    }).collect()
+}
+
+fn bench_filters(bench: &mut Bench) {
+    let mut header = Header::new();
+    header.set_size(1920, 2).unwrap();
+    header.set_color(ColorType::TruecolorAlpha, 8).unwrap();
+    let prev = synthetic(header.stride(), 1);
+    let row = synthetic(header.stride(), 2);
+
+    let filters = [
+        ("none", Filter::None),
+        ("sub", Filter::Sub),
+        ("up", Filter::Up),
+        ("average", Filter::Average),
+        ("paeth", Filter::Paeth),
+    ];
+    for &(name, filter) in filters.iter() {
+        let mut filter = bench::RowFilter::new(header, Fixed(filter), Heuristic::Complexity);
+        bench.run(&format!("filter/{}/rgba8", name), row.len(), || {
+            black_box(filter.filter(&prev, &row));
+        });
+    }
+
+    let filter = bench::RowFilter::new(header, Adaptive, Heuristic::Complexity);
+    bench.run("filter/complexity-scores/rgba8", row.len(), || {
+        black_box(filter.complexity_scores(&prev, &row));
+    });
+
+    let heuristics = [
+        ("complexity", Heuristic::Complexity),
+        ("entropy", Heuristic::Entropy),
+    ];
+    for &(name, heuristic) in heuristics.iter() {
+        let mut filter = bench::RowFilter::new(header, Adaptive, heuristic);
+        bench.run(&format!("filter/adaptive-{}/rgba8", name), row.len(), || {
+            black_box(filter.filter(&prev, &row));
+        });
+    }
+}
+
+fn bench_checksums(bench: &mut Bench) {
+    let data = synthetic(256 * 1024, 3);
+    bench.run("checksum/adler32/256k", data.len(), || {
+        black_box(bench::adler32(&data));
+    });
+    bench.run("checksum/crc32/256k", data.len(), || {
+        black_box(bench::crc32(&data));
+    });
+}
+
+fn bench_deflate(bench: &mut Bench) {
+    let dictionary = synthetic(32 * 1024, 4);
+    let data = synthetic(256 * 1024, 5);
+
+    let cases = [
+        ("zlib-fast", Backend::Zlib, CompressionLevel::Fast, Strategy::Default),
+        ("zlib-default", Backend::Zlib, CompressionLevel::Default, Strategy::Filtered),
+        ("zlib-high", Backend::Zlib, CompressionLevel::High, Strategy::Filtered),
+        ("zlib-rle", Backend::Zlib, CompressionLevel::Default, Strategy::Rle),
+        ("rle", Backend::Rle, CompressionLevel::Fastest, Strategy::Rle),
+    ];
+    for &(name, backend, level, strategy) in cases.iter() {
+        bench.run(&format!("deflate/{}/256k", name), data.len(), || {
+            black_box(bench::compress_chunk(backend, level, strategy, &dictionary, &data, false).unwrap());
+        });
+    }
+}
+
+fn read_sample(path: &Path) -> io::Result<(Header, Arc<Vec<u8>>)> {
+    let mut decoder = png::Decoder::new(File::open(path)?);
+    decoder.set_transformations(png::Transformations::IDENTITY);
+    let mut reader = decoder.read_info()?;
+    let info = reader.info();
+
+    let mut header = Header::new();
+    header.set_size(info.width, info.height)?;
+    header.set_color(ColorType::try_from(info.color_type as u8)?,
+                     info.bit_depth as u8)?;
+
+    let mut data = vec![0u8; reader.output_buffer_size()];
+    reader.next_frame(&mut data)?;
+    Ok((header, Arc::new(data)))
+}
+
+fn bench_encoder(bench: &mut Bench) {
+    // Truecolor photo, and a larger flat-color screenshot.
+    let samples = ["arch-640.png", "track-1280.png"];
+    let threads = [1, 0];
+    let chunk_sizes = [("auto", None), ("128k", Some(128 * 1024))];
+    let levels = [
+        ("fast", CompressionLevel::Fast),
+        ("default", CompressionLevel::Default),
+        ("high", CompressionLevel::High),
+    ];
+
+    let dir = Path::new(env!("CARGO_MANIFEST_DIR")).join("samples");
+    for sample in samples.iter() {
+        // Indexed samples would need their palettes; these have none.
+        let (header, data) = match read_sample(&dir.join(sample)) {
+            Ok(image) => image,
+            Err(e) => {
+                eprintln!("Skipping {}: {}", sample, e);
+                continue;
+            },
+        };
+        for &num_threads in threads.iter() {
+            let pool = ThreadPoolBuilder::new().num_threads(num_threads)
+                                               .build()
+                                               .unwrap();
+            let thread_name = if num_threads == 0 {
+                "all".to_string()
+            } else {
+                num_threads.to_string()
+            };
+            for &(chunk_name, chunk_size) in chunk_sizes.iter() {
+                for &(level_name, level) in levels.iter() {
+                    let name = format!("encode/{}/threads-{}/chunk-{}/{}",
+                                       sample, thread_name, chunk_name, level_name);
+                    bench.run(&name, data.len(), || {
+                        let mut options = Options::new();
+                        options.set_thread_pool(&pool).unwrap();
+                        options.set_compression_level(level).unwrap();
+                        if let Some(size) = chunk_size {
+                            options.set_chunk_size(size).unwrap();
+                        }
+                        let mut encoder = Encoder::new(Vec::new(), &options);
+                        encoder.write_header(&header).unwrap();
+                        encoder.write_image_frame(Arc::clone(&data), header.stride()).unwrap();
+                        black_box(encoder.finish().unwrap());
+                    });
+                }
+            }
+        }
+    }
+}
+
+fn main() {
+    let mut bench = Bench::new();
+    bench_filters(&mut bench);
+    bench_checksums(&mut bench);
+    bench_deflate(&mut bench);
+    bench_encoder(&mut bench);
+
+    if let Ok(baseline) = env::var("MTPNG_BENCH_BASELINE") {
+        let threshold = env::var("MTPNG_BENCH_THRESHOLD").ok()
+                                                         .and_then(|s| s.parse::<f64>().ok())
+                                                         .unwrap_or(10.0);
+        match bench.compare(&baseline, threshold) {
+            Ok(false) => {},
+            Ok(true) => process::exit(1),
+            Err(e) => {
+                eprintln!("Could not read baseline {}: {}", baseline, e);
+                process::exit(2);
+            },
+        }
+    }
+}
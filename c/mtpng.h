@@ -44,13 +44,23 @@ extern "C" {
 //
 #define MTPNG_THREADS_DEFAULT 0
 
+//
+// Pass to mtpng_buffer_pool_new() as the maximum size to use
+// the default, which retains up to 256 MiB of idle buffers.
+//
+#define MTPNG_BUFFER_POOL_DEFAULT 0
+
 //
 // Return type for mtpng functions.
 // Always check the return value, errors are real!
 //
+// MTPNG_RESULT_WOULD_BLOCK is only returned by the non-blocking
+// functions, when nothing could be done without waiting.
+//
 typedef enum mtpng_result_t {
     MTPNG_RESULT_OK = 0,
-    MTPNG_RESULT_ERR = 1
+    MTPNG_RESULT_ERR = 1,
+    MTPNG_RESULT_WOULD_BLOCK = 2
 } mtpng_result;
 
 //
@@ -68,6 +78,19 @@ typedef enum mtpng_filter_t {
     MTPNG_FILTER_PAETH = 4
 } mtpng_filter;
 
+//
+// Heuristics for MTPNG_FILTER_ADAPTIVE, for
+// mtpng_encoder_options_set_filter_heuristic().
+//
+// MTPNG_HEURISTIC_COMPLEXITY is the default behavior, matching
+// libpng. MTPNG_HEURISTIC_ENTROPY is slower but can also pick
+// MTPNG_FILTER_NONE, which helps on screenshots and line art.
+//
+typedef enum mtpng_heuristic_t {
+    MTPNG_HEURISTIC_COMPLEXITY = 0,
+    MTPNG_HEURISTIC_ENTROPY = 1
+} mtpng_heuristic;
+
 //
 // Strategy types for mtpng_encoder_set_strategy_mode().
 //
@@ -82,15 +105,41 @@ typedef enum mtpng_strategy_t {
     MTPNG_STRATEGY_FIXED = 4
 } mtpng_strategy;
 
+//
+// Deflate compressor implementations for
+// mtpng_encoder_options_set_backend().
+//
+// MTPNG_BACKEND_ADAPTIVE is the default behavior.
+//
+typedef enum mtpng_backend_t {
+    MTPNG_BACKEND_ADAPTIVE = -1,
+    MTPNG_BACKEND_ZLIB = 0,
+    MTPNG_BACKEND_RLE = 1
+} mtpng_backend;
+
 //
 // Compression levels for mtpng_encoder_options_set_compression_level().
 //
 typedef enum mtpng_compression_level_t {
+    MTPNG_COMPRESSION_LEVEL_FASTEST = 0,
     MTPNG_COMPRESSION_LEVEL_FAST = 1,
     MTPNG_COMPRESSION_LEVEL_DEFAULT = 6,
     MTPNG_COMPRESSION_LEVEL_HIGH = 9
 } mtpng_compression_level;
 
+//
+// Input channel orders for mtpng_encoder_options_set_channel_order().
+//
+// Color types without alpha may only use RGBA, or BGRA for truecolor;
+// greyscale with alpha may use ARGB for alpha first.
+//
+typedef enum mtpng_channel_order_t {
+    MTPNG_CHANNEL_ORDER_RGBA = 0,
+    MTPNG_CHANNEL_ORDER_BGRA = 1,
+    MTPNG_CHANNEL_ORDER_ARGB = 2,
+    MTPNG_CHANNEL_ORDER_ABGR = 3
+} mtpng_channel_order;
+
 //
 // Color types for mtpng_encoder_set_color().
 //
@@ -102,6 +151,42 @@ typedef enum mtpng_color_t {
     MTPNG_COLOR_TRUECOLOR_ALPHA = 6
 } mtpng_color;
 
+//
+// Interlace methods for mtpng_header_set_interlace().
+//
+typedef enum mtpng_interlace_t {
+    MTPNG_INTERLACE_NONE = 0,
+    MTPNG_INTERLACE_ADAM7 = 1
+} mtpng_interlace;
+
+//
+// APNG frame disposal for mtpng_frame_control_set_dispose_op(),
+// done to the frame's region before the next frame is drawn.
+//
+typedef enum mtpng_dispose_op_t {
+    MTPNG_DISPOSE_OP_NONE = 0,
+    MTPNG_DISPOSE_OP_BACKGROUND = 1,
+    MTPNG_DISPOSE_OP_PREVIOUS = 2
+} mtpng_dispose_op;
+
+//
+// APNG frame blending for mtpng_frame_control_set_blend_op().
+//
+typedef enum mtpng_blend_op_t {
+    MTPNG_BLEND_OP_SOURCE = 0,
+    MTPNG_BLEND_OP_OVER = 1
+} mtpng_blend_op;
+
+//
+// Stages of encoding, for mtpng_trace_func.
+//
+typedef enum mtpng_stage_t {
+    MTPNG_STAGE_FILTER = 0,
+    MTPNG_STAGE_DEFLATE = 1,
+    MTPNG_STAGE_WRITE = 2,
+    MTPNG_STAGE_WAIT = 3
+} mtpng_stage;
+
 #pragma mark Structs
 
 //
@@ -112,6 +197,101 @@ typedef enum mtpng_color_t {
 //
 typedef struct mtpng_threadpool_struct mtpng_threadpool;
 
+//
+// Represents a pool of reusable chunk buffers, which may be
+// shared between multiple encoders at once or over time.
+//
+// The contents are private; you will only ever use pointers.
+//
+typedef struct mtpng_buffer_pool_struct mtpng_buffer_pool;
+
+//
+// Represents a cache of compressed chunks from the last image
+// encoded with it, for re-encoding changed images quickly.
+//
+// The contents are private; you will only ever use pointers.
+//
+typedef struct mtpng_chunk_cache_struct mtpng_chunk_cache;
+
+//
+// Represents the smaller color type and bit depth found by scanning
+// an image, along with any palette and transparency data.
+//
+// The contents are private; you will only ever use pointers.
+//
+typedef struct mtpng_color_reduction_struct mtpng_color_reduction;
+
+//
+// Represents collected timings of each stage of each chunk
+// of an encode.
+//
+// The contents are private; you will only ever use pointers.
+//
+typedef struct mtpng_stats_struct mtpng_stats;
+
+//
+// Timings and sizes for one chunk of image data, from
+// mtpng_stats_get_chunk(). Times are in nanoseconds.
+//
+typedef struct mtpng_chunk_stats_t {
+    // Index of the chunk, counting across animation frames.
+    size_t index;
+    size_t rows;
+
+    // Filtered bytes including filter type bytes, and compressed bytes.
+    size_t bytes_in;
+    size_t bytes_out;
+
+    // From all the chunk's rows coming in until filtering started.
+    uint64_t queue_wait_ns;
+    uint64_t filter_ns;
+    // From filtering until compression started, waiting on the
+    // previous chunk's filtering for a dictionary.
+    uint64_t handoff_wait_ns;
+    uint64_t deflate_ns;
+    // From compression until written out, waiting on earlier chunks.
+    uint64_t output_wait_ns;
+    uint64_t write_ns;
+
+    // Rows filtered with each filter type, indexed by mtpng_filter.
+    size_t filters[5];
+
+    // Whether the compressed data came from a chunk cache.
+    bool reused;
+} mtpng_chunk_stats;
+
+//
+// Totals for an encode, from mtpng_stats_get_summary().
+// Times are in nanoseconds.
+//
+typedef struct mtpng_stats_summary_t {
+    // Chunks written out so far.
+    size_t chunks;
+    size_t threads;
+
+    // From writing the header until the last chunk was written out.
+    uint64_t elapsed_ns;
+
+    // Sums over the chunks; see mtpng_chunk_stats.
+    size_t bytes_in;
+    size_t bytes_out;
+    uint64_t queue_wait_ns;
+    uint64_t filter_ns;
+    uint64_t handoff_wait_ns;
+    uint64_t deflate_ns;
+    uint64_t output_wait_ns;
+    uint64_t write_ns;
+    size_t filters[5];
+    size_t reused;
+
+    // Time the encoder's thread spent blocked on the workers.
+    uint64_t blocked_ns;
+
+    // Thread time over the elapsed time not spent filtering or
+    // compressing, on all threads together.
+    uint64_t worker_idle_ns;
+} mtpng_stats_summary;
+
 //
 // Represents configuration options for the PNG encoder.
 //
@@ -127,6 +307,14 @@ typedef struct mtpng_encoder_options_struct mtpng_encoder_options;
 //
 typedef struct mtpng_header_struct mtpng_header;
 
+//
+// Represents an APNG animation frame's placement and timing,
+// belonging in the fcTL frame control chunk.
+//
+// The contents are private; you will only ever use pointers.
+//
+typedef struct mtpng_frame_control_struct mtpng_frame_control;
+
 //
 // Represents a PNG encoder instance, which can encode a single
 // image and then must be released. Multiple encoders may share
@@ -136,9 +324,32 @@ typedef struct mtpng_header_struct mtpng_header;
 //
 typedef struct mtpng_encoder_struct mtpng_encoder;
 
+//
+// Represents a batch of encoders working on many images at once,
+// sharing a thread pool between them.
+//
+// The contents are private; you will only ever use pointers.
+//
+typedef struct mtpng_batch_encoder_struct mtpng_batch_encoder;
+
+//
+// Represents configuration options for the PNG decoder.
+//
+// The contents are private; you will only ever use pointers.
+//
+typedef struct mtpng_decoder_options_struct mtpng_decoder_options;
+
+//
+// Represents a PNG decoder instance, which can decode a single
+// image and then must be released. Multiple decoders may share
+// a single thread pool.
+//
+// The contents are private; you will only ever use pointers.
+//
+typedef struct mtpng_decoder_struct mtpng_decoder;
+
 #pragma mark Function types
 
-#if 0
 //
 // Read callback type for mtpng_decoder_new().
 //
@@ -146,13 +357,12 @@ typedef struct mtpng_encoder_struct mtpng_encoder;
 // a data buffer to copy into. If data is not yet available, you
 // should block until it is.
 //
-// Return the number of bytes copied, or less on end of file or
-// failure.
+// Return the number of bytes copied, which may be less than len,
+// or 0 on end of file or failure.
 //
 typedef size_t (*mtpng_read_func)(void* user_data,
                                   uint8_t* p_bytes,
                                   size_t len);
-#endif
 
 //
 // Write callback type for mtpng_encoder_new().
@@ -170,6 +380,29 @@ typedef size_t (*mtpng_write_func)(void* user_data,
                                    const uint8_t* p_bytes,
                                    size_t len);
 
+//
+// One buffer of output for mtpng_writev_func, laid out the same
+// as POSIX struct iovec.
+//
+typedef struct mtpng_iovec_t {
+    const uint8_t* p_bytes;
+    size_t len;
+} mtpng_iovec;
+
+//
+// Vectored write callback type for mtpng_encoder_new_vectored().
+//
+// Each PNG chunk's length, tag, data, and CRC arrive together in
+// one call as several buffers, to be written in order. They may be
+// passed straight to writev() or gathered into a socket send.
+//
+// Return the total number of bytes written across all buffers,
+// or less on failure.
+//
+typedef size_t (*mtpng_writev_func)(void* user_data,
+                                    const mtpng_iovec* p_iov,
+                                    size_t iov_count);
+
 //
 // Flush callback type for mtpng_encoder_new().
 //
@@ -185,6 +418,54 @@ typedef size_t (*mtpng_write_func)(void* user_data,
 //
 typedef bool (*mtpng_flush_func)(void* user_data);
 
+//
+// Whence values for mtpng_seek_func, matching lseek() and fseek().
+//
+#define MTPNG_SEEK_SET 0
+#define MTPNG_SEEK_CUR 1
+#define MTPNG_SEEK_END 2
+
+//
+// Seek callback type for mtpng_encoder_new_seekable().
+//
+// Move the output position by offset bytes relative to the start
+// of the output, the current position, or the end, according to
+// whence. Any buffered output must be accounted for.
+//
+// Return the new position from the start of the output, or -1
+// on failure; failure will propagate to abort the encoding process.
+//
+typedef int64_t (*mtpng_seek_func)(void* user_data,
+                                   int64_t offset,
+                                   int whence);
+
+//
+// Notification callback type for mtpng_encoder_set_notify().
+//
+// Called on a worker thread each time a job finishes, after which
+// mtpng_encoder_poll() or mtpng_encoder_try_write_image_rows() may
+// be able to make progress. Keep it quick and thread-safe, such as
+// writing to an eventfd or pipe watched by your event loop.
+//
+typedef void (*mtpng_notify_func)(void* user_data);
+
+//
+// Trace callback type for mtpng_encoder_set_trace().
+//
+// Called with the time a stage took for a chunk, as it finishes:
+// on worker threads for filtering and compression, and on the
+// encoder's thread for writing and waiting. For MTPNG_STAGE_WAIT,
+// chunk is the index of the next chunk of input.
+//
+// start_ns counts from when the callback was set. Keep it quick
+// and thread-safe.
+//
+typedef void (*mtpng_trace_func)(void* user_data,
+                                 mtpng_stage stage,
+                                 size_t chunk,
+                                 uint64_t start_ns,
+                                 uint64_t duration_ns);
+
 #pragma mark ThreadPool
 
 //
@@ -224,221 +505,781 @@ mtpng_threadpool_new(mtpng_threadpool** pp_pool,
 extern mtpng_result
 mtpng_threadpool_release(mtpng_threadpool** pp_pool);
 
-#pragma mark Encoder options
+#pragma mark BufferPool
 
 //
-// Creates a new set of encoder options. Fill out the details
-// and pass in to mtpng_encoder_new(). May be reused on multiple
-// encoders.
-//
-// Free with mtpng_encoder_options_release().
+// Creates a new, empty buffer pool which will retain up to
+// max_bytes of idle chunk buffers for reuse.
+// MTPNG_BUFFER_POOL_DEFAULT (0) means to use the default limit.
 //
-// On input, *pp_options must be NULL.
-// On output, *pp_options will be a pointer to an options instance
+// On input, *pp_pool must be NULL.
+// On output, *pp_pool will be a pointer to a buffer pool instance
 // if successful, or remain unchanged in case of error.
 //
+// Attaching a buffer pool to encoder options lets many encodings
+// of same-sized images reuse memory instead of allocating it anew.
+//
+// A buffer pool may be used with multiple encoders, but caller
+// is responsible for ensuring that the pool lives longer than
+// all the encoders using it.
+//
 // Check the return value for errors.
 //
 extern mtpng_result
-mtpng_encoder_options_new(mtpng_encoder_options** pp_options);
+mtpng_buffer_pool_new(mtpng_buffer_pool** pp_pool,
+                      size_t max_bytes);
 
 //
-// Releases the option set's memory and clears the pointer.
+// Releases the pool's memory and clears the pointer.
 //
-// On input, *pp_options must be a valid instance pointer.
-// On output, *pp_options will be NULL on success or remain unchanged
+// On input, *pp_pool must be a valid instance pointer.
+// On output, *pp_pool will be NULL on success or remain unchanged
 // in case of failure.
 //
+// Caller's responsibility to ensure that no encoders are using
+// the pool.
+//
 // Check the return value for errors.
 //
 extern mtpng_result
-mtpng_encoder_options_release(mtpng_encoder_options** pp_options);
+mtpng_buffer_pool_release(mtpng_buffer_pool** pp_pool);
+
+#pragma mark Chunk cache
 
 //
-// Set the thread pool instance to queue work on.
-//
-// p_pool may be NULL, in which case a default global thread pool
-// will be used. If a thread pool is provided, it is the caller's
-// responsibility to keep the thread pool alive until all encoders
-// using it have been released.
-//
-// Check the return values for errors.
+// Creates a new, empty chunk cache.
 //
-extern mtpng_result
-mtpng_encoder_options_set_thread_pool(mtpng_encoder_options* p_options,
-                                      mtpng_threadpool* p_pool);
-
-
+// On input, *pp_cache must be NULL.
+// On output, *pp_cache will be a pointer to a chunk cache instance
+// if successful, or remain unchanged in case of error.
 //
-// Override the default PNG filter mode selection.
+// Attaching a chunk cache to encoder options keeps each image's
+// compressed chunks, and lets the next image encoded with it reuse
+// those whose rows haven't changed instead of compressing them again.
+// The image size, chunk size, and compression settings need to stay
+// the same for anything to be reused.
 //
-// The default is MTPNG_FILTER_NONE for indexed images and
-// MTPNG_FILTER_ADAPTIVE for all others. Some images compress
-// better with a particular filter.
+// A chunk cache may be used with multiple encoders, but caller
+// is responsible for ensuring that the cache lives longer than
+// all the encoders using it.
 //
 // Check the return value for errors.
 //
 extern mtpng_result
-mtpng_encoder_options_set_filter(mtpng_encoder_options* p_options,
-                                 mtpng_filter filter_mode);
+mtpng_chunk_cache_new(mtpng_chunk_cache** pp_cache);
 
 //
-// Override the default PNG strategy mode selection.
+// Releases the cache's memory and clears the pointer.
+//
+// On input, *pp_cache must be a valid instance pointer.
+// On output, *pp_cache will be NULL on success or remain unchanged
+// in case of failure.
+//
+// Caller's responsibility to ensure that no encoders are using
+// the cache.
 //
 // Check the return value for errors.
 //
 extern mtpng_result
-mtpng_encoder_options_set_strategy(mtpng_encoder_options* p_options,
-                                   mtpng_strategy strategy_mode);
+mtpng_chunk_cache_release(mtpng_chunk_cache** pp_cache);
 
 //
-// Override the default PNG compression level.
+// Get the number of chunks the last finished encode took from the
+// cache rather than compressing.
 //
 // Check the return value for errors.
 //
 extern mtpng_result
-mtpng_encoder_options_set_compression_level(mtpng_encoder_options* p_options,
-                                            mtpng_compression_level compression_level);
+mtpng_chunk_cache_get_reused_chunks(mtpng_chunk_cache* p_cache,
+                                    size_t* p_reused);
+
+#pragma mark Color reduction
 
 //
-// Override the default chunk size for parallel encoding
-// of larger files. Actual chunking will be in terms of
-// rows, so data chunks will be at least the given size
-// in bytes.
+// Scans an image held in memory for the smallest color type and bit
+// depth that holds every pixel exactly, using the thread pool from
+// the given options, or the default pool if p_options is NULL.
 //
-// If there are more chunks in the image's raw data bytes
-// than available CPUs on the thread pool, you should see
-// parallel speedups as long as input data is provided
-// fast enough.
+// Rows must be in PNG byte order, every frame_stride bytes, with len
+// bytes available in all. Indexed color images and those below 8 bits
+// per sample are left as they are.
 //
-// If the file is smaller than the chunk size, currently
-// the speed will be equivalent to running single-threaded.
+// On input, *pp_reduction must be NULL.
+// On output, *pp_reduction will be a pointer to a color reduction
+// instance if successful, or remain unchanged in case of error.
 //
-// chunk_size must be at least 32768 bytes, required for
-// maintaining compression across chunks.
+// To encode with it, attach it to the encoder options, write the
+// header from mtpng_color_reduction_get_header() and any palette and
+// transparency data it has, then the original image rows. Rows
+// with a color that wasn't in the scanned image make the encode fail.
 //
 // Check the return value for errors.
 //
 extern mtpng_result
-mtpng_encoder_options_set_chunk_size(mtpng_encoder_options* p_options,
-                                     size_t chunk_size);
-
-#pragma mark Header
+mtpng_color_reduction_new(mtpng_color_reduction** pp_reduction,
+                          mtpng_header* p_header,
+                          const uint8_t* p_frame,
+                          size_t len,
+                          size_t frame_stride,
+                          mtpng_encoder_options* p_options);
 
 //
-// Creates a new PNG header with default settings. Fill out the details
-// and pass in to mtpng_encoder_write_header(). May be reused on multiple
-// encoders.
+// Releases the color reduction's memory and clears the pointer.
 //
-// Free with mtpng_header_release().
+// On input, *pp_reduction must be a valid instance pointer.
+// On output, *pp_reduction will be NULL on success or remain unchanged
+// in case of failure.
 //
-// On input, *pp_header must be NULL.
-// On output, *pp_header will be a pointer to an options instance
-// if successful, or remain unchanged in case of error.
+// Caller's responsibility to ensure that no encoders are using
+// the color reduction.
 //
 // Check the return value for errors.
 //
 extern mtpng_result
-mtpng_header_new(mtpng_header** pp_header);
+mtpng_color_reduction_release(mtpng_color_reduction** pp_reduction);
 
 //
-// Releases the header's memory and clears the pointer.
-//
-// On input, *pp_header must be a valid instance pointer.
-// On output, *pp_header will be NULL on success or remain unchanged
-// in case of failure.
+// Copy the reduced image header over the given header instance.
 //
 // Check the return value for errors.
 //
 extern mtpng_result
-mtpng_header_release(mtpng_header** pp_header);
+mtpng_color_reduction_get_header(mtpng_color_reduction* p_reduction,
+                                 mtpng_header* p_header);
 
 //
-// Set the image size in pixels. The given width and height
-// values must not be 0, but are not otherwise limited.
-//
-// Caller is responsible for ensuring that at least one row
-// of image data copied a few times fits in memory, or you're
-// gonna have a bad time.
+// Get the palette to write for indexed color output, or NULL and 0
+// if there is none. The data belongs to the color reduction.
 //
 // Check the return value for errors.
 //
 extern mtpng_result
-mtpng_header_set_size(mtpng_header* p_header,
-                      uint32_t width,
-                      uint32_t height);
+mtpng_color_reduction_get_palette(mtpng_color_reduction* p_reduction,
+                                  const uint8_t** pp_bytes,
+                                  size_t* p_len);
 
 //
-// Set the color type and depth for the image.
-//
-// Any valid combination of color type and depth is accepted;
-// see https://www.w3.org/TR/PNG/#table111 for the specs.
-//
-// If you do not call this function, mtpng will assume you want
-// truecolor with alpha at 8-bit depth.
+// Get the transparency data to write for indexed color output with
+// translucent colors, or NULL and 0 if there is none. The data
+// belongs to the color reduction.
 //
 // Check the return value for errors.
 //
 extern mtpng_result
-mtpng_header_set_color(mtpng_header* p_header,
-                       mtpng_color color_type,
-                       uint8_t depth);
+mtpng_color_reduction_get_transparency(mtpng_color_reduction* p_reduction,
+                                       const uint8_t** pp_bytes,
+                                       size_t* p_len);
 
-#pragma mark Encoder
+#pragma mark Stats
 
 //
-// Create a new PNG encoder instance.
-// Copies the options data.
-//
-// On input, *pp_encoder must be NULL.
-// On output, *pp_encoder will be an instance pointer on success,
-// or remain unchanged in case of failure.
+// Create a new, empty set of stats.
 //
-// The write_func and flush_func callbacks are required, and must
-// not be NULL.
+// On input, *pp_stats must be NULL.
+// On output, *pp_stats will be a pointer to a stats instance
+// if successful, or remain unchanged in case of error.
 //
-// user_data is passed to the callback functions, and may be any
-// value such as a private object pointer or NULL.
+// Attach to encoder options to collect timings of each stage of each
+// chunk, to find where the time goes in an encode. Each encode starts
+// the stats afresh when it writes its header, and adds each chunk as
+// it's written out.
 //
-// p_options may be NULL, in which case default options will
-// be used including a global threadpool.
+// Caller is responsible for ensuring that the stats live longer than
+// all the encoders using them.
 //
-// Check the return values for errors.
+// Check the return value for errors.
 //
 extern mtpng_result
-mtpng_encoder_new(mtpng_encoder** pp_encoder,
-                  mtpng_write_func write_func,
-                  mtpng_flush_func flush_func,
-                  void* const user_data,
-                  mtpng_encoder_options* p_options);
+mtpng_stats_new(mtpng_stats** pp_stats);
 
 //
-// Releases the encoder's memory and clears the pointer.
-//
-// This need only be used if aborting encoding early due to
-// errors etc; normally the call to mtpng_encoder_finish()
-// at the end of encoding will consume the instance and
-// release its memory.
+// Releases the stats' memory and clears the pointer.
 //
-// On input, *pp_encoder must be a valid instance pointer.
-// On output, *pp_encoder will be NULL on success, or remain
-// unchanged in case of failure.
+// Check the return value for errors.
 //
-// If using a threadpool, must be called before releasing the
-// threadpool!
+extern mtpng_result
+mtpng_stats_release(mtpng_stats** pp_stats);
+
 //
-// If the encoder is still in use, this may explode.
+// Get the totals over all chunks written out so far.
 //
 // Check the return value for errors.
 //
 extern mtpng_result
-mtpng_encoder_release(mtpng_encoder** pp_encoder);
+mtpng_stats_get_summary(mtpng_stats* p_stats,
+                        mtpng_stats_summary* p_summary);
 
 //
-// Signal that we're done setting up, and start writing
-// header data to the output.
+// Get the number of chunks written out so far.
 //
-// Must be called before mtpng_encoder_append_row() or
+// Check the return value for errors.
+//
+extern mtpng_result
+mtpng_stats_get_chunk_count(mtpng_stats* p_stats,
+                            size_t* p_count);
+
+//
+// Get the stats of one chunk, by its index in output order,
+// which must be less than the chunk count.
+//
+// Check the return value for errors.
+//
+extern mtpng_result
+mtpng_stats_get_chunk(mtpng_stats* p_stats,
+                      size_t index,
+                      mtpng_chunk_stats* p_chunk);
+
+#pragma mark Encoder options
+
+//
+// Creates a new set of encoder options. Fill out the details
+// and pass in to mtpng_encoder_new(). May be reused on multiple
+// encoders.
+//
+// Free with mtpng_encoder_options_release().
+//
+// On input, *pp_options must be NULL.
+// On output, *pp_options will be a pointer to an options instance
+// if successful, or remain unchanged in case of error.
+//
+// Check the return value for errors.
+//
+extern mtpng_result
+mtpng_encoder_options_new(mtpng_encoder_options** pp_options);
+
+//
+// Releases the option set's memory and clears the pointer.
+//
+// On input, *pp_options must be a valid instance pointer.
+// On output, *pp_options will be NULL on success or remain unchanged
+// in case of failure.
+//
+// Check the return value for errors.
+//
+extern mtpng_result
+mtpng_encoder_options_release(mtpng_encoder_options** pp_options);
+
+//
+// Set the thread pool instance to queue work on.
+//
+// p_pool may be NULL, in which case a default global thread pool
+// will be used. If a thread pool is provided, it is the caller's
+// responsibility to keep the thread pool alive until all encoders
+// using it have been released.
+//
+// Check the return values for errors.
+//
+extern mtpng_result
+mtpng_encoder_options_set_thread_pool(mtpng_encoder_options* p_options,
+                                      mtpng_threadpool* p_pool);
+
+//
+// Set the buffer pool instance to recycle chunk buffers through.
+//
+// By default no pool is used, and buffers are freshly allocated
+// for each encoder. If a buffer pool is provided, it is the caller's
+// responsibility to keep the pool alive until all encoders using it
+// have been released.
+//
+// Check the return values for errors.
+//
+extern mtpng_result
+mtpng_encoder_options_set_buffer_pool(mtpng_encoder_options* p_options,
+                                      mtpng_buffer_pool* p_pool);
+
+//
+// Set the chunk cache instance to reuse compressed chunks from,
+// and keep this image's chunks in for the next.
+//
+// By default no cache is used, and every chunk is compressed. If
+// a chunk cache is provided, it is the caller's responsibility to
+// keep the cache alive until all encoders using it have been released.
+//
+// Check the return values for errors.
+//
+extern mtpng_result
+mtpng_encoder_options_set_chunk_cache(mtpng_encoder_options* p_options,
+                                      mtpng_chunk_cache* p_cache);
+
+//
+// Set the color reduction to convert input rows with, on the worker
+// threads. The header written must then be the reduction's, while the
+// image rows stay in the original format.
+//
+// By default no reduction is done. If a color reduction is provided,
+// it is the caller's responsibility to keep it alive until all
+// encoders using it have been released.
+//
+// Check the return values for errors.
+//
+extern mtpng_result
+mtpng_encoder_options_set_color_reduction(mtpng_encoder_options* p_options,
+                                          mtpng_color_reduction* p_reduction);
+
+
+//
+// Override the default PNG filter mode selection.
+//
+// The default is MTPNG_FILTER_NONE for indexed images and
+// MTPNG_FILTER_ADAPTIVE for all others. Some images compress
+// better with a particular filter.
+//
+// Check the return value for errors.
+//
+extern mtpng_result
+mtpng_encoder_options_set_filter(mtpng_encoder_options* p_options,
+                                 mtpng_filter filter_mode);
+
+//
+// Override the heuristic used to pick filters per row
+// in MTPNG_FILTER_ADAPTIVE mode.
+//
+// Check the return value for errors.
+//
+extern mtpng_result
+mtpng_encoder_options_set_filter_heuristic(mtpng_encoder_options* p_options,
+                                           mtpng_heuristic filter_heuristic);
+
+//
+// Enable or disable brute-force filter selection in
+// MTPNG_FILTER_ADAPTIVE mode. Each chunk is filtered every
+// possible way and test compressed, keeping the smallest.
+//
+// Off by default, as it's several times slower.
+//
+// Check the return value for errors.
+//
+extern mtpng_result
+mtpng_encoder_options_set_filter_trials(mtpng_encoder_options* p_options,
+                                        bool filter_trials);
+
+//
+// Override the default PNG strategy mode selection.
+//
+// Check the return value for errors.
+//
+extern mtpng_result
+mtpng_encoder_options_set_strategy(mtpng_encoder_options* p_options,
+                                   mtpng_strategy strategy_mode);
+
+//
+// Override the default deflate compressor selection.
+//
+// Check the return value for errors.
+//
+extern mtpng_result
+mtpng_encoder_options_set_backend(mtpng_encoder_options* p_options,
+                                  mtpng_backend backend_mode);
+
+//
+// Override the default PNG compression level.
+//
+// Check the return value for errors.
+//
+extern mtpng_result
+mtpng_encoder_options_set_compression_level(mtpng_encoder_options* p_options,
+                                            mtpng_compression_level compression_level);
+
+//
+// Override the default chunk size for parallel encoding
+// of larger files. Actual chunking will be in terms of
+// rows, so data chunks will be at least the given size
+// in bytes.
+//
+// If there are more chunks in the image's raw data bytes
+// than available CPUs on the thread pool, you should see
+// parallel speedups as long as input data is provided
+// fast enough.
+//
+// If the file is smaller than the chunk size, currently
+// the speed will be equivalent to running single-threaded.
+//
+// chunk_size must be at least 32768 bytes, required for
+// maintaining compression across chunks, or 0 to pick
+// automatically from the image size, thread count, and
+// compression level, which is the default behavior.
+//
+// Check the return value for errors.
+//
+extern mtpng_result
+mtpng_encoder_options_set_chunk_size(mtpng_encoder_options* p_options,
+                                     size_t chunk_size);
+
+//
+// Set the order of channels in input pixels, if not PNG's own
+// red, green, blue, and alpha. Input in any layout other than PNG
+// byte order is converted on the worker threads as it's filtered.
+//
+// The default is MTPNG_CHANNEL_ORDER_RGBA.
+//
+// Check the return value for errors.
+//
+extern mtpng_result
+mtpng_encoder_options_set_channel_order(mtpng_encoder_options* p_options,
+                                        mtpng_channel_order channel_order);
+
+//
+// Set whether input color samples are premultiplied by alpha,
+// in which case they're divided back out. Needs an alpha channel.
+//
+// Check the return value for errors.
+//
+extern mtpng_result
+mtpng_encoder_options_set_premultiplied_alpha(mtpng_encoder_options* p_options,
+                                              bool premultiplied);
+
+//
+// Set whether 16-bit input samples are least significant byte
+// first, rather than PNG's most significant byte first.
+//
+// Check the return value for errors.
+//
+extern mtpng_result
+mtpng_encoder_options_set_little_endian(mtpng_encoder_options* p_options,
+                                        bool little_endian);
+
+//
+// Set whether input samples for bit depths below 8, such as
+// palette indices, take a byte each instead of being packed.
+//
+// Check the return value for errors.
+//
+extern mtpng_result
+mtpng_encoder_options_set_unpacked_samples(mtpng_encoder_options* p_options,
+                                           bool unpacked);
+
+//
+// Set the distance in bytes from the start of one input row to the
+// next for mtpng_encoder_write_image_rows(), for rows with padding at
+// the end. The default of 0 means rows are contiguous.
+//
+// Check the return value for errors.
+//
+extern mtpng_result
+mtpng_encoder_options_set_input_stride(mtpng_encoder_options* p_options,
+                                       size_t stride);
+
+//
+// Limit the memory held by chunks between input and output to about
+// the given number of bytes, whatever the image height. Once at the
+// limit, mtpng_encoder_write_image_rows() waits for output to catch
+// up before taking another chunk.
+//
+// One chunk is always let in. Interlaced images are held whole, and
+// non-streaming output without a seek function buffers the compressed
+// image, neither of which counts toward the limit.
+//
+// Check the return value for errors.
+//
+extern mtpng_result
+mtpng_encoder_options_set_memory_limit(mtpng_encoder_options* p_options,
+                                       size_t bytes);
+
+//
+// Set the stats instance to collect timings of each stage into.
+//
+// By default no stats are collected. If stats are provided, it is
+// the caller's responsibility to keep them alive until all encoders
+// using them have been released.
+//
+// Check the return value for errors.
+//
+extern mtpng_result
+mtpng_encoder_options_set_stats(mtpng_encoder_options* p_options,
+                                mtpng_stats* p_stats);
+
+#pragma mark Header
+
+//
+// Creates a new PNG header with default settings. Fill out the details
+// and pass in to mtpng_encoder_write_header(). May be reused on multiple
+// encoders.
+//
+// Free with mtpng_header_release().
+//
+// On input, *pp_header must be NULL.
+// On output, *pp_header will be a pointer to an options instance
+// if successful, or remain unchanged in case of error.
+//
+// Check the return value for errors.
+//
+extern mtpng_result
+mtpng_header_new(mtpng_header** pp_header);
+
+//
+// Releases the header's memory and clears the pointer.
+//
+// On input, *pp_header must be a valid instance pointer.
+// On output, *pp_header will be NULL on success or remain unchanged
+// in case of failure.
+//
+// Check the return value for errors.
+//
+extern mtpng_result
+mtpng_header_release(mtpng_header** pp_header);
+
+//
+// Set the image size in pixels. The given width and height
+// values must not be 0, but are not otherwise limited.
+//
+// Caller is responsible for ensuring that at least one row
+// of image data copied a few times fits in memory, or you're
+// gonna have a bad time.
+//
+// Check the return value for errors.
+//
+extern mtpng_result
+mtpng_header_set_size(mtpng_header* p_header,
+                      uint32_t width,
+                      uint32_t height);
+
+//
+// Set the color type and depth for the image.
+//
+// Any valid combination of color type and depth is accepted;
+// see https://www.w3.org/TR/PNG/#table111 for the specs.
+//
+// If you do not call this function, mtpng will assume you want
+// truecolor with alpha at 8-bit depth.
+//
+// Check the return value for errors.
+//
+extern mtpng_result
+mtpng_header_set_color(mtpng_header* p_header,
+                       mtpng_color color_type,
+                       uint8_t depth);
+
+//
+// Set the interlace method for the image.
+//
+// MTPNG_INTERLACE_ADAM7 stores the image in seven passes, so a
+// partial download can show a low-detail preview of the whole
+// image. Files are larger, and no image data is output until all
+// rows have been given to the encoder.
+//
+// If you do not call this function, mtpng will not interlace.
+//
+// Check the return value for errors.
+//
+extern mtpng_result
+mtpng_header_set_interlace(mtpng_header* p_header,
+                           mtpng_interlace interlace_method);
+
+//
+// Get the image size in pixels.
+//
+// Check the return value for errors.
+//
+extern mtpng_result
+mtpng_header_get_size(mtpng_header* p_header,
+                      uint32_t* p_width,
+                      uint32_t* p_height);
+
+//
+// Get the color type and depth for the image.
+//
+// Check the return value for errors.
+//
+extern mtpng_result
+mtpng_header_get_color(mtpng_header* p_header,
+                       mtpng_color* p_color_type,
+                       uint8_t* p_depth);
+
+//
+// Get the interlace method for the image.
+//
+// Check the return value for errors.
+//
+extern mtpng_result
+mtpng_header_get_interlace(mtpng_header* p_header,
+                           mtpng_interlace* p_interlace_method);
+
+//
+// Get the length in bytes of a row of image data, with sub-byte
+// pixels packed together.
+//
+// Check the return value for errors.
+//
+extern mtpng_result
+mtpng_header_get_stride(mtpng_header* p_header,
+                        size_t* p_stride);
+
+#pragma mark Frame control
+
+//
+// Creates a new APNG frame control with default settings: 1x1 pixels
+// at the top left, with no delay, no disposal, and source blending.
+// Fill out the details and pass in to mtpng_encoder_write_frame_control().
+// May be reused for multiple frames.
+//
+// Free with mtpng_frame_control_release().
+//
+// On input, *pp_frame must be NULL.
+// On output, *pp_frame will be a pointer to a frame control instance
+// if successful, or remain unchanged in case of error.
+//
+// Check the return value for errors.
+//
+extern mtpng_result
+mtpng_frame_control_new(mtpng_frame_control** pp_frame);
+
+//
+// Releases the frame control's memory and clears the pointer.
+//
+// On input, *pp_frame must be a valid instance pointer.
+// On output, *pp_frame will be NULL on success or remain unchanged
+// in case of failure.
+//
+// Check the return value for errors.
+//
+extern mtpng_result
+mtpng_frame_control_release(mtpng_frame_control** pp_frame);
+
+//
+// Set the frame size in pixels, which must be non-zero.
+//
+// Check the return value for errors.
+//
+extern mtpng_result
+mtpng_frame_control_set_size(mtpng_frame_control* p_frame,
+                             uint32_t width,
+                             uint32_t height);
+
+//
+// Set the position of the frame's top left corner in the image.
+// The frame must fit within the image; the first frame must cover
+// all of it.
+//
+// Check the return value for errors.
+//
+extern mtpng_result
+mtpng_frame_control_set_offset(mtpng_frame_control* p_frame,
+                               uint32_t x_offset,
+                               uint32_t y_offset);
+
+//
+// Set how long the frame is shown, as a fraction of a second.
+// A denominator of 0 is taken as 100.
+//
+// Check the return value for errors.
+//
+extern mtpng_result
+mtpng_frame_control_set_delay(mtpng_frame_control* p_frame,
+                              uint16_t delay_num,
+                              uint16_t delay_den);
+
+//
+// Set the disposal done after the frame is shown.
+//
+// Check the return value for errors.
+//
+extern mtpng_result
+mtpng_frame_control_set_dispose_op(mtpng_frame_control* p_frame,
+                                   mtpng_dispose_op dispose_op);
+
+//
+// Set how the frame is drawn over the previous one.
+//
+// Check the return value for errors.
+//
+extern mtpng_result
+mtpng_frame_control_set_blend_op(mtpng_frame_control* p_frame,
+                                 mtpng_blend_op blend_op);
+
+#pragma mark Encoder
+
+//
+// Create a new PNG encoder instance.
+// Copies the options data.
+//
+// On input, *pp_encoder must be NULL.
+// On output, *pp_encoder will be an instance pointer on success,
+// or remain unchanged in case of failure.
+//
+// The write_func and flush_func callbacks are required, and must
+// not be NULL.
+//
+// user_data is passed to the callback functions, and may be any
+// value such as a private object pointer or NULL.
+//
+// p_options may be NULL, in which case default options will
+// be used including a global threadpool.
+//
+// Check the return values for errors.
+//
+extern mtpng_result
+mtpng_encoder_new(mtpng_encoder** pp_encoder,
+                  mtpng_write_func write_func,
+                  mtpng_flush_func flush_func,
+                  void* const user_data,
+                  mtpng_encoder_options* p_options);
+
+//
+// Create a new PNG encoder instance writing through a vectored
+// write callback, which saves copying each chunk's pieces into
+// one buffer before output.
+//
+// The writev_func and flush_func callbacks are required, and must
+// not be NULL. Otherwise the same as mtpng_encoder_new().
+//
+// Check the return values for errors.
+//
+extern mtpng_result
+mtpng_encoder_new_vectored(mtpng_encoder** pp_encoder,
+                           mtpng_writev_func writev_func,
+                           mtpng_flush_func flush_func,
+                           void* const user_data,
+                           mtpng_encoder_options* p_options);
+
+//
+// Create a new PNG encoder instance writing to a seekable output,
+// such as a file.
+//
+// When not in streaming mode, compressed image data is written
+// out as it's produced rather than buffered in memory until
+// mtpng_encoder_finish(), then the output is seeked back to fill
+// in the chunk length.
+//
+// The write_func, flush_func, and seek_func callbacks are required,
+// and must not be NULL. Otherwise the same as mtpng_encoder_new().
+//
+// Check the return values for errors.
+//
+extern mtpng_result
+mtpng_encoder_new_seekable(mtpng_encoder** pp_encoder,
+                           mtpng_write_func write_func,
+                           mtpng_flush_func flush_func,
+                           mtpng_seek_func seek_func,
+                           void* const user_data,
+                           mtpng_encoder_options* p_options);
+
+//
+// Releases the encoder's memory and clears the pointer.
+//
+// This need only be used if aborting encoding early due to
+// errors etc; normally the call to mtpng_encoder_finish()
+// at the end of encoding will consume the instance and
+// release its memory.
+//
+// On input, *pp_encoder must be a valid instance pointer.
+// On output, *pp_encoder will be NULL on success, or remain
+// unchanged in case of failure.
+//
+// If using a threadpool, must be called before releasing the
+// threadpool!
+//
+// If the encoder is still in use, this may explode.
+//
+// Check the return value for errors.
+//
+extern mtpng_result
+mtpng_encoder_release(mtpng_encoder** pp_encoder);
+
+//
+// Signal that we're done setting up, and start writing
+// header data to the output.
+//
+// Must be called before mtpng_encoder_append_row() or
 // mtpng_encoder_finish().
 //
 // Check the return value for errors.
@@ -480,6 +1321,34 @@ mtpng_encoder_write_transparency(mtpng_encoder* p_encoder,
                                  const uint8_t* p_bytes,
                                  size_t len);
 
+//
+// Make the file an APNG animation of num_frames frames, played
+// num_plays times, or forever if 0.
+//
+// Must be called after mtpng_encoder_write_header() and before any
+// image data. Start each frame with mtpng_encoder_write_frame_control()
+// and write its rows as for a still image, sized to the frame. If the
+// first image's data is written without a frame control, it's shown
+// by viewers without APNG support but isn't part of the animation.
+//
+// Check the return value for errors.
+//
+extern mtpng_result
+mtpng_encoder_write_animation_control(mtpng_encoder* p_encoder,
+                                      uint32_t num_frames,
+                                      uint32_t num_plays);
+
+//
+// Start the next frame of an animation. The previous frame's rows
+// must all have been written; it may still be compressing on the
+// thread pool while this frame's rows go in.
+//
+// Check the return value for errors.
+//
+extern mtpng_result
+mtpng_encoder_write_frame_control(mtpng_encoder* p_encoder,
+                                  mtpng_frame_control* p_frame);
+
 //
 // Write a custom ancillary chunk to the output stream.
 // The tag must be a 4-byte string. The data should be provided
@@ -501,7 +1370,8 @@ mtpng_encoder_write_chunk(mtpng_encoder* p_encoder,
 // mtpng_encoder_finish().
 //
 // Image data must be pre-packed in the correct bit depth and
-// channel order. If not all rows are provided before calling
+// channel order, unless another input format was set in the
+// encoder options. If not all rows are provided before calling
 // mtpng_encoder_finish(), failure will result.
 //
 // Check the return value for errors.
@@ -511,6 +1381,92 @@ mtpng_encoder_write_image_rows(mtpng_encoder* p_encoder,
                                const uint8_t* p_bytes,
                                size_t len);
 
+//
+// Set a callback to be told when the encoder's worker threads
+// finish a job, for driving the encoder from an event loop with
+// the non-blocking functions below.
+//
+// user_data is passed to the callback, and may be any value
+// such as a private object pointer or NULL.
+//
+// Check the return value for errors.
+//
+extern mtpng_result
+mtpng_encoder_set_notify(mtpng_encoder* p_encoder,
+                         mtpng_notify_func notify_func,
+                         void* const user_data);
+
+//
+// Set a callback to be called with the time each stage of encoding
+// took, for emitting trace spans. Must be set before image data is
+// written to see every chunk; setting it after mtpng_encoder_write_header()
+// is fine.
+//
+// user_data is passed to the callback, and may be any value
+// such as a private object pointer or NULL.
+//
+// Check the return value for errors.
+//
+extern mtpng_result
+mtpng_encoder_set_trace(mtpng_encoder* p_encoder,
+                        mtpng_trace_func trace_func,
+                        void* const user_data);
+
+//
+// Load rows of input data into the encoder as with
+// mtpng_encoder_write_image_rows(), but without waiting for
+// the worker threads if they're busy.
+//
+// On success, *p_written is set to the number of bytes taken,
+// always a whole number of rows, which may be fewer than len.
+// If no rows could be taken, returns MTPNG_RESULT_WOULD_BLOCK;
+// try again once notified.
+//
+// Check the return value for errors.
+//
+extern mtpng_result
+mtpng_encoder_try_write_image_rows(mtpng_encoder* p_encoder,
+                                   const uint8_t* p_bytes,
+                                   size_t len,
+                                   size_t* p_written);
+
+//
+// Collect finished work from the worker threads, start more, and
+// write out any output that's ready, without waiting.
+//
+// On success, *p_flushed is set to whether all input so far has
+// been written out; once it is after the whole image has been
+// provided, mtpng_encoder_finish() will not block on the threads.
+//
+// Check the return value for errors.
+//
+extern mtpng_result
+mtpng_encoder_poll(mtpng_encoder* p_encoder,
+                   bool* p_flushed);
+
+//
+// Load a whole image's input data into the encoder at once,
+// to be filtered and compressed directly from the given buffer
+// without copying.
+//
+// Rows start every stride bytes, which must be at least the
+// packed row length; any padding at the end of rows is ignored.
+// len must cover all rows of the image.
+//
+// Must be called after mtpng_encoder_write_header() and before
+// mtpng_encoder_finish(), instead of mtpng_encoder_write_image_rows().
+//
+// The buffer is read from the worker threads, and must remain
+// valid and unmodified until mtpng_encoder_finish() returns.
+//
+// Check the return value for errors.
+//
+extern mtpng_result
+mtpng_encoder_write_image_frame(mtpng_encoder* p_encoder,
+                                const uint8_t* p_bytes,
+                                size_t len,
+                                size_t stride);
+
 //
 // Wait for any outstanding work blocks, flush output,
 // release the encoder instance and clear the pointer.
@@ -533,6 +1489,225 @@ mtpng_encoder_write_image_rows(mtpng_encoder* p_encoder,
 extern mtpng_result
 mtpng_encoder_finish(mtpng_encoder** pp_encoder);
 
+#pragma mark Batch encoder
+
+//
+// Create a new batch encoder, for encoding many images at once.
+// Small images that can't use all threads on their own are
+// worked on together instead of one after another.
+//
+// The options are only used to size how many images are in
+// flight at once; each image is encoded with the options given
+// to its own encoder. Pass NULL for the defaults.
+//
+// On input, *pp_batch must be NULL.
+// On output, *pp_batch will contain a new instance pointer on
+// success, or remain unchanged in case of failure.
+//
+// Check the return value for errors.
+//
+extern mtpng_result
+mtpng_batch_encoder_new(mtpng_batch_encoder** pp_batch,
+                        mtpng_encoder_options* p_options);
+
+//
+// Release a batch encoder and all of its encoders without
+// finishing them.
+//
+// On input, *pp_batch must be a valid instance pointer.
+// On output, *pp_batch will be NULL on success, or remain
+// unchanged in case of failure.
+//
+// Check the return value for errors.
+//
+extern mtpng_result
+mtpng_batch_encoder_release(mtpng_batch_encoder** pp_batch);
+
+//
+// Add an image to the batch, taking ownership of its encoder.
+//
+// The encoder must have had its header written, and palette or
+// other chunks if any; the image data is given as for
+// mtpng_encoder_write_image_frame(), and will be encoded in the
+// background while further images are added.
+//
+// The buffer must remain valid and unmodified until
+// mtpng_batch_encoder_finish() returns.
+//
+// On input, *pp_encoder must be a valid instance pointer.
+// On output, *pp_encoder will be NULL; if adding the image fails,
+// the encoder is released.
+//
+// Check the return value for errors.
+//
+extern mtpng_result
+mtpng_batch_encoder_add_image(mtpng_batch_encoder* p_batch,
+                              mtpng_encoder** pp_encoder,
+                              const uint8_t* p_bytes,
+                              size_t len,
+                              size_t stride);
+
+//
+// Wait for all images in the batch to finish encoding, flush
+// their output, and release the batch and its encoders.
+//
+// On input, *pp_batch must be a valid instance pointer.
+// On output, *pp_batch will be NULL on success, or remain
+// unchanged in case of failure.
+//
+// If using a threadpool, must be called before releasing
+// the threadpool!
+//
+// Check the return value for errors.
+//
+extern mtpng_result
+mtpng_batch_encoder_finish(mtpng_batch_encoder** pp_batch);
+
+#pragma mark Decoder options
+
+//
+// Creates a new set of decoder options. Fill out the details
+// and pass in to mtpng_decoder_new(). May be reused on multiple
+// decoders.
+//
+// Free with mtpng_decoder_options_release().
+//
+// On input, *pp_options must be NULL.
+// On output, *pp_options will be a pointer to an options instance
+// if successful, or remain unchanged in case of error.
+//
+// Check the return value for errors.
+//
+extern mtpng_result
+mtpng_decoder_options_new(mtpng_decoder_options** pp_options);
+
+//
+// Releases the option set's memory and clears the pointer.
+//
+// On input, *pp_options must be a valid instance pointer.
+// On output, *pp_options will be NULL on success or remain unchanged
+// in case of failure.
+//
+// Check the return value for errors.
+//
+extern mtpng_result
+mtpng_decoder_options_release(mtpng_decoder_options** pp_options);
+
+//
+// Set the thread pool instance to queue work on.
+//
+// If this is not called, a default global thread pool will be
+// used. If a thread pool is provided, it is the caller's
+// responsibility to keep the thread pool alive until all decoders
+// using it have been released.
+//
+// Check the return values for errors.
+//
+extern mtpng_result
+mtpng_decoder_options_set_thread_pool(mtpng_decoder_options* p_options,
+                                      mtpng_threadpool* p_pool);
+
+#pragma mark Decoder
+
+//
+// Create a new PNG decoder instance reading from the given callback.
+// Decoding runs on the thread pool given in the options, inflating
+// and unfiltering image data while more is read in. Files written
+// by mtpng are inflated in pieces on all threads at once.
+//
+// Pass NULL for p_options to use the defaults.
+//
+// On input, *pp_decoder must be NULL.
+// On output, *pp_decoder will contain a new instance pointer on
+// success, or remain unchanged in case of failure.
+//
+// Check the return value for errors.
+//
+extern mtpng_result
+mtpng_decoder_new(mtpng_decoder** pp_decoder,
+                  mtpng_read_func read_func,
+                  void* const user_data,
+                  mtpng_decoder_options* p_options);
+
+//
+// Release a decoder without reading the rest of the file.
+//
+// On input, *pp_decoder must be a valid instance pointer.
+// On output, *pp_decoder will be NULL on success, or remain
+// unchanged in case of failure.
+//
+// Check the return value for errors.
+//
+extern mtpng_result
+mtpng_decoder_release(mtpng_decoder** pp_decoder);
+
+//
+// Read the file signature and chunks up to the image data, and
+// copy the image header over the given header instance.
+//
+// Only the default image of an APNG file is decoded, and ancillary
+// chunks other than the palette and transparency are skipped.
+//
+// Check the return value for errors.
+//
+extern mtpng_result
+mtpng_decoder_read_header(mtpng_decoder* p_decoder,
+                          mtpng_header* p_header);
+
+//
+// Get the file's palette, or NULL and 0 if there is none. The data
+// belongs to the decoder. Call after mtpng_decoder_read_header().
+//
+// Check the return value for errors.
+//
+extern mtpng_result
+mtpng_decoder_get_palette(mtpng_decoder* p_decoder,
+                          const uint8_t** pp_bytes,
+                          size_t* p_len);
+
+//
+// Get the file's transparency data, or NULL and 0 if there is none.
+// The data belongs to the decoder. Call after
+// mtpng_decoder_read_header().
+//
+// Check the return value for errors.
+//
+extern mtpng_result
+mtpng_decoder_get_transparency(mtpng_decoder* p_decoder,
+                               const uint8_t** pp_bytes,
+                               size_t* p_len);
+
+//
+// Read and decode the image data into the given buffer, which must
+// be exactly the header's stride times its height in bytes. Rows
+// come one after another in PNG byte order, with interlaced images
+// put back together in the same layout.
+//
+// May only be called once.
+//
+// Check the return value for errors.
+//
+extern mtpng_result
+mtpng_decoder_read_image(mtpng_decoder* p_decoder,
+                         uint8_t* p_bytes,
+                         size_t len);
+
+//
+// Read the rest of the file through its end chunk, and release
+// the decoder.
+//
+// On input, *pp_decoder must be a valid instance pointer.
+// On output, *pp_decoder will be NULL on success, or remain
+// unchanged in case of failure.
+//
+// If using a threadpool, must be called before releasing
+// the threadpool!
+//
+// Check the return value for errors.
+//
+extern mtpng_result
+mtpng_decoder_finish(mtpng_decoder** pp_decoder);
+
 #pragma mark footer
 
 #ifdef __cplusplus
@@ -0,0 +1,318 @@
+//
+// mtpng - a multithreaded parallel PNG encoder in Rust
+// batch.rs - encodes many images together on one thread pool
+//
+// Copyright (c) 2018-2024 Brooke Vibber
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+//
+
+
+//
+// Small images don't split into enough chunks to keep every thread
+// busy, and encoding them one after another leaves most of the pool
+// idle. A batch keeps several images in flight instead, each with
+// its own Encoder and chunk ordering, sharing the pool between them.
+//
+// Each Encoder's notify callback rings a shared bell as its jobs
+// finish, so the batch can sleep until there's something to do
+// rather than blocking on any one image. An image with more chunks
+// than the threads have room for is handed over a few chunks at a
+// time, as its earlier ones finish.
+//
+
+use std::collections::VecDeque;
+
+use std::io;
+use std::io::Write;
+
+use std::sync::{Arc, Mutex};
+use std::sync::mpsc;
+use std::sync::mpsc::{Sender, Receiver};
+
+use super::encoder::Encoder;
+use super::encoder::FrameBuffer;
+use super::encoder::Options;
+
+use super::utils::*;
+
+// An image in the batch, holding its frame until all of its
+// chunks have been started.
+struct Image<'a, W: Write> {
+    index: usize,
+    encoder: Encoder<'a, W>,
+    frame: Option<FrameBuffer>,
+    frame_stride: usize,
+}
+
+/// Encodes many images concurrently, sharing one thread pool.
+///
+/// Useful for thumbnails and tiles that are too small to split up
+/// across all threads on their own.
+pub struct BatchEncoder<'a, W: Write> {
+    threads: usize,
+
+    // Images yet to start, in the order they were added.
+    queue: VecDeque<Image<'a, W>>,
+
+    // Images with jobs in flight.
+    active: Vec<Image<'a, W>>,
+
+    // Finished output sinks, in the order the images were added.
+    finished: Vec<Option<W>>,
+
+    bell_tx: Sender<()>,
+    bell_rx: Receiver<()>,
+}
+
+impl<'a, W: Write> BatchEncoder<'a, W> {
+    /// Create a new batch. The options are used to size how many
+    /// images are worked on at once; each image is encoded with the
+    /// options of its own Encoder.
+    pub fn new(options: &Options<'a>) -> BatchEncoder<'a, W> {
+        let (bell_tx, bell_rx) = mpsc::channel();
+        BatchEncoder {
+            threads: options.threads(),
+            queue: VecDeque::new(),
+            active: Vec::new(),
+            finished: Vec::new(),
+            bell_tx,
+            bell_rx,
+        }
+    }
+
+    /// Add an image to the batch, returning its index in the output
+    /// of finish().
+    ///
+    /// The encoder must have had its header, and palette or other
+    /// chunks if any, written already. The image data is given as a
+    /// whole frame as for Encoder::write_image_frame(), and will be
+    /// encoded in the background while further images are added.
+    ///
+    /// The batch takes over the encoder's set_notify() callback.
+    pub fn add_image<B>(&mut self,
+                        encoder: Encoder<'a, W>,
+                        frame: Arc<B>,
+                        frame_stride: usize) -> io::Result<usize>
+        where B: AsRef<[u8]> + Send + Sync + 'static
+    {
+        let frame: FrameBuffer = frame;
+        encoder.check_frame(&frame, frame_stride)?;
+
+        let index = self.finished.len();
+        self.finished.push(None);
+        self.queue.push_back(Image {
+            index,
+            encoder,
+            frame: Some(frame),
+            frame_stride,
+        });
+        self.poll()?;
+        Ok(index)
+    }
+
+    /// Return the number of images added so far.
+    pub fn len(&self) -> usize {
+        self.finished.len()
+    }
+
+    /// Check if no images have been added.
+    pub fn is_empty(&self) -> bool {
+        self.finished.is_empty()
+    }
+
+    //
+    // Keep the threads busy with a couple of extra images queueing
+    // jobs, as Encoder does with chunks.
+    //
+    fn max_active(&self) -> usize {
+        self.threads + 2
+    }
+
+    //
+    // Start new images while there's room, and move along the ones
+    // already going, without blocking on the threads. Images only get
+    // as many chunks started as their encoder has room for; the rest
+    // follow on later polls.
+    //
+    fn poll(&mut self) -> io::Result<()> {
+        while self.active.len() < self.max_active() {
+            match self.queue.pop_front() {
+                Some(mut image) => {
+                    let bell = Mutex::new(self.bell_tx.clone());
+                    image.encoder.set_notify(move || {
+                        bell.lock().unwrap().send(()).ok();
+                    });
+                    self.active.push(image);
+                },
+                None => break,
+            }
+        }
+
+        let mut i = 0;
+        while i < self.active.len() {
+            let image = &mut self.active[i];
+            image.encoder.poll()?;
+            if let Some(frame) = image.frame.take() {
+                if !image.encoder.try_write_frame_buffer(&frame, image.frame_stride)? {
+                    image.frame = Some(frame);
+                }
+            }
+            if image.frame.is_none() && image.encoder.is_finished() {
+                let image = self.active.swap_remove(i);
+                self.finished[image.index] = Some(image.encoder.finish()?);
+            } else {
+                i += 1;
+            }
+        }
+        Ok(())
+    }
+
+    /// Finish encoding all images, blocking until done, and return
+    /// their output sinks in the order they were added.
+    pub fn finish(mut self) -> io::Result<Vec<W>> {
+        loop {
+            self.poll()?;
+            if self.active.is_empty() && self.queue.is_empty() {
+                break;
+            }
+
+            // Sleep until a job finishes somewhere, then take any
+            // other rings along with it.
+            if self.bell_rx.recv().is_err() {
+                return Err(other("batch bell hung up"));
+            }
+            while self.bell_rx.try_recv().is_ok() {}
+        }
+
+        let mut output = Vec::with_capacity(self.finished.len());
+        for sink in self.finished.drain(..) {
+            match sink {
+                Some(sink) => output.push(sink),
+                None => return Err(other("invalid internal state")),
+            }
+        }
+        Ok(output)
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::BatchEncoder;
+    use super::super::ColorType;
+    use super::super::Header;
+    use super::super::encoder::Encoder;
+    use super::super::encoder::Options;
+
+    use rayon::ThreadPoolBuilder;
+
+    use std::sync::Arc;
+    use std::sync::mpsc;
+
+    #[test]
+    fn it_works() {
+        let options = Options::new();
+        let mut batch = BatchEncoder::new(&options);
+        let mut expected = Vec::new();
+
+        for i in 0 .. 20usize {
+            let (width, height) = (64 + i * 7, 48 + i * 5);
+            let mut header = Header::new();
+            header.set_size(width as u32, height as u32).unwrap();
+            header.set_color(ColorType::Truecolor, 8).unwrap();
+
+            let mut data = vec![0u8; width * 3 * height];
+            for (j, byte) in data.iter_mut().enumerate() {
+                *byte = ((j * (i + 1)) % 251) as u8;
+            }
+
+            // Reference output, encoded on its own.
+            let mut encoder = Encoder::new(Vec::<u8>::new(), &options);
+            encoder.write_header(&header).unwrap();
+            encoder.write_image_rows(&data).unwrap();
+            expected.push(encoder.finish().unwrap());
+
+            let mut encoder = Encoder::new(Vec::<u8>::new(), &options);
+            encoder.write_header(&header).unwrap();
+            assert_eq!(batch.add_image(encoder, Arc::new(data), width * 3).unwrap(), i);
+        }
+        assert_eq!(batch.len(), 20);
+
+        let actual = batch.finish().unwrap();
+        assert_eq!(actual.len(), expected.len());
+        for (actual, expected) in actual.iter().zip(expected.iter()) {
+            assert!(actual == expected, "batch output should match single output");
+        }
+    }
+
+    #[test]
+    fn rejects_bad_frame() {
+        let options = Options::new();
+        let mut batch = BatchEncoder::new(&options);
+
+        let mut header = Header::new();
+        header.set_size(64, 64).unwrap();
+        header.set_color(ColorType::Truecolor, 8).unwrap();
+        let mut encoder = Encoder::new(Vec::<u8>::new(), &options);
+        encoder.write_header(&header).unwrap();
+
+        assert!(batch.add_image(encoder, Arc::new(vec![0u8; 64 * 3]), 64 * 3).is_err());
+        assert!(batch.is_empty());
+    }
+
+    #[test]
+    fn does_not_block_on_large_image() {
+        let pool = ThreadPoolBuilder::new().num_threads(1).build().unwrap();
+        let mut options = Options::new();
+        options.set_thread_pool(&pool).unwrap();
+        options.set_chunk_size(32768).unwrap();
+        let mut batch = BatchEncoder::new(&options);
+
+        let (width, height) = (1024usize, 512usize);
+        let mut header = Header::new();
+        header.set_size(width as u32, height as u32).unwrap();
+        header.set_color(ColorType::TruecolorAlpha, 8).unwrap();
+        let data: Vec<u8> = (0 .. width * 4 * height).map(|j| (j % 251) as u8).collect();
+
+        // Reference output, encoded on its own.
+        let mut encoder = Encoder::new(Vec::<u8>::new(), &options);
+        encoder.write_header(&header).unwrap();
+        encoder.write_image_rows(&data).unwrap();
+        let expected = encoder.finish().unwrap();
+
+        // Hold the only thread so no jobs finish until we say so.
+        let (gate_tx, gate_rx) = mpsc::channel::<()>();
+        pool.spawn(move || {
+            gate_rx.recv().ok();
+        });
+
+        // Far more chunks than the thread has room for, so adding
+        // the image and polling return with most of it still to start.
+        let mut encoder = Encoder::new(Vec::<u8>::new(), &options);
+        encoder.write_header(&header).unwrap();
+        assert_eq!(batch.add_image(encoder, Arc::new(data), width * 4).unwrap(), 0);
+        batch.poll().unwrap();
+        assert!(batch.active.len() == 1 && batch.active[0].frame.is_some());
+        assert!(batch.finished[0].is_none());
+
+        gate_tx.send(()).unwrap();
+        let actual = batch.finish().unwrap();
+        assert!(actual[0] == expected, "batch output should match single output");
+    }
+}
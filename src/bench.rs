@@ -0,0 +1,98 @@
+//
+// mtpng - a multithreaded parallel PNG encoder in Rust
+// bench.rs - internal kernels exposed for benchmarking
+//
+// Copyright (c) 2018-2024 Brooke Vibber
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+//
+
+//
+// Thin wrappers over the per-row and per-chunk work of the encoder,
+// so benches/ can time each stage on its own. Only built with the
+// "bench" feature; not a stable API.
+//
+
+use std::io;
+
+use super::Backend;
+use super::CompressionLevel;
+use super::Filter;
+use super::Header;
+use super::Heuristic;
+use super::Mode;
+use super::Strategy;
+
+use super::deflate;
+use super::filter::AdaptiveFilter;
+
+//
+// Filters rows as a filter job would, with the kernels for this CPU.
+//
+pub struct RowFilter {
+    filter: AdaptiveFilter,
+}
+
+impl RowFilter {
+    pub fn new(header: Header, mode: Mode<Filter>, heuristic: Heuristic) -> RowFilter {
+        RowFilter {
+            filter: AdaptiveFilter::new(header, mode, heuristic),
+        }
+    }
+
+    //
+    // Filter a row against the previous one, returning the filter
+    // type byte and the filtered bytes.
+    //
+    pub fn filter(&mut self, prev: &[u8], src: &[u8]) -> &[u8] {
+        self.filter.filter(prev, src)
+    }
+
+    //
+    // Complexity scores of the Sub, Up, Average, and Paeth filters
+    // for a row, without filtering it.
+    //
+    pub fn complexity_scores(&self, prev: &[u8], src: &[u8]) -> [u32; 4] {
+        self.filter.complexity_scores(prev, src)
+    }
+}
+
+pub fn adler32(bytes: &[u8]) -> u32 {
+    deflate::adler32(deflate::adler32_initial(), bytes)
+}
+
+pub fn crc32(bytes: &[u8]) -> u32 {
+    deflate::crc32(deflate::crc32_initial(), bytes)
+}
+
+//
+// Compress one chunk of filtered data as a deflate job would, with
+// the previous chunk's tail as the dictionary.
+//
+pub fn compress_chunk(backend: Backend,
+                      level: CompressionLevel,
+                      strategy: Strategy,
+                      dictionary: &[u8],
+                      input: &[u8],
+                      last: bool) -> io::Result<Vec<u8>>
+{
+    let compressor = deflate::compressor(backend);
+    let output = Vec::with_capacity(compressor.bound(input.len()));
+    compressor.compress(level, strategy, dictionary, input, last, output)
+}
@@ -23,10 +23,13 @@
 // THE SOFTWARE.
 //
 
+use std::cell::Cell;
 use std::convert::TryFrom;
 use std::fs::File;
 use std::io;
-use std::io::{Error, ErrorKind, Write};
+use std::io::{Error, ErrorKind, Read, Seek, SeekFrom, Write};
+use std::rc::Rc;
+use std::sync::Arc;
 
 // CLI options
 extern crate clap;
@@ -44,11 +47,17 @@ use time::OffsetDateTime;
 
 // Hey that's us!
 extern crate mtpng;
-use mtpng::{ColorType, CompressionLevel, Header};
+use mtpng::{ColorReduction, ColorType, CompressionLevel, Header, InterlaceMethod};
 use mtpng::Mode::{Adaptive, Fixed};
+use mtpng::decoder;
 use mtpng::encoder::{Encoder, Options};
+use mtpng::stats::Stats;
 use mtpng::Strategy;
+use mtpng::Backend;
 use mtpng::Filter;
+use mtpng::Heuristic;
+#[cfg(unix)]
+use mtpng::mmap::{self, MappedFile, MappedWriter};
 
 pub fn err(payload: &str) -> Error
 {
@@ -62,20 +71,171 @@ fn expand(src: &[u8]) -> io::Result<Vec<u8>>
     Ok(v)
 }
 
+//
+// Notes when image data first goes out, for the time to first byte.
+// Anything written before the image rows start going in is headers.
+//
+struct TimingWriter<W: Write> {
+    inner: W,
+    started: Rc<Cell<bool>>,
+    first_byte: Option<OffsetDateTime>,
+}
+
+impl<W: Write> Write for TimingWriter<W> {
+    fn write(&mut self, buf: &[u8]) -> io::Result<usize> {
+        if self.first_byte.is_none() && self.started.get() && !buf.is_empty() {
+            self.first_byte = Some(OffsetDateTime::now_utc());
+        }
+        self.inner.write(buf)
+    }
+
+    fn write_vectored(&mut self, bufs: &[io::IoSlice]) -> io::Result<usize> {
+        if self.first_byte.is_none() && self.started.get() && bufs.iter().any(|buf| !buf.is_empty()) {
+            self.first_byte = Some(OffsetDateTime::now_utc());
+        }
+        self.inner.write_vectored(bufs)
+    }
+
+    fn flush(&mut self) -> io::Result<()> {
+        self.inner.flush()
+    }
+}
+
+impl<W: Write + Seek> Seek for TimingWriter<W> {
+    fn seek(&mut self, pos: SeekFrom) -> io::Result<u64> {
+        self.inner.seek(pos)
+    }
+}
+
+//
+// The output file, written through a memory mapping when asked.
+//
+enum Output {
+    File(File),
+    #[cfg(unix)]
+    Mapped(MappedWriter),
+}
+
+impl Output {
+    fn create(filename: &str, header: &Header, mapped: bool) -> io::Result<Output> {
+        if !mapped {
+            return Ok(Output::File(File::create(filename)?));
+        }
+        #[cfg(unix)]
+        return Ok(Output::Mapped(MappedWriter::create(filename, mmap::output_bound(header))?));
+        #[cfg(not(unix))]
+        {
+            let _ = header;
+            return Err(err("Memory-mapped files are not supported on this platform"));
+        }
+    }
+
+    fn finish(self) -> io::Result<()> {
+        match self {
+            Output::File(_) => Ok(()),
+            #[cfg(unix)]
+            Output::Mapped(writer) => writer.finish().map(|_file| ()),
+        }
+    }
+}
+
+impl Write for Output {
+    fn write(&mut self, buf: &[u8]) -> io::Result<usize> {
+        match *self {
+            Output::File(ref mut file) => file.write(buf),
+            #[cfg(unix)]
+            Output::Mapped(ref mut writer) => writer.write(buf),
+        }
+    }
+
+    fn write_vectored(&mut self, bufs: &[io::IoSlice]) -> io::Result<usize> {
+        match *self {
+            Output::File(ref mut file) => file.write_vectored(bufs),
+            #[cfg(unix)]
+            Output::Mapped(ref mut writer) => writer.write_vectored(bufs),
+        }
+    }
+
+    fn flush(&mut self) -> io::Result<()> {
+        match *self {
+            Output::File(ref mut file) => file.flush(),
+            #[cfg(unix)]
+            Output::Mapped(ref mut writer) => writer.flush(),
+        }
+    }
+}
+
+impl Seek for Output {
+    fn seek(&mut self, pos: SeekFrom) -> io::Result<u64> {
+        match *self {
+            Output::File(ref mut file) => file.seek(pos),
+            #[cfg(unix)]
+            Output::Mapped(ref mut writer) => writer.seek(pos),
+        }
+    }
+}
+
 struct Image {
     header: Header,
-    data: Vec<u8>,
+    data: Arc<Vec<u8>>,
     palette: Option<Vec<u8>>,
     transparency: Option<Vec<u8>>,
 }
 
-fn read_png(filename: &str)
+fn read_png(pool: &ThreadPool, filename: &str, mapped: bool, parallel: bool)
+    -> io::Result<Image>
+{
+    if !mapped {
+        let input = File::open(filename)?;
+        if parallel {
+            return decode_png_parallel(pool, io::BufReader::new(input));
+        }
+        return decode_png(input);
+    }
+    #[cfg(unix)]
+    {
+        let file = MappedFile::open(filename)?;
+        if parallel {
+            return decode_png_parallel(pool, &file.as_ref()[..]);
+        }
+        return decode_png(&file.as_ref()[..]);
+    }
+    #[cfg(not(unix))]
+    return Err(err("Memory-mapped files are not supported on this platform"));
+}
+
+fn decode_png_parallel<R: Read>(pool: &ThreadPool, input: R)
+    -> io::Result<Image>
+{
+    let mut options = decoder::Options::new();
+    options.set_thread_pool(pool)?;
+
+    let mut decoder = decoder::Decoder::new(input, &options);
+    let mut header = decoder.read_header()?;
+    let palette = decoder.palette().map(|data| data.to_vec());
+    let transparency = decoder.transparency().map(|data| data.to_vec());
+    let data = decoder.read_image()?;
+    decoder.finish()?;
+
+    // Rows come back de-interlaced, and are re-encoded as set
+    // on the command line.
+    header.set_interlace_method(InterlaceMethod::Standard)?;
+
+    Ok(Image {
+        header,
+        data: Arc::new(data),
+        palette,
+        transparency
+    })
+}
+
+fn decode_png<R: Read>(input: R)
     -> io::Result<Image>
 {
     use png::Decoder;
     use png::Transformations;
 
-    let mut decoder = Decoder::new(File::open(filename)?);
+    let mut decoder = Decoder::new(input);
     decoder.set_transformations(Transformations::IDENTITY);
 
     let mut reader = decoder.read_info()?;
@@ -100,7 +260,7 @@ fn read_png(filename: &str)
 
     Ok(Image {
         header,
-        data,
+        data: Arc::new(data),
         palette,
         transparency
     })
@@ -109,18 +269,29 @@ fn read_png(filename: &str)
 fn write_png(pool: &ThreadPool,
              args: &ArgMatches,
              filename: &str,
-             image: &Image)
-   -> io::Result<()>
+             image: &Image,
+             mapped: bool)
+   -> io::Result<Option<OffsetDateTime>>
 {
-    let writer = File::create(filename)?;
+    let stats = Stats::new();
     let mut options = Options::new();
 
     // Encoding options
     options.set_thread_pool(pool)?;
 
+    let show_stats = match args.value_of("stats") {
+        None | Some("no") => false,
+        Some("yes")       => true,
+        _                 => return Err(err("Invalid stats mode, try yes or no.")),
+    };
+    if show_stats {
+        options.set_stats(&stats)?;
+    }
+
     match args.value_of("chunk-size") {
-        None    => {},
-        Some(s) => {
+        None         => {},
+        Some("auto") => options.set_chunk_size_mode(Adaptive)?,
+        Some(s)      => {
             let n = s.parse::<usize>().map_err(|_e| err("Invalid chunk size"))?;
             options.set_chunk_size(n)?;
         },
@@ -137,12 +308,27 @@ fn write_png(pool: &ThreadPool,
         _                => return Err(err("Unsupported filter type")),
     }
 
+    match args.value_of("heuristic") {
+        None               => {},
+        Some("complexity") => options.set_filter_heuristic(Heuristic::Complexity)?,
+        Some("entropy")    => options.set_filter_heuristic(Heuristic::Entropy)?,
+        _                  => return Err(err("Unsupported filter heuristic")),
+    }
+
+    match args.value_of("trials") {
+        None        => {},
+        Some("yes") => options.set_filter_trials(true)?,
+        Some("no")  => options.set_filter_trials(false)?,
+        _           => return Err(err("Invalid trials mode, try yes or no.")),
+    }
+
     match args.value_of("level") {
         None            => {},
         Some("default") => options.set_compression_level(CompressionLevel::Default)?,
+        Some("0")       => options.set_compression_level(CompressionLevel::Fastest)?,
         Some("1")       => options.set_compression_level(CompressionLevel::Fast)?,
         Some("9")       => options.set_compression_level(CompressionLevel::High)?,
-        _               => return Err(err("Unsupported compression level (try default, 1, or 9)")),
+        _               => return Err(err("Unsupported compression level (try default, 0, 1, or 9)")),
     }
 
     match args.value_of("strategy") {
@@ -156,6 +342,14 @@ fn write_png(pool: &ThreadPool,
         _                => return Err(err("Invalid compression strategy mode"))?,
     }
 
+    match args.value_of("backend") {
+        None         => {},
+        Some("auto") => options.set_backend_mode(Adaptive)?,
+        Some("zlib") => options.set_backend_mode(Fixed(Backend::Zlib))?,
+        Some("rle")  => options.set_backend_mode(Fixed(Backend::Rle))?,
+        _            => return Err(err("Invalid compression backend"))?,
+    }
+
     match args.value_of("streaming") {
         None        => {},
         Some("yes") => options.set_streaming(true)?,
@@ -163,22 +357,75 @@ fn write_png(pool: &ThreadPool,
         _           => return Err(err("Invalid streaming mode, try yes or no."))
     }
 
-    let mut encoder = Encoder::new(writer, &options);
+    // A color key in the source's tRNS chunk wouldn't carry over.
+    let reduction = match args.value_of("reduce") {
+        None | Some("no") => None,
+        Some("yes") if image.transparency.is_some() => None,
+        Some("yes")       => Some(ColorReduction::new(&image.header,
+                                                      &image.data[..],
+                                                      image.header.stride(),
+                                                      &options)?),
+        _                 => return Err(err("Invalid reduce mode, try yes or no.")),
+    };
+
+    let mut header = image.header;
+    let mut palette = image.palette.as_deref();
+    let mut transparency = image.transparency.as_deref();
+    if let Some(ref reduction) = reduction {
+        options.set_color_reduction(reduction)?;
+        header = reduction.header();
+        if reduction.is_reduced() {
+            palette = reduction.palette();
+            transparency = reduction.transparency();
+        }
+    }
+
+    match args.value_of("interlace") {
+        None        => {},
+        Some("yes") => header.set_interlace_method(InterlaceMethod::Adam7)?,
+        Some("no")  => header.set_interlace_method(InterlaceMethod::Standard)?,
+        _           => return Err(err("Invalid interlace mode, try yes or no.")),
+    }
+
+    let started = Rc::new(Cell::new(false));
+    let writer = TimingWriter {
+        inner: Output::create(filename, &header, mapped)?,
+        started: Rc::clone(&started),
+        first_byte: None,
+    };
+    let mut encoder = Encoder::new_seekable(writer, &options);
 
     // Image data
-    encoder.write_header(&image.header)?;
-    match &image.palette {
+    encoder.write_header(&header)?;
+    match palette {
         Some(v) => encoder.write_palette(v)?,
         None => {},
     }
-    match &image.transparency {
+    match transparency {
         Some(v) => encoder.write_transparency(v)?,
         None => {},
     }
-    encoder.write_image_rows(&image.data)?;
-    encoder.finish()?;
+    started.set(true);
+    encoder.write_image_frame(Arc::clone(&image.data), image.header.stride())?;
+    let writer = encoder.finish()?;
+    writer.inner.finish()?;
+
+    if show_stats {
+        let ms = |duration: std::time::Duration| (duration.as_secs_f64() * 1000.0).round();
+        let summary = stats.summary();
+        eprintln!("{} chunks, {} -> {} bytes", summary.chunks, summary.bytes_in, summary.bytes_out);
+        eprintln!("Filter {} ms, deflate {} ms, write {} ms; workers idle {} ms",
+                  ms(summary.filter_time), ms(summary.deflate_time),
+                  ms(summary.write_time), ms(summary.worker_idle));
+        eprintln!("Waits: queue {} ms, handoff {} ms, output {} ms, blocked on workers {} ms",
+                  ms(summary.queue_wait), ms(summary.handoff_wait),
+                  ms(summary.output_wait), ms(summary.blocked_time));
+        eprintln!("Filters: none {}, sub {}, up {}, average {}, paeth {}",
+                  summary.filters[0], summary.filters[1], summary.filters[2],
+                  summary.filters[3], summary.filters[4]);
+    }
 
-    Ok(())
+    Ok(writer.first_byte)
 }
 
 fn doit(args: ArgMatches) -> io::Result<()> {
@@ -194,6 +441,18 @@ fn doit(args: ArgMatches) -> io::Result<()> {
                                        .map_err(|e| err(&e.to_string()))?;
     eprintln!("Using {} threads", pool.current_num_threads());
 
+    let mapped = match args.value_of("mmap") {
+        None | Some("no") => false,
+        Some("yes")       => true,
+        _                 => return Err(err("Invalid mmap mode, try yes or no.")),
+    };
+
+    let parallel = match args.value_of("decoder") {
+        None | Some("png") => false,
+        Some("mtpng")      => true,
+        _                  => return Err(err("Invalid decoder, try png or mtpng.")),
+    };
+
     let reps = match args.value_of("repeat") {
         Some(s) => {
             s.parse::<usize>().map_err(|_e| err("invalid repeat"))?
@@ -206,14 +465,21 @@ fn doit(args: ArgMatches) -> io::Result<()> {
     let outfile = args.value_of("output").unwrap();
 
     println!("{} -> {}", infile, outfile);
-    let image = read_png(infile)?;
+    let read_time = OffsetDateTime::now_utc();
+    let image = read_png(&pool, infile, mapped, parallel)?;
+    let delta = OffsetDateTime::now_utc() - read_time;
+    println!("Read in {} ms", (delta.as_seconds_f64() * 1000.0).round());
 
     for _i in 0 .. reps {
         let start_time = OffsetDateTime::now_utc();
-        write_png(&pool, &args, outfile, &image)?;
+        let first_byte = write_png(&pool, &args, outfile, &image, mapped)?;
         let delta = OffsetDateTime::now_utc() - start_time;
 
-        println!("Done in {} ms", (delta.as_seconds_f64() * 1000.0).round());
+        // Time to first byte of image data, which streaming mode keeps low.
+        let ttfb = first_byte.map(|time| time - start_time).unwrap_or(delta);
+        println!("Done in {} ms, first image data at {} ms",
+                 (delta.as_seconds_f64() * 1000.0).round(),
+                 (ttfb.as_seconds_f64() * 1000.0).round());
     }
 
     Ok(())
@@ -227,20 +493,52 @@ pub fn main() {
         .arg(Arg::new("chunk-size")
             .long("chunk-size")
             .value_name("bytes")
-            .help("Divide image into chunks of at least this given size.")
+            .help("Divide image into chunks of at least this given size, or auto.")
             .takes_value(true))
         .arg(Arg::new("filter")
             .long("filter")
             .value_name("filter")
             .help("Set a fixed filter: one of none, sub, up, average, or paeth."))
+        .arg(Arg::new("heuristic")
+            .long("heuristic")
+            .value_name("heuristic")
+            .help("Adaptive filter heuristic: complexity (like libpng) or entropy (can pick none)."))
+        .arg(Arg::new("trials")
+            .long("trials")
+            .value_name("trials")
+            .help("Test compress every filter choice per chunk and keep the smallest (yes or no); slow."))
         .arg(Arg::new("level")
             .long("level")
             .value_name("level")
-            .help("Set deflate compression level, from 1-9."))
+            .help("Set deflate compression level: 0 (fastest), 1, default, or 9."))
         .arg(Arg::new("strategy")
             .long("strategy")
             .value_name("strategy")
             .help("Deflate strategy: one of filtered, huffman, rle, or fixed."))
+        .arg(Arg::new("backend")
+            .long("backend")
+            .value_name("backend")
+            .help("Deflate compressor: auto, zlib, or rle."))
+        .arg(Arg::new("interlace")
+            .long("interlace")
+            .value_name("interlace")
+            .help("Use Adam7 interlacing, for progressive display; trades off file size"))
+        .arg(Arg::new("reduce")
+            .long("reduce")
+            .value_name("reduce")
+            .help("Losslessly reduce the color type and bit depth to the smallest that fits the image"))
+        .arg(Arg::new("decoder")
+            .long("decoder")
+            .value_name("decoder")
+            .help("Decode the input with the png crate, or mtpng's own parallel decoder: png or mtpng."))
+        .arg(Arg::new("mmap")
+            .long("mmap")
+            .value_name("mmap")
+            .help("Read the input file and write the output file through memory mappings"))
+        .arg(Arg::new("stats")
+            .long("stats")
+            .value_name("stats")
+            .help("Print time spent in each stage of encoding, and the filters used"))
         .arg(Arg::new("streaming")
             .long("streaming")
             .value_name("streaming")
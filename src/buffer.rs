@@ -0,0 +1,291 @@
+//
+// mtpng - a multithreaded parallel PNG encoder in Rust
+// buffer.rs - contiguous aligned storage for chunk data
+//
+// Copyright (c) 2018-2024 Brooke Vibber
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+//
+
+use std::mem;
+
+use std::ops::Deref;
+use std::ops::DerefMut;
+
+use std::sync::Arc;
+use std::sync::Mutex;
+
+//
+// Alignment of buffer contents, matching a typical CPU cache line.
+//
+const ALIGNMENT: usize = 64;
+
+struct PoolState {
+    buffers: Vec<Vec<u8>>,
+    bytes: usize,
+    max_bytes: usize,
+}
+
+/// Pool of reusable byte buffers for chunk storage.
+///
+/// Attach to encoder::Options with set_buffer_pool() to recycle
+/// the pixel, filter, and deflate output buffers of each chunk
+/// when it is dropped, instead of allocating fresh ones. Encoding
+/// many same-sized images with a shared pool reaches a steady state
+/// with no per-image buffer allocations.
+///
+/// May be shared between multiple encoders at once or over time.
+#[derive(Clone)]
+pub struct BufferPool {
+    state: Arc<Mutex<PoolState>>,
+}
+
+impl BufferPool {
+    /// Create a new empty pool, which will retain up to 256 MiB
+    /// of idle buffers.
+    pub fn new() -> BufferPool {
+        BufferPool::with_max_bytes(256 * 1024 * 1024)
+    }
+
+    /// Create a new empty pool, which will retain up to the given
+    /// number of bytes of idle buffers. Buffers returned beyond
+    /// that are freed.
+    pub fn with_max_bytes(max_bytes: usize) -> BufferPool {
+        BufferPool {
+            state: Arc::new(Mutex::new(PoolState {
+                buffers: Vec::new(),
+                bytes: 0,
+                max_bytes,
+            })),
+        }
+    }
+
+    /// Return the total capacity in bytes of idle buffers held
+    /// for reuse.
+    pub fn idle_bytes(&self) -> usize {
+        match self.state.lock() {
+            Ok(state) => state.bytes,
+            Err(_) => 0,
+        }
+    }
+
+    //
+    // Take an empty buffer with at least the given capacity,
+    // reusing the smallest suitable idle buffer if available.
+    //
+    pub fn take(&self, capacity: usize) -> Vec<u8> {
+        if let Ok(mut state) = self.state.lock() {
+            let best = state.buffers.iter()
+                                    .enumerate()
+                                    .filter(|&(_, buffer)| buffer.capacity() >= capacity)
+                                    .min_by_key(|&(_, buffer)| buffer.capacity())
+                                    .map(|(i, _)| i);
+            if let Some(i) = best {
+                let mut buffer = state.buffers.swap_remove(i);
+                state.bytes -= buffer.capacity();
+                buffer.clear();
+                return buffer;
+            }
+        }
+        Vec::with_capacity(capacity)
+    }
+
+    //
+    // Return a buffer to the pool for reuse.
+    //
+    pub fn give(&self, buffer: Vec<u8>) {
+        if buffer.capacity() == 0 {
+            return;
+        }
+        if let Ok(mut state) = self.state.lock() {
+            if state.bytes + buffer.capacity() <= state.max_bytes {
+                state.bytes += buffer.capacity();
+                state.buffers.push(buffer);
+            }
+        }
+    }
+}
+
+impl Default for BufferPool {
+    fn default() -> Self {
+        Self::new()
+    }
+}
+
+//
+// Fixed-capacity byte buffer whose contents start on a cache
+// line boundary. Used as a single contiguous slab for a chunk's
+// rows, so the filters walk linear memory instead of chasing a
+// pointer per row.
+//
+// The backing Vec is never reallocated once created, which is
+// what keeps the start of the contents aligned.
+//
+// If taken from a BufferPool, the backing Vec is returned to
+// the pool on drop.
+//
+pub struct AlignedBuffer {
+    data: Vec<u8>,
+    offset: usize,
+    capacity: usize,
+    pool: Option<BufferPool>,
+}
+
+impl AlignedBuffer {
+    pub fn with_capacity(capacity: usize) -> AlignedBuffer {
+        AlignedBuffer::from_vec(Vec::with_capacity(capacity + ALIGNMENT - 1), capacity, None)
+    }
+
+    //
+    // Create a buffer backed by storage from the given pool,
+    // if any, otherwise freshly allocated.
+    //
+    pub fn with_pool(pool: Option<&BufferPool>, capacity: usize) -> AlignedBuffer {
+        match pool {
+            Some(pool) => {
+                let data = pool.take(capacity + ALIGNMENT - 1);
+                AlignedBuffer::from_vec(data, capacity, Some(pool.clone()))
+            },
+            None => AlignedBuffer::with_capacity(capacity),
+        }
+    }
+
+    fn from_vec(mut data: Vec<u8>, capacity: usize, pool: Option<BufferPool>) -> AlignedBuffer {
+        assert!(data.capacity() >= capacity + ALIGNMENT - 1);
+        data.clear();
+        let misalignment = data.as_ptr() as usize % ALIGNMENT;
+        let offset = if misalignment == 0 {
+            0
+        } else {
+            ALIGNMENT - misalignment
+        };
+        data.resize(offset, 0);
+        AlignedBuffer {
+            data,
+            offset,
+            capacity,
+            pool,
+        }
+    }
+
+    //
+    // Empty the buffer, keeping its storage.
+    //
+    pub fn clear(&mut self) {
+        self.data.truncate(self.offset);
+    }
+
+    pub fn remaining(&self) -> usize {
+        self.capacity - self.len()
+    }
+
+    //
+    // Append bytes to the end of the buffer.
+    // Will panic if the buffer's capacity would be exceeded.
+    //
+    pub fn extend_from_slice(&mut self, bytes: &[u8]) {
+        if bytes.len() > self.remaining() {
+            panic!("Tried to overflow aligned buffer: {} > {}", bytes.len(), self.remaining());
+        }
+        self.data.extend_from_slice(bytes);
+    }
+}
+
+impl Drop for AlignedBuffer {
+    fn drop(&mut self) {
+        if let Some(pool) = self.pool.take() {
+            pool.give(mem::take(&mut self.data));
+        }
+    }
+}
+
+impl Deref for AlignedBuffer {
+    type Target = [u8];
+
+    fn deref(&self) -> &[u8] {
+        &self.data[self.offset ..]
+    }
+}
+
+impl DerefMut for AlignedBuffer {
+    fn deref_mut(&mut self) -> &mut [u8] {
+        &mut self.data[self.offset ..]
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::AlignedBuffer;
+    use super::BufferPool;
+    use super::ALIGNMENT;
+
+    #[test]
+    fn it_works() {
+        let mut buffer = AlignedBuffer::with_capacity(1000);
+        assert_eq!(buffer.len(), 0);
+        assert_eq!(buffer.remaining(), 1000);
+        assert_eq!(buffer.as_ptr() as usize % ALIGNMENT, 0);
+
+        buffer.extend_from_slice(&[1u8; 600]);
+        buffer.extend_from_slice(&[2u8; 400]);
+        assert_eq!(buffer.len(), 1000);
+        assert_eq!(buffer.remaining(), 0);
+        assert_eq!(buffer[599], 1);
+        assert_eq!(buffer[600], 2);
+        assert_eq!(buffer.as_ptr() as usize % ALIGNMENT, 0);
+    }
+
+    #[test]
+    fn pool_works() {
+        let pool = BufferPool::new();
+        assert_eq!(pool.idle_bytes(), 0);
+
+        let buffer = AlignedBuffer::with_pool(Some(&pool), 1000);
+        let ptr = buffer.as_ptr();
+        drop(buffer);
+        assert!(pool.idle_bytes() >= 1000);
+
+        // Same size should get the same storage back.
+        let mut buffer = AlignedBuffer::with_pool(Some(&pool), 1000);
+        assert_eq!(buffer.as_ptr(), ptr);
+        assert_eq!(buffer.len(), 0);
+        assert_eq!(pool.idle_bytes(), 0);
+        buffer.extend_from_slice(&[1u8; 1000]);
+        drop(buffer);
+
+        // Larger sizes need a fresh allocation.
+        let buffer = AlignedBuffer::with_pool(Some(&pool), 2000);
+        assert_eq!(buffer.as_ptr() as usize % ALIGNMENT, 0);
+        assert!(pool.idle_bytes() >= 1000);
+    }
+
+    #[test]
+    fn pool_limit_works() {
+        let pool = BufferPool::with_max_bytes(100);
+        drop(AlignedBuffer::with_pool(Some(&pool), 1000));
+        assert_eq!(pool.idle_bytes(), 0);
+    }
+
+    #[test]
+    #[should_panic]
+    fn overflow_panics() {
+        let mut buffer = AlignedBuffer::with_capacity(16);
+        buffer.extend_from_slice(&[0u8; 17]);
+    }
+}
@@ -0,0 +1,184 @@
+//
+// mtpng - a multithreaded parallel PNG encoder in Rust
+// cache.rs - compressed chunk reuse between encodes
+//
+// Copyright (c) 2018-2024 Brooke Vibber
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+//
+
+//
+// Each compressed chunk depends only on its own filtered bytes,
+// the last 32 KiB of the previous chunk's as a dictionary, and
+// where it falls in the stream. So when the same image is encoded
+// again after a small change, any chunk whose filtered data and
+// predecessor's are both unchanged compresses to the very same
+// bytes, and can be copied over instead.
+//
+// Filtering still runs for every chunk: it's needed to find out
+// whether anything changed, and changed chunks need their unchanged
+// neighbors' output as a dictionary anyway. Deflate is the bulk of
+// the work, and that's what gets skipped.
+//
+
+use std::collections::hash_map::DefaultHasher;
+
+use std::hash::Hasher;
+
+use std::sync::Arc;
+use std::sync::Mutex;
+
+use super::Backend;
+use super::CompressionLevel;
+use super::Strategy;
+
+//
+// Compression settings that affect the output bytes; chunks
+// compressed with different ones can't be reused.
+//
+#[derive(Copy, Clone, PartialEq, Eq)]
+pub struct Settings {
+    pub compression_level: CompressionLevel,
+    pub strategy: Strategy,
+    pub backend: Backend,
+}
+
+//
+// A compressed chunk, and what went into it.
+//
+pub struct CachedChunk {
+    pub is_start: bool,
+    pub is_end: bool,
+
+    // Hashes of this chunk's filtered data, and the previous
+    // chunk's, which the dictionary came from.
+    pub hash: u64,
+    pub prior_hash: Option<u64>,
+
+    pub data: Arc<Vec<u8>>,
+    pub crc32: u32,
+}
+
+impl CachedChunk {
+    pub fn matches(&self,
+                   is_start: bool,
+                   is_end: bool,
+                   hash: u64,
+                   prior_hash: Option<u64>) -> bool
+    {
+        self.is_start == is_start &&
+        self.is_end == is_end &&
+        self.hash == hash &&
+        self.prior_hash == prior_hash
+    }
+}
+
+// The chunks of one encode, by chunk index.
+pub type CachedChunks = Vec<Option<CachedChunk>>;
+
+//
+// Hash of a chunk's filtered data. 64 bits makes an accidental
+// match, which would corrupt the image, vanishingly unlikely.
+//
+pub fn hash(data: &[u8]) -> u64 {
+    let mut hasher = DefaultHasher::new();
+    hasher.write(data);
+    hasher.finish()
+}
+
+struct CacheState {
+    settings: Option<Settings>,
+    chunks: Arc<CachedChunks>,
+    reused: usize,
+}
+
+/// Keeps the compressed chunks of the last image encoded with it, so
+/// the next encode can reuse any chunks whose rows haven't changed
+/// instead of compressing them again.
+///
+/// Attach to encoder::Options with set_chunk_cache(). Useful when
+/// saving the same image repeatedly after small edits: only the
+/// chunks touching changed rows, and the chunk after each of those,
+/// are compressed again. The image size, chunk size, and compression
+/// settings need to stay the same for anything to be reused.
+///
+/// Holds a copy of the compressed image data. May be shared between
+/// encoders; the last one to finish replaces the cache contents.
+#[derive(Clone)]
+pub struct ChunkCache {
+    state: Arc<Mutex<CacheState>>,
+}
+
+impl ChunkCache {
+    /// Create a new empty cache.
+    pub fn new() -> ChunkCache {
+        ChunkCache {
+            state: Arc::new(Mutex::new(CacheState {
+                settings: None,
+                chunks: Arc::new(Vec::new()),
+                reused: 0,
+            })),
+        }
+    }
+
+    /// Return the number of chunks the last finished encode took
+    /// from the cache rather than compressing.
+    pub fn reused_chunks(&self) -> usize {
+        match self.state.lock() {
+            Ok(state) => state.reused,
+            Err(_) => 0,
+        }
+    }
+
+    /// Drop all cached chunks, freeing their memory.
+    pub fn clear(&self) {
+        if let Ok(mut state) = self.state.lock() {
+            state.settings = None;
+            state.chunks = Arc::new(Vec::new());
+        }
+    }
+
+    //
+    // Get the chunks from the last encode, if made with the
+    // same settings.
+    //
+    pub fn chunks(&self, settings: Settings) -> Arc<CachedChunks> {
+        match self.state.lock() {
+            Ok(ref state) if state.settings == Some(settings) => Arc::clone(&state.chunks),
+            _ => Arc::new(Vec::new()),
+        }
+    }
+
+    //
+    // Replace the contents with a finished encode's chunks.
+    //
+    pub fn store(&self, settings: Settings, chunks: CachedChunks, reused: usize) {
+        if let Ok(mut state) = self.state.lock() {
+            state.settings = Some(settings);
+            state.chunks = Arc::new(chunks);
+            state.reused = reused;
+        }
+    }
+}
+
+impl Default for ChunkCache {
+    fn default() -> Self {
+        Self::new()
+    }
+}
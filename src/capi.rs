@@ -29,25 +29,44 @@ use rayon::ThreadPoolBuilder;
 use std::convert::TryFrom;
 
 use std::io;
-use std::io::Write;
+use std::io::{IoSlice, Read, Seek, SeekFrom, Write};
 
 use std::ptr;
 
+use std::sync::Arc;
+
+use std::time::{Duration, Instant};
+
 use std::ffi::CStr;
 use std::os::raw::c_char;
 
 use libc::{c_void, c_int, size_t};
 
+use super::BufferPool;
+use super::ChannelOrder;
+use super::ChunkCache;
+use super::ColorReduction;
 use super::ColorType;
 use super::Strategy;
+use super::Backend;
 use super::CompressionLevel;
 use super::Mode::{Adaptive, Fixed};
 use super::Header;
+use super::BlendOp;
+use super::DisposeOp;
+use super::FrameControl;
+use super::InterlaceMethod;
 
+use super::batch::BatchEncoder;
+use super::decoder::Decoder;
+use super::decoder::Options as DecoderOptions;
 use super::encoder::Encoder;
 use super::encoder::Options;
 
 use super::filter::Filter;
+use super::filter::Heuristic;
+
+use super::stats::{ChunkStats, Stage, Stats, Summary};
 
 use super::utils::invalid_input;
 use super::utils::other;
@@ -56,29 +75,46 @@ use super::utils::other;
 pub enum CResult {
     Ok = 0,
     Err = 1,
+    WouldBlock = 2,
 }
 
 impl From<Result<(),io::Error>> for CResult {
     fn from(result: Result<(),io::Error>) -> CResult {
         match result {
             Ok(()) => CResult::Ok,
+            Err(ref e) if e.kind() == io::ErrorKind::WouldBlock => CResult::WouldBlock,
             Err(_) => CResult::Err,
         }
     }
 }
 
-/*
 pub type CReadFunc = unsafe extern "C"
     fn(*const c_void, *mut u8, size_t) -> size_t;
-*/
 
 pub type CWriteFunc = unsafe extern "C"
     fn(*const c_void, *const u8, size_t) -> size_t;
 
+// Laid out like POSIX struct iovec.
+#[repr(C)]
+pub struct CIoVec {
+    p_bytes: *const u8,
+    len: size_t,
+}
+
+pub type CWritevFunc = unsafe extern "C"
+    fn(*const c_void, *const CIoVec, size_t) -> size_t;
+
 pub type CFlushFunc = unsafe extern "C"
     fn(*const c_void) -> bool;
 
-/*
+pub type CSeekFunc = unsafe extern "C"
+    fn(*const c_void, i64, c_int) -> i64;
+
+pub type CNotifyFunc = unsafe extern "C"
+    fn(*const c_void);
+
+pub type CTraceFunc = unsafe extern "C"
+    fn(*const c_void, c_int, size_t, u64, u64);
 
 //
 // Adapter for Read trait to use C callback.
@@ -102,38 +138,61 @@ impl CReader {
 
 impl Read for CReader {
     fn read(&mut self, buf: &mut [u8]) -> io::Result<usize> {
+        if buf.is_empty() {
+            return Ok(0);
+        }
         let ret = unsafe {
             (self.read_func)(self.user_data,
-                             &mut buf[0],
+                             buf.as_mut_ptr(),
                              buf.len())
         };
-        if ret == buf.len() {
+        // Short reads are fine, and 0 is the end of input.
+        if ret <= buf.len() {
             Ok(ret)
         } else {
             Err(other("mtpng read callback returned failure"))
         }
     }
 }
-*/
 
 //
 // Adapter for Write trait to use C callbacks.
 //
+// Takes either a write or a writev callback.
 pub struct CWriter {
-    write_func: CWriteFunc,
+    write_func: Option<CWriteFunc>,
+    writev_func: Option<CWritevFunc>,
     flush_func: CFlushFunc,
+    seek_func: Option<CSeekFunc>,
     user_data: *mut c_void,
 }
 
 impl CWriter {
     fn new(write_func: CWriteFunc,
            flush_func: CFlushFunc,
+           seek_func: Option<CSeekFunc>,
            user_data: *mut c_void)
     -> CWriter
     {
         CWriter {
-            write_func: write_func,
+            write_func: Some(write_func),
+            writev_func: None,
+            flush_func: flush_func,
+            seek_func: seek_func,
+            user_data: user_data,
+        }
+    }
+
+    fn new_vectored(writev_func: CWritevFunc,
+                    flush_func: CFlushFunc,
+                    user_data: *mut c_void)
+    -> CWriter
+    {
+        CWriter {
+            write_func: None,
+            writev_func: Some(writev_func),
             flush_func: flush_func,
+            seek_func: None,
             user_data: user_data,
         }
     }
@@ -141,10 +200,14 @@ impl CWriter {
 
 impl Write for CWriter {
     fn write(&mut self, buf: &[u8]) -> io::Result<usize> {
+        let write_func = match self.write_func {
+            Some(func) => func,
+            None => return self.write_vectored(&[IoSlice::new(buf)]),
+        };
         let ret = unsafe {
-            (self.write_func)(self.user_data,
-                                   &buf[0],
-                                   buf.len())
+            (write_func)(self.user_data,
+                         buf.as_ptr(),
+                         buf.len())
         };
         if ret == buf.len() {
             Ok(ret)
@@ -153,6 +216,31 @@ impl Write for CWriter {
         }
     }
 
+    fn write_vectored(&mut self, bufs: &[IoSlice]) -> io::Result<usize> {
+        let writev_func = match self.writev_func {
+            Some(func) => func,
+            None => match bufs.iter().find(|buf| !buf.is_empty()) {
+                Some(buf) => return self.write(buf),
+                None => return Ok(0),
+            },
+        };
+        let iov: Vec<CIoVec> = bufs.iter().map(|buf| CIoVec {
+            p_bytes: buf.as_ptr(),
+            len: buf.len(),
+        }).collect();
+        let len: usize = bufs.iter().map(|buf| buf.len()).sum();
+        let ret = unsafe {
+            (writev_func)(self.user_data,
+                          iov.as_ptr(),
+                          iov.len())
+        };
+        if ret == len {
+            Ok(ret)
+        } else {
+            Err(other("mtpng writev callback returned failure"))
+        }
+    }
+
     fn flush(&mut self) -> io::Result<()> {
         let ret = unsafe {
             (self.flush_func)(self.user_data)
@@ -165,13 +253,205 @@ impl Write for CWriter {
     }
 }
 
+impl Seek for CWriter {
+    fn seek(&mut self, pos: SeekFrom) -> io::Result<u64> {
+        let seek_func = match self.seek_func {
+            Some(func) => func,
+            None => return Err(other("mtpng output is not seekable")),
+        };
+        let (offset, whence) = match pos {
+            SeekFrom::Start(offset) => {
+                if offset > i64::max_value() as u64 {
+                    return Err(invalid_input("Seek offset out of range"));
+                }
+                (offset as i64, 0)
+            },
+            SeekFrom::Current(offset) => (offset, 1),
+            SeekFrom::End(offset) => (offset, 2),
+        };
+        let ret = unsafe {
+            seek_func(self.user_data, offset, whence)
+        };
+        if ret >= 0 {
+            Ok(ret as u64)
+        } else {
+            Err(other("mtpng seek callback returned failure"))
+        }
+    }
+}
+
+//
+// Wrapper for a caller-pinned image buffer passed to
+// mtpng_encoder_write_image_frame().
+//
+// The caller guarantees the memory stays valid and unmodified
+// until the encoder is finished, so it's safe to share the
+// pointer with the worker threads.
+//
+struct CFrame {
+    p_bytes: *const u8,
+    len: usize,
+}
+
+unsafe impl Send for CFrame {}
+unsafe impl Sync for CFrame {}
+
+impl AsRef<[u8]> for CFrame {
+    fn as_ref(&self) -> &[u8] {
+        unsafe {
+            ::std::slice::from_raw_parts(self.p_bytes, self.len)
+        }
+    }
+}
+
+//
+// Notification callback for mtpng_encoder_set_notify(), which
+// is called from the worker threads.
+//
+// The caller guarantees the callback is thread-safe with the
+// given user data.
+//
+struct CNotify {
+    notify_func: CNotifyFunc,
+    user_data: *const c_void,
+}
+
+unsafe impl Send for CNotify {}
+unsafe impl Sync for CNotify {}
+
+impl CNotify {
+    fn notify(&self) {
+        unsafe {
+            (self.notify_func)(self.user_data);
+        }
+    }
+}
+
+//
+// Trace callback for mtpng_encoder_set_trace(), which is called
+// from the worker threads and the encoder's thread. Span start
+// times count from when it was set.
+//
+struct CTrace {
+    trace_func: CTraceFunc,
+    user_data: *const c_void,
+    epoch: Instant,
+}
+
+unsafe impl Send for CTrace {}
+unsafe impl Sync for CTrace {}
+
+impl CTrace {
+    fn trace(&self, stage: Stage, chunk: usize, start: Instant, duration: Duration) {
+        let start = start.saturating_duration_since(self.epoch);
+        unsafe {
+            (self.trace_func)(self.user_data,
+                              stage as c_int,
+                              chunk,
+                              nanos(start),
+                              nanos(duration));
+        }
+    }
+}
+
+fn nanos(duration: Duration) -> u64 {
+    duration.as_nanos() as u64
+}
+
+// Times are in nanoseconds; see mtpng_chunk_stats in mtpng.h.
+#[repr(C)]
+pub struct CChunkStats {
+    index: size_t,
+    rows: size_t,
+    bytes_in: size_t,
+    bytes_out: size_t,
+    queue_wait_ns: u64,
+    filter_ns: u64,
+    handoff_wait_ns: u64,
+    deflate_ns: u64,
+    output_wait_ns: u64,
+    write_ns: u64,
+    filters: [size_t; 5],
+    reused: bool,
+}
+
+impl CChunkStats {
+    fn from(chunk: &ChunkStats) -> CChunkStats {
+        CChunkStats {
+            index: chunk.index,
+            rows: chunk.rows,
+            bytes_in: chunk.bytes_in,
+            bytes_out: chunk.bytes_out,
+            queue_wait_ns: nanos(chunk.queue_wait),
+            filter_ns: nanos(chunk.filter_time),
+            handoff_wait_ns: nanos(chunk.handoff_wait),
+            deflate_ns: nanos(chunk.deflate_time),
+            output_wait_ns: nanos(chunk.output_wait),
+            write_ns: nanos(chunk.write_time),
+            filters: chunk.filters,
+            reused: chunk.reused,
+        }
+    }
+}
+
+// See mtpng_stats_summary in mtpng.h.
+#[repr(C)]
+pub struct CStatsSummary {
+    chunks: size_t,
+    threads: size_t,
+    elapsed_ns: u64,
+    bytes_in: size_t,
+    bytes_out: size_t,
+    queue_wait_ns: u64,
+    filter_ns: u64,
+    handoff_wait_ns: u64,
+    deflate_ns: u64,
+    output_wait_ns: u64,
+    write_ns: u64,
+    filters: [size_t; 5],
+    reused: size_t,
+    blocked_ns: u64,
+    worker_idle_ns: u64,
+}
+
+impl CStatsSummary {
+    fn from(summary: &Summary) -> CStatsSummary {
+        CStatsSummary {
+            chunks: summary.chunks,
+            threads: summary.threads,
+            elapsed_ns: nanos(summary.elapsed),
+            bytes_in: summary.bytes_in,
+            bytes_out: summary.bytes_out,
+            queue_wait_ns: nanos(summary.queue_wait),
+            filter_ns: nanos(summary.filter_time),
+            handoff_wait_ns: nanos(summary.handoff_wait),
+            deflate_ns: nanos(summary.deflate_time),
+            output_wait_ns: nanos(summary.output_wait),
+            write_ns: nanos(summary.write_time),
+            filters: summary.filters,
+            reused: summary.reused,
+            blocked_ns: nanos(summary.blocked_time),
+            worker_idle_ns: nanos(summary.worker_idle),
+        }
+    }
+}
+
 // Cheat on the lifetimes?
 type CEncoder = Encoder<'static, CWriter>;
+type CBatchEncoder = BatchEncoder<'static, CWriter>;
 
 pub type PThreadPool = *mut ThreadPool;
+pub type PBufferPool = *mut BufferPool;
+pub type PChunkCache = *mut ChunkCache;
+pub type PColorReduction = *mut ColorReduction;
+pub type PStats = *mut Stats;
 pub type PEncoderOptions = *mut Options<'static>;
 pub type PEncoder = *mut CEncoder;
+pub type PBatchEncoder = *mut CBatchEncoder;
+pub type PDecoderOptions = *mut DecoderOptions<'static>;
+pub type PDecoder = *mut Decoder<'static, CReader>;
 pub type PHeader = *mut Header;
+pub type PFrameControl = *mut FrameControl;
 
 
 #[no_mangle]
@@ -215,35 +495,40 @@ fn mtpng_threadpool_release(pp_pool: *mut PThreadPool)
 
 #[no_mangle]
 pub unsafe extern "C"
-fn mtpng_encoder_options_new(pp_options: *mut PEncoderOptions)
+fn mtpng_buffer_pool_new(pp_pool: *mut PBufferPool, max_bytes: size_t)
 -> CResult
 {
     CResult::from(|| -> io::Result<()> {
-        if pp_options.is_null() {
-            return Err(invalid_input("pp_options must not be null"));
+        if pp_pool.is_null() {
+            return Err(invalid_input("pp_pool must not be null"));
         }
-        if !(*pp_options).is_null() {
-            return Err(invalid_input("*pp_options must be null"))
+        if !(*pp_pool).is_null() {
+            return Err(invalid_input("*pp_pool must be null"))
         }
-        *pp_options = Box::into_raw(Box::new(Options::new()));
+        let pool = if max_bytes == 0 {
+            BufferPool::new()
+        } else {
+            BufferPool::with_max_bytes(max_bytes)
+        };
+        *pp_pool = Box::into_raw(Box::new(pool));
         Ok(())
     }())
 }
 
 #[no_mangle]
 pub unsafe extern "C"
-fn mtpng_encoder_options_release(pp_options: *mut PEncoderOptions)
+fn mtpng_buffer_pool_release(pp_pool: *mut PBufferPool)
 -> CResult
 {
     CResult::from(|| -> io::Result<()> {
-        if pp_options.is_null() {
-            return Err(invalid_input("pp_header must not be null"));
+        if pp_pool.is_null() {
+            return Err(invalid_input("pp_pool must not be null"));
         }
-        if (*pp_options).is_null() {
-            return Err(invalid_input("*pp_header must not be null"));
+        if (*pp_pool).is_null() {
+            return Err(invalid_input("*pp_pool must not be null"));
         }
-        drop(Box::from_raw(*pp_options));
-        *pp_options = ptr::null_mut();
+        drop(Box::from_raw(*pp_pool));
+        *pp_pool = ptr::null_mut();
         Ok(())
     }())
 }
@@ -251,303 +536,1250 @@ fn mtpng_encoder_options_release(pp_options: *mut PEncoderOptions)
 
 #[no_mangle]
 pub unsafe extern "C"
-fn mtpng_encoder_options_set_thread_pool(p_options: PEncoderOptions,
-                                         p_pool: PThreadPool)
+fn mtpng_chunk_cache_new(pp_cache: *mut PChunkCache)
 -> CResult
 {
     CResult::from(|| -> io::Result<()> {
-        if p_options.is_null() {
-            return Err(invalid_input("p_options must not be null"));
+        if pp_cache.is_null() {
+            return Err(invalid_input("pp_cache must not be null"));
         }
-        (*p_options).set_thread_pool(&*p_pool)
+        if !(*pp_cache).is_null() {
+            return Err(invalid_input("*pp_cache must be null"))
+        }
+        *pp_cache = Box::into_raw(Box::new(ChunkCache::new()));
+        Ok(())
     }())
 }
 
-
 #[no_mangle]
 pub unsafe extern "C"
-fn mtpng_encoder_options_set_filter(p_options: PEncoderOptions,
-                                    filter_mode: c_int)
+fn mtpng_chunk_cache_release(pp_cache: *mut PChunkCache)
 -> CResult
 {
     CResult::from(|| -> io::Result<()> {
-        if p_options.is_null() {
-            return Err(invalid_input("p_options must not be null"));
+        if pp_cache.is_null() {
+            return Err(invalid_input("pp_cache must not be null"));
         }
-        if filter_mode > u8::max_value() as c_int {
-            return Err(invalid_input("Invalid filter mode"));
+        if (*pp_cache).is_null() {
+            return Err(invalid_input("*pp_cache must not be null"));
         }
-        let mode = if filter_mode < 0 {
-            Adaptive
-        } else {
-            Fixed(Filter::try_from(filter_mode as u8)?)
-        };
-        (*p_options).set_filter_mode(mode)
+        drop(Box::from_raw(*pp_cache));
+        *pp_cache = ptr::null_mut();
+        Ok(())
     }())
 }
 
 #[no_mangle]
 pub unsafe extern "C"
-fn mtpng_encoder_options_set_strategy(p_options: PEncoderOptions,
-                                      strategy_mode: c_int)
+fn mtpng_chunk_cache_get_reused_chunks(p_cache: PChunkCache,
+                                       p_reused: *mut size_t)
 -> CResult
 {
     CResult::from(|| -> io::Result<()> {
-        if p_options.is_null() {
-            return Err(invalid_input("p_options must not be null"));
+        if p_cache.is_null() {
+            return Err(invalid_input("p_cache must not be null"));
         }
-        if strategy_mode > u8::max_value() as c_int {
-            return Err(invalid_input("Invalid strategy mode"));
+        if p_reused.is_null() {
+            return Err(invalid_input("p_reused must not be null"));
         }
-        let mode = if strategy_mode < 0 {
-            Adaptive
-        } else {
-            Fixed(Strategy::try_from(strategy_mode as u8)?)
-        };
-        (*p_options).set_strategy_mode(mode)
+        *p_reused = (*p_cache).reused_chunks();
+        Ok(())
     }())
 }
 
+
 #[no_mangle]
 pub unsafe extern "C"
-fn mtpng_encoder_options_set_compression_level(p_options: PEncoderOptions,
-                                               compression_level: c_int)
+fn mtpng_color_reduction_new(pp_reduction: *mut PColorReduction,
+                             p_header: PHeader,
+                             p_frame: *const u8,
+                             len: size_t,
+                             frame_stride: size_t,
+                             p_options: PEncoderOptions)
 -> CResult
 {
     CResult::from(|| -> io::Result<()> {
-        if p_options.is_null() {
-            return Err(invalid_input("p_options must not be null"));
+        if pp_reduction.is_null() {
+            return Err(invalid_input("pp_reduction must not be null"));
         }
-        if compression_level < 0 || compression_level > 9 {
-            return Err(invalid_input("Invalid compression level"));
+        if !(*pp_reduction).is_null() {
+            return Err(invalid_input("*pp_reduction must be null"))
         }
-        let level = CompressionLevel::try_from(compression_level as u8)?;
-        (*p_options).set_compression_level(level)
+        if p_header.is_null() {
+            return Err(invalid_input("p_header must not be null"));
+        }
+        if p_frame.is_null() {
+            return Err(invalid_input("p_frame must not be null"));
+        }
+        let frame = ::std::slice::from_raw_parts(p_frame, len);
+        let reduction = if p_options.is_null() {
+            ColorReduction::new(&*p_header, frame, frame_stride, &Options::new())?
+        } else {
+            ColorReduction::new(&*p_header, frame, frame_stride, &*p_options)?
+        };
+        *pp_reduction = Box::into_raw(Box::new(reduction));
+        Ok(())
     }())
 }
 
 #[no_mangle]
 pub unsafe extern "C"
-fn mtpng_encoder_options_set_chunk_size(p_options: PEncoderOptions,
-                                        chunk_size: size_t)
+fn mtpng_color_reduction_release(pp_reduction: *mut PColorReduction)
 -> CResult
 {
     CResult::from(|| -> io::Result<()> {
-        if p_options.is_null() {
-            return Err(invalid_input("p_encoder must not be null"));
+        if pp_reduction.is_null() {
+            return Err(invalid_input("pp_reduction must not be null"));
         }
-        (*p_options).set_chunk_size(chunk_size)
+        if (*pp_reduction).is_null() {
+            return Err(invalid_input("*pp_reduction must not be null"));
+        }
+        drop(Box::from_raw(*pp_reduction));
+        *pp_reduction = ptr::null_mut();
+        Ok(())
     }())
 }
 
-
 #[no_mangle]
 pub unsafe extern "C"
-fn mtpng_header_new(pp_header: *mut PHeader)
+fn mtpng_color_reduction_get_header(p_reduction: PColorReduction,
+                                    p_header: PHeader)
 -> CResult
 {
     CResult::from(|| -> io::Result<()> {
-        if pp_header.is_null() {
-            return Err(invalid_input("pp_header must not be null"));
+        if p_reduction.is_null() {
+            return Err(invalid_input("p_reduction must not be null"));
         }
-        if !(*pp_header).is_null() {
-            return Err(invalid_input("*pp_header must be null"))
+        if p_header.is_null() {
+            return Err(invalid_input("p_header must not be null"));
         }
-        *pp_header = Box::into_raw(Box::new(Header::new()));
+        *p_header = (*p_reduction).header();
         Ok(())
     }())
 }
 
+// Hand out a view of optional chunk data, or NULL and 0 for none.
+unsafe fn get_chunk_data(data: Option<&[u8]>,
+                         pp_bytes: *mut *const u8,
+                         p_len: *mut size_t)
+-> io::Result<()>
+{
+    if pp_bytes.is_null() {
+        return Err(invalid_input("pp_bytes must not be null"));
+    }
+    if p_len.is_null() {
+        return Err(invalid_input("p_len must not be null"));
+    }
+    match data {
+        Some(data) => {
+            *pp_bytes = data.as_ptr();
+            *p_len = data.len();
+        },
+        None => {
+            *pp_bytes = ptr::null();
+            *p_len = 0;
+        },
+    }
+    Ok(())
+}
+
 #[no_mangle]
 pub unsafe extern "C"
-fn mtpng_header_release(pp_header: *mut PHeader)
+fn mtpng_color_reduction_get_palette(p_reduction: PColorReduction,
+                                     pp_bytes: *mut *const u8,
+                                     p_len: *mut size_t)
 -> CResult
 {
     CResult::from(|| -> io::Result<()> {
-        if pp_header.is_null() {
-            return Err(invalid_input("pp_header must not be null"));
-        }
-        if (*pp_header).is_null() {
-            return Err(invalid_input("*pp_header must not be null"));
+        if p_reduction.is_null() {
+            return Err(invalid_input("p_reduction must not be null"));
         }
-        drop(Box::from_raw(*pp_header));
-        *pp_header = ptr::null_mut();
-        Ok(())
+        get_chunk_data((*p_reduction).palette(), pp_bytes, p_len)
     }())
 }
 
 #[no_mangle]
 pub unsafe extern "C"
-fn mtpng_header_set_size(p_header: PHeader,
-                         width: u32,
-                         height: u32)
+fn mtpng_color_reduction_get_transparency(p_reduction: PColorReduction,
+                                          pp_bytes: *mut *const u8,
+                                          p_len: *mut size_t)
 -> CResult
 {
     CResult::from(|| -> io::Result<()> {
-        if p_header.is_null() {
-            return Err(invalid_input("p_encoder must not be null"));
+        if p_reduction.is_null() {
+            return Err(invalid_input("p_reduction must not be null"));
         }
-        (*p_header).set_size(width, height)
+        get_chunk_data((*p_reduction).transparency(), pp_bytes, p_len)
     }())
 }
 
+
 #[no_mangle]
 pub unsafe extern "C"
-fn mtpng_header_set_color(p_header: PHeader,
-                                   color_type: c_int,
-                                   depth: u8)
+fn mtpng_stats_new(pp_stats: *mut PStats)
 -> CResult
 {
     CResult::from(|| -> io::Result<()> {
-        if p_header.is_null() {
-            return Err(invalid_input("p_header must not be null"));
+        if pp_stats.is_null() {
+            return Err(invalid_input("pp_stats must not be null"));
         }
-        if color_type < 0 || color_type > u8::max_value() as c_int {
-            return Err(invalid_input("Invalid color type"));
+        if !(*pp_stats).is_null() {
+            return Err(invalid_input("*pp_stats must be null"))
         }
-        let color = ColorType::try_from(color_type as u8)?;
-        (*p_header).set_color(color, depth)
+        *pp_stats = Box::into_raw(Box::new(Stats::new()));
+        Ok(())
     }())
 }
 
-
-
 #[no_mangle]
 pub unsafe extern "C"
-fn mtpng_encoder_new(pp_encoder: *mut PEncoder,
-                     write_func: Option<CWriteFunc>,
-                     flush_func: Option<CFlushFunc>,
-                     user_data: *mut c_void,
-                     p_options: PEncoderOptions)
+fn mtpng_stats_release(pp_stats: *mut PStats)
 -> CResult
 {
     CResult::from(|| -> io::Result<()> {
-        if pp_encoder.is_null() {
-            return Err(invalid_input("pp_encoder must not be null"));
+        if pp_stats.is_null() {
+            return Err(invalid_input("pp_stats must not be null"));
         }
-        if !(*pp_encoder).is_null() {
-            return Err(invalid_input("*pp_encoder must be null"));
+        if (*pp_stats).is_null() {
+            return Err(invalid_input("*pp_stats must not be null"));
         }
-        let writer = match (write_func, flush_func) {
-            (Some(wf), Some(ff)) => CWriter::new(wf, ff, user_data),
-            _ => return Err(invalid_input("write_func and flush_func must not be null"))
-        };
-        let default = Options::<'static>::new();
-        let options = if p_options.is_null() {
-            &default
-        } else {
-            &*p_options
-        };
-        let encoder = Encoder::new(writer, options);
-        *pp_encoder = Box::into_raw(Box::new(encoder));
+        drop(Box::from_raw(*pp_stats));
+        *pp_stats = ptr::null_mut();
         Ok(())
     }())
 }
 
 #[no_mangle]
 pub unsafe extern "C"
-fn mtpng_encoder_release(pp_encoder: *mut PEncoder)
+fn mtpng_stats_get_summary(p_stats: PStats,
+                           p_summary: *mut CStatsSummary)
 -> CResult
 {
     CResult::from(|| -> io::Result<()> {
-        if pp_encoder.is_null() {
-            return Err(invalid_input("pp_encoder must not be null"))
+        if p_stats.is_null() {
+            return Err(invalid_input("p_stats must not be null"));
         }
-        if (*pp_encoder).is_null() {
-            return Err(invalid_input("*pp_encoder must not be null"))
+        if p_summary.is_null() {
+            return Err(invalid_input("p_summary must not be null"));
         }
-        drop(Box::from_raw(*pp_encoder));
-        *pp_encoder = ptr::null_mut();
+        *p_summary = CStatsSummary::from(&(*p_stats).summary());
         Ok(())
     }())
 }
 
-
 #[no_mangle]
 pub unsafe extern "C"
-fn mtpng_encoder_write_header(p_encoder: PEncoder,
-                              p_header: PHeader)
+fn mtpng_stats_get_chunk_count(p_stats: PStats,
+                               p_count: *mut size_t)
 -> CResult
 {
     CResult::from(|| -> io::Result<()> {
-        if p_encoder.is_null() {
-            return Err(invalid_input("p_encoder must not be null"));
+        if p_stats.is_null() {
+            return Err(invalid_input("p_stats must not be null"));
         }
-        if p_header.is_null() {
-            return Err(invalid_input("p_header must not be null"));
+        if p_count.is_null() {
+            return Err(invalid_input("p_count must not be null"));
         }
-        (*p_encoder).write_header(&*p_header)?;
+        *p_count = (*p_stats).chunks().len();
         Ok(())
     }())
 }
 
 #[no_mangle]
 pub unsafe extern "C"
-fn mtpng_encoder_write_palette(p_encoder: PEncoder,
-                               p_bytes: *const u8,
-                               len: size_t)
+fn mtpng_stats_get_chunk(p_stats: PStats,
+                         index: size_t,
+                         p_chunk: *mut CChunkStats)
 -> CResult
 {
     CResult::from(|| -> io::Result<()> {
-        if p_encoder.is_null() {
-            return Err(invalid_input("p_encoder must not be null"));
+        if p_stats.is_null() {
+            return Err(invalid_input("p_stats must not be null"));
         }
-        if p_bytes.is_null() {
-            return Err(invalid_input("p_bytes must not be null"));
+        if p_chunk.is_null() {
+            return Err(invalid_input("p_chunk must not be null"));
+        }
+        match (*p_stats).chunks().get(index) {
+            Some(chunk) => {
+                *p_chunk = CChunkStats::from(chunk);
+                Ok(())
+            },
+            None => Err(invalid_input("Chunk index out of range")),
         }
-        let slice = ::std::slice::from_raw_parts(p_bytes, len);
-        (*p_encoder).write_palette(slice)
     }())
 }
 
+
 #[no_mangle]
 pub unsafe extern "C"
-fn mtpng_encoder_write_transparency(p_encoder: PEncoder,
-                                    p_bytes: *const u8,
-                                    len: size_t)
+fn mtpng_encoder_options_new(pp_options: *mut PEncoderOptions)
+-> CResult
+{
+    CResult::from(|| -> io::Result<()> {
+        if pp_options.is_null() {
+            return Err(invalid_input("pp_options must not be null"));
+        }
+        if !(*pp_options).is_null() {
+            return Err(invalid_input("*pp_options must be null"))
+        }
+        *pp_options = Box::into_raw(Box::new(Options::new()));
+        Ok(())
+    }())
+}
+
+#[no_mangle]
+pub unsafe extern "C"
+fn mtpng_encoder_options_release(pp_options: *mut PEncoderOptions)
+-> CResult
+{
+    CResult::from(|| -> io::Result<()> {
+        if pp_options.is_null() {
+            return Err(invalid_input("pp_header must not be null"));
+        }
+        if (*pp_options).is_null() {
+            return Err(invalid_input("*pp_header must not be null"));
+        }
+        drop(Box::from_raw(*pp_options));
+        *pp_options = ptr::null_mut();
+        Ok(())
+    }())
+}
+
+
+#[no_mangle]
+pub unsafe extern "C"
+fn mtpng_encoder_options_set_thread_pool(p_options: PEncoderOptions,
+                                         p_pool: PThreadPool)
+-> CResult
+{
+    CResult::from(|| -> io::Result<()> {
+        if p_options.is_null() {
+            return Err(invalid_input("p_options must not be null"));
+        }
+        (*p_options).set_thread_pool(&*p_pool)
+    }())
+}
+
+#[no_mangle]
+pub unsafe extern "C"
+fn mtpng_encoder_options_set_buffer_pool(p_options: PEncoderOptions,
+                                         p_pool: PBufferPool)
+-> CResult
+{
+    CResult::from(|| -> io::Result<()> {
+        if p_options.is_null() {
+            return Err(invalid_input("p_options must not be null"));
+        }
+        if p_pool.is_null() {
+            return Err(invalid_input("p_pool must not be null"));
+        }
+        (*p_options).set_buffer_pool(&*p_pool)
+    }())
+}
+
+#[no_mangle]
+pub unsafe extern "C"
+fn mtpng_encoder_options_set_chunk_cache(p_options: PEncoderOptions,
+                                         p_cache: PChunkCache)
+-> CResult
+{
+    CResult::from(|| -> io::Result<()> {
+        if p_options.is_null() {
+            return Err(invalid_input("p_options must not be null"));
+        }
+        if p_cache.is_null() {
+            return Err(invalid_input("p_cache must not be null"));
+        }
+        (*p_options).set_chunk_cache(&*p_cache)
+    }())
+}
+
+#[no_mangle]
+pub unsafe extern "C"
+fn mtpng_encoder_options_set_color_reduction(p_options: PEncoderOptions,
+                                             p_reduction: PColorReduction)
+-> CResult
+{
+    CResult::from(|| -> io::Result<()> {
+        if p_options.is_null() {
+            return Err(invalid_input("p_options must not be null"));
+        }
+        if p_reduction.is_null() {
+            return Err(invalid_input("p_reduction must not be null"));
+        }
+        (*p_options).set_color_reduction(&*p_reduction)
+    }())
+}
+
+
+#[no_mangle]
+pub unsafe extern "C"
+fn mtpng_encoder_options_set_filter(p_options: PEncoderOptions,
+                                    filter_mode: c_int)
+-> CResult
+{
+    CResult::from(|| -> io::Result<()> {
+        if p_options.is_null() {
+            return Err(invalid_input("p_options must not be null"));
+        }
+        if filter_mode > u8::max_value() as c_int {
+            return Err(invalid_input("Invalid filter mode"));
+        }
+        let mode = if filter_mode < 0 {
+            Adaptive
+        } else {
+            Fixed(Filter::try_from(filter_mode as u8)?)
+        };
+        (*p_options).set_filter_mode(mode)
+    }())
+}
+
+#[no_mangle]
+pub unsafe extern "C"
+fn mtpng_encoder_options_set_filter_heuristic(p_options: PEncoderOptions,
+                                              filter_heuristic: c_int)
+-> CResult
+{
+    CResult::from(|| -> io::Result<()> {
+        if p_options.is_null() {
+            return Err(invalid_input("p_options must not be null"));
+        }
+        if filter_heuristic < 0 || filter_heuristic > u8::max_value() as c_int {
+            return Err(invalid_input("Invalid filter heuristic"));
+        }
+        (*p_options).set_filter_heuristic(Heuristic::try_from(filter_heuristic as u8)?)
+    }())
+}
+
+#[no_mangle]
+pub unsafe extern "C"
+fn mtpng_encoder_options_set_filter_trials(p_options: PEncoderOptions,
+                                           filter_trials: bool)
+-> CResult
+{
+    CResult::from(|| -> io::Result<()> {
+        if p_options.is_null() {
+            return Err(invalid_input("p_options must not be null"));
+        }
+        (*p_options).set_filter_trials(filter_trials)
+    }())
+}
+
+#[no_mangle]
+pub unsafe extern "C"
+fn mtpng_encoder_options_set_strategy(p_options: PEncoderOptions,
+                                      strategy_mode: c_int)
+-> CResult
+{
+    CResult::from(|| -> io::Result<()> {
+        if p_options.is_null() {
+            return Err(invalid_input("p_options must not be null"));
+        }
+        if strategy_mode > u8::max_value() as c_int {
+            return Err(invalid_input("Invalid strategy mode"));
+        }
+        let mode = if strategy_mode < 0 {
+            Adaptive
+        } else {
+            Fixed(Strategy::try_from(strategy_mode as u8)?)
+        };
+        (*p_options).set_strategy_mode(mode)
+    }())
+}
+
+#[no_mangle]
+pub unsafe extern "C"
+fn mtpng_encoder_options_set_backend(p_options: PEncoderOptions,
+                                     backend_mode: c_int)
+-> CResult
+{
+    CResult::from(|| -> io::Result<()> {
+        if p_options.is_null() {
+            return Err(invalid_input("p_options must not be null"));
+        }
+        if backend_mode > u8::max_value() as c_int {
+            return Err(invalid_input("Invalid backend mode"));
+        }
+        let mode = if backend_mode < 0 {
+            Adaptive
+        } else {
+            Fixed(Backend::try_from(backend_mode as u8)?)
+        };
+        (*p_options).set_backend_mode(mode)
+    }())
+}
+
+#[no_mangle]
+pub unsafe extern "C"
+fn mtpng_encoder_options_set_compression_level(p_options: PEncoderOptions,
+                                               compression_level: c_int)
+-> CResult
+{
+    CResult::from(|| -> io::Result<()> {
+        if p_options.is_null() {
+            return Err(invalid_input("p_options must not be null"));
+        }
+        if compression_level < 0 || compression_level > 9 {
+            return Err(invalid_input("Invalid compression level"));
+        }
+        let level = CompressionLevel::try_from(compression_level as u8)?;
+        (*p_options).set_compression_level(level)
+    }())
+}
+
+#[no_mangle]
+pub unsafe extern "C"
+fn mtpng_encoder_options_set_chunk_size(p_options: PEncoderOptions,
+                                        chunk_size: size_t)
+-> CResult
+{
+    CResult::from(|| -> io::Result<()> {
+        if p_options.is_null() {
+            return Err(invalid_input("p_encoder must not be null"));
+        }
+        if chunk_size == 0 {
+            (*p_options).set_chunk_size_mode(Adaptive)
+        } else {
+            (*p_options).set_chunk_size(chunk_size)
+        }
+    }())
+}
+
+#[no_mangle]
+pub unsafe extern "C"
+fn mtpng_encoder_options_set_channel_order(p_options: PEncoderOptions,
+                                           channel_order: c_int)
+-> CResult
+{
+    CResult::from(|| -> io::Result<()> {
+        if p_options.is_null() {
+            return Err(invalid_input("p_options must not be null"));
+        }
+        if channel_order < 0 || channel_order > u8::max_value() as c_int {
+            return Err(invalid_input("Invalid channel order"));
+        }
+        (*p_options).set_channel_order(ChannelOrder::try_from(channel_order as u8)?)
+    }())
+}
+
+#[no_mangle]
+pub unsafe extern "C"
+fn mtpng_encoder_options_set_premultiplied_alpha(p_options: PEncoderOptions,
+                                                 premultiplied: bool)
+-> CResult
+{
+    CResult::from(|| -> io::Result<()> {
+        if p_options.is_null() {
+            return Err(invalid_input("p_options must not be null"));
+        }
+        (*p_options).set_premultiplied_alpha(premultiplied)
+    }())
+}
+
+#[no_mangle]
+pub unsafe extern "C"
+fn mtpng_encoder_options_set_little_endian(p_options: PEncoderOptions,
+                                           little_endian: bool)
+-> CResult
+{
+    CResult::from(|| -> io::Result<()> {
+        if p_options.is_null() {
+            return Err(invalid_input("p_options must not be null"));
+        }
+        (*p_options).set_little_endian(little_endian)
+    }())
+}
+
+#[no_mangle]
+pub unsafe extern "C"
+fn mtpng_encoder_options_set_unpacked_samples(p_options: PEncoderOptions,
+                                              unpacked: bool)
+-> CResult
+{
+    CResult::from(|| -> io::Result<()> {
+        if p_options.is_null() {
+            return Err(invalid_input("p_options must not be null"));
+        }
+        (*p_options).set_unpacked_samples(unpacked)
+    }())
+}
+
+#[no_mangle]
+pub unsafe extern "C"
+fn mtpng_encoder_options_set_input_stride(p_options: PEncoderOptions,
+                                          stride: size_t)
+-> CResult
+{
+    CResult::from(|| -> io::Result<()> {
+        if p_options.is_null() {
+            return Err(invalid_input("p_options must not be null"));
+        }
+        (*p_options).set_input_stride(stride)
+    }())
+}
+
+#[no_mangle]
+pub unsafe extern "C"
+fn mtpng_encoder_options_set_memory_limit(p_options: PEncoderOptions,
+                                          bytes: size_t)
+-> CResult
+{
+    CResult::from(|| -> io::Result<()> {
+        if p_options.is_null() {
+            return Err(invalid_input("p_options must not be null"));
+        }
+        (*p_options).set_memory_limit(bytes)
+    }())
+}
+
+#[no_mangle]
+pub unsafe extern "C"
+fn mtpng_encoder_options_set_stats(p_options: PEncoderOptions,
+                                   p_stats: PStats)
+-> CResult
+{
+    CResult::from(|| -> io::Result<()> {
+        if p_options.is_null() {
+            return Err(invalid_input("p_options must not be null"));
+        }
+        if p_stats.is_null() {
+            return Err(invalid_input("p_stats must not be null"));
+        }
+        (*p_options).set_stats(&*p_stats)
+    }())
+}
+
+
+#[no_mangle]
+pub unsafe extern "C"
+fn mtpng_header_new(pp_header: *mut PHeader)
+-> CResult
+{
+    CResult::from(|| -> io::Result<()> {
+        if pp_header.is_null() {
+            return Err(invalid_input("pp_header must not be null"));
+        }
+        if !(*pp_header).is_null() {
+            return Err(invalid_input("*pp_header must be null"))
+        }
+        *pp_header = Box::into_raw(Box::new(Header::new()));
+        Ok(())
+    }())
+}
+
+#[no_mangle]
+pub unsafe extern "C"
+fn mtpng_header_release(pp_header: *mut PHeader)
+-> CResult
+{
+    CResult::from(|| -> io::Result<()> {
+        if pp_header.is_null() {
+            return Err(invalid_input("pp_header must not be null"));
+        }
+        if (*pp_header).is_null() {
+            return Err(invalid_input("*pp_header must not be null"));
+        }
+        drop(Box::from_raw(*pp_header));
+        *pp_header = ptr::null_mut();
+        Ok(())
+    }())
+}
+
+#[no_mangle]
+pub unsafe extern "C"
+fn mtpng_header_set_size(p_header: PHeader,
+                         width: u32,
+                         height: u32)
+-> CResult
+{
+    CResult::from(|| -> io::Result<()> {
+        if p_header.is_null() {
+            return Err(invalid_input("p_encoder must not be null"));
+        }
+        (*p_header).set_size(width, height)
+    }())
+}
+
+#[no_mangle]
+pub unsafe extern "C"
+fn mtpng_header_set_color(p_header: PHeader,
+                                   color_type: c_int,
+                                   depth: u8)
+-> CResult
+{
+    CResult::from(|| -> io::Result<()> {
+        if p_header.is_null() {
+            return Err(invalid_input("p_header must not be null"));
+        }
+        if color_type < 0 || color_type > u8::max_value() as c_int {
+            return Err(invalid_input("Invalid color type"));
+        }
+        let color = ColorType::try_from(color_type as u8)?;
+        (*p_header).set_color(color, depth)
+    }())
+}
+
+#[no_mangle]
+pub unsafe extern "C"
+fn mtpng_header_set_interlace(p_header: PHeader,
+                              interlace_method: c_int)
+-> CResult
+{
+    CResult::from(|| -> io::Result<()> {
+        if p_header.is_null() {
+            return Err(invalid_input("p_header must not be null"));
+        }
+        if interlace_method < 0 || interlace_method > u8::max_value() as c_int {
+            return Err(invalid_input("Invalid interlace method"));
+        }
+        let method = InterlaceMethod::try_from(interlace_method as u8)?;
+        (*p_header).set_interlace_method(method)
+    }())
+}
+
+#[no_mangle]
+pub unsafe extern "C"
+fn mtpng_header_get_size(p_header: PHeader,
+                         p_width: *mut u32,
+                         p_height: *mut u32)
+-> CResult
+{
+    CResult::from(|| -> io::Result<()> {
+        if p_header.is_null() {
+            return Err(invalid_input("p_header must not be null"));
+        }
+        if p_width.is_null() {
+            return Err(invalid_input("p_width must not be null"));
+        }
+        if p_height.is_null() {
+            return Err(invalid_input("p_height must not be null"));
+        }
+        *p_width = (*p_header).width();
+        *p_height = (*p_header).height();
+        Ok(())
+    }())
+}
+
+#[no_mangle]
+pub unsafe extern "C"
+fn mtpng_header_get_color(p_header: PHeader,
+                          p_color_type: *mut c_int,
+                          p_depth: *mut u8)
+-> CResult
+{
+    CResult::from(|| -> io::Result<()> {
+        if p_header.is_null() {
+            return Err(invalid_input("p_header must not be null"));
+        }
+        if p_color_type.is_null() {
+            return Err(invalid_input("p_color_type must not be null"));
+        }
+        if p_depth.is_null() {
+            return Err(invalid_input("p_depth must not be null"));
+        }
+        *p_color_type = (*p_header).color_type() as c_int;
+        *p_depth = (*p_header).depth();
+        Ok(())
+    }())
+}
+
+#[no_mangle]
+pub unsafe extern "C"
+fn mtpng_header_get_interlace(p_header: PHeader,
+                              p_interlace_method: *mut c_int)
+-> CResult
+{
+    CResult::from(|| -> io::Result<()> {
+        if p_header.is_null() {
+            return Err(invalid_input("p_header must not be null"));
+        }
+        if p_interlace_method.is_null() {
+            return Err(invalid_input("p_interlace_method must not be null"));
+        }
+        *p_interlace_method = (*p_header).interlace_method() as c_int;
+        Ok(())
+    }())
+}
+
+#[no_mangle]
+pub unsafe extern "C"
+fn mtpng_header_get_stride(p_header: PHeader,
+                           p_stride: *mut size_t)
+-> CResult
+{
+    CResult::from(|| -> io::Result<()> {
+        if p_header.is_null() {
+            return Err(invalid_input("p_header must not be null"));
+        }
+        if p_stride.is_null() {
+            return Err(invalid_input("p_stride must not be null"));
+        }
+        *p_stride = (*p_header).stride();
+        Ok(())
+    }())
+}
+
+#[no_mangle]
+pub unsafe extern "C"
+fn mtpng_frame_control_new(pp_frame: *mut PFrameControl)
+-> CResult
+{
+    CResult::from(|| -> io::Result<()> {
+        if pp_frame.is_null() {
+            return Err(invalid_input("pp_frame must not be null"));
+        }
+        if !(*pp_frame).is_null() {
+            return Err(invalid_input("*pp_frame must be null"))
+        }
+        *pp_frame = Box::into_raw(Box::new(FrameControl::new()));
+        Ok(())
+    }())
+}
+
+#[no_mangle]
+pub unsafe extern "C"
+fn mtpng_frame_control_release(pp_frame: *mut PFrameControl)
+-> CResult
+{
+    CResult::from(|| -> io::Result<()> {
+        if pp_frame.is_null() {
+            return Err(invalid_input("pp_frame must not be null"));
+        }
+        if (*pp_frame).is_null() {
+            return Err(invalid_input("*pp_frame must not be null"));
+        }
+        drop(Box::from_raw(*pp_frame));
+        *pp_frame = ptr::null_mut();
+        Ok(())
+    }())
+}
+
+#[no_mangle]
+pub unsafe extern "C"
+fn mtpng_frame_control_set_size(p_frame: PFrameControl,
+                                width: u32,
+                                height: u32)
+-> CResult
+{
+    CResult::from(|| -> io::Result<()> {
+        if p_frame.is_null() {
+            return Err(invalid_input("p_frame must not be null"));
+        }
+        (*p_frame).set_size(width, height)
+    }())
+}
+
+#[no_mangle]
+pub unsafe extern "C"
+fn mtpng_frame_control_set_offset(p_frame: PFrameControl,
+                                  x_offset: u32,
+                                  y_offset: u32)
+-> CResult
+{
+    CResult::from(|| -> io::Result<()> {
+        if p_frame.is_null() {
+            return Err(invalid_input("p_frame must not be null"));
+        }
+        (*p_frame).set_offset(x_offset, y_offset)
+    }())
+}
+
+#[no_mangle]
+pub unsafe extern "C"
+fn mtpng_frame_control_set_delay(p_frame: PFrameControl,
+                                 delay_num: u16,
+                                 delay_den: u16)
+-> CResult
+{
+    CResult::from(|| -> io::Result<()> {
+        if p_frame.is_null() {
+            return Err(invalid_input("p_frame must not be null"));
+        }
+        (*p_frame).set_delay(delay_num, delay_den)
+    }())
+}
+
+#[no_mangle]
+pub unsafe extern "C"
+fn mtpng_frame_control_set_dispose_op(p_frame: PFrameControl,
+                                      dispose_op: c_int)
+-> CResult
+{
+    CResult::from(|| -> io::Result<()> {
+        if p_frame.is_null() {
+            return Err(invalid_input("p_frame must not be null"));
+        }
+        if dispose_op < 0 || dispose_op > u8::max_value() as c_int {
+            return Err(invalid_input("Invalid dispose op"));
+        }
+        (*p_frame).set_dispose_op(DisposeOp::try_from(dispose_op as u8)?)
+    }())
+}
+
+#[no_mangle]
+pub unsafe extern "C"
+fn mtpng_frame_control_set_blend_op(p_frame: PFrameControl,
+                                    blend_op: c_int)
+-> CResult
+{
+    CResult::from(|| -> io::Result<()> {
+        if p_frame.is_null() {
+            return Err(invalid_input("p_frame must not be null"));
+        }
+        if blend_op < 0 || blend_op > u8::max_value() as c_int {
+            return Err(invalid_input("Invalid blend op"));
+        }
+        (*p_frame).set_blend_op(BlendOp::try_from(blend_op as u8)?)
+    }())
+}
+
+
+
+#[no_mangle]
+pub unsafe extern "C"
+fn mtpng_encoder_new(pp_encoder: *mut PEncoder,
+                     write_func: Option<CWriteFunc>,
+                     flush_func: Option<CFlushFunc>,
+                     user_data: *mut c_void,
+                     p_options: PEncoderOptions)
+-> CResult
+{
+    CResult::from(|| -> io::Result<()> {
+        if pp_encoder.is_null() {
+            return Err(invalid_input("pp_encoder must not be null"));
+        }
+        if !(*pp_encoder).is_null() {
+            return Err(invalid_input("*pp_encoder must be null"));
+        }
+        let writer = match (write_func, flush_func) {
+            (Some(wf), Some(ff)) => CWriter::new(wf, ff, None, user_data),
+            _ => return Err(invalid_input("write_func and flush_func must not be null"))
+        };
+        let default = Options::<'static>::new();
+        let options = if p_options.is_null() {
+            &default
+        } else {
+            &*p_options
+        };
+        let encoder = Encoder::new(writer, options);
+        *pp_encoder = Box::into_raw(Box::new(encoder));
+        Ok(())
+    }())
+}
+
+#[no_mangle]
+pub unsafe extern "C"
+fn mtpng_encoder_new_vectored(pp_encoder: *mut PEncoder,
+                              writev_func: Option<CWritevFunc>,
+                              flush_func: Option<CFlushFunc>,
+                              user_data: *mut c_void,
+                              p_options: PEncoderOptions)
+-> CResult
+{
+    CResult::from(|| -> io::Result<()> {
+        if pp_encoder.is_null() {
+            return Err(invalid_input("pp_encoder must not be null"));
+        }
+        if !(*pp_encoder).is_null() {
+            return Err(invalid_input("*pp_encoder must be null"));
+        }
+        let writer = match (writev_func, flush_func) {
+            (Some(wf), Some(ff)) => CWriter::new_vectored(wf, ff, user_data),
+            _ => return Err(invalid_input("writev_func and flush_func must not be null"))
+        };
+        let default = Options::<'static>::new();
+        let options = if p_options.is_null() {
+            &default
+        } else {
+            &*p_options
+        };
+        let encoder = Encoder::new(writer, options);
+        *pp_encoder = Box::into_raw(Box::new(encoder));
+        Ok(())
+    }())
+}
+
+#[no_mangle]
+pub unsafe extern "C"
+fn mtpng_encoder_new_seekable(pp_encoder: *mut PEncoder,
+                              write_func: Option<CWriteFunc>,
+                              flush_func: Option<CFlushFunc>,
+                              seek_func: Option<CSeekFunc>,
+                              user_data: *mut c_void,
+                              p_options: PEncoderOptions)
+-> CResult
+{
+    CResult::from(|| -> io::Result<()> {
+        if pp_encoder.is_null() {
+            return Err(invalid_input("pp_encoder must not be null"));
+        }
+        if !(*pp_encoder).is_null() {
+            return Err(invalid_input("*pp_encoder must be null"));
+        }
+        let writer = match (write_func, flush_func, seek_func) {
+            (Some(wf), Some(ff), Some(sf)) => CWriter::new(wf, ff, Some(sf), user_data),
+            _ => return Err(invalid_input("write_func, flush_func, and seek_func must not be null"))
+        };
+        let default = Options::<'static>::new();
+        let options = if p_options.is_null() {
+            &default
+        } else {
+            &*p_options
+        };
+        let encoder = Encoder::new_seekable(writer, options);
+        *pp_encoder = Box::into_raw(Box::new(encoder));
+        Ok(())
+    }())
+}
+
+#[no_mangle]
+pub unsafe extern "C"
+fn mtpng_encoder_release(pp_encoder: *mut PEncoder)
+-> CResult
+{
+    CResult::from(|| -> io::Result<()> {
+        if pp_encoder.is_null() {
+            return Err(invalid_input("pp_encoder must not be null"))
+        }
+        if (*pp_encoder).is_null() {
+            return Err(invalid_input("*pp_encoder must not be null"))
+        }
+        drop(Box::from_raw(*pp_encoder));
+        *pp_encoder = ptr::null_mut();
+        Ok(())
+    }())
+}
+
+
+#[no_mangle]
+pub unsafe extern "C"
+fn mtpng_encoder_write_header(p_encoder: PEncoder,
+                              p_header: PHeader)
+-> CResult
+{
+    CResult::from(|| -> io::Result<()> {
+        if p_encoder.is_null() {
+            return Err(invalid_input("p_encoder must not be null"));
+        }
+        if p_header.is_null() {
+            return Err(invalid_input("p_header must not be null"));
+        }
+        (*p_encoder).write_header(&*p_header)?;
+        Ok(())
+    }())
+}
+
+#[no_mangle]
+pub unsafe extern "C"
+fn mtpng_encoder_write_palette(p_encoder: PEncoder,
+                               p_bytes: *const u8,
+                               len: size_t)
+-> CResult
+{
+    CResult::from(|| -> io::Result<()> {
+        if p_encoder.is_null() {
+            return Err(invalid_input("p_encoder must not be null"));
+        }
+        if p_bytes.is_null() {
+            return Err(invalid_input("p_bytes must not be null"));
+        }
+        let slice = ::std::slice::from_raw_parts(p_bytes, len);
+        (*p_encoder).write_palette(slice)
+    }())
+}
+
+#[no_mangle]
+pub unsafe extern "C"
+fn mtpng_encoder_write_transparency(p_encoder: PEncoder,
+                                    p_bytes: *const u8,
+                                    len: size_t)
+-> CResult
+{
+    CResult::from(|| -> io::Result<()> {
+        if p_encoder.is_null() {
+            return Err(invalid_input("p_encoder must not be null"));
+        }
+        if p_bytes.is_null() {
+            return Err(invalid_input("p_bytes must not be null"));
+        }
+        let slice = ::std::slice::from_raw_parts(p_bytes, len);
+        (*p_encoder).write_transparency(slice)
+    }())
+}
+
+#[no_mangle]
+pub unsafe extern "C"
+fn mtpng_encoder_write_animation_control(p_encoder: PEncoder,
+                                         num_frames: u32,
+                                         num_plays: u32)
+-> CResult
+{
+    CResult::from(|| -> io::Result<()> {
+        if p_encoder.is_null() {
+            return Err(invalid_input("p_encoder must not be null"));
+        }
+        (*p_encoder).write_animation_control(num_frames, num_plays)
+    }())
+}
+
+#[no_mangle]
+pub unsafe extern "C"
+fn mtpng_encoder_write_frame_control(p_encoder: PEncoder,
+                                     p_frame: PFrameControl)
+-> CResult
+{
+    CResult::from(|| -> io::Result<()> {
+        if p_encoder.is_null() {
+            return Err(invalid_input("p_encoder must not be null"));
+        }
+        if p_frame.is_null() {
+            return Err(invalid_input("p_frame must not be null"));
+        }
+        (*p_encoder).write_frame_control(&*p_frame)
+    }())
+}
+
+#[no_mangle]
+pub unsafe extern "C"
+fn mtpng_encoder_write_chunk(p_encoder: PEncoder,
+                             p_tag: *const c_char,
+                             p_bytes: *const u8,
+                             len: size_t)
+-> CResult
+{
+    CResult::from(|| -> io::Result<()> {
+        if p_encoder.is_null() {
+            return Err(invalid_input("p_encoder must not be null"));
+        }
+        if p_tag.is_null() {
+            return Err(invalid_input("p_tag must not be null"));
+        }
+        if p_bytes.is_null() {
+            return Err(invalid_input("p_bytes must not be null"));
+        }
+        let tag = CStr::from_ptr(p_tag).to_bytes();
+        let slice = ::std::slice::from_raw_parts(p_bytes, len);
+        (*p_encoder).write_chunk(tag, slice)
+    }())
+}
+
+#[no_mangle]
+pub unsafe extern "C"
+fn mtpng_encoder_write_image_rows(p_encoder: PEncoder,
+                                  p_bytes: *const u8,
+                                  len: size_t)
+-> CResult
+{
+    CResult::from(|| -> io::Result<()> {
+        if p_encoder.is_null() {
+            return Err(invalid_input("p_encoder must not be null"));
+        }
+        if p_bytes.is_null() {
+            return Err(invalid_input("p_bytes must not be null"));
+        }
+        let slice = ::std::slice::from_raw_parts(p_bytes, len);
+        (*p_encoder).write_image_rows(slice)
+    }())
+}
+
+#[no_mangle]
+pub unsafe extern "C"
+fn mtpng_encoder_set_notify(p_encoder: PEncoder,
+                            notify_func: Option<CNotifyFunc>,
+                            user_data: *const c_void)
 -> CResult
 {
     CResult::from(|| -> io::Result<()> {
         if p_encoder.is_null() {
             return Err(invalid_input("p_encoder must not be null"));
         }
-        if p_bytes.is_null() {
-            return Err(invalid_input("p_bytes must not be null"));
-        }
-        let slice = ::std::slice::from_raw_parts(p_bytes, len);
-        (*p_encoder).write_transparency(slice)
+        let notify = match notify_func {
+            Some(notify_func) => CNotify {
+                notify_func,
+                user_data,
+            },
+            None => return Err(invalid_input("notify_func must not be null")),
+        };
+        (*p_encoder).set_notify(move || notify.notify());
+        Ok(())
     }())
 }
 
 #[no_mangle]
 pub unsafe extern "C"
-fn mtpng_encoder_write_chunk(p_encoder: PEncoder,
-                             p_tag: *const c_char,
-                             p_bytes: *const u8,
-                             len: size_t)
+fn mtpng_encoder_set_trace(p_encoder: PEncoder,
+                           trace_func: Option<CTraceFunc>,
+                           user_data: *const c_void)
 -> CResult
 {
     CResult::from(|| -> io::Result<()> {
         if p_encoder.is_null() {
             return Err(invalid_input("p_encoder must not be null"));
         }
-        if p_tag.is_null() {
-            return Err(invalid_input("p_tag must not be null"));
+        let trace = match trace_func {
+            Some(trace_func) => CTrace {
+                trace_func,
+                user_data,
+                epoch: Instant::now(),
+            },
+            None => return Err(invalid_input("trace_func must not be null")),
+        };
+        (*p_encoder).set_trace_func(move |span| {
+            trace.trace(span.stage, span.chunk, span.start, span.duration)
+        });
+        Ok(())
+    }())
+}
+
+#[no_mangle]
+pub unsafe extern "C"
+fn mtpng_encoder_try_write_image_rows(p_encoder: PEncoder,
+                                      p_bytes: *const u8,
+                                      len: size_t,
+                                      p_written: *mut size_t)
+-> CResult
+{
+    CResult::from(|| -> io::Result<()> {
+        if p_encoder.is_null() {
+            return Err(invalid_input("p_encoder must not be null"));
         }
         if p_bytes.is_null() {
             return Err(invalid_input("p_bytes must not be null"));
         }
-        let tag = CStr::from_ptr(p_tag).to_bytes();
+        if p_written.is_null() {
+            return Err(invalid_input("p_written must not be null"));
+        }
         let slice = ::std::slice::from_raw_parts(p_bytes, len);
-        (*p_encoder).write_chunk(tag, slice)
+        *p_written = (*p_encoder).try_write_image_rows(slice)?;
+        Ok(())
     }())
 }
 
 #[no_mangle]
 pub unsafe extern "C"
-fn mtpng_encoder_write_image_rows(p_encoder: PEncoder,
-                                  p_bytes: *const u8,
-                                  len: size_t)
+fn mtpng_encoder_poll(p_encoder: PEncoder,
+                      p_flushed: *mut bool)
+-> CResult
+{
+    CResult::from(|| -> io::Result<()> {
+        if p_encoder.is_null() {
+            return Err(invalid_input("p_encoder must not be null"));
+        }
+        if p_flushed.is_null() {
+            return Err(invalid_input("p_flushed must not be null"));
+        }
+        (*p_encoder).poll()?;
+        *p_flushed = (*p_encoder).is_flushed();
+        Ok(())
+    }())
+}
+
+#[no_mangle]
+pub unsafe extern "C"
+fn mtpng_encoder_write_image_frame(p_encoder: PEncoder,
+                                   p_bytes: *const u8,
+                                   len: size_t,
+                                   stride: size_t)
 -> CResult
 {
     CResult::from(|| -> io::Result<()> {
@@ -557,8 +1789,11 @@ fn mtpng_encoder_write_image_rows(p_encoder: PEncoder,
         if p_bytes.is_null() {
             return Err(invalid_input("p_bytes must not be null"));
         }
-        let slice = ::std::slice::from_raw_parts(p_bytes, len);
-        (*p_encoder).write_image_rows(slice)
+        let frame = CFrame {
+            p_bytes,
+            len,
+        };
+        (*p_encoder).write_image_frame(Arc::new(frame), stride)
     }())
 }
 
@@ -584,3 +1819,306 @@ fn mtpng_encoder_finish(pp_encoder: *mut PEncoder)
         Ok(())
     }())
 }
+
+
+#[no_mangle]
+pub unsafe extern "C"
+fn mtpng_batch_encoder_new(pp_batch: *mut PBatchEncoder,
+                           p_options: PEncoderOptions)
+-> CResult
+{
+    CResult::from(|| -> io::Result<()> {
+        if pp_batch.is_null() {
+            return Err(invalid_input("pp_batch must not be null"));
+        }
+        if !(*pp_batch).is_null() {
+            return Err(invalid_input("*pp_batch must be null"));
+        }
+        let default = Options::<'static>::new();
+        let options = if p_options.is_null() {
+            &default
+        } else {
+            &*p_options
+        };
+        let batch = BatchEncoder::new(options);
+        *pp_batch = Box::into_raw(Box::new(batch));
+        Ok(())
+    }())
+}
+
+#[no_mangle]
+pub unsafe extern "C"
+fn mtpng_batch_encoder_release(pp_batch: *mut PBatchEncoder)
+-> CResult
+{
+    CResult::from(|| -> io::Result<()> {
+        if pp_batch.is_null() {
+            return Err(invalid_input("pp_batch must not be null"))
+        }
+        if (*pp_batch).is_null() {
+            return Err(invalid_input("*pp_batch must not be null"))
+        }
+        drop(Box::from_raw(*pp_batch));
+        *pp_batch = ptr::null_mut();
+        Ok(())
+    }())
+}
+
+#[no_mangle]
+pub unsafe extern "C"
+fn mtpng_batch_encoder_add_image(p_batch: PBatchEncoder,
+                                 pp_encoder: *mut PEncoder,
+                                 p_bytes: *const u8,
+                                 len: size_t,
+                                 stride: size_t)
+-> CResult
+{
+    CResult::from(|| -> io::Result<()> {
+        if p_batch.is_null() {
+            return Err(invalid_input("p_batch must not be null"));
+        }
+        if pp_encoder.is_null() {
+            return Err(invalid_input("pp_encoder must not be null"));
+        }
+        if (*pp_encoder).is_null() {
+            return Err(invalid_input("*pp_encoder must not be null"));
+        }
+        if p_bytes.is_null() {
+            return Err(invalid_input("p_bytes must not be null"));
+        }
+        let frame = Arc::new(CFrame {
+            p_bytes,
+            len,
+        });
+
+        // Take ownership back from C and hand it to the batch,
+        // which drops it on failure.
+        let b_encoder = Box::from_raw(*pp_encoder);
+        *pp_encoder = ptr::null_mut();
+        (*p_batch).add_image(*b_encoder, frame, stride)?;
+        Ok(())
+    }())
+}
+
+#[no_mangle]
+pub unsafe extern "C"
+fn mtpng_batch_encoder_finish(pp_batch: *mut PBatchEncoder)
+-> CResult
+{
+    CResult::from(|| -> io::Result<()> {
+        if pp_batch.is_null() {
+            return Err(invalid_input("pp_batch must not be null"));
+        }
+        if (*pp_batch).is_null() {
+            return Err(invalid_input("*pp_batch must not be null"));
+        }
+
+        // Take ownership back from C...
+        let b_batch = Box::from_raw(*pp_batch);
+        *pp_batch = ptr::null_mut();
+
+        // And finish it out.
+        b_batch.finish()?;
+        Ok(())
+    }())
+}
+
+
+#[no_mangle]
+pub unsafe extern "C"
+fn mtpng_decoder_options_new(pp_options: *mut PDecoderOptions)
+-> CResult
+{
+    CResult::from(|| -> io::Result<()> {
+        if pp_options.is_null() {
+            return Err(invalid_input("pp_options must not be null"));
+        }
+        if !(*pp_options).is_null() {
+            return Err(invalid_input("*pp_options must be null"))
+        }
+        *pp_options = Box::into_raw(Box::new(DecoderOptions::new()));
+        Ok(())
+    }())
+}
+
+#[no_mangle]
+pub unsafe extern "C"
+fn mtpng_decoder_options_release(pp_options: *mut PDecoderOptions)
+-> CResult
+{
+    CResult::from(|| -> io::Result<()> {
+        if pp_options.is_null() {
+            return Err(invalid_input("pp_options must not be null"));
+        }
+        if (*pp_options).is_null() {
+            return Err(invalid_input("*pp_options must not be null"));
+        }
+        drop(Box::from_raw(*pp_options));
+        *pp_options = ptr::null_mut();
+        Ok(())
+    }())
+}
+
+#[no_mangle]
+pub unsafe extern "C"
+fn mtpng_decoder_options_set_thread_pool(p_options: PDecoderOptions,
+                                         p_pool: PThreadPool)
+-> CResult
+{
+    CResult::from(|| -> io::Result<()> {
+        if p_options.is_null() {
+            return Err(invalid_input("p_options must not be null"));
+        }
+        if p_pool.is_null() {
+            return Err(invalid_input("p_pool must not be null"));
+        }
+        (*p_options).set_thread_pool(&*p_pool)
+    }())
+}
+
+
+#[no_mangle]
+pub unsafe extern "C"
+fn mtpng_decoder_new(pp_decoder: *mut PDecoder,
+                     read_func: Option<CReadFunc>,
+                     user_data: *mut c_void,
+                     p_options: PDecoderOptions)
+-> CResult
+{
+    CResult::from(|| -> io::Result<()> {
+        if pp_decoder.is_null() {
+            return Err(invalid_input("pp_decoder must not be null"));
+        }
+        if !(*pp_decoder).is_null() {
+            return Err(invalid_input("*pp_decoder must be null"));
+        }
+        let reader = match read_func {
+            Some(rf) => CReader::new(rf, user_data),
+            None => return Err(invalid_input("read_func must not be null")),
+        };
+        let default = DecoderOptions::<'static>::new();
+        let options = if p_options.is_null() {
+            &default
+        } else {
+            &*p_options
+        };
+        let decoder = Decoder::new(reader, options);
+        *pp_decoder = Box::into_raw(Box::new(decoder));
+        Ok(())
+    }())
+}
+
+#[no_mangle]
+pub unsafe extern "C"
+fn mtpng_decoder_release(pp_decoder: *mut PDecoder)
+-> CResult
+{
+    CResult::from(|| -> io::Result<()> {
+        if pp_decoder.is_null() {
+            return Err(invalid_input("pp_decoder must not be null"));
+        }
+        if (*pp_decoder).is_null() {
+            return Err(invalid_input("*pp_decoder must not be null"));
+        }
+        drop(Box::from_raw(*pp_decoder));
+        *pp_decoder = ptr::null_mut();
+        Ok(())
+    }())
+}
+
+#[no_mangle]
+pub unsafe extern "C"
+fn mtpng_decoder_read_header(p_decoder: PDecoder,
+                             p_header: PHeader)
+-> CResult
+{
+    CResult::from(|| -> io::Result<()> {
+        if p_decoder.is_null() {
+            return Err(invalid_input("p_decoder must not be null"));
+        }
+        if p_header.is_null() {
+            return Err(invalid_input("p_header must not be null"));
+        }
+        *p_header = (*p_decoder).read_header()?;
+        Ok(())
+    }())
+}
+
+#[no_mangle]
+pub unsafe extern "C"
+fn mtpng_decoder_get_palette(p_decoder: PDecoder,
+                             pp_bytes: *mut *const u8,
+                             p_len: *mut size_t)
+-> CResult
+{
+    CResult::from(|| -> io::Result<()> {
+        if p_decoder.is_null() {
+            return Err(invalid_input("p_decoder must not be null"));
+        }
+        get_chunk_data((*p_decoder).palette(), pp_bytes, p_len)
+    }())
+}
+
+#[no_mangle]
+pub unsafe extern "C"
+fn mtpng_decoder_get_transparency(p_decoder: PDecoder,
+                                  pp_bytes: *mut *const u8,
+                                  p_len: *mut size_t)
+-> CResult
+{
+    CResult::from(|| -> io::Result<()> {
+        if p_decoder.is_null() {
+            return Err(invalid_input("p_decoder must not be null"));
+        }
+        get_chunk_data((*p_decoder).transparency(), pp_bytes, p_len)
+    }())
+}
+
+#[no_mangle]
+pub unsafe extern "C"
+fn mtpng_decoder_read_image(p_decoder: PDecoder,
+                            p_bytes: *mut u8,
+                            len: size_t)
+-> CResult
+{
+    CResult::from(|| -> io::Result<()> {
+        if p_decoder.is_null() {
+            return Err(invalid_input("p_decoder must not be null"));
+        }
+        if p_bytes.is_null() {
+            return Err(invalid_input("p_bytes must not be null"));
+        }
+        let header = (*p_decoder).read_header()?;
+        let size = header.stride().checked_mul(header.height() as usize)
+                                  .ok_or_else(|| invalid_input("Image is too large"))?;
+        if len != size {
+            return Err(invalid_input("len must be the image's stride times its height"));
+        }
+        let data = (*p_decoder).read_image()?;
+        ptr::copy_nonoverlapping(data.as_ptr(), p_bytes, len);
+        Ok(())
+    }())
+}
+
+#[no_mangle]
+pub unsafe extern "C"
+fn mtpng_decoder_finish(pp_decoder: *mut PDecoder)
+-> CResult
+{
+    CResult::from(|| -> io::Result<()> {
+        if pp_decoder.is_null() {
+            return Err(invalid_input("pp_decoder must not be null"));
+        }
+        if (*pp_decoder).is_null() {
+            return Err(invalid_input("*pp_decoder must not be null"));
+        }
+
+        // Take ownership back from C...
+        let b_decoder = Box::from_raw(*pp_decoder);
+        *pp_decoder = ptr::null_mut();
+
+        // And read through the end of the file.
+        b_decoder.finish()?;
+        Ok(())
+    }())
+}
@@ -0,0 +1,348 @@
+//
+// mtpng - a multithreaded parallel PNG encoder in Rust
+// convert.rs - input pixel format conversion
+//
+// Copyright (c) 2018-2024 Brooke Vibber
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+//
+
+//
+// Pixels often come from framebuffers and decoders in some other
+// layout than PNG's: blue first, alpha first or premultiplied, 16-bit
+// samples in native little-endian order, or palette indices one per
+// byte. Rather than have the caller make a serial pass over the whole
+// image to fix them up, the filter jobs convert each chunk's rows on
+// the worker threads just before filtering.
+//
+
+use std::convert::TryFrom;
+
+use std::io;
+
+use super::ColorType;
+use super::Header;
+
+use super::utils::*;
+
+/// Order of the channels of input pixels.
+///
+/// For color types without alpha, the alpha-first orders are
+/// invalid, and only greyscale with alpha may have it first.
+#[repr(u8)]
+#[derive(Copy, Clone, PartialEq, Eq)]
+pub enum ChannelOrder {
+    /// Red, green, and blue, then alpha: PNG's own order.
+    Rgba = 0,
+    /// Blue, green, and red, then alpha, as in many framebuffers.
+    Bgra = 1,
+    /// Alpha, then red, green, and blue.
+    Argb = 2,
+    /// Alpha, then blue, green, and red.
+    Abgr = 3,
+}
+
+impl TryFrom<u8> for ChannelOrder {
+    type Error = io::Error;
+
+    fn try_from(val: u8) -> Result<Self, Self::Error> {
+        match val {
+            0 => Ok(ChannelOrder::Rgba),
+            1 => Ok(ChannelOrder::Bgra),
+            2 => Ok(ChannelOrder::Argb),
+            3 => Ok(ChannelOrder::Abgr),
+            _ => Err(invalid_input("Invalid channel order")),
+        }
+    }
+}
+
+//
+// How input pixels differ from PNG byte order. Set up through
+// encoder::Options; the default needs no conversion.
+//
+#[derive(Copy, Clone)]
+pub struct InputFormat {
+    pub channel_order: ChannelOrder,
+
+    // Color samples have been multiplied by alpha.
+    pub premultiplied: bool,
+
+    // 16-bit samples are least significant byte first.
+    pub little_endian: bool,
+
+    // Sub-byte samples each take a whole byte, in the low bits.
+    pub unpacked: bool,
+
+    // Bytes from one input row to the next, or 0 for no padding.
+    pub stride: usize,
+}
+
+impl InputFormat {
+    pub fn new() -> InputFormat {
+        InputFormat {
+            channel_order: ChannelOrder::Rgba,
+            premultiplied: false,
+            little_endian: false,
+            unpacked: false,
+            stride: 0,
+        }
+    }
+
+    //
+    // Check the format makes sense for the image.
+    //
+    pub fn validate(&self, header: &Header) -> io::Result<()> {
+        let color_type = header.color_type;
+        let has_alpha = matches!(color_type, ColorType::GreyscaleAlpha | ColorType::TruecolorAlpha);
+        match (color_type, self.channel_order) {
+            (_, ChannelOrder::Rgba) => {},
+            (ColorType::Truecolor, ChannelOrder::Bgra) => {},
+            (ColorType::GreyscaleAlpha, ChannelOrder::Argb) => {},
+            (ColorType::TruecolorAlpha, _) => {},
+            _ => return Err(invalid_input("Channel order is invalid for the color type")),
+        }
+        if self.premultiplied && !has_alpha {
+            return Err(invalid_input("Premultiplied alpha needs a color type with alpha"));
+        }
+        if self.little_endian && header.depth != 16 {
+            return Err(invalid_input("Little-endian input needs a depth of 16"));
+        }
+        if self.unpacked && header.depth >= 8 {
+            return Err(invalid_input("Unpacked input needs a depth below 8"));
+        }
+        if self.stride != 0 && self.stride < self.row_bytes(header) {
+            return Err(invalid_input("Input stride must be at least the row length"));
+        }
+        Ok(())
+    }
+
+    //
+    // Whether rows need converting before they can be filtered.
+    // Padding is left behind when rows are read in, so doesn't count.
+    //
+    pub fn needs_conversion(&self) -> bool {
+        self.channel_order != ChannelOrder::Rgba ||
+        self.premultiplied ||
+        self.little_endian ||
+        self.unpacked
+    }
+
+    //
+    // Length of an input row, without padding.
+    //
+    pub fn row_bytes(&self, header: &Header) -> usize {
+        if self.unpacked {
+            header.width as usize
+        } else {
+            header.stride()
+        }
+    }
+
+    //
+    // Output channel positions within an input pixel.
+    //
+    fn channel_map(&self, color_type: ColorType) -> [usize; 4] {
+        match (color_type, self.channel_order) {
+            (ColorType::Truecolor, ChannelOrder::Bgra)      => [2, 1, 0, 3],
+            (ColorType::GreyscaleAlpha, ChannelOrder::Argb) => [1, 0, 2, 3],
+            (_, ChannelOrder::Bgra)                         => [2, 1, 0, 3],
+            (_, ChannelOrder::Argb)                         => [1, 2, 3, 0],
+            (_, ChannelOrder::Abgr)                         => [3, 2, 1, 0],
+            (_, ChannelOrder::Rgba)                         => [0, 1, 2, 3],
+        }
+    }
+
+    //
+    // Convert a row of input pixels into PNG byte order. The output
+    // must be the header's stride in length.
+    //
+    pub fn convert_row(&self, header: &Header, src: &[u8], out: &mut [u8]) {
+        let depth = header.depth as usize;
+        if depth < 8 {
+            if self.unpacked {
+                pack_row(depth, src, out);
+            } else {
+                out.copy_from_slice(src);
+            }
+            return;
+        }
+
+        let channels = header.color_type.channels();
+        let map = self.channel_map(header.color_type);
+        let unpremultiply = self.premultiplied;
+
+        //
+        // Simple loops over whole pixels, which the compiler can
+        // unroll and vectorize for each pixel size.
+        //
+        if depth == 8 {
+            for (dest, pixel) in out.chunks_exact_mut(channels).zip(src.chunks_exact(channels)) {
+                for c in 0 .. channels {
+                    dest[c] = pixel[map[c]];
+                }
+                if unpremultiply {
+                    unpremultiply8(dest);
+                }
+            }
+        } else {
+            let little_endian = self.little_endian;
+            let bpp = channels * 2;
+            for (dest, pixel) in out.chunks_exact_mut(bpp).zip(src.chunks_exact(bpp)) {
+                for c in 0 .. channels {
+                    let s = map[c] * 2;
+                    let (hi, lo) = if little_endian {
+                        (pixel[s + 1], pixel[s])
+                    } else {
+                        (pixel[s], pixel[s + 1])
+                    };
+                    dest[c * 2] = hi;
+                    dest[c * 2 + 1] = lo;
+                }
+                if unpremultiply {
+                    unpremultiply16(dest);
+                }
+            }
+        }
+    }
+}
+
+impl Default for InputFormat {
+    fn default() -> Self {
+        Self::new()
+    }
+}
+
+//
+// Pack one sample per byte into depth bits each,
+// most significant bits first.
+//
+fn pack_row(depth: usize, src: &[u8], out: &mut [u8]) {
+    let per_byte = 8 / depth;
+    let mask = ((1u16 << depth) - 1) as u8;
+    for (dest, samples) in out.iter_mut().zip(src.chunks(per_byte)) {
+        let mut byte = 0u8;
+        for (i, &sample) in samples.iter().enumerate() {
+            byte |= (sample & mask) << (8 - depth * (i + 1));
+        }
+        *dest = byte;
+    }
+}
+
+//
+// Divide the color samples of a pixel, alpha last, by its alpha.
+// Fully transparent pixels come out black.
+//
+fn unpremultiply8(pixel: &mut [u8]) {
+    let last = pixel.len() - 1;
+    let alpha = u32::from(pixel[last]);
+    if alpha == 255 {
+        return;
+    }
+    for sample in pixel[.. last].iter_mut() {
+        *sample = if alpha == 0 {
+            0
+        } else {
+            let val = (u32::from(*sample) * 255 + alpha / 2) / alpha;
+            if val > 255 { 255 } else { val as u8 }
+        };
+    }
+}
+
+fn unpremultiply16(pixel: &mut [u8]) {
+    let last = pixel.len() - 2;
+    let alpha = u32::from(pixel[last]) << 8 | u32::from(pixel[last + 1]);
+    if alpha == 65535 {
+        return;
+    }
+    for sample in pixel[.. last].chunks_exact_mut(2) {
+        let val = if alpha == 0 {
+            0
+        } else {
+            let val = u32::from(sample[0]) << 8 | u32::from(sample[1]);
+            let val = (val * 65535 + alpha / 2) / alpha;
+            if val > 65535 { 65535 } else { val }
+        };
+        sample[0] = (val >> 8) as u8;
+        sample[1] = val as u8;
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    fn header(width: u32, color_type: ColorType, depth: u8) -> Header {
+        let mut header = Header::new();
+        header.set_size(width, 1).unwrap();
+        header.set_color(color_type, depth).unwrap();
+        header
+    }
+
+    fn convert(format: &InputFormat, header: &Header, src: &[u8]) -> Vec<u8> {
+        format.validate(header).unwrap();
+        let mut out = vec![0u8; header.stride()];
+        format.convert_row(header, src, &mut out);
+        out
+    }
+
+    #[test]
+    fn it_works() {
+        let mut format = InputFormat::new();
+        format.channel_order = ChannelOrder::Bgra;
+        format.premultiplied = true;
+        let rgba = header(3, ColorType::TruecolorAlpha, 8);
+        assert_eq!(convert(&format, &rgba, &[10, 20, 30, 255,
+                                             64, 32, 0, 128,
+                                             9, 9, 9, 0]),
+                   vec![30, 20, 10, 255,
+                        0, 64, 128, 128,
+                        0, 0, 0, 0]);
+
+        format.channel_order = ChannelOrder::Argb;
+        format.premultiplied = false;
+        assert_eq!(convert(&format, &header(1, ColorType::TruecolorAlpha, 8), &[1, 2, 3, 4]),
+                   vec![2, 3, 4, 1]);
+
+        format.channel_order = ChannelOrder::Bgra;
+        format.little_endian = true;
+        assert_eq!(convert(&format, &header(1, ColorType::Truecolor, 16), &[1, 2, 3, 4, 5, 6]),
+                   vec![6, 5, 4, 3, 2, 1]);
+
+        let mut format = InputFormat::new();
+        format.unpacked = true;
+        assert_eq!(convert(&format, &header(5, ColorType::IndexedColor, 2), &[3, 0, 1, 2, 3]),
+                   vec![0b1100_0110, 0b1100_0000]);
+    }
+
+    #[test]
+    fn it_validates() {
+        let mut format = InputFormat::new();
+        format.channel_order = ChannelOrder::Argb;
+        assert!(format.validate(&header(1, ColorType::Truecolor, 8)).is_err());
+        assert!(format.validate(&header(1, ColorType::GreyscaleAlpha, 8)).is_ok());
+
+        let mut format = InputFormat::new();
+        format.premultiplied = true;
+        assert!(format.validate(&header(1, ColorType::Truecolor, 8)).is_err());
+
+        let mut format = InputFormat::new();
+        format.stride = 2;
+        assert!(format.validate(&header(1, ColorType::Truecolor, 8)).is_err());
+    }
+}
@@ -0,0 +1,1098 @@
+//
+// mtpng - a multithreaded parallel PNG encoder in Rust
+// decoder.rs - pipelined and parallel PNG decoding
+//
+// Copyright (c) 2018-2024 Brooke Vibber
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+//
+
+//
+// In general the image data can't be split up for decoding the way
+// it can for encoding: it's one deflate stream, and where its blocks
+// begin can't be told without decoding everything before them. It
+// can still be pipelined, with the caller's thread reading chunks
+// while one job at a time inflates what has come in so far, and
+// another unfilters the rows inflated so far into the output image.
+//
+// mtpng's own encoder, and anything else that sync-flushes its
+// stream, ends each chunk of rows with the 00 00 ff ff of an empty
+// stored block, and starts the next on a byte boundary. The stream
+// is cut into pieces after each of those, and the pieces inflated
+// at once on all the threads, without the window before them; see
+// inflate.rs. The unfilter job fills in each piece's copies from the
+// one before as it goes.
+//
+// The same four bytes can come up by chance inside compressed data.
+// A piece is only used once the one before it is found to have ended
+// on a block boundary right where it starts. If one didn't, the rest
+// of the stream is inflated again in one piece.
+//
+
+use rayon::ThreadPool;
+
+use std::cmp;
+use std::collections::VecDeque;
+use std::convert::TryFrom;
+
+use std::io;
+use std::io::Read;
+
+use std::mem;
+
+use std::sync::Arc;
+use std::sync::mpsc;
+use std::sync::mpsc::{Sender, Receiver};
+
+use super::ColorType;
+use super::Header;
+use super::InterlaceMethod;
+use super::utils::*;
+
+use super::deflate;
+use super::deflate::Inflate;
+use super::filter;
+use super::filter::Filter;
+use super::inflate;
+use super::inflate::{Output, WINDOW_SIZE};
+use super::interlace;
+use super::reader;
+use super::reader::{Chunk, Reader};
+
+/// Options setup struct for the PNG decoder.
+/// May be modified and reused.
+#[derive(Copy, Clone)]
+pub struct Options<'a> {
+    thread_pool: Option<&'a ThreadPool>,
+}
+
+impl<'a> Options<'a> {
+    /// Create a new Options struct using default options:
+    /// * thread_pool: global default
+    pub fn new() -> Options<'a> {
+        Options {
+            //
+            // Use the global thread pool.
+            //
+            thread_pool: None,
+        }
+    }
+
+    /// Use a custom Rayon ThreadPool instance instead of the global pool.
+    pub fn set_thread_pool(&mut self, thread_pool: &'a ThreadPool) -> IoResult {
+        self.thread_pool = Some(thread_pool);
+        Ok(())
+    }
+}
+
+impl<'a> Default for Options<'a> {
+    fn default() -> Self {
+        Self::new()
+    }
+}
+
+//
+// Compressed data searched for a sync flush before giving up on
+// cutting the stream into pieces, and inflating it in one go.
+//
+const SEARCH_LIMIT: usize = 4 * 1024 * 1024;
+
+// The length and its complement of a sync flush's empty stored block.
+const SYNC_FLUSH: [u8; 4] = [0, 0, 0xff, 0xff];
+
+fn check_zlib_header(cmf: u8, flg: u8) -> IoResult {
+    // Deflate, with at most a 32 KiB window.
+    if cmf & 0x0f != 8 || cmf >> 4 > 7 {
+        return Err(invalid_input("Invalid compression method"));
+    }
+    if (u16::from(cmf) << 8 | u16::from(flg)) % 31 != 0 {
+        return Err(invalid_input("Corrupt deflate data"));
+    }
+    if flg & 0x20 != 0 {
+        return Err(invalid_input("Preset dictionaries are not allowed"));
+    }
+    Ok(())
+}
+
+//
+// Unfilters rows into the image as inflated data comes in, in order.
+// It moves from job to job, so only one runs at a time.
+//
+struct Unfilter {
+    header: Header,
+
+    // The image so far, grown as rows come in rather than allocated
+    // up front from the header's size, and its length when done.
+    image: Vec<u8>,
+    len: usize,
+
+    // The end of the filtered data so far, to fill in the next
+    // piece's copies from before it.
+    window: Vec<u8>,
+    adler32: u32,
+
+    // The current pass, its header, and the row within it;
+    // no header once all rows are in.
+    pass: usize,
+    pass_header: Option<Header>,
+    row: usize,
+
+    // A row's filtered bytes, when split between pieces.
+    partial: Vec<u8>,
+
+    // The pass's previous and current rows, unfiltered. Rows of
+    // non-interlaced images go straight into the image instead.
+    prev: Vec<u8>,
+    current: Vec<u8>,
+}
+
+impl Unfilter {
+    fn new(header: Header) -> io::Result<Unfilter> {
+        let len = header.stride().checked_mul(header.height() as usize)
+                                 .ok_or_else(|| invalid_input("Image is too large"))?;
+        let mut unfilter = Unfilter {
+            header,
+            image: Vec::new(),
+            len,
+            window: Vec::with_capacity(WINDOW_SIZE),
+            adler32: deflate::adler32_initial(),
+            pass: 0,
+            pass_header: None,
+            row: 0,
+            partial: Vec::new(),
+            prev: Vec::new(),
+            current: Vec::new(),
+        };
+        unfilter.start_pass(0);
+        Ok(unfilter)
+    }
+
+    //
+    // Move on to the first pass from the given one that has any rows.
+    //
+    fn start_pass(&mut self, first: usize) {
+        self.pass_header = None;
+        self.row = 0;
+        match self.header.interlace_method() {
+            InterlaceMethod::Standard => {
+                if first == 0 {
+                    self.pass_header = Some(self.header);
+                }
+            },
+            InterlaceMethod::Adam7 => {
+                for pass in first .. interlace::PASSES.len() {
+                    if let Some(pass_header) = interlace::pass_header(&self.header, pass) {
+                        self.pass = pass;
+                        self.pass_header = Some(pass_header);
+                        break;
+                    }
+                }
+            },
+        }
+        if let Some(pass_header) = self.pass_header {
+            // The row above the first is all zeros.
+            self.prev.clear();
+            self.prev.resize(pass_header.stride(), 0);
+            if let InterlaceMethod::Adam7 = self.header.interlace_method() {
+                self.current.resize(pass_header.stride(), 0);
+            }
+        }
+    }
+
+    //
+    // Grow the image to end bytes, if not already that long. Reserves
+    // room doubling as it goes, but only up to the whole image, and
+    // fails if that can't be had rather than aborting.
+    //
+    fn grow_image(&mut self, end: usize) -> IoResult {
+        if end <= self.image.len() {
+            return Ok(());
+        }
+        if end > self.image.capacity() {
+            let target = cmp::min(cmp::max(end, self.image.capacity() * 2), self.len);
+            self.image.try_reserve_exact(target - self.image.len())
+                      .map_err(|_| other("Out of memory for image"))?;
+        }
+        self.image.resize(end, 0);
+        Ok(())
+    }
+
+    fn keep_window(&mut self, data: &[u8]) {
+        if data.len() >= WINDOW_SIZE {
+            self.window.clear();
+            self.window.extend_from_slice(&data[data.len() - WINDOW_SIZE ..]);
+        } else {
+            let excess = (self.window.len() + data.len()).saturating_sub(WINDOW_SIZE);
+            self.window.drain(.. excess);
+            self.window.extend_from_slice(data);
+        }
+    }
+
+    fn add(&mut self, mut output: Output) -> IoResult {
+        if !output.is_resolved() {
+            output.resolve(&self.window)?;
+        }
+        let data = output.data;
+        if data.is_empty() {
+            return Ok(());
+        }
+        self.adler32 = deflate::adler32(self.adler32, &data);
+        self.keep_window(&data);
+
+        let mut pos = 0;
+        while pos < data.len() {
+            let len = match self.pass_header {
+                Some(pass_header) => pass_header.stride() + 1,
+                None => return Err(invalid_input("Too much image data")),
+            };
+            if self.partial.is_empty() && data.len() - pos >= len {
+                self.unfilter_row(&data[pos .. pos + len])?;
+                pos += len;
+            } else {
+                let take = cmp::min(len - self.partial.len(), data.len() - pos);
+                self.partial.extend_from_slice(&data[pos .. pos + take]);
+                pos += take;
+                if self.partial.len() == len {
+                    let row = mem::take(&mut self.partial);
+                    self.unfilter_row(&row)?;
+                    self.partial = row;
+                    self.partial.clear();
+                }
+            }
+        }
+        Ok(())
+    }
+
+    fn unfilter_row(&mut self, filtered: &[u8]) -> IoResult {
+        let pass_header = match self.pass_header {
+            Some(pass_header) => pass_header,
+            None => return Err(invalid_input("Too much image data")),
+        };
+        let filter = Filter::try_from(filtered[0]).map_err(|_| invalid_input("Invalid filter type"))?;
+        let bpp = pass_header.bytes_per_pixel();
+        let stride = pass_header.stride();
+
+        match self.header.interlace_method() {
+            InterlaceMethod::Standard => {
+                let start = self.row * stride;
+                self.grow_image(start + stride)?;
+                let (above, rest) = self.image.split_at_mut(start);
+                let prev = if self.row == 0 {
+                    &self.prev[..]
+                } else {
+                    &above[start - stride ..]
+                };
+                filter::unfilter(filter, bpp, prev, &filtered[1 ..], &mut rest[.. stride]);
+            },
+            InterlaceMethod::Adam7 => {
+                filter::unfilter(filter, bpp, &self.prev, &filtered[1 ..], &mut self.current);
+
+                let y = interlace::image_row(self.pass, self.row);
+                let image_stride = self.header.stride();
+                self.grow_image((y + 1) * image_stride)?;
+                let bits_per_pixel = self.header.color_type().channels() * self.header.depth() as usize;
+                interlace::insert_row(self.pass,
+                                      bits_per_pixel,
+                                      pass_header.width() as usize,
+                                      &self.current,
+                                      &mut self.image[y * image_stride .. (y + 1) * image_stride]);
+                mem::swap(&mut self.prev, &mut self.current);
+            },
+        }
+
+        self.row += 1;
+        if self.row == pass_header.height() as usize {
+            let next = self.pass + 1;
+            self.start_pass(next);
+        }
+        Ok(())
+    }
+
+    //
+    // Check all rows came in, matching the stream's checksum,
+    // and return the image.
+    //
+    fn finish(self, trailer: &[u8]) -> io::Result<Vec<u8>> {
+        if self.pass_header.is_some() || !self.partial.is_empty() {
+            return Err(invalid_input("Truncated image data"));
+        }
+        if trailer.len() != 4 || u32::from_be_bytes([trailer[0], trailer[1], trailer[2], trailer[3]]) != self.adler32 {
+            return Err(invalid_input("Bad image data checksum"));
+        }
+        debug_assert_eq!(self.image.len(), self.len);
+        Ok(self.image)
+    }
+}
+
+enum ThreadMessage {
+    // A piece cut at a sync flush, by job number.
+    Inflated(usize, io::Result<Output>),
+
+    // The stream after its job, with the data inflated and any
+    // input left over after its end.
+    Streamed(io::Result<(Inflate, Vec<u8>, Vec<u8>)>),
+
+    Unfiltered(io::Result<Unfilter>),
+}
+
+#[derive(Copy, Clone)]
+enum DispatchMode {
+    Blocking,
+    NonBlocking,
+}
+
+#[derive(Copy, Clone, PartialEq, Eq)]
+enum Split {
+    // Looking for the first sync flush.
+    Searching,
+    // Cutting the stream into pieces at each sync flush.
+    Pieces,
+    // Inflating the stream in one go.
+    Stream,
+    // After a false sync flush, keeping the rest for one last piece.
+    Joined,
+}
+
+// A piece of the stream between sync flushes.
+struct Piece {
+    job: usize,
+    input: Arc<Vec<u8>>,
+    result: Option<io::Result<Output>>,
+}
+
+//
+// Decodes the image data as its chunks are read in, handing work
+// out to the thread pool.
+//
+struct ImageData<'a> {
+    thread_pool: Option<&'a ThreadPool>,
+    tx: Sender<ThreadMessage>,
+    rx: Receiver<ThreadMessage>,
+
+    // Filtered bytes in the whole image, and inflated so far
+    // in one go.
+    limit: usize,
+    streamed: usize,
+
+    split: Split,
+    zlib_header: Vec<u8>,
+    ended: bool,
+
+    // Compressed data not yet handed off, and how much of it
+    // has been searched for a sync flush.
+    input: Vec<u8>,
+    searched: usize,
+
+    // Pieces being inflated, in order.
+    pieces: VecDeque<Piece>,
+    next_job: usize,
+
+    // The inflate stream, if inflating in one go, when not in a job.
+    stream: Option<Inflate>,
+
+    // After the end of the deflate data: its Adler-32 checksum.
+    trailer: Vec<u8>,
+
+    // Inflated data waiting to be unfiltered, in order, and the
+    // unfilter state when not in a job.
+    inflated: VecDeque<Output>,
+    unfilter: Option<Unfilter>,
+}
+
+impl<'a> ImageData<'a> {
+    fn new(thread_pool: Option<&'a ThreadPool>, header: Header) -> io::Result<ImageData<'a>> {
+        let (tx, rx) = mpsc::channel();
+        Ok(ImageData {
+            thread_pool,
+            tx,
+            rx,
+            limit: interlace::filtered_len(&header),
+            streamed: 0,
+            split: Split::Searching,
+            zlib_header: Vec::new(),
+            ended: false,
+            input: Vec::new(),
+            searched: 0,
+            pieces: VecDeque::new(),
+            next_job: 0,
+            stream: None,
+            trailer: Vec::new(),
+            inflated: VecDeque::new(),
+            unfilter: Some(Unfilter::new(header)?),
+        })
+    }
+
+    fn spawn<F>(&self, func: F)
+        where F: FnOnce(&Sender<ThreadMessage>) + Send + 'static
+    {
+        let tx = self.tx.clone();
+        let job = move || func(&tx);
+        match self.thread_pool {
+            Some(pool) => pool.spawn(job),
+            None => ::rayon::spawn(job),
+        }
+    }
+
+    //
+    // Take the data of another IDAT chunk.
+    //
+    fn add(&mut self, data: &[u8]) -> IoResult {
+        let mut data = data;
+        if self.zlib_header.len() < 2 {
+            let take = cmp::min(2 - self.zlib_header.len(), data.len());
+            self.zlib_header.extend_from_slice(&data[.. take]);
+            data = &data[take ..];
+            if self.zlib_header.len() == 2 {
+                check_zlib_header(self.zlib_header[0], self.zlib_header[1])?;
+            }
+        }
+        self.input.extend_from_slice(data);
+
+        if let Split::Searching | Split::Pieces = self.split {
+            self.cut();
+            if self.split == Split::Searching && self.input.len() > SEARCH_LIMIT {
+                self.start_stream()?;
+            }
+        }
+        self.dispatch(DispatchMode::NonBlocking)
+    }
+
+    //
+    // Hand off everything up to each sync flush in the new input
+    // as a piece.
+    //
+    fn cut(&mut self) {
+        let mut start = 0;
+        let mut pos = self.searched.saturating_sub(SYNC_FLUSH.len() - 1);
+        while let Some(found) = self.input[pos ..].windows(SYNC_FLUSH.len())
+                                                  .position(|bytes| bytes == SYNC_FLUSH) {
+            let end = pos + found + SYNC_FLUSH.len();
+            let piece = self.input[start .. end].to_vec();
+            self.spawn_piece(piece, false);
+            self.split = Split::Pieces;
+            start = end;
+            pos = end;
+        }
+        self.input.drain(.. start);
+        self.searched = self.input.len();
+    }
+
+    fn spawn_piece(&mut self, input: Vec<u8>, front: bool) {
+        let input = Arc::new(input);
+        let job = self.next_job;
+        self.next_job += 1;
+
+        let piece = Piece {
+            job,
+            input: Arc::clone(&input),
+            result: None,
+        };
+        if front {
+            self.pieces.push_front(piece);
+        } else {
+            self.pieces.push_back(piece);
+        }
+
+        let limit = self.limit;
+        self.spawn(move |tx| {
+            tx.send(ThreadMessage::Inflated(job, inflate::inflate(&input, limit))).ok();
+        });
+    }
+
+    fn start_stream(&mut self) -> IoResult {
+        self.split = Split::Stream;
+        self.stream = Some(Inflate::new()?);
+        Ok(())
+    }
+
+    //
+    // No more IDAT chunks; the rest of the input is the last piece
+    // and the checksum.
+    //
+    fn end(&mut self) -> IoResult {
+        self.ended = true;
+        if self.zlib_header.len() < 2 {
+            return Err(invalid_input("Truncated image data"));
+        }
+        match self.split {
+            Split::Searching => {
+                self.start_stream()?;
+            },
+            Split::Pieces | Split::Joined => {
+                let mut input = mem::take(&mut self.input);
+                if input.len() < 4 {
+                    // The checksum happened to end like a sync flush.
+                    if let Some(piece) = self.pieces.pop_back() {
+                        let mut joined = (*piece.input).clone();
+                        joined.extend_from_slice(&input);
+                        input = joined;
+                    }
+                }
+                if input.len() < 4 {
+                    return Err(invalid_input("Truncated image data"));
+                }
+                let len = input.len() - 4;
+                self.trailer = input.split_off(len);
+                self.spawn_piece(input, false);
+            },
+            Split::Stream => {},
+        }
+        Ok(())
+    }
+
+    //
+    // Hand pieces over to be unfiltered in order, as each is found
+    // to follow on from the one before.
+    //
+    fn check_pieces(&mut self) -> IoResult {
+        loop {
+            // Whether the front piece is the last isn't known
+            // until the next one is cut, or the input ends.
+            let known = self.ended || self.pieces.len() > 1;
+            let last = self.ended && self.pieces.len() == 1;
+            let result = match self.pieces.front_mut() {
+                Some(piece) if known => match piece.result.take() {
+                    Some(result) => result,
+                    None => return Ok(()),
+                },
+                _ => return Ok(()),
+            };
+
+            let error = match result {
+                Ok(output) => {
+                    if output.last == last {
+                        self.pieces.pop_front();
+                        self.inflated.push_back(output);
+                        continue;
+                    }
+                    invalid_input("Truncated image data")
+                },
+                Err(e) => e,
+            };
+
+            // The piece didn't end on a block boundary, or ran past
+            // the end of the stream, so the next one can't start where
+            // it was cut. Data with one false sync flush likely has
+            // more, so rather than join them up one at a time, inflate
+            // the rest in one piece.
+            if self.pieces.len() < 2 {
+                return Err(error);
+            }
+            let mut joined = Vec::new();
+            for piece in self.pieces.drain(..) {
+                joined.extend_from_slice(&piece.input);
+            }
+            if self.ended {
+                self.spawn_piece(joined, false);
+            } else {
+                joined.extend_from_slice(&self.input);
+                self.input = joined;
+                self.split = Split::Joined;
+            }
+            return Ok(());
+        }
+    }
+
+    fn run_stream(&mut self) -> IoResult {
+        if self.split != Split::Stream || self.input.is_empty() {
+            return Ok(());
+        }
+        let limit = self.limit.checked_sub(self.streamed)
+                              .ok_or_else(|| invalid_input("Too much image data"))?;
+        let mut stream = match self.stream.take() {
+            Some(stream) => stream,
+            None => return Ok(()),
+        };
+        let input = mem::take(&mut self.input);
+        self.spawn(move |tx| {
+            let mut output = Vec::new();
+            let result = match stream.inflate(&input, &mut output, limit) {
+                Ok(used) => Ok((stream, output, input[used ..].to_vec())),
+                Err(e) => Err(e),
+            };
+            tx.send(ThreadMessage::Streamed(result)).ok();
+        });
+        Ok(())
+    }
+
+    fn run_unfilter(&mut self) {
+        if self.inflated.is_empty() {
+            return;
+        }
+        let mut unfilter = match self.unfilter.take() {
+            Some(unfilter) => unfilter,
+            None => return,
+        };
+        let outputs: Vec<Output> = self.inflated.drain(..).collect();
+        self.spawn(move |tx| {
+            let result = match outputs.into_iter().try_for_each(|output| unfilter.add(output)) {
+                Ok(()) => Ok(unfilter),
+                Err(e) => Err(e),
+            };
+            tx.send(ThreadMessage::Unfiltered(result)).ok();
+        });
+    }
+
+    fn in_flight(&self) -> bool {
+        self.pieces.iter().any(|piece| piece.result.is_none()) ||
+            (self.split == Split::Stream && self.stream.is_none()) ||
+            self.unfilter.is_none()
+    }
+
+    fn done(&self) -> bool {
+        self.pieces.is_empty() &&
+            self.inflated.is_empty() &&
+            self.unfilter.is_some() &&
+            (self.split != Split::Stream || (self.stream.is_some() && self.input.is_empty()))
+    }
+
+    fn dispatch(&mut self, mode: DispatchMode) -> IoResult {
+        // See if anything interesting happened on the threads.
+        let mut blocking_mode = mode;
+        while self.in_flight() {
+            let message = match blocking_mode {
+                DispatchMode::Blocking => self.rx.recv().ok(),
+                DispatchMode::NonBlocking => self.rx.try_recv().ok(),
+            };
+            match message {
+                Some(ThreadMessage::Inflated(job, result)) => {
+                    // Pieces joined up since have a new job.
+                    if let Some(piece) = self.pieces.iter_mut().find(|piece| piece.job == job) {
+                        piece.result = Some(result);
+                    }
+                },
+                Some(ThreadMessage::Streamed(result)) => {
+                    let (stream, output, rest) = result?;
+                    self.streamed += output.len();
+                    self.stream = Some(stream);
+                    self.trailer.extend_from_slice(&rest);
+                    if !output.is_empty() {
+                        self.inflated.push_back(Output::from_data(output));
+                    }
+                },
+                Some(ThreadMessage::Unfiltered(result)) => {
+                    self.unfilter = Some(result?);
+                },
+                None => {
+                    // No more output from the threads.
+                    break;
+                },
+            }
+            // After the first one, keep reading any if they're there
+            // but don't block further.
+            blocking_mode = DispatchMode::NonBlocking;
+        }
+
+        self.check_pieces()?;
+        self.run_stream()?;
+        self.run_unfilter();
+        Ok(())
+    }
+
+    fn finish(mut self) -> io::Result<Vec<u8>> {
+        self.end()?;
+        self.dispatch(DispatchMode::NonBlocking)?;
+        while !self.done() {
+            if !self.in_flight() {
+                return Err(other("Decoder stalled"));
+            }
+            self.dispatch(DispatchMode::Blocking)?;
+        }
+        if let Some(ref stream) = self.stream {
+            if !stream.finished() {
+                return Err(invalid_input("Truncated image data"));
+            }
+        }
+        match self.unfilter.take() {
+            Some(unfilter) => unfilter.finish(&self.trailer),
+            None => Err(other("Decoder stalled")),
+        }
+    }
+}
+
+/// Parallel PNG file decoder.
+///
+/// Reads the header and palette, then decodes the image data,
+/// inflating and unfiltering it on the thread pool while the rest
+/// of the file is read in. Files written with sync flushes between
+/// chunks of rows, as mtpng's encoder does, are inflated in pieces
+/// on all the threads at once.
+///
+/// Only the default image of an APNG animation is decoded, and other
+/// ancillary chunks are skipped.
+pub struct Decoder<'a, R: Read> {
+    reader: Reader<R>,
+    options: Options<'a>,
+
+    header: Option<Header>,
+    palette: Option<Vec<u8>>,
+    transparency: Option<Vec<u8>>,
+    read_image: bool,
+
+    // The chunk after those handled so far, already read to find
+    // where they end.
+    next_chunk: Option<Chunk>,
+}
+
+impl<'a, R: Read> Decoder<'a, R> {
+    /// Creates a new Decoder instance with the given Read input source and options.
+    pub fn new(read: R, options: &Options<'a>) -> Decoder<'a, R> {
+        Decoder {
+            reader: Reader::new(read),
+            options: *options,
+            header: None,
+            palette: None,
+            transparency: None,
+            read_image: false,
+            next_chunk: None,
+        }
+    }
+
+    fn next_chunk(&mut self) -> io::Result<Chunk> {
+        match self.next_chunk.take() {
+            Some(chunk) => Ok(chunk),
+            None => self.reader.read_chunk(),
+        }
+    }
+
+    /// Read the file signature and chunks up to the image data,
+    /// and return the image header.
+    ///
+    /// The palette and transparency chunks can be had afterwards
+    /// with palette() and transparency().
+    pub fn read_header(&mut self) -> io::Result<Header> {
+        if let Some(header) = self.header {
+            return Ok(header);
+        }
+
+        self.reader.read_signature()?;
+        let (tag, data) = self.reader.read_chunk()?;
+        if &tag != b"IHDR" {
+            return Err(invalid_input("Missing header"));
+        }
+        let header = reader::parse_header(&data)?;
+
+        loop {
+            let (tag, data) = self.reader.read_chunk()?;
+            match &tag {
+                b"PLTE" => {
+                    if data.is_empty() || data.len() % 3 != 0 || data.len() > 768 {
+                        return Err(invalid_input("Invalid palette"));
+                    }
+                    self.palette = Some(data);
+                },
+                b"tRNS" => {
+                    self.transparency = Some(data);
+                },
+                b"IDAT" => {
+                    self.next_chunk = Some((tag, data));
+                    break;
+                },
+                b"IEND" => {
+                    return Err(invalid_input("Missing image data"));
+                },
+                _ => {
+                    if reader::is_critical(&tag) {
+                        return Err(invalid_input("Unsupported critical chunk"));
+                    }
+                },
+            }
+        }
+
+        if let ColorType::IndexedColor = header.color_type() {
+            if self.palette.is_none() {
+                return Err(invalid_input("Missing palette"));
+            }
+        }
+
+        self.header = Some(header);
+        Ok(header)
+    }
+
+    /// Return the palette, if the file has one.
+    pub fn palette(&self) -> Option<&[u8]> {
+        self.palette.as_ref().map(|data| &data[..])
+    }
+
+    /// Return the transparency chunk's data, if the file has one.
+    pub fn transparency(&self) -> Option<&[u8]> {
+        self.transparency.as_ref().map(|data| &data[..])
+    }
+
+    /// Read and decode the image data, returning its rows one after
+    /// another at the header's stride in bytes, in PNG byte order.
+    ///
+    /// Interlaced images come out with their passes put back together,
+    /// in the same layout.
+    pub fn read_image(&mut self) -> io::Result<Vec<u8>> {
+        let header = self.read_header()?;
+        if self.read_image {
+            return Err(invalid_input("Cannot read image data twice"));
+        }
+        self.read_image = true;
+
+        let mut image_data = ImageData::new(self.options.thread_pool, header)?;
+        loop {
+            let (tag, data) = self.next_chunk()?;
+            if &tag != b"IDAT" {
+                self.next_chunk = Some((tag, data));
+                break;
+            }
+            image_data.add(&data)?;
+        }
+        image_data.finish()
+    }
+
+    /// Read the rest of the file through its end chunk, and return
+    /// the Read input source.
+    pub fn finish(mut self) -> io::Result<R> {
+        self.read_header()?;
+        loop {
+            let (tag, _) = self.next_chunk()?;
+            match &tag {
+                b"IEND" => break,
+                b"IDAT" => {},
+                _ => {
+                    if reader::is_critical(&tag) {
+                        return Err(invalid_input("Unsupported critical chunk"));
+                    }
+                },
+            }
+        }
+        Ok(self.reader.into_inner())
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::Decoder;
+    use super::Options;
+    use super::super::ColorType;
+    use super::super::CompressionLevel;
+    use super::super::Header;
+    use super::super::InterlaceMethod;
+    use super::super::deflate;
+    use super::super::encoder;
+    use super::super::encoder::Encoder;
+    use super::super::writer::Writer;
+
+    use rayon::ThreadPoolBuilder;
+
+    use std::io;
+
+    // Pixels with some detail, so the chunks don't all compress alike.
+    // Bits past the end of packed rows are zero, as they decode.
+    fn make_image(header: &Header) -> Vec<u8> {
+        let stride = header.stride();
+        let bits = header.color_type().channels() * header.depth() as usize * header.width() as usize;
+        let mask = 0xffu8 << ((8 - bits % 8) % 8);
+        (0 .. stride * header.height() as usize).map(|i| {
+            let (x, y) = (i % stride, i / stride);
+            let val = ((x * 3 + y) ^ (x * y / 7) ^ (i / 4099)) as u8;
+            if x == stride - 1 {
+                val & mask
+            } else {
+                val
+            }
+        }).collect()
+    }
+
+    fn encode(header: &Header, options: &encoder::Options, data: &[u8]) -> Vec<u8> {
+        let mut encoder = Encoder::new(Vec::<u8>::new(), options);
+        encoder.write_header(header).unwrap();
+        if let ColorType::IndexedColor = header.color_type() {
+            encoder.write_palette(&[0u8; 768]).unwrap();
+        }
+        encoder.write_image_rows(data).unwrap();
+        encoder.finish().unwrap()
+    }
+
+    fn try_decode(png: &[u8]) -> io::Result<Vec<u8>> {
+        let mut decoder = Decoder::new(png, &Options::new());
+        let data = decoder.read_image()?;
+        decoder.finish()?;
+        Ok(data)
+    }
+
+    fn decode(png: &[u8], options: &Options) -> (Header, Vec<u8>) {
+        let mut decoder = Decoder::new(png, options);
+        let header = decoder.read_header().unwrap();
+        let data = decoder.read_image().unwrap();
+        let rest = decoder.finish().unwrap();
+        assert!(rest.is_empty());
+        (header, data)
+    }
+
+    #[test]
+    fn it_works() {
+        let pool = ThreadPoolBuilder::new().num_threads(4).build().unwrap();
+        let mut decode_options = Options::new();
+        decode_options.set_thread_pool(&pool).unwrap();
+
+        let images = [(ColorType::Truecolor, 8, 640, 480),
+                      (ColorType::TruecolorAlpha, 16, 301, 207),
+                      (ColorType::Greyscale, 1, 333, 100),
+                      (ColorType::IndexedColor, 4, 50, 1)];
+        let levels = [CompressionLevel::Fastest, CompressionLevel::Default, CompressionLevel::High];
+        for &(color_type, depth, width, height) in images.iter() {
+            for &interlace in [InterlaceMethod::Standard, InterlaceMethod::Adam7].iter() {
+                for &level in levels.iter() {
+                    for &streaming in [false, true].iter() {
+                        let mut header = Header::new();
+                        header.set_size(width, height).unwrap();
+                        header.set_color(color_type, depth).unwrap();
+                        header.set_interlace_method(interlace).unwrap();
+                        let data = make_image(&header);
+
+                        // Small chunks, so images come in many pieces.
+                        let mut options = encoder::Options::new();
+                        options.set_thread_pool(&pool).unwrap();
+                        options.set_chunk_size(32 * 1024).unwrap();
+                        options.set_compression_level(level).unwrap();
+                        options.set_streaming(streaming).unwrap();
+                        let png = encode(&header, &options, &data);
+
+                        let (decoded_header, decoded) = decode(&png, &decode_options);
+                        assert_eq!(decoded_header.width(), width);
+                        assert_eq!(decoded_header.height(), height);
+                        assert!(decoded == data);
+                    }
+                }
+            }
+        }
+    }
+
+    // A PNG with the image data compressed however zlib likes, split
+    // into IDAT chunks of the given size.
+    fn write_png(header: &Header, data: &[u8], level: i32, idat_size: usize) -> Vec<u8> {
+        let stride = header.stride();
+        let mut filtered = Vec::new();
+        for row in data.chunks(stride) {
+            // Unfiltered rows; the encoded files cover the filters.
+            filtered.push(0);
+            filtered.extend_from_slice(row);
+        }
+
+        let mut options = deflate::Options::new();
+        options.set_level(level);
+        let mut encoder = deflate::Deflate::new(options, Vec::new());
+        encoder.write(&filtered, deflate::Flush::Finish).unwrap();
+        let compressed = encoder.finish().unwrap();
+
+        let mut png = Vec::new();
+        {
+            let mut writer = Writer::new(&mut png);
+            writer.write_signature().unwrap();
+            writer.write_header(*header).unwrap();
+            writer.write_chunk(b"tEXt", b"Comment\0skipped").unwrap();
+            for idat in compressed.chunks(idat_size) {
+                writer.write_chunk(b"IDAT", idat).unwrap();
+            }
+            writer.write_chunk(b"IEND", b"").unwrap();
+        }
+        png
+    }
+
+    #[test]
+    fn it_works_in_one_stream() {
+        let mut header = Header::new();
+        header.set_size(1000, 1000).unwrap();
+        header.set_color(ColorType::Truecolor, 8).unwrap();
+        let data = make_image(&header);
+
+        // Level 0 stores the data as is, with stored block headers
+        // in between; other levels have no sync flushes at all.
+        for &level in [0, 6].iter() {
+            let png = write_png(&header, &data, level, 8192);
+            let (_, decoded) = decode(&png, &Options::new());
+            assert!(decoded == data);
+        }
+
+        // Stored pixels that look like sync flushes all over.
+        let data: Vec<u8> = (0 .. data.len()).map(|i| [0, 0, 0xff, 0xff][i % 4]).collect();
+        let png = write_png(&header, &data, 0, 8192);
+        let (_, decoded) = decode(&png, &Options::new());
+        assert!(decoded == data);
+    }
+
+    #[test]
+    fn it_fails() {
+        let mut header = Header::new();
+        header.set_size(300, 200).unwrap();
+        header.set_color(ColorType::Greyscale, 8).unwrap();
+        let data = make_image(&header);
+        let mut options = encoder::Options::new();
+        options.set_chunk_size(32 * 1024).unwrap();
+        let png = encode(&header, &options, &data);
+
+        // Cut short at the end chunk, and inside the image data.
+        for &len in [png.len() - 12, png.len() - 40, png.len() / 2, 20].iter() {
+            assert!(try_decode(&png[.. len]).is_err());
+        }
+
+        // Damage inside the compressed data and to the checksum after
+        // it, with the chunk CRC fixed up so only the deflate checks
+        // can catch it.
+        let good = write_png(&header, &data, 6, 1 << 20);
+        assert!(try_decode(&good).is_ok());
+        let idat = 8 + 25 + 12 + 15;
+        let crc_pos = good.len() - 12 - 4;
+        for &pos in [idat + 8 + 100, crc_pos - 1].iter() {
+            let mut damaged = good.clone();
+            damaged[pos] ^= 0x55;
+            let crc = deflate::crc32(deflate::crc32_initial(), &damaged[idat + 4 .. crc_pos]);
+            damaged[crc_pos .. crc_pos + 4].copy_from_slice(&crc.to_be_bytes());
+            assert!(try_decode(&damaged).is_err());
+        }
+
+        // A header claiming a huge image, with little data behind it,
+        // fails as truncated without allocating it.
+        let mut huge = Header::new();
+        huge.set_size(0x100000, 0x100000).unwrap();
+        huge.set_color(ColorType::TruecolorAlpha, 16).unwrap();
+        let png = write_png(&huge, &[0u8; 1000], 6, 1 << 20);
+        assert!(try_decode(&png).is_err());
+
+        // Too much data in a stream with no sync flushes to cut at:
+        // lots of empty fixed Huffman blocks, then a few literals.
+        let mut tiny = Header::new();
+        tiny.set_size(1, 1).unwrap();
+        tiny.set_color(ColorType::Greyscale, 8).unwrap();
+        let mut options = deflate::Options::new();
+        options.set_window_bits(-15);
+        let mut encoder = deflate::Deflate::new(options, Vec::new());
+        encoder.write(&[0, 1, 2, 3, 4], deflate::Flush::Finish).unwrap();
+        let literals = encoder.finish().unwrap();
+        let mut idat = vec![0x78, 0x9c];
+        for _ in 0 .. 1024 * 1024 {
+            idat.extend_from_slice(&[0x02, 0x08, 0x20, 0x80, 0x00]);
+        }
+        idat.extend_from_slice(&literals);
+        let mut png = Vec::new();
+        {
+            let mut writer = Writer::new(&mut png);
+            writer.write_signature().unwrap();
+            writer.write_header(tiny).unwrap();
+            writer.write_chunk(b"IDAT", &idat).unwrap();
+            writer.write_chunk(b"IDAT", &[0, 0, 0, 1]).unwrap();
+            writer.write_chunk(b"IEND", b"").unwrap();
+        }
+        assert!(try_decode(&png).is_err());
+    }
+}
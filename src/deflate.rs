@@ -23,8 +23,11 @@
 // THE SOFTWARE.
 //
 
+use std::cell::RefCell;
+
 use std::io;
-use std::io::Write;
+
+use std::cmp;
 
 use std::mem;
 
@@ -36,6 +39,10 @@ use std::os::raw::*;
 
 use ::libz_sys::*;
 
+use super::CompressionLevel;
+
+use super::rle::RleCompressor;
+
 use super::utils::*;
 
 pub fn adler32(sum: u32, bytes: &[u8]) -> u32 {
@@ -50,12 +57,55 @@ pub fn adler32_initial() -> u32 {
     }
 }
 
+//
+// Some slack on top of zlib's upper bounds, which assume the
+// stream is finished in one go. A sync flush can add an empty
+// stored block and the pending bits before it.
+//
+const FLUSH_MARGIN: usize = 16;
+
+//
+// Upper bound on the compressed size of the given number of input
+// bytes in a single write, with the default window and memory
+// settings. Useful for sizing an output buffer up front.
+//
+pub fn deflate_bound(len: usize) -> usize {
+    let bound = unsafe {
+        ::libz_sys::compressBound(len as c_ulong) as usize
+    };
+    bound + FLUSH_MARGIN
+}
+
 pub fn adler32_combine(sum_a: u32, sum_b: u32, len_b: usize) -> u32 {
     unsafe {
         ::libz_sys::adler32_combine(c_ulong::from(sum_a), c_ulong::from(sum_b), len_b as c_long) as u32
     }
 }
 
+//
+// CRC-32 as used for PNG chunks, via zlib's table-driven
+// implementation (zlib-ng builds use carry-less multiply where the
+// CPU has it) so it's cheap to run on each chunk's output.
+//
+pub fn crc32(sum: u32, bytes: &[u8]) -> u32 {
+    unsafe {
+        ::libz_sys::crc32(c_ulong::from(sum), bytes.as_ptr(), bytes.len() as c_uint) as u32
+    }
+}
+
+pub fn crc32_initial() -> u32 {
+    unsafe {
+        ::libz_sys::crc32(0, ptr::null(), 0) as u32
+    }
+}
+
+pub fn crc32_combine(sum_a: u32, sum_b: u32, len_b: usize) -> u32 {
+    unsafe {
+        ::libz_sys::crc32_combine(c_ulong::from(sum_a), c_ulong::from(sum_b), len_b as c_long) as u32
+    }
+}
+
+#[derive(Copy, Clone, PartialEq, Eq)]
 pub struct Options {
     level: c_int,
     method: c_int,
@@ -65,7 +115,7 @@ pub struct Options {
 }
 
 #[repr(i32)]
-#[derive(Copy, Clone)]
+#[derive(Copy, Clone, PartialEq, Eq)]
 pub enum Strategy {
     Default = Z_DEFAULT_STRATEGY,
     Filtered = Z_FILTERED,
@@ -89,6 +139,148 @@ impl TryFrom<u8> for Strategy {
     }
 }
 
+/// Deflate compressor implementations.
+#[repr(u8)]
+#[derive(Copy, Clone, PartialEq, Eq)]
+pub enum Backend {
+    /// The system or bundled zlib library, via libz-sys.
+    ///
+    /// Build with the "zlib-ng" feature to use zlib-ng's faster
+    /// vectorized match finding and checksums instead; that is a
+    /// build-time choice, separate from picking a Backend here.
+    Zlib = 0,
+    /// Built-in fixed Huffman run-length encoder.
+    ///
+    /// Very fast but compresses poorly except on images with large
+    /// flat areas.
+    Rle = 1,
+}
+
+impl TryFrom<u8> for Backend {
+    type Error = io::Error;
+
+    fn try_from(val: u8) -> Result<Self, Self::Error> {
+        match val {
+            0 => Ok(Backend::Zlib),
+            1 => Ok(Backend::Rle),
+            _ => Err(invalid_input("Invalid backend constant")),
+        }
+    }
+}
+
+//
+// Interface to a deflate compressor implementation.
+//
+// Each chunk of filtered image data is compressed independently on
+// a worker thread as raw deflate data, primed with up to 32 KiB of
+// the preceding chunk's data as a dictionary (empty for the first).
+// Unless it's the last chunk, output must end on a byte boundary with
+// no final block, as with zlib's Z_SYNC_FLUSH, so the chunks can be
+// concatenated into a single stream.
+//
+// Compressed bytes are appended to the given output buffer, which is
+// returned. The zlib header and Adler-32 trailer are written by the
+// encoder, not the compressor.
+//
+// bound() gives the most output compress() can append for an input
+// of the given length, so the encoder can size buffers up front.
+//
+pub trait Compressor {
+    fn bound(&self, len: usize) -> usize;
+
+    fn compress(&self,
+                level: CompressionLevel,
+                strategy: Strategy,
+                dictionary: &[u8],
+                input: &[u8],
+                last: bool,
+                output: Vec<u8>) -> io::Result<Vec<u8>>;
+}
+
+pub fn compressor(backend: Backend) -> &'static dyn Compressor {
+    match backend {
+        Backend::Zlib => &ZlibCompressor,
+        Backend::Rle  => &RleCompressor,
+    }
+}
+
+//
+// Upper bound on the compressed size with any backend, for
+// estimates made before the backend is known.
+//
+pub fn max_bound(len: usize) -> usize {
+    cmp::max(ZlibCompressor.bound(len), RleCompressor.bound(len))
+}
+
+//
+// The two-byte zlib stream header, as zlib itself would write it for
+// the given settings with a 32 KiB window and no preset dictionary.
+//
+// https://tools.ietf.org/html/rfc1950
+//
+pub fn zlib_header(level: CompressionLevel, strategy: Strategy) -> [u8; 2] {
+    // Deflate method with a 32 KiB window.
+    let cmf = 0x78u16;
+
+    // Informational only.
+    let flevel = match strategy {
+        Strategy::HuffmanOnly | Strategy::Rle | Strategy::Fixed => 0,
+        Strategy::Default | Strategy::Filtered => match level {
+            CompressionLevel::Fastest => 0,
+            CompressionLevel::Fast    => 0,
+            CompressionLevel::Default => 2,
+            CompressionLevel::High    => 3,
+        },
+    };
+
+    // Check bits make the header a multiple of 31.
+    let mut header = cmf << 8 | flevel << 6;
+    header += 31 - header % 31;
+    [(header >> 8) as u8, (header & 0xff) as u8]
+}
+
+struct ZlibCompressor;
+
+impl Compressor for ZlibCompressor {
+    fn bound(&self, len: usize) -> usize {
+        deflate_bound(len)
+    }
+
+    fn compress(&self,
+                level: CompressionLevel,
+                strategy: Strategy,
+                dictionary: &[u8],
+                input: &[u8],
+                last: bool,
+                output: Vec<u8>) -> io::Result<Vec<u8>>
+    {
+        let mut options = Options::new();
+
+        // Negative forces raw stream output; the encoder
+        // provides the header and checksum.
+        options.set_window_bits(-15);
+
+        match level {
+            CompressionLevel::Default => {},
+            CompressionLevel::Fastest => options.set_level(1),
+            CompressionLevel::Fast => options.set_level(1),
+            CompressionLevel::High => options.set_level(9),
+        }
+        options.set_strategy(strategy);
+
+        let mut encoder = Deflate::new(options, output);
+        if !dictionary.is_empty() {
+            encoder.set_dictionary(dictionary)?;
+        }
+        encoder.write(input, if last {
+            Flush::Finish
+        } else {
+            Flush::SyncFlush
+        })?;
+        encoder.finish()
+    }
+}
+
 impl Options {
     pub fn new() -> Options {
         Options {
@@ -131,59 +323,165 @@ pub enum Flush {
     Finish = Z_FINISH as isize,
 }
 
-pub struct Deflate<W: Write> {
-    output: W,
+//
+// An initialized zlib deflate stream.
+// The zlib state is deallocated on drop.
+//
+// The z_stream is boxed because zlib's internal state keeps a
+// pointer back to it, so it must not move once initialized.
+//
+struct Stream {
+    options: Options,
+    raw: Box<z_stream>,
+}
+
+impl Stream {
+    fn new(options: Options) -> io::Result<Stream> {
+        let mut raw = Box::new(unsafe {
+            let maybe = mem::MaybeUninit::<z_stream>::zeroed();
+            maybe.assume_init()
+        });
+        let ret = unsafe {
+            deflateInit2_(&mut *raw,
+                          options.level,
+                          options.method,
+                          options.window_bits,
+                          options.mem_level,
+                          options.strategy,
+                          zlibVersion(),
+                          mem::size_of::<z_stream>() as c_int)
+        };
+        match ret {
+            Z_OK => Ok(Stream {
+                options,
+                raw,
+            }),
+            Z_MEM_ERROR => Err(other("Out of memory")),
+            Z_STREAM_ERROR => Err(invalid_input("Invalid parameter")),
+            Z_VERSION_ERROR => Err(invalid_input("Incompatible version of zlib")),
+            _ => Err(other("Unexpected error")),
+        }
+    }
+
+    //
+    // Return the stream to its freshly initialized state,
+    // keeping the allocated window and hash tables.
+    //
+    fn reset(&mut self) -> IoResult {
+        let ret = unsafe {
+            deflateReset(&mut *self.raw)
+        };
+        match ret {
+            Z_OK => Ok(()),
+            Z_STREAM_ERROR => Err(invalid_input("Inconsistent stream state")),
+            _ => Err(other("Unexpected error")),
+        }
+    }
+}
+
+impl Drop for Stream {
+    fn drop(&mut self) {
+        // Z_DATA_ERROR means we freed before finishing the stream.
+        // For our use case we do this deliberately, it's ok!
+        unsafe {
+            deflateEnd(&mut *self.raw);
+        }
+    }
+}
+
+//
+// Maximum number of idle streams to keep per thread.
+// Every chunk is compressed as a raw stream, so an encoder only
+// needs one per thread; the rest let encoders with different
+// levels or strategies share a thread pool, as in a batch,
+// without freeing each other's streams.
+//
+const MAX_CACHED_STREAMS: usize = 4;
+
+thread_local! {
+    //
+    // Idle initialized streams, for reuse by later Deflate instances
+    // on the same thread. Thread pool workers live across chunks and
+    // images, so this saves allocating and zeroing zlib's window and
+    // hash tables for every chunk.
+    //
+    static STREAM_CACHE: RefCell<Vec<Stream>> = RefCell::new(Vec::new());
+}
+
+//
+// Get an initialized stream with the given options, from the
+// current thread's cache if possible.
+//
+fn take_stream(options: Options) -> io::Result<Stream> {
+    let cached = STREAM_CACHE.try_with(|cache| {
+        let mut cache = cache.borrow_mut();
+        match cache.iter().position(|stream| stream.options == options) {
+            Some(i) => Some(cache.swap_remove(i)),
+            None => None,
+        }
+    });
+    match cached {
+        Ok(Some(stream)) => Ok(stream),
+        _ => Stream::new(options),
+    }
+}
+
+//
+// Reset a stream and return it to the current thread's cache.
+// If the cache is full, the oldest stream is freed.
+//
+fn recycle_stream(mut stream: Stream) {
+    if stream.reset().is_ok() {
+        let _ = STREAM_CACHE.try_with(move |cache| {
+            let mut cache = cache.borrow_mut();
+            if cache.len() >= MAX_CACHED_STREAMS {
+                cache.remove(0);
+            }
+            cache.push(stream);
+        });
+    }
+}
+
+//
+// Compresses into an output Vec, writing directly
+// into its reserved space.
+//
+pub struct Deflate {
+    output: Vec<u8>,
     options: Options,
-    initialized: bool,
     finished: bool,
-    stream: Box<z_stream>,
+    stream: Option<Stream>,
 }
 
-impl<W: Write> Deflate<W> {
-    pub fn new(options: Options, w: W) -> Deflate<W> {
+impl Deflate {
+    pub fn new(options: Options, output: Vec<u8>) -> Deflate {
         Deflate {
-            output: w,
+            output,
             options,
-            initialized: false,
             finished: false,
-            stream: Box::new(unsafe {
-                let maybe = mem::MaybeUninit::<z_stream>::zeroed();
-                maybe.assume_init()
-            }),
+            stream: None,
         }
     }
 
     pub fn init(&mut self) -> IoResult {
-        if self.initialized {
-            Ok(())
-        } else {
-            let ret = unsafe {
-                deflateInit2_(&mut *self.stream,
-                              self.options.level,
-                              self.options.method,
-                              self.options.window_bits,
-                              self.options.mem_level,
-                              self.options.strategy,
-                              zlibVersion(),
-                              mem::size_of::<z_stream>() as c_int)
-            };
-            match ret {
-                Z_OK => {
-                    self.initialized = true;
-                    Ok(())
-                },
-                Z_MEM_ERROR => Err(other("Out of memory")),
-                Z_STREAM_ERROR => Err(invalid_input("Invalid parameter")),
-                Z_VERSION_ERROR => Err(invalid_input("Incompatible version of zlib")),
-                _ => Err(other("Unexpected error")),
-            }
+        if self.stream.is_none() {
+            self.stream = Some(take_stream(self.options)?);
         }
+        Ok(())
     }
 
-    pub fn set_dictionary(&mut self, dict: &[u8]) -> IoResult {
+    fn raw_stream(&mut self) -> io::Result<&mut z_stream> {
         self.init()?;
+        match self.stream {
+            Some(ref mut stream) => Ok(&mut *stream.raw),
+            None => Err(other("Uninitialized stream")),
+        }
+    }
+
+    pub fn set_dictionary(&mut self, dict: &[u8]) -> IoResult {
+        let stream = self.raw_stream()?;
         let ret = unsafe {
-            deflateSetDictionary(&mut *self.stream,
+            deflateSetDictionary(stream,
                                  &dict[0],
                                  dict.len() as c_uint)
         };
@@ -195,21 +493,41 @@ impl<W: Write> Deflate<W> {
     }
 
     fn deflate(&mut self, data: &[u8], flush: Flush) -> IoResult {
-        self.init()?;
-        let mut buffer = [0u8; 128 * 1024];
-        let stream = &mut *self.stream;
+        let stream = match self.stream {
+            Some(ref mut stream) => &mut *stream.raw,
+            None => return Err(other("Uninitialized stream")),
+        };
+
+        // Reserve enough room for the whole output up front,
+        // so zlib can normally finish in a single call.
+        let bound = unsafe {
+            deflateBound(stream, data.len() as c_ulong) as usize
+        };
+        self.output.reserve(bound + FLUSH_MARGIN);
+
         stream.next_in = &data[0] as *const u8 as *mut u8;
         stream.avail_in = data.len() as c_uint;
         loop {
-            stream.next_out = &mut buffer[0] as *mut u8;
-            stream.avail_out = buffer.len() as c_uint;
+            if self.output.capacity() == self.output.len() {
+                self.output.reserve(128 * 1024);
+            }
+            let start = self.output.len();
+            let avail = cmp::min(self.output.capacity() - start,
+                                 c_uint::max_value() as usize);
+            stream.next_out = unsafe {
+                self.output.as_mut_ptr().add(start)
+            };
+            stream.avail_out = avail as c_uint;
             let ret = unsafe {
                 deflate(stream, flush as c_int)
             };
             match ret {
                 Z_OK | Z_STREAM_END => {
-                    let end = buffer.len() - stream.avail_out as usize;
-                    self.output.write_all(&buffer[0 .. end])?;
+                    // zlib has initialized this many bytes of the reserved space.
+                    let end = start + avail - stream.avail_out as usize;
+                    unsafe {
+                        self.output.set_len(end);
+                    }
                     match ret {
                         Z_OK => {
                             if stream.avail_out == 0 {
@@ -244,22 +562,210 @@ impl<W: Write> Deflate<W> {
     }
 
     //
-    // Deallocate the zlib state and return the writer.
+    // Release the zlib state for reuse and return the output.
     //
-    pub fn finish(mut self) -> io::Result<W> {
-        if self.initialized {
-            let ret = unsafe {
-                deflateEnd(&mut *self.stream)
-            };
-            match ret {
-                // Z_DATA_ERROR means we freed before finishing the stream.
-                // For our use case we do this deliberately, it's ok!
-                Z_OK | Z_DATA_ERROR => Ok(self.output),
-                Z_STREAM_ERROR => Err(invalid_input("Inconsistent stream state")),
-                _ => Err(other("Unexpected error")),
+    pub fn finish(mut self) -> io::Result<Vec<u8>> {
+        if let Some(stream) = self.stream.take() {
+            recycle_stream(stream);
+        }
+        Ok(self.output)
+    }
+}
+
+//
+// A raw zlib inflate stream, for image data that has to be decoded
+// in one go from the start. The zlib state is deallocated on drop.
+//
+pub struct Inflate {
+    raw: Box<z_stream>,
+    finished: bool,
+}
+
+// The stream is only used by one thread at a time.
+unsafe impl Send for Inflate {}
+
+impl Inflate {
+    pub fn new() -> io::Result<Inflate> {
+        let mut raw = Box::new(unsafe {
+            let maybe = mem::MaybeUninit::<z_stream>::zeroed();
+            maybe.assume_init()
+        });
+        let ret = unsafe {
+            // Negative for raw stream input; the decoder
+            // checks the header and checksum.
+            inflateInit2_(&mut *raw,
+                          -15,
+                          zlibVersion(),
+                          mem::size_of::<z_stream>() as c_int)
+        };
+        match ret {
+            Z_OK => Ok(Inflate {
+                raw,
+                finished: false,
+            }),
+            Z_MEM_ERROR => Err(other("Out of memory")),
+            Z_VERSION_ERROR => Err(invalid_input("Incompatible version of zlib")),
+            _ => Err(other("Unexpected error")),
+        }
+    }
+
+    //
+    // Decompress input onto the end of output, up to limit bytes in
+    // all. Returns how much input was used, which is all of it unless
+    // the stream ended partway through.
+    //
+    pub fn inflate(&mut self, input: &[u8], output: &mut Vec<u8>, limit: usize) -> io::Result<usize> {
+        let mut used = 0;
+        while used < input.len() && !self.finished {
+            let piece = &input[used .. cmp::min(input.len(), used + c_uint::max_value() as usize)];
+            let stream = &mut *self.raw;
+            stream.next_in = piece.as_ptr() as *mut u8;
+            stream.avail_in = piece.len() as c_uint;
+            // Output is given room for a byte past the limit, to tell
+            // a stream with more to come from one that fits exactly;
+            // reserve() may allocate more than asked, so clamp to it.
+            let room = limit.saturating_add(1);
+            loop {
+                if output.capacity() == output.len() {
+                    output.reserve(cmp::min(room - output.len(), cmp::max(piece.len() * 4, 64 * 1024)));
+                }
+                let start = output.len();
+                let avail = cmp::min(cmp::min(output.capacity(), room) - start,
+                                     c_uint::max_value() as usize);
+                stream.next_out = unsafe {
+                    output.as_mut_ptr().add(start)
+                };
+                stream.avail_out = avail as c_uint;
+                let ret = unsafe {
+                    inflate(stream, Z_NO_FLUSH)
+                };
+                match ret {
+                    Z_OK | Z_STREAM_END | Z_BUF_ERROR => {
+                        // zlib has initialized this many bytes of the reserved space.
+                        let end = start + avail - stream.avail_out as usize;
+                        unsafe {
+                            output.set_len(end);
+                        }
+                        if end > limit {
+                            return Err(invalid_input("Too much image data"));
+                        }
+                        if ret == Z_STREAM_END {
+                            self.finished = true;
+                            break;
+                        }
+                        if stream.avail_in == 0 && stream.avail_out != 0 {
+                            // Used up the input.
+                            break;
+                        }
+                        // Otherwise out of room; make more and go again.
+                    },
+                    Z_NEED_DICT | Z_DATA_ERROR => return Err(invalid_input("Corrupt deflate data")),
+                    Z_MEM_ERROR => return Err(other("Out of memory")),
+                    Z_STREAM_ERROR => return Err(invalid_input("Inconsistent stream state")),
+                    _ => return Err(other("Unexpected error")),
+                }
             }
-        } else {
-            Ok(self.output)
+            used += piece.len() - stream.avail_in as usize;
         }
+        Ok(used)
+    }
+
+    //
+    // Whether the stream's final block has been decoded.
+    //
+    pub fn finished(&self) -> bool {
+        self.finished
+    }
+}
+
+impl Drop for Inflate {
+    fn drop(&mut self) {
+        unsafe {
+            inflateEnd(&mut *self.raw);
+        }
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::Deflate;
+    use super::Inflate;
+    use super::Flush;
+    use super::Options;
+    use super::Strategy;
+    use super::zlib_header;
+    use super::super::CompressionLevel;
+
+    fn compress(data: &[u8]) -> Vec<u8> {
+        let mut options = Options::new();
+        options.set_window_bits(-15);
+        let mut encoder = Deflate::new(options, Vec::<u8>::new());
+        encoder.set_dictionary(&data[0 .. 1024]).unwrap();
+        encoder.write(data, Flush::SyncFlush).unwrap();
+        encoder.finish().unwrap()
+    }
+
+    #[test]
+    fn reused_stream_works() {
+        let data: Vec<u8> = (0 .. 65536).map(|i| (i * 7 % 251) as u8).collect();
+
+        // The second run picks up the first run's stream from the
+        // thread's cache, and must not be affected by its history.
+        let first = compress(&data);
+        let second = compress(&data);
+        assert!(first.len() > 0);
+        assert!(first == second, "reused stream should give the same output");
+    }
+
+    #[test]
+    fn zlib_header_works() {
+        let levels = [(CompressionLevel::Fast, 1),
+                      (CompressionLevel::Default, -1),
+                      (CompressionLevel::High, 9)];
+        let strategies = [Strategy::Default, Strategy::Filtered,
+                          Strategy::HuffmanOnly, Strategy::Rle, Strategy::Fixed];
+        for &(level, zlevel) in levels.iter() {
+            for &strategy in strategies.iter() {
+                // Compare with what zlib writes itself.
+                let mut options = Options::new();
+                options.set_level(zlevel);
+                options.set_strategy(strategy);
+                let mut encoder = Deflate::new(options, Vec::<u8>::new());
+                encoder.write(b"hello", Flush::Finish).unwrap();
+                let data = encoder.finish().unwrap();
+                assert_eq!(zlib_header(level, strategy), data[0 .. 2]);
+            }
+        }
+    }
+
+    #[test]
+    fn inflate_works() {
+        let data: Vec<u8> = (0 .. 200000).map(|i| (i / 3 % 251) as u8).collect();
+        let mut options = Options::new();
+        options.set_window_bits(-15);
+        let mut encoder = Deflate::new(options, Vec::<u8>::new());
+        encoder.write(&data, Flush::SyncFlush).unwrap();
+        encoder.write(b"end", Flush::Finish).unwrap();
+        let mut compressed = encoder.finish().unwrap();
+        compressed.extend(b"tail");
+
+        // Fed in pieces, stopping at the end of the stream.
+        let mut inflate = Inflate::new().unwrap();
+        let mut output = Vec::new();
+        let mut used = 0;
+        for piece in compressed.chunks(1000) {
+            used += inflate.inflate(piece, &mut output, data.len() + 3).unwrap();
+        }
+        assert!(inflate.finished());
+        assert_eq!(&compressed[used ..], b"tail");
+        assert!(output[.. data.len()] == data[..]);
+        assert_eq!(&output[data.len() ..], b"end");
+
+        // Over the limit, even with room to spare in the output.
+        let mut inflate = Inflate::new().unwrap();
+        assert!(inflate.inflate(&compressed, &mut Vec::new(), 1000).is_err());
+        let mut inflate = Inflate::new().unwrap();
+        let mut output = Vec::with_capacity(data.len() * 2);
+        assert!(inflate.inflate(&compressed, &mut output, 1000).is_err());
     }
 }
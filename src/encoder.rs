@@ -25,29 +25,61 @@
 
 use rayon::ThreadPool;
 
+use std::cmp;
 use std::collections::VecDeque;
 
+use std::future::Future;
+
 use std::io;
-use std::io::Write;
+use std::io::{Seek, Write};
+
+use std::mem;
 
-use std::sync::Arc;
+use std::pin::Pin;
+
+use std::sync::{Arc, Mutex};
+use std::sync::atomic::{AtomicUsize, Ordering};
 use std::sync::mpsc;
 use std::sync::mpsc::{Sender, Receiver};
 
+use std::task::{Context, Poll, Waker};
+
+use std::time::Instant;
+
+use super::Backend;
+use super::ChannelOrder;
+use super::ChunkCache;
+use super::ColorReduction;
 use super::ColorType;
 use super::CompressionLevel;
 use super::Strategy;
+use super::FrameControl;
 use super::Header;
+use super::InterlaceMethod;
 use super::Mode;
 use super::Mode::{Adaptive, Fixed};
 
+use super::buffer::AlignedBuffer;
+use super::buffer::BufferPool;
+
+use super::cache;
+use super::cache::CachedChunk;
+use super::cache::CachedChunks;
+
+use super::convert::InputFormat;
+
 use super::filter::AdaptiveFilter;
 use super::filter::Filter;
+use super::filter::Heuristic;
+use super::writer::PatchFunc;
 use super::writer::Writer;
+use super::writer::seek_patch;
 
 use super::deflate;
-use super::deflate::Deflate;
-use super::deflate::Flush;
+use super::interlace;
+
+use super::stats;
+use super::stats::{ChunkStats, Stage, Stats, TraceFunc};
 
 use super::utils::*;
 
@@ -56,32 +88,50 @@ use super::utils::*;
 /// May be modified and reused.
 #[derive(Copy, Clone)]
 pub struct Options<'a> {
-    chunk_size: usize,
+    chunk_size: Mode<usize>,
     compression_level: CompressionLevel,
     strategy_mode: Mode<Strategy>,
+    backend_mode: Mode<Backend>,
     filter_mode: Mode<Filter>,
+    filter_heuristic: Heuristic,
+    filter_trials: bool,
     streaming: bool,
+    input_format: InputFormat,
     thread_pool: Option<&'a ThreadPool>,
+    buffer_pool: Option<&'a BufferPool>,
+    chunk_cache: Option<&'a ChunkCache>,
+    color_reduction: Option<&'a ColorReduction>,
+    memory_limit: Option<usize>,
+    stats: Option<&'a Stats>,
 }
 
 impl<'a> Options<'a> {
     /// Create a new Options struct using default options:
-    /// * chunk_size: 256 KiB
+    /// * chunk_size: Adaptive
     /// * compression_level: Default
     /// * strategy_mode: Adaptive
+    /// * backend_mode: Adaptive
     /// * filter_mode: Adaptive
+    /// * filter_heuristic: Complexity
+    /// * filter_trials: off
     /// * streaming: off
+    /// * input format: PNG byte order, with no row padding
     /// * thread_pool: global default
+    /// * buffer_pool: none
+    /// * chunk_cache: none
+    /// * color_reduction: none
+    /// * memory_limit: none
+    /// * stats: none
     ///
     /// The compression, strategy, and filtering use the same
     /// defaults as libpng.
     pub fn new() -> Options<'a> {
         Options {
             //
-            // A chunk size of 256 KiB gives compression results very similar
-            // to a single stream when otherwise using defaults.
+            // Pick from the image size, thread count, and compression
+            // level; see Encoder::chunk_size().
             //
-            chunk_size: 256 * 1024,
+            chunk_size: Adaptive,
 
             //
             // Same defaults as libpng.
@@ -89,6 +139,17 @@ impl<'a> Options<'a> {
             compression_level: CompressionLevel::Default,
             strategy_mode: Adaptive,
             filter_mode: Adaptive,
+            filter_heuristic: Heuristic::Complexity,
+
+            //
+            // Trial compression is many times slower.
+            //
+            filter_trials: false,
+
+            //
+            // zlib unless something else is requested.
+            //
+            backend_mode: Adaptive,
 
             //
             // Streaming mode can produce lower latency to first bytes hitting
@@ -100,10 +161,40 @@ impl<'a> Options<'a> {
             //
             streaming: false,
 
+            //
+            // Rows come in ready to filter.
+            //
+            input_format: InputFormat::new(),
+
             //
             // Use the global thread pool.
             //
             thread_pool: None,
+
+            //
+            // Allocate fresh chunk buffers for each image.
+            //
+            buffer_pool: None,
+
+            //
+            // Compress every chunk of every image.
+            //
+            chunk_cache: None,
+
+            //
+            // Write the color type and depth the header asks for.
+            //
+            color_reduction: None,
+
+            //
+            // Keep as many chunks in flight as keeps the threads busy.
+            //
+            memory_limit: None,
+
+            //
+            // Don't collect timings.
+            //
+            stats: None,
         }
     }
 
@@ -113,23 +204,67 @@ impl<'a> Options<'a> {
         Ok(())
     }
 
+    /// Recycle chunk buffers through a BufferPool instead of
+    /// allocating new ones, which helps when encoding many images.
+    pub fn set_buffer_pool(&mut self, buffer_pool: &'a BufferPool) -> IoResult {
+        self.buffer_pool = Some(buffer_pool);
+        Ok(())
+    }
+
+    /// Reuse compressed chunks from the last image encoded with the
+    /// same cache wherever the rows haven't changed, and keep this
+    /// image's chunks in it for the next.
+    pub fn set_chunk_cache(&mut self, chunk_cache: &'a ChunkCache) -> IoResult {
+        self.chunk_cache = Some(chunk_cache);
+        Ok(())
+    }
+
+    /// Convert input rows to the smaller color type and depth found
+    /// by a ColorReduction scan of the image, on the worker threads.
+    ///
+    /// The header passed to Encoder::write_header() must then be the
+    /// reduction's, while the image data stays in the original format.
+    /// Rows with a color that wasn't in the scanned image are an error.
+    pub fn set_color_reduction(&mut self, color_reduction: &'a ColorReduction) -> IoResult {
+        self.color_reduction = Some(color_reduction);
+        Ok(())
+    }
+
+    /// Collect timings of each stage of each chunk into the given
+    /// Stats, starting afresh when the header is written.
+    pub fn set_stats(&mut self, stats: &'a Stats) -> IoResult {
+        self.stats = Some(stats);
+        Ok(())
+    }
+
     /// Set the size in bytes of chunks used for distributing data to threads.
     /// The actual chunk size used will be a multiple of row lengths approximating
     /// the requested size.
     ///
     /// Chunk size must be at least 32 KiB.
     pub fn set_chunk_size(&mut self, chunk_size: usize) -> IoResult {
-        if chunk_size < 32768 {
-            Err(invalid_input("chunk size must be at least 32768"))
-        } else {
-            self.chunk_size = chunk_size;
-            Ok(())
+        self.set_chunk_size_mode(Fixed(chunk_size))
+    }
+
+    /// Set the chunk size mode. By default it will use Adaptive, which
+    /// aims for a few chunks per thread so small images still get some
+    /// parallelism, while keeping chunks large enough for the compression
+    /// level not to lose much ratio at the boundaries.
+    ///
+    /// Fixed chunk sizes must be at least 32 KiB.
+    pub fn set_chunk_size_mode(&mut self, chunk_size: Mode<usize>) -> IoResult {
+        match chunk_size {
+            Fixed(n) if n < 32768 => Err(invalid_input("chunk size must be at least 32768")),
+            _ => {
+                self.chunk_size = chunk_size;
+                Ok(())
+            }
         }
     }
 
     /// Set the deflate compression level.
-    /// Currently supported are Fast (equivalent to gzip -1),
-    /// Default (gzip -6), and High (gzip -9).
+    /// Currently supported are Fastest (built-in run-length encoder),
+    /// Fast (equivalent to gzip -1), Default (gzip -6), and High (gzip -9).
     pub fn set_compression_level(&mut self, level: CompressionLevel) -> IoResult {
         self.compression_level = level;
         Ok(())
@@ -148,6 +283,25 @@ impl<'a> Options<'a> {
         Ok(())
     }
 
+    /// Set the heuristic used by the Adaptive filter mode. By default it
+    /// will use Complexity, which matches libpng but never picks the None
+    /// filter. Entropy considers None as well, which can do much better on
+    /// screenshot-style images, at some cost in speed.
+    pub fn set_filter_heuristic(&mut self, filter_heuristic: Heuristic) -> IoResult {
+        self.filter_heuristic = filter_heuristic;
+        Ok(())
+    }
+
+    /// Enable or disable brute-force filter selection. When on and the
+    /// filter mode is Adaptive, each chunk is filtered with every fixed
+    /// filter and every heuristic, test compressed, and the smallest
+    /// kept. Chunks still run in parallel, but each costs several extra
+    /// deflate passes, so this is for when size matters far more than time.
+    pub fn set_filter_trials(&mut self, filter_trials: bool) -> IoResult {
+        self.filter_trials = filter_trials;
+        Ok(())
+    }
+
     /// Set the deflate compression strategy. By default it will use Adaptive,
     /// which picks Default for Fixed<None> or Filtered for other filter types.
     /// This matches libpng's logic as well.
@@ -156,14 +310,94 @@ impl<'a> Options<'a> {
         Ok(())
     }
 
+    /// Set the deflate compressor implementation. By default it will use
+    /// Adaptive, which picks Rle for the Fastest compression level and
+    /// Zlib otherwise.
+    pub fn set_backend_mode(&mut self, backend_mode: Mode<Backend>) -> IoResult {
+        self.backend_mode = backend_mode;
+        Ok(())
+    }
+
     /// Enable or disable streaming mode, which emits a separate "IDAT" PNG chunk
     /// around each compressed data chunk. This allows for streaming a large file
     /// over a network etc during compression, at a cost of a few more bytes at
     /// chunk boundaries.
+    ///
+    /// In streaming mode the first chunks are only a few rows long, doubling
+    /// up to the full chunk size, so compressed data starts going out soon
+    /// after the first rows come in.
     pub fn set_streaming(&mut self, streaming: bool) -> IoResult {
         self.streaming = streaming;
         Ok(())
     }
+
+    /// Set the order of the channels in input pixels, if not PNG's
+    /// own red, green, blue, and alpha order.
+    ///
+    /// Input in any other layout set here is converted to PNG byte
+    /// order on the worker threads, as each chunk is filtered.
+    pub fn set_channel_order(&mut self, channel_order: ChannelOrder) -> IoResult {
+        self.input_format.channel_order = channel_order;
+        Ok(())
+    }
+
+    /// Set whether input color samples are premultiplied by alpha,
+    /// in which case they're divided back out.
+    pub fn set_premultiplied_alpha(&mut self, premultiplied: bool) -> IoResult {
+        self.input_format.premultiplied = premultiplied;
+        Ok(())
+    }
+
+    /// Set whether 16-bit input samples are least significant byte
+    /// first, rather than PNG's most significant byte first.
+    pub fn set_little_endian(&mut self, little_endian: bool) -> IoResult {
+        self.input_format.little_endian = little_endian;
+        Ok(())
+    }
+
+    /// Set whether input samples for bit depths below 8 take a byte
+    /// each, such as palette indices, instead of being packed.
+    pub fn set_unpacked_samples(&mut self, unpacked: bool) -> IoResult {
+        self.input_format.unpacked = unpacked;
+        Ok(())
+    }
+
+    /// Limit the memory held by chunks between input and output to
+    /// about this many bytes, so it stays the same however tall the
+    /// image is. Once at the limit, write_image_rows() waits for
+    /// output to catch up before taking another chunk, and
+    /// try_write_image_rows() holds back.
+    ///
+    /// One chunk is always let in, and an adaptive chunk size is kept
+    /// small enough for each thread to have one within the limit.
+    /// Interlaced images are held whole until all their rows are in,
+    /// and non-streaming output to a sink that can't seek still
+    /// buffers the compressed image, neither of which counts here.
+    pub fn set_memory_limit(&mut self, bytes: usize) -> IoResult {
+        self.memory_limit = Some(bytes);
+        Ok(())
+    }
+
+    /// Set the distance in bytes from the start of one input row to
+    /// the next for Encoder::write_image_rows(), for rows with padding
+    /// at the end. The default of 0 means rows are contiguous.
+    pub fn set_input_stride(&mut self, stride: usize) -> IoResult {
+        self.input_format.stride = stride;
+        Ok(())
+    }
+}
+
+impl<'a> Options<'a> {
+    pub(crate) fn threads(&self) -> usize {
+        match self.thread_pool {
+            Some(pool) => pool.current_num_threads(),
+            None => ::rayon::current_num_threads()
+        }
+    }
+
+    pub(crate) fn thread_pool(&self) -> Option<&'a ThreadPool> {
+        self.thread_pool
+    }
 }
 
 impl<'a> Default for Options<'a> {
@@ -172,6 +406,52 @@ impl<'a> Default for Options<'a> {
     }
 }
 
+/// Shared whole-image pixel buffer, for zero-copy input via
+/// Encoder::write_image_frame().
+///
+/// Any type that can be viewed as a byte slice and safely shared
+/// between threads may be used, such as an Arc<Vec<u8>>.
+pub type FrameBuffer = Arc<dyn AsRef<[u8]> + Send + Sync>;
+
+/// Callback for Encoder::set_notify(), called on worker threads.
+pub type NotifyFunc = Arc<dyn Fn() + Send + Sync>;
+
+/// Callback for Encoder::set_buffer_func(), given each piece of
+/// output in turn.
+pub type BufferFunc = Box<dyn FnMut(Arc<Vec<u8>>) -> IoResult + Send>;
+
+// Backing storage for a pixel chunk's rows.
+enum PixelData {
+    // Rows copied in one at a time into a contiguous slab,
+    // each with stride bytes per row
+    Owned(AlignedBuffer),
+
+    // Rows borrowed from a caller-provided frame buffer, starting
+    // at the byte offset and spaced by the frame's own stride.
+    Shared {
+        frame: FrameBuffer,
+        offset: usize,
+        frame_stride: usize,
+    },
+
+    // Rows of an Adam7 pass, still spread out over the whole image;
+    // the filter job pulls them out with unpack().
+    Interlaced {
+        image: Arc<PixelChunk>,
+        pass: usize,
+    },
+}
+
+// How input rows get to PNG byte order in the header's format.
+#[derive(Clone)]
+enum Conversion {
+    // Rearranged from another layout of the same color type.
+    Format(InputFormat),
+
+    // Reduced from a larger color type or depth.
+    Reduce(ColorReduction),
+}
+
 // Accumulates a set of pixels, then gets sent off as input
 // to the deflate jobs.
 struct PixelChunk {
@@ -183,14 +463,75 @@ struct PixelChunk {
     is_start: bool,
     is_end: bool,
 
+    // Bytes in each row, without any padding.
     stride: usize,
 
-    // Rows of pixel data, each with stride bytes per row
-    rows: Vec<Vec<u8>>,
+    // How input rows are still to be converted, if at all.
+    conversion: Option<Conversion>,
+
+    // Rows of pixel data
+    rows: PixelData,
 }
 
 impl PixelChunk {
-    fn new(header: Header, index: usize, start_row: usize, end_row: usize) -> PixelChunk {
+    fn new(header: Header,
+           conversion: Option<Conversion>,
+           index: usize,
+           start_row: usize,
+           end_row: usize,
+           pool: Option<&BufferPool>) -> PixelChunk
+    {
+        let nbytes = PixelChunk::row_bytes(&header, &conversion) * (end_row - start_row);
+        let rows = PixelData::Owned(AlignedBuffer::with_pool(pool, nbytes));
+        PixelChunk::with_data(header, conversion, index, start_row, end_row, rows)
+    }
+
+    // Wrap a range of rows from a whole-image buffer without copying.
+    fn from_frame(header: Header,
+                  conversion: Option<Conversion>,
+                  index: usize,
+                  start_row: usize,
+                  end_row: usize,
+                  frame: FrameBuffer,
+                  frame_stride: usize) -> PixelChunk
+    {
+        let rows = PixelData::Shared {
+            frame,
+            offset: start_row * frame_stride,
+            frame_stride,
+        };
+        PixelChunk::with_data(header, conversion, index, start_row, end_row, rows)
+    }
+
+    // Refer to a range of rows of an interlace pass in the whole image,
+    // given the pass's header. Any chunk but the first and last of all
+    // passes sits in the middle of the compressed data.
+    fn from_pass(header: Header,
+                 index: usize,
+                 start_row: usize,
+                 end_row: usize,
+                 image: Arc<PixelChunk>,
+                 pass: usize,
+                 is_start: bool,
+                 is_end: bool) -> PixelChunk
+    {
+        let rows = PixelData::Interlaced {
+            image,
+            pass,
+        };
+        let mut chunk = PixelChunk::with_data(header, None, index, start_row, end_row, rows);
+        chunk.is_start = is_start;
+        chunk.is_end = is_end;
+        chunk
+    }
+
+    fn with_data(header: Header,
+                 conversion: Option<Conversion>,
+                 index: usize,
+                 start_row: usize,
+                 end_row: usize,
+                 rows: PixelData) -> PixelChunk
+    {
         assert!(start_row <= end_row);
 
         let height = header.height as usize;
@@ -205,22 +546,130 @@ impl PixelChunk {
             is_start: start_row == 0,
             is_end: end_row == height,
 
-            stride: header.stride(),
+            stride: PixelChunk::row_bytes(&header, &conversion),
+            conversion,
+
+            rows,
+        }
+    }
 
-            rows: Vec::with_capacity(end_row - start_row),
+    // Length of a stored input row.
+    fn row_bytes(header: &Header, conversion: &Option<Conversion>) -> usize {
+        match *conversion {
+            Some(Conversion::Format(ref format)) => format.row_bytes(header),
+            Some(Conversion::Reduce(ref reduction)) => reduction.row_bytes(header.width as usize),
+            None => header.stride(),
         }
     }
 
     fn is_full(&self) -> bool {
-        self.rows.len() == (self.end_row - self.start_row)
+        match self.rows {
+            PixelData::Owned(ref rows) => rows.remaining() == 0,
+            PixelData::Shared { .. } => true,
+            PixelData::Interlaced { .. } => true,
+        }
+    }
+
+    fn is_interlaced(&self) -> bool {
+        matches!(self.rows, PixelData::Interlaced { .. })
+    }
+
+    fn needs_unpacking(&self) -> bool {
+        self.is_interlaced() || self.conversion.is_some()
+    }
+
+    //
+    // Convert a stored input row into PNG byte order, filling the
+    // header's stride.
+    //
+    fn convert_row(&self, src: &[u8], out: &mut [u8]) -> IoResult {
+        match self.conversion {
+            Some(Conversion::Format(ref format)) => format.convert_row(&self.header, src, out),
+            Some(Conversion::Reduce(ref reduction)) => reduction.convert_row(self.header.width as usize, src, out)?,
+            None => out.copy_from_slice(src),
+        }
+        Ok(())
+    }
+
+    //
+    // Copy out a range of rows as a regular chunk in PNG byte order,
+    // converting them from the input format, and pulling interlaced
+    // ones out of the whole image.
+    //
+    fn unpack(&self, start_row: usize, end_row: usize, pool: Option<&BufferPool>) -> io::Result<PixelChunk> {
+        let mut chunk = PixelChunk::new(self.header, None, self.index, start_row, end_row, pool);
+        chunk.is_start = self.is_start;
+        chunk.is_end = self.is_end;
+
+        let mut row = vec![0u8; self.header.stride()];
+        match self.rows {
+            PixelData::Interlaced { ref image, pass } => {
+                let bits_per_pixel = self.header.color_type.channels() * self.header.depth as usize;
+                let width = self.header.width as usize;
+
+                let mut converted = vec![0u8; image.header.stride()];
+                for i in start_row .. end_row {
+                    for byte in row.iter_mut() {
+                        *byte = 0;
+                    }
+                    let src = image.get_row(interlace::image_row(pass, i));
+                    let src = match image.conversion {
+                        Some(_) => {
+                            image.convert_row(src, &mut converted)?;
+                            &converted[..]
+                        },
+                        None => src,
+                    };
+                    interlace::extract_row(pass, bits_per_pixel, width, src, &mut row);
+                    chunk.read_row(&row);
+                }
+            },
+            _ => {
+                if self.conversion.is_none() {
+                    panic!("Tried to unpack a chunk already in PNG byte order");
+                }
+                for i in start_row .. end_row {
+                    self.convert_row(self.get_row(i), &mut row)?;
+                    chunk.read_row(&row);
+                }
+            },
+        }
+        Ok(chunk)
+    }
+
+    //
+    // Return a copy of just the last row, which is all the next chunk's
+    // filter job needs, so the rest can be freed once this chunk is
+    // filtered. Rows that aren't this chunk's own to free are shared.
+    //
+    fn last_row(self: &Arc<Self>, pool: Option<&BufferPool>) -> Arc<PixelChunk> {
+        match self.rows {
+            PixelData::Owned(_) if self.end_row - self.start_row > 1 => {
+                let mut chunk = PixelChunk::new(self.header,
+                                                self.conversion.clone(),
+                                                self.index,
+                                                self.end_row - 1,
+                                                self.end_row,
+                                                pool);
+                chunk.is_start = self.is_start;
+                chunk.is_end = self.is_end;
+                chunk.read_row(self.get_row(self.end_row - 1));
+                Arc::new(chunk)
+            },
+            _ => Arc::clone(self),
+        }
     }
 
     fn read_row(&mut self, row: &[u8])
     {
-        let mut row_copy = Vec::with_capacity(self.stride);
-        row_copy.extend_from_slice(row);
-
-        self.rows.push(row_copy);
+        match self.rows {
+            PixelData::Owned(ref mut rows) => {
+                rows.extend_from_slice(row);
+            },
+            PixelData::Shared { .. } | PixelData::Interlaced { .. } => {
+                panic!("Tried to copy a row into a shared frame chunk");
+            }
+        }
     }
 
     fn get_row(&self, row: usize) -> &[u8] {
@@ -229,102 +678,273 @@ impl PixelChunk {
         } else if row >= self.end_row {
             panic!("Tried to access row from later chunk: {} >= {}", row, self.end_row);
         } else {
-            &self.rows[row - self.start_row]
+            let index = row - self.start_row;
+            match self.rows {
+                PixelData::Owned(ref rows) => {
+                    let start = index * self.stride;
+                    &rows[start .. start + self.stride]
+                },
+                PixelData::Shared { ref frame, offset, frame_stride } => {
+                    let start = offset + index * frame_stride;
+                    &(**frame).as_ref()[start .. start + self.stride]
+                },
+                PixelData::Interlaced { .. } => {
+                    panic!("Tried to access row of a chunk before deinterlacing");
+                }
+            }
+        }
+    }
+}
+
+impl PixelChunk {
+    //
+    // Filter all rows of this chunk into the output buffer,
+    // returning the checksum of the filtered data.
+    //
+    // Needs the previous chunk for the row above the first,
+    // unless this is the first chunk.
+    //
+    fn filter_rows(&self,
+                   prior_input: Option<&PixelChunk>,
+                   filter: &mut AdaptiveFilter,
+                   data: &mut AlignedBuffer) -> u32
+    {
+        let mut adler32 = deflate::adler32_initial();
+        let zero = vec![0u8; self.stride];
+        for i in self.start_row .. self.end_row {
+            let prior = if i == self.start_row {
+                match prior_input {
+                    Some(input) => input,
+                    None => self, // Won't get used.
+                }
+            } else {
+                self
+            };
+            let prev = if i == 0 {
+                &zero
+            } else {
+                prior.get_row(i - 1)
+            };
+
+            let row = self.get_row(i);
+
+            let output = filter.filter(prev, row);
+
+            // Checksum each row while it's still in cache, rather
+            // than making another pass over the chunk later.
+            adler32 = deflate::adler32(adler32, output);
+
+            data.extend_from_slice(output);
         }
+        adler32
     }
 }
 
+//
+// Candidates for brute-force filter selection, in order of
+// preference when they compress to the same size.
+//
+// The heuristic doesn't matter for the fixed filters.
+//
+const TRIAL_FILTERS: [(Mode<Filter>, Heuristic); 7] = [
+    (Adaptive, Heuristic::Complexity),
+    (Adaptive, Heuristic::Entropy),
+    (Fixed(Filter::None), Heuristic::Complexity),
+    (Fixed(Filter::Sub), Heuristic::Complexity),
+    (Fixed(Filter::Up), Heuristic::Complexity),
+    (Fixed(Filter::Average), Heuristic::Complexity),
+    (Fixed(Filter::Paeth), Heuristic::Complexity),
+];
+
+// Deflate settings for test compressing the trial filters.
+#[derive(Copy, Clone)]
+struct Trials {
+    compression_level: CompressionLevel,
+    strategy: Strategy,
+    backend: Backend,
+}
+
 // Takes pixel chunks as input and accumulates filtered output.
 struct FilterChunk {
     index: usize,
-    start_row: usize,
-    end_row: usize,
     is_start: bool,
     is_end: bool,
 
-    stride: usize,
     filter_mode: Mode<Filter>,
+    filter_heuristic: Heuristic,
+
+    // If set, try every TRIAL_FILTERS candidate and keep the
+    // smallest, instead of using filter_mode and filter_heuristic.
+    trials: Option<Trials>,
 
     // The input pixels for chunk n-1
     // Needed for its last row only.
     prior_input: Option<Arc<PixelChunk>>,
 
-    // The input pixels for chunk n
-    input: Arc<PixelChunk>,
+    // The input pixels for chunk n, let go of once filtered.
+    input: Option<Arc<PixelChunk>>,
 
-    // Filtered output bytes
-    data: Vec<u8>,
+    // Filtered output bytes, in a contiguous slab
+    // with stride bytes per row
+    data: AlignedBuffer,
+
+    // Checksum of the filtered output
+    adler32: u32,
+
+    // Hash of the filtered output when using a chunk cache, else 0.
+    hash: u64,
+
+    // Second buffer for trial filtering, released once done.
+    scratch: Option<AlignedBuffer>,
+
+    // Timings and counts so far, and when filtering finished.
+    stats: ChunkStats,
+    filtered_at: Option<Instant>,
 }
 
 impl FilterChunk {
     fn new(prior_input: Option<Arc<PixelChunk>>,
            input: Arc<PixelChunk>,
-           filter_mode: Mode<Filter>) -> FilterChunk
+           filter_mode: Mode<Filter>,
+           filter_heuristic: Heuristic,
+           trials: Option<Trials>,
+           pool: Option<&BufferPool>) -> io::Result<FilterChunk>
     {
+        // Interlaced chunks only point into the whole image, and others
+        // may need converting from the input format; unpack this chunk's
+        // pixels and the row above it here on the worker.
+        let (prior_input, input) = if input.is_interlaced() {
+            let prior = if input.start_row > 0 {
+                Some(Arc::new(input.unpack(input.start_row - 1, input.start_row, pool)?))
+            } else {
+                None
+            };
+            (prior, Arc::new(input.unpack(input.start_row, input.end_row, pool)?))
+        } else if input.needs_unpacking() {
+            let prior = match prior_input {
+                Some(prior) => Some(Arc::new(prior.unpack(prior.end_row - 1, prior.end_row, pool)?)),
+                None => None,
+            };
+            (prior, Arc::new(input.unpack(input.start_row, input.end_row, pool)?))
+        } else {
+            (prior_input, input)
+        };
+
         // Prepend one byte for the filter selector.
         let stride = input.stride + 1;
-        let nbytes = stride * (input.end_row - input.start_row);
+        let index = input.index;
+        let rows = input.end_row - input.start_row;
+        let nbytes = stride * rows;
 
-        FilterChunk {
-            index: input.index,
-            start_row: input.start_row,
-            end_row: input.end_row,
+        Ok(FilterChunk {
+            index,
             is_start: input.is_start,
             is_end: input.is_end,
 
-            stride,
             filter_mode,
+            filter_heuristic,
+            trials,
 
             prior_input,
-            input,
-            data: Vec::with_capacity(nbytes),
-        }
+            input: Some(input),
+            data: AlignedBuffer::with_pool(pool, nbytes),
+            adler32: deflate::adler32_initial(),
+            hash: 0,
+            scratch: match trials {
+                Some(_) => Some(AlignedBuffer::with_pool(pool, nbytes)),
+                None    => None,
+            },
+
+            stats: ChunkStats {
+                index,
+                rows,
+                bytes_in: nbytes,
+                ..ChunkStats::default()
+            },
+            filtered_at: None,
+        })
     }
 
-    // Return the last up-to-32kib, used as an input dictionary
+    // Copy out the last up-to-32kib, used as an input dictionary
     // for the next chunk's deflate job.
-    fn get_trailer(&self) -> &[u8] {
+    fn trailer(&self) -> Trailer {
         let trailer = 32768;
         let len = self.data.len();
-        if len > trailer {
-            &self.data[len - trailer .. len]
-        } else {
-            &self.data[0 .. len]
+        let start = if len > trailer { len - trailer } else { 0 };
+        Trailer {
+            data: self.data[start .. len].to_vec(),
+            hash: self.hash,
         }
     }
 
     //
     // Run the filtering, on a background thread.
     //
+    // The pixels are released once filtered, so they don't stay
+    // around while this chunk waits on its neighbor to be deflated.
+    //
     fn run(&mut self) -> IoResult {
-        let mut filter = AdaptiveFilter::new(self.input.header, self.filter_mode);
-        let zero = vec![0u8; self.stride - 1];
-        for i in self.start_row .. self.end_row {
-            let prior = if i == self.start_row {
-                match self.prior_input {
-                    Some(ref input) => input,
-                    None => &self.input, // Won't get used.
+        let input = match self.input.take() {
+            Some(input) => input,
+            None => panic!("Tried to filter a chunk twice"),
+        };
+        let prior_input = self.prior_input.take();
+        let prior_input = prior_input.as_deref();
+        match self.trials {
+            None => {
+                let mut filter = AdaptiveFilter::new(input.header,
+                                                     self.filter_mode,
+                                                     self.filter_heuristic);
+                self.adler32 = input.filter_rows(prior_input, &mut filter, &mut self.data);
+                self.stats.filters = filter.filter_counts();
+            },
+            Some(trials) => {
+                //
+                // Test compress each candidate on its own. The real
+                // deflate job will be primed with the previous chunk's
+                // filtered output, but that's still being decided in
+                // parallel; leaving it out shortchanges every candidate
+                // about equally.
+                //
+                let compressor = deflate::compressor(trials.backend);
+                let mut scratch = self.scratch.take().unwrap();
+                let mut output = Vec::new();
+                let mut best = usize::max_value();
+                for &(mode, heuristic) in TRIAL_FILTERS.iter() {
+                    let mut filter = AdaptiveFilter::new(input.header, mode, heuristic);
+                    scratch.clear();
+                    let adler32 = input.filter_rows(prior_input, &mut filter, &mut scratch);
+
+                    output.clear();
+                    output = compressor.compress(trials.compression_level,
+                                                 trials.strategy,
+                                                 &[],
+                                                 &scratch,
+                                                 true,
+                                                 output)?;
+                    if output.len() < best {
+                        best = output.len();
+                        self.adler32 = adler32;
+                        self.stats.filters = filter.filter_counts();
+                        mem::swap(&mut self.data, &mut scratch);
+                    }
                 }
-            } else {
-                &self.input
-            };
-            let prev = if i == 0 {
-                &zero
-            } else {
-                prior.get_row(i - 1)
-            };
-
-            let row = self.input.get_row(i);
-
-            let output = filter.filter(prev, row);
-
-            self.data.write_all(output)?
+            },
         }
         Ok(())
     }
 }
 
+// The end of a filtered chunk, which is all the next chunk's
+// deflate job needs of it.
+struct Trailer {
+    data: Vec<u8>,
+    hash: u64,
+}
+
 // Takes filter chunks as input and accumulates compressed output.
+// The input is only borrowed while compressing, so the filtered
+// data can be freed as soon as that's done.
 struct DeflateChunk {
     index: usize,
     is_start: bool,
@@ -332,27 +952,39 @@ struct DeflateChunk {
 
     compression_level: CompressionLevel,
     strategy: Strategy,
+    backend: Backend,
 
-    // The filtered pixels for chunk n-1
-    // Empty on first chunk.
-    // Needed for its last row only.
-    prior_input: Option<Arc<FilterChunk>>,
+    // Checksum, length, and chunk cache hash of the filtered pixels
+    // for chunk n, and the hash of chunk n-1's, if any.
+    adler32: u32,
+    input_len: usize,
+    hash: u64,
+    prior_hash: Option<u64>,
 
-    // The filtered pixels for chunk n
-    input: Arc<FilterChunk>,
+    // Compressed output bytes, shared with the chunk cache if used
+    data: Arc<Vec<u8>>,
 
-    // Compressed output bytes
-    data: Vec<u8>,
+    // CRC-32 of this chunk's compressed output
+    crc32: u32,
 
-    // Checksum of this chunk
-    adler32: u32,
+    // Whether the output came from the chunk cache
+    reused: bool,
+
+    // Timings and counts so far, and when compression finished.
+    stats: ChunkStats,
+    deflated_at: Option<Instant>,
+
+    // Recycles the output buffer, if set
+    pool: Option<BufferPool>,
 }
 
 impl DeflateChunk {
     fn new(compression_level: CompressionLevel,
            strategy: Strategy,
-           prior_input: Option<Arc<FilterChunk>>,
-           input: Arc<FilterChunk>) -> DeflateChunk {
+           backend: Backend,
+           prior_input: Option<&Trailer>,
+           input: &FilterChunk,
+           pool: Option<BufferPool>) -> DeflateChunk {
 
         DeflateChunk {
             index: input.index,
@@ -361,61 +993,80 @@ impl DeflateChunk {
 
             compression_level,
             strategy,
-
-            prior_input,
-            input,
-            data: Vec::new(),
-            adler32: deflate::adler32_initial(),
+            backend,
+
+            adler32: input.adler32,
+            input_len: input.data.len(),
+            hash: input.hash,
+            prior_hash: prior_input.map(|trailer| trailer.hash),
+            data: Arc::new(Vec::new()),
+            crc32: deflate::crc32_initial(),
+            reused: false,
+            stats: input.stats,
+            deflated_at: None,
+            pool,
         }
     }
 
-    fn run(&mut self) -> IoResult {
-        // Run the deflate!
-        // Todo: don't create an empty vector earlier, but reuse it sanely.
-        let data = Vec::<u8>::new();
-
-        let mut options = deflate::Options::new();
+    //
+    // Take the output from an earlier encode instead of compressing.
+    //
+    fn reuse(&mut self, chunk: &CachedChunk) {
+        self.data = Arc::clone(&chunk.data);
+        self.crc32 = chunk.crc32;
+        self.reused = true;
+    }
 
-        options.set_window_bits(if self.is_start {
-            // 15 means 2^15 (32 KiB), the max supported.
-            15
-        } else {
-            // Negative forces raw stream output so we don't get
-            // a second header...
-            -15
-        });
+    fn run(&mut self, prior_input: Option<&Trailer>, input: &FilterChunk) -> IoResult {
+        // Run the deflate!
+        // Size the output buffer for this backend's worst case and
+        // the zlib header, so it never needs to grow.
+        let compressor = deflate::compressor(self.backend);
+        let bound = compressor.bound(input.data.len()) + 2;
+        let mut data = match self.pool {
+            Some(ref pool) => pool.take(bound),
+            None => Vec::with_capacity(bound),
+        };
 
-        match self.compression_level {
-            CompressionLevel::Default => {},
-            CompressionLevel::Fast => options.set_level(1),
-            CompressionLevel::High => options.set_level(9),
+        // Chunks are compressed as raw deflate data so they can be
+        // concatenated; the first one carries the zlib header.
+        if self.is_start {
+            data.extend_from_slice(&deflate::zlib_header(self.compression_level, self.strategy));
         }
-        options.set_strategy(self.strategy);
 
-        let mut encoder = Deflate::new(options, data);
+        let dictionary = match prior_input {
+            Some(trailer) => &trailer.data[..],
+            None => &[],
+        };
 
+        match compressor.compress(self.compression_level,
+                                  self.strategy,
+                                  dictionary,
+                                  &input.data,
+                                  self.is_end,
+                                  data) {
+            Ok(data) => {
+                // Checksum the output here on the worker while it's hot,
+                // so the writer can combine results instead of making
+                // another serial pass over it.
+                self.crc32 = deflate::crc32(deflate::crc32_initial(), &data);
 
-        if let Some(ref filter) = self.prior_input {
-            let trailer = filter.get_trailer();
-            encoder.set_dictionary(trailer)?;
+                // This seems lame to move the vector back, but it's actually cheap.
+                self.data = Arc::new(data);
+                Ok(())
+            },
+            Err(e) => Err(e)
         }
+    }
+}
 
-        encoder.write(&self.input.data, if self.is_end {
-            Flush::Finish
-        } else {
-            Flush::SyncFlush
-        })?;
-
-        // In raw deflate mode we have to calculate the checksum ourselves.
-        self.adler32 = deflate::adler32(1, &self.input.data);
-
-        match encoder.finish() {
-            Ok(data) => {
-                // This seems lame to move the vector back, but it's actually cheap.
-                self.data = data;
-                Ok(())
-            },
-            Err(e) => Err(e)
+impl Drop for DeflateChunk {
+    fn drop(&mut self) {
+        if let Some(ref pool) = self.pool {
+            // Buffers still held by the chunk cache stay there.
+            if let Ok(data) = Arc::try_unwrap(mem::take(&mut self.data)) {
+                pool.give(data);
+            }
         }
     }
 }
@@ -425,9 +1076,10 @@ impl DeflateChunk {
 // but are returned in original order, in pairs with the
 // prior chunk when available.
 //
-// The prior chunk is passed around because filtering and
-// deflating jobs need the end (last row, or last 32 KiB)
-// of the previous chunk's input as well as their own.
+// The prior chunk is passed around because filtering jobs
+// need the last row of the previous chunk's input as well
+// as their own; set_prev() can swap in a trimmed copy with
+// just that, or nothing where it isn't needed.
 //
 struct ChunkMap<T> {
     cursor_in: usize,
@@ -487,6 +1139,10 @@ impl<T> ChunkMap<T> {
         }
     }
 
+    fn set_prev(&mut self, prev: Option<Arc<T>>) {
+        self.prev = prev;
+    }
+
     fn pop_front(&mut self) -> Option<(Option<Arc<T>>, Arc<T>)> {
         match self.chunks.get(0) {
             Some(Some(_)) => {
@@ -514,8 +1170,196 @@ impl<T> ChunkMap<T> {
     }
 }
 
+//
+// Hands filtered chunks on to their deflate jobs right on the worker
+// threads, so a chunk doesn't sit waiting for the encoder's thread to
+// come back around to dispatch() before it can be compressed.
+//
+// Deflating chunk n needs the filtered output of chunk n, and the
+// trailer of chunk n-1's. Each filter job counts down the deflate
+// jobs waiting on it, and one that brings a count to zero starts
+// that deflate job itself. Each filtered chunk and trailer has just
+// the one user, and is let go of as soon as its job takes it.
+//
+struct Handoff {
+    // Index of the first chunk; each frame of an animation has its own.
+    first: usize,
+
+    compression_level: CompressionLevel,
+    strategy: Strategy,
+    backend: Backend,
+    pool: Option<BufferPool>,
+
+    // Chunks from the last encode, if using a chunk cache.
+    cache: Option<Arc<CachedChunks>>,
+
+    // Filtered chunks, and the trailers of all but the last,
+    // held until the deflate jobs using them start.
+    filtered: Vec<Mutex<Option<FilterChunk>>>,
+    trailers: Vec<Mutex<Option<Trailer>>>,
+
+    // Filter jobs each deflate job is still waiting on.
+    waiting: Vec<AtomicUsize>,
+
+    // The encoder's trace callback, read as each deflate job starts.
+    trace: Arc<Mutex<Option<TraceFunc>>>,
+}
+
+impl Handoff {
+    fn new(first: usize,
+           chunks: usize,
+           compression_level: CompressionLevel,
+           strategy: Strategy,
+           backend: Backend,
+           pool: Option<BufferPool>,
+           cache: Option<Arc<CachedChunks>>,
+           trace: Arc<Mutex<Option<TraceFunc>>>) -> Handoff {
+        Handoff {
+            first,
+            compression_level,
+            strategy,
+            backend,
+            pool,
+            cache,
+            filtered: (0 .. chunks).map(|_| Mutex::new(None)).collect(),
+            trailers: (0 .. chunks).map(|_| Mutex::new(None)).collect(),
+            waiting: (0 .. chunks).map(|index| {
+                AtomicUsize::new(if index == 0 { 1 } else { 2 })
+            }).collect(),
+            trace,
+        }
+    }
+
+    fn contains(&self, index: usize) -> bool {
+        index >= self.first && index < self.first + self.filtered.len()
+    }
+
+    fn caching(&self) -> bool {
+        self.cache.is_some()
+    }
+
+    //
+    // Find the last encode's output for a chunk, if it was compressed
+    // from the same filtered data with the same dictionary.
+    //
+    fn cached(&self, deflate: &DeflateChunk) -> Option<&CachedChunk> {
+        let chunk = self.cache.as_ref()?.get(deflate.index)?.as_ref()?;
+        if chunk.matches(deflate.is_start,
+                         deflate.is_end,
+                         deflate.hash,
+                         deflate.prior_hash) {
+            Some(chunk)
+        } else {
+            None
+        }
+    }
+
+    //
+    // Save a filtered chunk, and return the indexes of any
+    // deflate jobs that now have all their input, counting
+    // from the first chunk.
+    //
+    fn land(&self, filter: FilterChunk) -> Vec<usize> {
+        let index = filter.index - self.first;
+        if index + 1 < self.trailers.len() {
+            *self.trailers[index].lock().unwrap() = Some(filter.trailer());
+        }
+        *self.filtered[index].lock().unwrap() = Some(filter);
+
+        let end = cmp::min(index + 2, self.waiting.len());
+        (index .. end).filter(|&target| {
+            self.waiting[target].fetch_sub(1, Ordering::AcqRel) == 1
+        }).collect()
+    }
+
+    //
+    // Hand a filtered chunk, or the trailer of one, over to
+    // the deflate job that needs it.
+    //
+    fn take(&self, index: usize) -> FilterChunk {
+        match self.filtered[index].lock().unwrap().take() {
+            Some(filter) => filter,
+            None => panic!("Started deflate job before its input landed"),
+        }
+    }
+
+    fn take_trailer(&self, index: usize) -> Trailer {
+        match self.trailers[index].lock().unwrap().take() {
+            Some(trailer) => trailer,
+            None => panic!("Started deflate job before its dictionary landed"),
+        }
+    }
+}
+
+//
+// Start deflating a chunk from a worker thread. This is spawned on
+// the worker's own pool, which is the encoder's pool.
+//
+fn spawn_deflate(handoff: &Arc<Handoff>,
+                 index: usize,
+                 tx: &Sender<ThreadMessage>,
+                 notify: &Arc<Mutex<Option<NotifyFunc>>>) {
+    let prior_input = if index > 0 {
+        Some(handoff.take_trailer(index - 1))
+    } else {
+        None
+    };
+    let input = handoff.take(index);
+    let trace = handoff.trace.lock().unwrap().clone();
+    let handoff = Arc::clone(handoff);
+    spawn_job(None, tx.clone(), Arc::clone(notify), move |tx| {
+        let start = Instant::now();
+        let mut deflate = DeflateChunk::new(handoff.compression_level,
+                                            handoff.strategy,
+                                            handoff.backend,
+                                            prior_input.as_ref(),
+                                            &input,
+                                            handoff.pool.clone());
+        let result = match handoff.cached(&deflate) {
+            Some(chunk) => {
+                deflate.reuse(chunk);
+                Ok(())
+            },
+            None => deflate.run(prior_input.as_ref(), &input),
+        };
+        if let Some(filtered_at) = input.filtered_at {
+            deflate.stats.handoff_wait = start.saturating_duration_since(filtered_at);
+        }
+        deflate.stats.deflate_time = stats::trace(&trace, Stage::Deflate, deflate.index, start);
+        deflate.stats.bytes_out = deflate.data.len();
+        deflate.stats.reused = deflate.reused;
+        deflate.deflated_at = Some(Instant::now());
+        tx.send(match result {
+            Ok(()) => ThreadMessage::DeflateDone(Arc::new(deflate)),
+            Err(e) => ThreadMessage::Error(e),
+        }).ok();
+    });
+}
+
+//
+// Run a job on the given pool, or the current one, then let any
+// set_notify() callback know there may be something to pick up.
+//
+fn spawn_job<F>(thread_pool: Option<&ThreadPool>,
+                tx: Sender<ThreadMessage>,
+                notify: Arc<Mutex<Option<NotifyFunc>>>,
+                func: F)
+    where F: Fn(&Sender<ThreadMessage>) + Send + 'static
+{
+    let job = move || {
+        func(&tx);
+        let notify = notify.lock().unwrap().clone();
+        if let Some(notify) = notify {
+            notify();
+        }
+    };
+    match thread_pool {
+        Some(pool) => pool.spawn(job),
+        None => ::rayon::spawn(job),
+    }
+}
+
 enum ThreadMessage {
-    FilterDone(Arc<FilterChunk>),
     DeflateDone(Arc<DeflateChunk>),
     Error(io::Error),
 }
@@ -531,6 +1375,28 @@ enum RowStatus {
     Done,
 }
 
+// Size of the first chunk in streaming mode; later ones double from here.
+const STREAMING_FIRST_CHUNK: usize = 16 * 1024;
+
+//
+// Roughly the most memory a chunk of rows holds at once between
+// coming in and going out: its filtered rows, along with either its
+// pixels while filtering or its compressed output while deflating.
+//
+fn chunk_memory(header: &Header, rows: usize) -> usize {
+    let filtered = (header.stride() + 1) * rows;
+    filtered + deflate::max_bound(filtered)
+}
+
+// Rows of one Adam7 pass making up a chunk of output.
+#[derive(Copy, Clone)]
+struct PassChunk {
+    header: Header,
+    pass: usize,
+    start_row: usize,
+    end_row: usize,
+}
+
 /// Parallel PNG encoder state.
 /// Takes an Options struct with initializer data and a Write struct
 /// to send output to.
@@ -546,28 +1412,81 @@ pub struct Encoder<'a, W: Write> {
     wrote_transparency: bool,
     started_image: bool,
 
+    // APNG state: frames announced in acTL, and fcTL chunks given so far.
+    // Frame controls queue up until their frame's data is output, which
+    // may be after later frames have started going in.
+    num_frames: u32,
+    frames_input: u32,
+    started_frame: bool,
+    next_frame_control: Option<FrameControl>,
+    frame_controls: VecDeque<Option<FrameControl>>,
+    frames_output: usize,
+    sequence: u32,
+
+    // The IHDR header; header is that of the current frame.
+    image_header: Header,
+
     chunks_total: usize,
     chunks_output: usize,
 
+    // First row of each chunk of input, and the image height at the end.
+    // Interlaced images come in as one chunk, and go out as pass_chunks.
+    chunk_starts: Vec<usize>,
+    pass_chunks: Vec<PassChunk>,
+
+    // Chunks queued up for filtering so far, and the index
+    // of the current frame's first chunk.
+    chunks_input: usize,
+    chunk_base: usize,
+
     // Accumulates input rows until enough are ready to fire off a filter job.
     pixel_accumulator: Arc<PixelChunk>,
     pixel_index: usize,
     current_row: u32,
 
-    // Accumulates completed output from pixel input, filter, and deflate jobs.
+    // Accumulates completed output from pixel input and deflate jobs;
+    // filter jobs pass their output on to deflate jobs directly.
     pixel_chunks: ChunkMap<PixelChunk>,
-    filter_chunks: ChunkMap<FilterChunk>,
     deflate_chunks: ChunkMap<DeflateChunk>,
+    handoffs: VecDeque<Arc<Handoff>>,
+
+    // Estimated memory of each chunk from input until it's output,
+    // and the total, for the memory limit.
+    chunk_memory: VecDeque<usize>,
+    memory_in_flight: usize,
+
+    // When each chunk waiting to be filtered had all its rows in.
+    queued_at: VecDeque<Instant>,
+
+    // Chunks of the last encode using the chunk cache, and this one's
+    // to replace them with once done.
+    cached_chunks: Option<Arc<CachedChunks>>,
+    cache_chunks: CachedChunks,
+    cache_reused: usize,
 
     // Accumulates the checksum of all output chunks in turn.
     adler32: u32,
 
     // Accumulates IDAT output when not using streaming output mode
     idat_buffer: Vec<u8>,
+    idat_crc32: u32,
+
+    // Fills in the IDAT length afterwards on seekable outputs, so
+    // non-streaming output can be written as it's compressed.
+    seek_patch: Option<PatchFunc<W>>,
 
     // For messages from the thread pool.
     tx: Sender<ThreadMessage>,
     rx: Receiver<ThreadMessage>,
+
+    // Called after each job's message is sent, so whoever is driving
+    // the encoder without blocking knows to poll() again. Shared with
+    // the jobs so jobs already running see a changed callback.
+    notify: Arc<Mutex<Option<NotifyFunc>>>,
+
+    // Called with the time each stage takes, if set. Shared with the
+    // frames' handoffs so deflate jobs started later see a new callback.
+    trace: Arc<Mutex<Option<TraceFunc>>>,
 }
 
 impl<'a, W: Write> Encoder<'a, W> {
@@ -586,23 +1505,49 @@ impl<'a, W: Write> Encoder<'a, W> {
             wrote_transparency: false,
             started_image: false,
 
+            num_frames: 0,
+            frames_input: 0,
+            started_frame: false,
+            next_frame_control: None,
+            frame_controls: VecDeque::new(),
+            frames_output: 0,
+            sequence: 0,
+
+            image_header: Header::new(),
+
             chunks_total: 0,
             chunks_output: 0,
+            chunk_starts: Vec::new(),
+            pass_chunks: Vec::new(),
+            chunks_input: 0,
+            chunk_base: 0,
 
             // hack, clean this up later
-            pixel_accumulator: Arc::new(PixelChunk::new(Header::new(), 0, 0, 0)),
+            pixel_accumulator: Arc::new(PixelChunk::new(Header::new(), None, 0, 0, 0, None)),
             pixel_index: 0,
             current_row: 0,
 
             pixel_chunks: ChunkMap::new(),
-            filter_chunks: ChunkMap::new(),
             deflate_chunks: ChunkMap::new(),
+            handoffs: VecDeque::new(),
+
+            chunk_memory: VecDeque::new(),
+            memory_in_flight: 0,
+            queued_at: VecDeque::new(),
+
+            cached_chunks: None,
+            cache_chunks: Vec::new(),
+            cache_reused: 0,
 
             adler32: deflate::adler32_initial(),
             idat_buffer: Vec::new(),
+            idat_crc32: deflate::crc32_initial(),
+            seek_patch: None,
 
             tx,
             rx,
+            notify: Arc::new(Mutex::new(None)),
+            trace: Arc::new(Mutex::new(None)),
         }
     }
 
@@ -612,49 +1557,161 @@ impl<'a, W: Write> Encoder<'a, W> {
         self.flush()?;
         if self.is_finished() {
             self.writer.write_end()?;
+            if let Some(cache) = self.options.chunk_cache {
+                cache.store(self.cache_settings(),
+                            mem::take(&mut self.cache_chunks),
+                            self.cache_reused);
+            }
             self.writer.finish()
         } else {
             Err(other("Incomplete image input"))
         }
     }
 
+    // Chunks being filtered, waiting on their neighbor, or being deflated.
     fn running_jobs(&self) -> usize {
-        self.filter_chunks.running_jobs() + self.deflate_chunks.running_jobs()
+        self.deflate_chunks.running_jobs()
     }
 
     fn threads(&self) -> usize {
-        match self.options.thread_pool {
-            Some(pool) => pool.current_num_threads(),
-            None => ::rayon::current_num_threads()
-        }
+        self.options.threads()
     }
 
     fn max_threads(&self) -> usize {
-        // Keep the threads busy by queueing a couple extra jobs
-        // But not so busy that we don't interleave types
+        // Keep the threads busy by queueing a couple extra chunks,
+        // in case one is waiting on the one before it.
         self.threads() + 2
     }
 
     fn dispatch_func<F>(&self, func: F)
         where F: Fn(&Sender<ThreadMessage>) + Send + 'static
     {
-        let tx = self.tx.clone();
-        match self.options.thread_pool {
-            Some(pool) => {
-                pool.spawn(move || {
-                    func(&tx);
-                });
-            },
-            None => {
-                ::rayon::spawn(move || {
-                    func(&tx);
-                });
+        spawn_job(self.options.thread_pool,
+                  self.tx.clone(),
+                  Arc::clone(&self.notify),
+                  func);
+    }
+
+    fn chunk_size(&self) -> usize {
+        match self.options.chunk_size {
+            Fixed(n) => n,
+            Adaptive => {
+                //
+                // Smaller chunks lose a little compression at each
+                // boundary, which matters more the harder zlib is
+                // trying; larger ones only help ratio up to a point,
+                // and cost parallelism and latency beyond it.
+                //
+                let (min, max) = match self.options.compression_level {
+                    CompressionLevel::Fastest => (32 * 1024, 256 * 1024),
+                    CompressionLevel::Fast    => (32 * 1024, 256 * 1024),
+                    CompressionLevel::Default => (32 * 1024, 512 * 1024),
+                    CompressionLevel::High    => (64 * 1024, 1024 * 1024),
+                };
+
+                //
+                // A few chunks per thread evens out the load when
+                // some parts of the image are slower to compress.
+                //
+                let chunks_per_thread = 4;
+                let bytes = (self.header.stride() + 1) * self.header.height() as usize;
+                let target = bytes / (self.threads() * chunks_per_thread);
+
+                //
+                // Under a memory limit, leave room for a chunk on each
+                // thread and the extras queued; see chunk_memory().
+                //
+                let max = match self.options.memory_limit {
+                    Some(limit) => cmp::min(max, limit / (2 * self.max_threads())),
+                    None => max,
+                };
+                cmp::max(min, cmp::min(max, target))
+            }
+        }
+    }
+
+    //
+    // Split the image rows into chunks of about chunk_size() bytes,
+    // or with ramp set, ramp up to that size from a few rows.
+    //
+    fn chunk_starts(&self, header: &Header, ramp: bool) -> Vec<usize> {
+        let stride = header.stride() + 1;
+        let height = header.height() as usize;
+        let chunk_size = self.chunk_size();
+
+        let mut starts = vec![0];
+        let mut row = 0;
+        if ramp {
+            let mut size = STREAMING_FIRST_CHUNK;
+            while size < chunk_size && row < height {
+                // At least one row per chunk, however wide.
+                row = cmp::min(height, row + cmp::max(1, size / stride));
+                starts.push(row);
+                size *= 2;
+            }
+        }
+
+        let rows = height - row;
+        if rows > 0 {
+            let chunks = cmp::max(1, cmp::min(rows, stride * rows / chunk_size));
+            for index in 1 ..= chunks {
+                starts.push(row + index * rows / chunks);
+            }
+        }
+        starts
+    }
+
+    //
+    // Split each pass of an interlaced image into chunks as if it
+    // were an image of its own. Only the first pass needs ramping up
+    // for streaming, as it goes out first.
+    //
+    fn pass_chunks(&self) -> Vec<PassChunk> {
+        let mut chunks = Vec::new();
+        for pass in 0 .. interlace::PASSES.len() {
+            if let Some(header) = interlace::pass_header(&self.header, pass) {
+                let ramp = self.options.streaming && chunks.is_empty();
+                for rows in self.chunk_starts(&header, ramp).windows(2) {
+                    chunks.push(PassChunk {
+                        header,
+                        pass,
+                        start_row: rows[0],
+                        end_row: rows[1],
+                    });
+                }
             }
         }
+        chunks
+    }
+
+    //
+    // How input rows get converted to PNG byte order, if they need it.
+    //
+    fn conversion(&self) -> Option<Conversion> {
+        match self.options.color_reduction {
+            Some(reduction) if reduction.is_reduced() => Some(Conversion::Reduce(reduction.clone())),
+            _ if self.options.input_format.needs_conversion() => Some(Conversion::Format(self.options.input_format)),
+            _ => None,
+        }
+    }
+
+    fn row_bytes(&self) -> usize {
+        PixelChunk::row_bytes(&self.header, &self.conversion())
+    }
+
+    fn input_stride(&self) -> usize {
+        match self.options.input_format.stride {
+            0 => self.row_bytes(),
+            stride => stride,
+        }
+    }
+
+    fn input_chunks(&self) -> usize {
+        self.chunk_starts.len() - 1
     }
 
     fn start_row(&self, index: usize) -> usize {
-        index * self.header.height() as usize / self.chunks_total
+        self.chunk_starts[index]
     }
 
     fn end_row(&self, index: usize) -> usize {
@@ -684,6 +1741,27 @@ impl<'a, W: Write> Encoder<'a, W> {
         }
     }
 
+    fn filter_trials(&self) -> Option<Trials> {
+        match self.options.filter_mode {
+            Adaptive if self.options.filter_trials => Some(Trials {
+                compression_level: self.options.compression_level,
+                strategy: self.compression_strategy(),
+                backend: self.compression_backend(),
+            }),
+            _ => None,
+        }
+    }
+
+    fn compression_backend(&self) -> Backend {
+        match self.options.backend_mode {
+            Fixed(b) => b,
+            Adaptive => match self.options.compression_level {
+                CompressionLevel::Fastest => Backend::Rle,
+                _                         => Backend::Zlib,
+            },
+        }
+    }
+
     fn compression_strategy(&self) -> Strategy {
         match self.options.strategy_mode {
             Fixed(s) => s,
@@ -694,14 +1772,19 @@ impl<'a, W: Write> Encoder<'a, W> {
         }
     }
 
+    fn cache_settings(&self) -> cache::Settings {
+        cache::Settings {
+            compression_level: self.options.compression_level,
+            strategy: self.compression_strategy(),
+            backend: self.compression_backend(),
+        }
+    }
+
     fn dispatch(&mut self, mode: DispatchMode) -> IoResult {
         // See if anything interesting happened on the threads.
         let mut blocking_mode = mode;
-        while self.filter_chunks.in_flight() || self.deflate_chunks.in_flight() {
+        while self.deflate_chunks.in_flight() {
             match self.receive(blocking_mode) {
-                Some(ThreadMessage::FilterDone(filter)) => {
-                    self.filter_chunks.land(filter.index, filter);
-                }
                 Some(ThreadMessage::DeflateDone(deflate)) => {
                     self.deflate_chunks.land(deflate.index, deflate);
                 },
@@ -718,43 +1801,50 @@ impl<'a, W: Write> Encoder<'a, W> {
             blocking_mode = DispatchMode::NonBlocking;
         }
 
-        // If we have more deflate work to do, dispatch them!
-        while self.running_jobs() < self.max_threads() {
-            match self.filter_chunks.pop_front() {
-                Some((previous, current)) => {
-                    // Prepare to dispatch the deflate job:
-                    let level = self.options.compression_level;
-                    let strategy = self.compression_strategy();
-                    self.deflate_chunks.advance();
-                    self.dispatch_func(move |tx| {
-                        let mut deflate = DeflateChunk::new(level, strategy, previous.clone(), current.clone());
-                        tx.send(match deflate.run() {
-                            Ok(()) => ThreadMessage::DeflateDone(Arc::new(deflate)),
-                            Err(e) => ThreadMessage::Error(e),
-                        }).ok();
-                    });
-                },
-                None => {
-                    break;
-                }
-            }
-        }
-
         // If we have more filter work to do, dispatch them!
+        // The workers start the deflate jobs themselves as filtered
+        // chunks become available.
         while self.running_jobs() < self.max_threads() {
             match self.pixel_chunks.pop_front() {
                 Some((previous, current)) => {
+                    // Hold on to only the last row for the next job.
+                    let last_row = current.last_row(self.options.buffer_pool);
+                    self.pixel_chunks.set_prev(Some(last_row));
+
                     // Prepare to dispatch the filter job:
-                    self.filter_chunks.advance();
+                    self.deflate_chunks.advance();
                     let filter_mode = self.filter_mode();
+                    let filter_heuristic = self.options.filter_heuristic;
+                    let trials = self.filter_trials();
+                    let pool = self.options.buffer_pool.cloned();
+                    let handoff = self.handoff(current.index);
+                    let notify = Arc::clone(&self.notify);
+                    let queued = self.queued_at.pop_front().unwrap_or_else(Instant::now);
+                    let trace = self.trace.lock().unwrap().clone();
                     self.dispatch_func(move |tx| {
-                        let mut filter = FilterChunk::new(previous.clone(),
-                                                          current.clone(),
-                                                          filter_mode);
-                        tx.send(match filter.run() {
-                            Ok(()) => ThreadMessage::FilterDone(Arc::new(filter)),
-                            Err(e) => ThreadMessage::Error(e),
-                        }).ok();
+                        let start = Instant::now();
+                        let result = FilterChunk::new(previous.clone(),
+                                                      current.clone(),
+                                                      filter_mode,
+                                                      filter_heuristic,
+                                                      trials,
+                                                      pool.as_ref());
+                        match result.and_then(|mut filter| filter.run().map(|()| filter)) {
+                            Ok(mut filter) => {
+                                if handoff.caching() {
+                                    filter.hash = cache::hash(&filter.data);
+                                }
+                                filter.stats.queue_wait = start.saturating_duration_since(queued);
+                                filter.stats.filter_time = stats::trace(&trace, Stage::Filter, filter.index, start);
+                                filter.filtered_at = Some(Instant::now());
+                                for index in handoff.land(filter) {
+                                    spawn_deflate(&handoff, index, tx, &notify);
+                                }
+                            },
+                            Err(e) => {
+                                tx.send(ThreadMessage::Error(e)).ok();
+                            }
+                        }
                     });
                 },
                 None => {
@@ -768,35 +1858,108 @@ impl<'a, W: Write> Encoder<'a, W> {
             if self.chunks_output >= self.chunks_total {
                 panic!("Got extra output after end of file; should not happen.");
             }
+            let start = Instant::now();
+
+            // Nothing needs the previous output chunk.
+            self.deflate_chunks.set_prev(None);
+            if let Some(memory) = self.chunk_memory.pop_front() {
+                self.memory_in_flight -= memory;
+            }
+
+            // Each frame of an animation is a separate deflate stream,
+            // with its frame control before it.
+            if current.is_start {
+                self.adler32 = deflate::adler32_initial();
+                if let Some(frame) = self.frame_controls.pop_front().and_then(|frame| frame) {
+                    self.writer.write_frame_control(self.sequence, &frame)?;
+                    self.sequence += 1;
+                }
+            }
 
             // Combine the checksums!
+            // In raw deflate mode we have to calculate these ourselves;
+            // each filter job summed its own output, and the total goes
+            // after the last chunk.
             self.adler32 = deflate::adler32_combine(self.adler32,
                                                     current.adler32,
-                                                    current.input.data.len());
+                                                    current.input_len);
 
-            // if not streaming, append to an in-memory buffer
-            // and output a giant tag later.
-            if self.options.streaming {
-                self.writer.write_chunk(b"IDAT", &current.data)?;
+            // Frames after the first go in fdAT chunks, one per
+            // compressed chunk as in streaming mode.
+            //
+            // if not streaming, write a single giant tag, either
+            // directly if we can go back and fill in its length,
+            // or by appending to an in-memory buffer to output later.
+            if self.frames_output > 0 {
+                let mut trailer = Vec::<u8>::new();
+                if current.is_end {
+                    write_be32(&mut trailer, self.adler32)?;
+                }
+                self.writer.write_frame_data_with_crc(self.sequence, &current.data, current.crc32, &trailer)?;
+                self.sequence += 1;
+            } else if self.options.streaming {
+                self.writer.write_shared_chunk(b"IDAT", &[], &current.data, current.crc32, &[])?;
 
                 if current.is_end {
                     let mut chunk = Vec::<u8>::new();
-                    if !current.is_start {
-                        write_be32(&mut chunk, self.adler32)?;
-                    }
+                    write_be32(&mut chunk, self.adler32)?;
                     self.writer.write_chunk(b"IDAT", &chunk)?;
                 }
+            } else if let Some(patch) = self.seek_patch {
+                if current.is_start {
+                    self.writer.start_chunk(b"IDAT")?;
+                }
+                self.writer.write_chunk_data_with_crc(&current.data, current.crc32)?;
+
+                if current.is_end {
+                    let mut chunk = Vec::<u8>::new();
+                    write_be32(&mut chunk, self.adler32)?;
+                    self.writer.write_chunk_data(&chunk)?;
+                    self.writer.end_chunk(patch)?;
+                }
             } else {
                 self.idat_buffer.write_all(&current.data)?;
+                self.idat_crc32 = deflate::crc32_combine(self.idat_crc32,
+                                                         current.crc32,
+                                                         current.data.len());
 
                 if current.is_end {
-                    if !current.is_start {
-                        write_be32(&mut self.idat_buffer, self.adler32)?;
-                    }
-                    self.writer.write_chunk(b"IDAT", &self.idat_buffer)?;
+                    let mut chunk = Vec::<u8>::new();
+                    write_be32(&mut chunk, self.adler32)?;
+                    self.idat_buffer.write_all(&chunk)?;
+                    self.idat_crc32 = deflate::crc32(self.idat_crc32, &chunk);
+                    let idat = Arc::new(mem::take(&mut self.idat_buffer));
+                    self.writer.write_shared_chunk(b"IDAT", &[], &idat, self.idat_crc32, &[])?;
+                }
+            }
+
+            if self.cached_chunks.is_some() {
+                if current.reused {
+                    self.cache_reused += 1;
                 }
+                self.cache_chunks.push(Some(CachedChunk {
+                    is_start: current.is_start,
+                    is_end: current.is_end,
+                    hash: current.hash,
+                    prior_hash: current.prior_hash,
+                    data: Arc::clone(&current.data),
+                    crc32: current.crc32,
+                }));
             }
 
+            let mut chunk_stats = current.stats;
+            if let Some(deflated_at) = current.deflated_at {
+                chunk_stats.output_wait = start.saturating_duration_since(deflated_at);
+            }
+            let trace = self.trace.lock().unwrap().clone();
+            chunk_stats.write_time = stats::trace(&trace, Stage::Write, current.index, start);
+            if let Some(stats) = self.options.stats {
+                stats.add_chunk(chunk_stats);
+            }
+
+            if current.is_end {
+                self.frames_output += 1;
+            }
             self.chunks_output += 1;
         }
 
@@ -811,29 +1974,140 @@ impl<'a, W: Write> Encoder<'a, W> {
         if self.wrote_header {
             return Err(invalid_input("Cannot write header a second time."));
         }
+        match self.options.color_reduction {
+            Some(reduction) => reduction.validate(header, &self.options.input_format)?,
+            None => self.options.input_format.validate(header)?,
+        }
 
         self.header = *header;
+        self.image_header = *header;
+        if let Some(stats) = self.options.stats {
+            stats.start(self.threads());
+        }
+        self.cached_chunks = self.options.chunk_cache.map(|cache| cache.chunks(self.cache_settings()));
+        self.start_frame();
 
-        let stride = self.header.stride() + 1;
-        let height = self.header.height as usize;
+        self.wrote_header = true;
 
-        let chunks = stride * height / self.options.chunk_size;
-        self.chunks_total = if chunks < 1 {
-            1
-        } else {
-            chunks
+        self.writer.write_signature()?;
+        self.writer.write_header(self.header)
+    }
+
+    //
+    // Lay out the chunks of the image, or of the next frame of an
+    // animation, which continue on from the previous frame's.
+    //
+    fn start_frame(&mut self) {
+        self.chunk_base = self.chunks_total;
+        self.pixel_index = 0;
+        self.current_row = 0;
+        self.started_frame = false;
+
+        let chunks = match self.header.interlace_method {
+            InterlaceMethod::Standard => {
+                self.chunk_starts = self.chunk_starts(&self.header, self.options.streaming);
+                self.input_chunks()
+            },
+            InterlaceMethod::Adam7 => {
+                self.chunk_starts = vec![0, self.header.height as usize];
+                self.pass_chunks = self.pass_chunks();
+                self.pass_chunks.len()
+            },
         };
+        self.chunks_total += chunks;
+
+        self.handoffs.push_back(Arc::new(Handoff::new(self.chunk_base,
+                                                      chunks,
+                                                      self.options.compression_level,
+                                                      self.compression_strategy(),
+                                                      self.compression_backend(),
+                                                      self.options.buffer_pool.cloned(),
+                                                      self.cached_chunks.clone(),
+                                                      Arc::clone(&self.trace))));
 
-        self.pixel_chunks.advance();
         self.pixel_accumulator = Arc::new(PixelChunk::new(self.header,
-                                                          0, // index
+                                                          self.conversion(),
+                                                          self.chunk_base,
                                                           self.start_row(0),
-                                                          self.end_row(0)));
+                                                          self.end_row(0),
+                                                          self.options.buffer_pool));
+    }
 
-        self.wrote_header = true;
+    //
+    // Get the handoff for a chunk's frame. Chunks are dispatched
+    // in order, so any earlier frames are done with.
+    //
+    fn handoff(&mut self, index: usize) -> Arc<Handoff> {
+        while !self.handoffs[0].contains(index) {
+            self.handoffs.pop_front();
+        }
+        Arc::clone(&self.handoffs[0])
+    }
 
-        self.writer.write_signature()?;
-        self.writer.write_header(self.header)
+    /// Write an APNG animation control chunk, making the file an
+    /// animation of the given number of frames, played num_plays
+    /// times or forever if 0.
+    ///
+    /// Must come after the header and before any image data. Each
+    /// frame is then started with write_frame_control() and its rows
+    /// written as for a still image. If the first image's data is
+    /// written without a frame control first, it is shown by decoders
+    /// without APNG support but isn't part of the animation.
+    pub fn write_animation_control(&mut self, num_frames: u32, num_plays: u32) -> IoResult {
+        if !self.wrote_header {
+            return Err(invalid_input("Cannot write animation control before header."));
+        }
+        if self.num_frames > 0 {
+            return Err(invalid_input("Cannot write animation control a second time."));
+        }
+        if self.started_image {
+            return Err(invalid_input("Cannot write animation control after image data."));
+        }
+        if num_frames == 0 {
+            return Err(invalid_input("Animation must have at least one frame."));
+        }
+
+        self.num_frames = num_frames;
+        self.writer.write_animation_control(num_frames, num_plays)
+    }
+
+    /// Start the next frame of an animation, which must fit in the
+    /// image. Its rows follow, sized to match the frame.
+    ///
+    /// Previous frames may still be compressing in the background;
+    /// their output is written in order as it's ready.
+    pub fn write_frame_control(&mut self, frame: &FrameControl) -> IoResult {
+        if self.num_frames == 0 {
+            return Err(invalid_input("Cannot write frame control before animation control."));
+        }
+        if self.frames_input >= self.num_frames {
+            return Err(invalid_input("Cannot write more frames than in animation control."));
+        }
+        if self.next_frame_control.is_some() {
+            return Err(invalid_input("Cannot write frame control twice for one frame."));
+        }
+        let right = frame.x_offset as u64 + frame.width as u64;
+        let bottom = frame.y_offset as u64 + frame.height as u64;
+        if right > self.image_header.width as u64 || bottom > self.image_header.height as u64 {
+            return Err(invalid_input("Frame must fit within the image."));
+        }
+
+        if self.started_image {
+            if self.current_row < self.header.height {
+                return Err(invalid_input("Cannot start a frame before the last one is complete."));
+            }
+            self.header.width = frame.width;
+            self.header.height = frame.height;
+            self.start_frame();
+        } else if frame.width != self.image_header.width ||
+                  frame.height != self.image_header.height ||
+                  frame.x_offset != 0 || frame.y_offset != 0 {
+            return Err(invalid_input("First frame must cover the whole image."));
+        }
+
+        self.frames_input += 1;
+        self.next_frame_control = Some(*frame);
+        Ok(())
     }
 
     /// Write an indexed-color palette as a PLTE chunk.
@@ -924,17 +2198,15 @@ impl<'a, W: Write> Encoder<'a, W> {
     }
 
     //
-    // Copy a row's pixel data into buffers for async compression.
-    // Returns immediately after copying.
+    // Validate state before accepting any image data.
     //
-    fn process_row(&mut self, row: &[u8]) -> io::Result<RowStatus>
-    {
-        if self.pixel_index >= self.chunks_total {
-            return Err(other("invalid internal state"));
-        }
+    fn start_image(&mut self) -> IoResult {
         if !self.wrote_header {
             return Err(invalid_input("Cannot write image data before header."));
         }
+        if self.pixel_index >= self.input_chunks() {
+            return Err(other("invalid internal state"));
+        }
         if let ColorType::IndexedColor = self.header.color_type {
             if !self.wrote_palette {
                 return Err(invalid_input("Cannot write indexed-color image data before palette."));
@@ -943,58 +2215,278 @@ impl<'a, W: Write> Encoder<'a, W> {
         if !self.started_image {
             self.started_image = true;
         }
+        if !self.started_frame {
+            self.started_frame = true;
+            self.frame_controls.push_back(self.next_frame_control.take());
+        }
+        Ok(())
+    }
 
-        Arc::get_mut(&mut self.pixel_accumulator).unwrap().read_row(row);
-
-        if self.pixel_accumulator.is_full() {
-            // Move the item off to the completed stack...
-            self.pixel_chunks.land(self.pixel_index, self.pixel_accumulator.clone());
-
-            // Make a nice new buffer to accumulate data into.
-            self.pixel_index += 1;
-            if self.pixel_index < self.chunks_total {
-                self.pixel_chunks.advance();
-                self.pixel_accumulator = Arc::new(PixelChunk::new(self.header,
-                                                                  self.pixel_index,
-                                                                  self.start_row(self.pixel_index),
-                                                                  self.end_row(self.pixel_index)));
+    //
+    // Move the current pixel accumulator off to the completed stack,
+    // and dispatch any available async tasks and output.
+    //
+    // In blocking mode, waits for the threads to have room for more
+    // work first; else the caller should check has_room() before
+    // starting another chunk.
+    //
+    fn land_pixel_chunk(&mut self, mode: DispatchMode) -> IoResult {
+        let image = Arc::clone(&self.pixel_accumulator);
+        if self.pass_chunks.is_empty() {
+            self.queue_pixel_chunk(image);
+        } else {
+            // The whole interlaced image is in; each pass's chunks
+            // get their pixels from it on the worker threads.
+            for index in 0 .. self.pass_chunks.len() {
+                let chunk = self.pass_chunks[index];
+                self.queue_pixel_chunk(Arc::new(PixelChunk::from_pass(chunk.header,
+                                                                      self.chunk_base + index,
+                                                                      chunk.start_row,
+                                                                      chunk.end_row,
+                                                                      Arc::clone(&image),
+                                                                      chunk.pass,
+                                                                      index == 0,
+                                                                      index == self.pass_chunks.len() - 1)));
             }
+        }
+        self.pixel_index += 1;
 
-            // Dispatch any available async tasks and output.
-            while self.running_jobs() >= self.max_threads() {
-                self.dispatch(DispatchMode::Blocking)?;
+        if let DispatchMode::Blocking = mode {
+            if !self.has_room() {
+                let start = Instant::now();
+                while !self.has_room() {
+                    self.dispatch(DispatchMode::Blocking)?;
+                }
+                self.blocked(start);
             }
-            self.dispatch(DispatchMode::NonBlocking)?;
         }
+        self.dispatch(DispatchMode::NonBlocking)
+    }
 
-        self.current_row += 1;
-        if self.current_row == self.header.height {
-            Ok(RowStatus::Done)
-        } else {
-            Ok(RowStatus::Continue)
+    //
+    // Account for time spent waiting on the threads since start.
+    //
+    fn blocked(&self, start: Instant) {
+        let trace = self.trace.lock().unwrap().clone();
+        let duration = stats::trace(&trace, Stage::Wait, self.chunks_input, start);
+        if let Some(stats) = self.options.stats {
+            stats.add_blocked(duration);
+        }
+    }
+
+    fn queue_pixel_chunk(&mut self, chunk: Arc<PixelChunk>) {
+        let rows = chunk.end_row - chunk.start_row;
+        let memory = chunk_memory(&chunk.header, rows);
+        self.memory_in_flight += memory;
+        self.chunk_memory.push_back(memory);
+        self.queued_at.push_back(Instant::now());
+
+        self.pixel_chunks.advance();
+        self.pixel_chunks.land(chunk.index, chunk);
+        self.chunks_input += 1;
+    }
+
+    fn has_room(&self) -> bool {
+        self.running_jobs() < self.max_threads() && self.has_memory()
+    }
+
+    //
+    // Check whether the next input chunk fits in the memory limit
+    // alongside those in flight. There's always room for one chunk.
+    //
+    fn has_memory(&self) -> bool {
+        match self.options.memory_limit {
+            Some(limit) if self.memory_in_flight > 0 && self.pixel_index < self.input_chunks() => {
+                let rows = self.end_row(self.pixel_index) - self.start_row(self.pixel_index);
+                self.memory_in_flight + chunk_memory(&self.header, rows) <= limit
+            },
+            _ => true,
+        }
+    }
+
+    //
+    // Copy a row's pixel data into buffers for async compression.
+    // Returns immediately after copying.
+    //
+    fn process_row(&mut self, row: &[u8], mode: DispatchMode) -> io::Result<RowStatus>
+    {
+        self.start_image()?;
+
+        Arc::get_mut(&mut self.pixel_accumulator).unwrap().read_row(row);
+
+        if self.pixel_accumulator.is_full() {
+            self.land_pixel_chunk(mode)?;
+
+            // Make a nice new buffer to accumulate data into.
+            if self.pixel_index < self.input_chunks() {
+                self.pixel_accumulator = Arc::new(PixelChunk::new(self.header,
+                                                                  self.conversion(),
+                                                                  self.chunk_base + self.pixel_index,
+                                                                  self.start_row(self.pixel_index),
+                                                                  self.end_row(self.pixel_index),
+                                                                  self.options.buffer_pool));
+            }
+        }
+
+        self.current_row += 1;
+        if self.current_row == self.header.height {
+            Ok(RowStatus::Done)
+        } else {
+            Ok(RowStatus::Continue)
         }
     }
 
     /// Encode and compress the given image data and write to output.
     /// Input data must be packed in the correct format for the given
-    /// color type and depth, with no padding at the end of rows.
+    /// color type and depth, or as set up in the Options, with rows
+    /// one input stride apart; by default there's no padding at the
+    /// end of rows.
     ///
     /// An integral number of rows must be provided at once.
     ///
     /// If not all of the image rows are provided, multiple calls are
     /// required to finish out the data.
     pub fn write_image_rows(&mut self, buf: &[u8]) -> IoResult {
-        let stride = self.header.stride();
+        let stride = self.input_stride();
+        let row_bytes = self.row_bytes();
         if buf.len() % stride != 0 {
             Err(invalid_input("Buffer must be an integral number of rows"))
         } else {
             for row in buf.chunks(stride) {
-                self.process_row(row)?;
+                self.process_row(&row[.. row_bytes], DispatchMode::Blocking)?;
             }
             Ok(())
         }
     }
 
+    /// Like write_image_rows(), but never blocks waiting on the threads.
+    ///
+    /// Returns the number of bytes taken, always a whole number of rows,
+    /// which may be fewer than given. If no rows can be taken until some
+    /// jobs finish, returns an error of kind WouldBlock; try again after
+    /// the set_notify() callback is called.
+    ///
+    /// Output may still block, if the Write sink does.
+    pub fn try_write_image_rows(&mut self, buf: &[u8]) -> io::Result<usize> {
+        let stride = self.input_stride();
+        let row_bytes = self.row_bytes();
+        if buf.len() % stride != 0 {
+            return Err(invalid_input("Buffer must be an integral number of rows"));
+        }
+
+        self.poll()?;
+
+        let mut written = 0;
+        for row in buf.chunks(stride) {
+            // Only hold back at the start of a chunk;
+            // a chunk that's begun can always be filled.
+            let chunk_start = self.start_row(self.pixel_index) as u32;
+            if self.current_row == chunk_start && !self.has_room() {
+                break;
+            }
+            self.process_row(&row[.. row_bytes], DispatchMode::NonBlocking)?;
+            written += stride;
+        }
+
+        if written == 0 && !buf.is_empty() {
+            Err(io::Error::new(io::ErrorKind::WouldBlock, "Encoder threads are busy"))
+        } else {
+            Ok(written)
+        }
+    }
+
+    /// Encode and compress a whole image held in a shared buffer,
+    /// without copying the rows.
+    ///
+    /// Rows start every frame_stride bytes, which must be at least
+    /// the packed row length; any padding at the end of rows is
+    /// ignored, as is the Options input stride. The buffer is held
+    /// by the filter jobs and released as they complete.
+    ///
+    /// Must be called instead of write_image_rows(), not in addition.
+    pub fn write_image_frame<B>(&mut self, frame: Arc<B>, frame_stride: usize) -> IoResult
+        where B: AsRef<[u8]> + Send + Sync + 'static
+    {
+        self.write_frame_buffer(frame, frame_stride)
+    }
+
+    //
+    // Check that a frame could be written now, without starting the image.
+    //
+    pub(crate) fn check_frame(&self, frame: &FrameBuffer, frame_stride: usize) -> IoResult {
+        if !self.wrote_header {
+            return Err(invalid_input("Cannot write image data before header."));
+        }
+        if let ColorType::IndexedColor = self.header.color_type {
+            if !self.wrote_palette {
+                return Err(invalid_input("Cannot write indexed-color image data before palette."));
+            }
+        }
+        if self.current_row != 0 || self.pixel_index != 0 {
+            return Err(invalid_input("Cannot write an image frame after image rows."));
+        }
+
+        let stride = self.row_bytes();
+        if frame_stride < stride {
+            return Err(invalid_input("Frame stride must be at least the row length"));
+        }
+        let height = self.header.height as usize;
+        let len = frame_stride.checked_mul(height - 1)
+                              .and_then(|len| len.checked_add(stride))
+                              .ok_or_else(|| invalid_input("Frame size overflows"))?;
+        if (**frame).as_ref().len() < len {
+            return Err(invalid_input("Frame buffer is too small for the image"));
+        }
+        Ok(())
+    }
+
+    pub(crate) fn write_frame_buffer(&mut self, frame: FrameBuffer, frame_stride: usize) -> IoResult {
+        self.check_frame(&frame, frame_stride)?;
+        self.start_image()?;
+
+        while self.pixel_index < self.input_chunks() {
+            self.land_frame_chunk(&frame, frame_stride, DispatchMode::Blocking)?;
+        }
+
+        self.current_row = self.header.height;
+        Ok(())
+    }
+
+    //
+    // Like write_frame_buffer(), but only starts chunks while the
+    // threads have room, never blocking on them. Returns whether the
+    // whole frame is in; if not, call again with the same frame once
+    // some jobs have finished.
+    //
+    pub(crate) fn try_write_frame_buffer(&mut self, frame: &FrameBuffer, frame_stride: usize) -> io::Result<bool> {
+        if self.pixel_index == 0 {
+            self.check_frame(frame, frame_stride)?;
+            self.start_image()?;
+        }
+
+        while self.pixel_index < self.input_chunks() && self.has_room() {
+            self.land_frame_chunk(frame, frame_stride, DispatchMode::NonBlocking)?;
+        }
+
+        if self.pixel_index < self.input_chunks() {
+            Ok(false)
+        } else {
+            self.current_row = self.header.height;
+            Ok(true)
+        }
+    }
+
+    fn land_frame_chunk(&mut self, frame: &FrameBuffer, frame_stride: usize, mode: DispatchMode) -> IoResult {
+        self.pixel_accumulator = Arc::new(PixelChunk::from_frame(self.header,
+                                                                 self.conversion(),
+                                                                 self.chunk_base + self.pixel_index,
+                                                                 self.start_row(self.pixel_index),
+                                                                 self.end_row(self.pixel_index),
+                                                                 Arc::clone(frame),
+                                                                 frame_stride));
+        self.land_pixel_chunk(mode)
+    }
+
     /// Return completion progress as a fraction of 1.0
     ///
     /// Currently progress is measured in chunks, so small files may
@@ -1006,29 +2498,180 @@ impl<'a, W: Write> Encoder<'a, W> {
     /// Return finished-ness state.
     /// Is it finished? Yeah or no.
     pub fn is_finished(&self) -> bool {
-        self.chunks_output == self.chunks_total
+        self.chunks_output == self.chunks_total && self.frames_input == self.num_frames
+    }
+
+    /// Set a callback to be called on a worker thread each time a job
+    /// finishes, after which poll() or try_write_image_rows() may be
+    /// able to make progress.
+    ///
+    /// The callback should be quick, such as waking an event loop.
+    /// Replaces any previous callback.
+    pub fn set_notify<F>(&mut self, func: F)
+        where F: Fn() + Send + Sync + 'static
+    {
+        *self.notify.lock().unwrap() = Some(Arc::new(func));
+    }
+
+    /// Set a callback to be called with the time each stage took, as
+    /// each chunk finishes filtering and compressing on the worker
+    /// threads and being written on this one, and whenever this thread
+    /// waits on the workers. Useful for emitting tracing spans.
+    ///
+    /// Must be set before image data is written to see every chunk;
+    /// setting it after write_header() is fine. Replaces any previous
+    /// callback.
+    pub fn set_trace_func<F>(&mut self, func: F)
+        where F: Fn(&stats::Span) + Send + Sync + 'static
+    {
+        *self.trace.lock().unwrap() = Some(Arc::new(func));
+    }
+
+    /// Hand all output to the given function as buffers, in order,
+    /// instead of writing it to the Write sink, which gets nothing.
+    ///
+    /// Compressed chunks go over as they came from the worker threads,
+    /// without being copied, in streaming mode or for animation frames
+    /// after the first; otherwise the image data goes over as one
+    /// buffer at the end. The bytes in between come in small buffers
+    /// of their own. Once handed over a buffer is the function's to
+    /// keep; Arc::try_unwrap() gets the Vec back unless a chunk cache
+    /// holds it too.
+    ///
+    /// Must be set before writing the header. Output isn't seeked
+    /// back over with this set, even from new_seekable().
+    pub fn set_buffer_func<F>(&mut self, func: F) -> IoResult
+        where F: FnMut(Arc<Vec<u8>>) -> IoResult + Send + 'static
+    {
+        if self.wrote_header {
+            return Err(invalid_input("Cannot set a buffer function after the header."));
+        }
+        self.writer.set_buffer_func(Box::new(func));
+        self.seek_patch = None;
+        Ok(())
+    }
+
+    /// Land any finished jobs, start more, and write out whatever
+    /// output is ready, without waiting on the threads.
+    pub fn poll(&mut self) -> IoResult {
+        self.dispatch(DispatchMode::NonBlocking)
+    }
+
+    /// Check whether all input so far has been written out, so that
+    /// flush() or finish() won't block on the threads.
+    pub fn is_flushed(&self) -> bool {
+        self.chunks_output >= self.chunks_input
     }
 
     /// Flush all currently in-progress data to output
     /// Warning: this may block.
     pub fn flush(&mut self) -> IoResult {
-        while self.chunks_output < self.pixel_index {
-            // Dispatch any available async tasks and output.
-            self.dispatch(DispatchMode::Blocking)?;
+        if !self.is_flushed() {
+            let start = Instant::now();
+            while !self.is_flushed() {
+                // Dispatch any available async tasks and output.
+                self.dispatch(DispatchMode::Blocking)?;
+            }
+            self.blocked(start);
         }
         Ok(())
     }
 }
 
+impl<'a, W: Write + Unpin> Encoder<'a, W> {
+    /// Like finish(), but returns a Future instead of blocking while
+    /// the threads finish their work.
+    ///
+    /// Takes over the set_notify() callback to wake the task.
+    pub fn finish_async(mut self) -> Finish<'a, W> {
+        let waker = Arc::new(Mutex::new(None::<Waker>));
+        let notify_waker = Arc::clone(&waker);
+        self.set_notify(move || {
+            if let Some(waker) = notify_waker.lock().unwrap().take() {
+                waker.wake();
+            }
+        });
+        Finish {
+            encoder: Some(self),
+            waker,
+        }
+    }
+}
+
+/// Future returned by Encoder::finish_async(), resolving to the
+/// Write sink once all output has been written.
+pub struct Finish<'a, W: Write> {
+    encoder: Option<Encoder<'a, W>>,
+    waker: Arc<Mutex<Option<Waker>>>,
+}
+
+impl<'a, W: Write + Unpin> Future for Finish<'a, W> {
+    type Output = io::Result<W>;
+
+    fn poll(self: Pin<&mut Self>, cx: &mut Context) -> Poll<Self::Output> {
+        let this = self.get_mut();
+
+        // Register before checking, so a job finishing in between
+        // still wakes us.
+        *this.waker.lock().unwrap() = Some(cx.waker().clone());
+
+        let flushed = match this.encoder {
+            Some(ref mut encoder) => {
+                if let Err(e) = encoder.poll() {
+                    return Poll::Ready(Err(e));
+                }
+                encoder.is_flushed()
+            },
+            None => return Poll::Ready(Err(other("Future polled after completion"))),
+        };
+        if flushed {
+            Poll::Ready(this.encoder.take().unwrap().finish())
+        } else {
+            Poll::Pending
+        }
+    }
+}
+
+impl<'a, W: Write + Seek> Encoder<'a, W> {
+    /// Creates a new Encoder instance with the given seekable output sink
+    /// and options.
+    ///
+    /// When not in streaming mode, compressed image data is written out
+    /// as soon as it's ready instead of being buffered in memory until the
+    /// end, then the sink is seeked back to fill in the IDAT chunk length.
+    pub fn new_seekable(write: W, options: &Options<'a>) -> Encoder<'a, W> {
+        let mut encoder = Encoder::new(write, options);
+        encoder.seek_patch = Some(seek_patch::<W>);
+        encoder
+    }
+}
+
 #[cfg(test)]
 mod tests {
     use super::super::Header;
     use super::super::ColorType;
+    use super::BufferPool;
+    use super::ChannelOrder;
+    use super::ChunkCache;
+    use super::ColorReduction;
+    use super::CompressionLevel;
+    use super::FrameControl;
+    use super::InterlaceMethod;
     use super::Encoder;
     use super::Options;
     use super::IoResult;
 
+    use rayon::ThreadPoolBuilder;
+
+    use std::cmp;
+    use std::future::Future;
     use std::io;
+    use std::io::Cursor;
+    use std::pin::Pin;
+    use std::sync::{Arc, Mutex};
+    use std::sync::mpsc;
+    use std::task::{Context, Poll, Wake, Waker};
+    use std::thread;
 
     fn test_encoder<F>(width: u32, height: u32, func: F)
         where F: Fn(&mut Encoder<Vec<u8>>, &[u8]) -> IoResult
@@ -1092,4 +2735,737 @@ mod tests {
             Ok(())
         });
     }
+
+    #[test]
+    fn test_buffer_pool() {
+        let width = 1920usize;
+        let height = 1080usize;
+        let data = vec![128u8; width * 3];
+
+        let mut header = Header::new();
+        header.set_size(width as u32, height as u32).unwrap();
+        header.set_color(ColorType::Truecolor, 8).unwrap();
+
+        let pool = BufferPool::new();
+        let mut options = Options::new();
+        options.set_buffer_pool(&pool).unwrap();
+
+        let mut outputs = Vec::new();
+        for _i in 0 .. 2 {
+            let mut encoder = Encoder::new(Vec::<u8>::new(), &options);
+            encoder.write_header(&header).unwrap();
+            for _y in 0 .. height {
+                encoder.write_image_rows(&data).unwrap();
+            }
+            outputs.push(encoder.finish().unwrap());
+            assert!(pool.idle_bytes() > 0, "chunk buffers should land back in the pool");
+        }
+        assert!(outputs[0] == outputs[1], "pooled buffers should not change output");
+    }
+
+    #[test]
+    fn test_seekable() {
+        let width = 1920usize;
+        let height = 1080usize;
+        let mut data = vec![0u8; width * 3 * height];
+        for (i, byte) in data.iter_mut().enumerate() {
+            *byte = (i % 251) as u8;
+        }
+
+        let mut header = Header::new();
+        header.set_size(width as u32, height as u32).unwrap();
+        header.set_color(ColorType::Truecolor, 8).unwrap();
+        let options = Options::new();
+
+        let mut encoder = Encoder::new(Vec::<u8>::new(), &options);
+        encoder.write_header(&header).unwrap();
+        encoder.write_image_rows(&data).unwrap();
+        let expected = encoder.finish().unwrap();
+
+        let mut encoder = Encoder::new_seekable(Cursor::new(Vec::<u8>::new()), &options);
+        encoder.write_header(&header).unwrap();
+        encoder.write_image_rows(&data).unwrap();
+        let actual = encoder.finish().unwrap().into_inner();
+
+        assert!(actual == expected, "seekable output should match buffered output");
+    }
+
+    // Minimal executor, parking the thread until woken.
+    fn block_on<F: Future>(mut future: F) -> F::Output {
+        struct Unparker(thread::Thread);
+
+        impl Wake for Unparker {
+            fn wake(self: Arc<Self>) {
+                self.0.unpark();
+            }
+        }
+
+        let waker = Waker::from(Arc::new(Unparker(thread::current())));
+        let mut cx = Context::from_waker(&waker);
+        let mut future = unsafe { Pin::new_unchecked(&mut future) };
+        loop {
+            match future.as_mut().poll(&mut cx) {
+                Poll::Ready(output) => return output,
+                Poll::Pending => thread::park(),
+            }
+        }
+    }
+
+    #[test]
+    fn test_nonblocking() {
+        let width = 1920usize;
+        let height = 1080usize;
+        let mut data = vec![0u8; width * 3 * height];
+        for (i, byte) in data.iter_mut().enumerate() {
+            *byte = (i % 251) as u8;
+        }
+
+        let mut header = Header::new();
+        header.set_size(width as u32, height as u32).unwrap();
+        header.set_color(ColorType::Truecolor, 8).unwrap();
+        let mut options = Options::new();
+        options.set_chunk_size(65536).unwrap();
+
+        let mut encoder = Encoder::new(Vec::<u8>::new(), &options);
+        encoder.write_header(&header).unwrap();
+        encoder.write_image_rows(&data).unwrap();
+        let expected = encoder.finish().unwrap();
+
+        let (tx, rx) = mpsc::channel();
+        let tx = Mutex::new(tx);
+        let mut encoder = Encoder::new(Vec::<u8>::new(), &options);
+        encoder.set_notify(move || {
+            tx.lock().unwrap().send(()).ok();
+        });
+        encoder.write_header(&header).unwrap();
+
+        let mut remaining = &data[..];
+        let mut would_block = 0;
+        while !remaining.is_empty() {
+            match encoder.try_write_image_rows(remaining) {
+                Ok(n) => remaining = &remaining[n ..],
+                Err(ref e) if e.kind() == io::ErrorKind::WouldBlock => {
+                    would_block += 1;
+                    rx.recv().unwrap();
+                },
+                Err(e) => panic!("Error {}", e),
+            }
+        }
+        assert!(would_block > 0, "should have run out of threads at some point");
+
+        let actual = block_on(encoder.finish_async()).unwrap();
+        assert!(actual == expected, "non-blocking output should match blocking output");
+    }
+
+    #[test]
+    fn test_chunk_size() {
+        let pool = ThreadPoolBuilder::new().num_threads(4).build().unwrap();
+        let mut options = Options::new();
+        options.set_thread_pool(&pool).unwrap();
+
+        let chunks = |options: &Options, width: u32, height: u32| {
+            let mut header = Header::new();
+            header.set_size(width, height).unwrap();
+            header.set_color(ColorType::TruecolorAlpha, 8).unwrap();
+            let mut encoder = Encoder::new(Vec::<u8>::new(), options);
+            encoder.write_header(&header).unwrap();
+            encoder.chunks_total
+        };
+
+        // Thumbnails get split up at the smallest chunk size,
+        assert_eq!(chunks(&options, 200, 200), 4);
+
+        // big images at the largest,
+        assert_eq!(chunks(&options, 7680, 4320), 253);
+
+        // and the ones in between a few chunks per thread.
+        assert_eq!(chunks(&options, 1920, 1080), 16);
+
+        // Fixed sizes are as requested, but never less than a row.
+        options.set_chunk_size(256 * 1024).unwrap();
+        assert_eq!(chunks(&options, 200, 200), 1);
+        assert_eq!(chunks(&options, 100000, 2), 2);
+    }
+
+    #[test]
+    fn test_streaming_chunks() {
+        let pool = ThreadPoolBuilder::new().num_threads(4).build().unwrap();
+        let mut options = Options::new();
+        options.set_thread_pool(&pool).unwrap();
+        options.set_streaming(true).unwrap();
+
+        let mut header = Header::new();
+        header.set_size(1920, 1080).unwrap();
+        header.set_color(ColorType::TruecolorAlpha, 8).unwrap();
+        let mut encoder = Encoder::new(Vec::<u8>::new(), &options);
+        encoder.write_header(&header).unwrap();
+
+        // Ramping up from a couple of rows to full-size chunks.
+        assert_eq!(&encoder.chunk_starts[.. 6], &[0, 2, 6, 14, 31, 65]);
+        assert_eq!(encoder.chunks_total, 5 + 15);
+        assert_eq!(encoder.chunk_starts[encoder.chunks_total], 1080);
+    }
+
+    #[test]
+    fn test_filter_trials() {
+        let width = 1024usize;
+        let height = 512usize;
+
+        // Dithered two-color noise, which the default heuristic
+        // filters badly and the None filter handles well.
+        let mut seed = 12345u32;
+        let mut data = vec![0u8; width * 3 * height];
+        for byte in data.iter_mut() {
+            seed = seed.wrapping_mul(1103515245).wrapping_add(12345);
+            *byte = if seed & 0x10000 == 0 { 17 } else { 230 };
+        }
+
+        let mut header = Header::new();
+        header.set_size(width as u32, height as u32).unwrap();
+        header.set_color(ColorType::Truecolor, 8).unwrap();
+
+        let mut options = Options::new();
+        options.set_chunk_size(65536).unwrap();
+
+        let mut encoder = Encoder::new(Vec::<u8>::new(), &options);
+        encoder.write_header(&header).unwrap();
+        encoder.write_image_rows(&data).unwrap();
+        let heuristic = encoder.finish().unwrap();
+
+        options.set_filter_trials(true).unwrap();
+        let mut encoder = Encoder::new(Vec::<u8>::new(), &options);
+        encoder.write_header(&header).unwrap();
+        encoder.write_image_rows(&data).unwrap();
+        let trials = encoder.finish().unwrap();
+
+        assert!(trials.len() < heuristic.len(),
+                "trials should beat the heuristic: {} vs {}", trials.len(), heuristic.len());
+    }
+
+    #[test]
+    fn test_frame() {
+        let width = 1920usize;
+        let height = 1080usize;
+        let frame_stride = width * 3 + 16;
+
+        let mut frame = vec![0u8; frame_stride * height];
+        for y in 0 .. height {
+            for x in 0 .. width * 3 {
+                frame[y * frame_stride + x] = ((x + y) % 255) as u8;
+            }
+        }
+
+        let mut header = Header::new();
+        header.set_size(width as u32, height as u32).unwrap();
+        header.set_color(ColorType::Truecolor, 8).unwrap();
+        let options = Options::new();
+
+        let mut encoder = Encoder::new(Vec::<u8>::new(), &options);
+        encoder.write_header(&header).unwrap();
+        for row in frame.chunks(frame_stride) {
+            encoder.write_image_rows(&row[0 .. width * 3]).unwrap();
+        }
+        let expected = encoder.finish().unwrap();
+
+        let mut encoder = Encoder::new(Vec::<u8>::new(), &options);
+        encoder.write_header(&header).unwrap();
+        encoder.write_image_frame(Arc::new(frame), frame_stride).unwrap();
+        encoder.flush().unwrap();
+        assert_eq!(encoder.is_finished(), true);
+        let actual = encoder.finish().unwrap();
+
+        assert!(actual == expected, "frame output should match row output");
+    }
+
+    #[test]
+    fn test_interlaced() {
+        let width = 1000usize;
+        let height = 700usize;
+        let mut data = vec![0u8; width * 3 * height];
+        for (i, byte) in data.iter_mut().enumerate() {
+            *byte = (i % 251) as u8;
+        }
+
+        let mut header = Header::new();
+        header.set_size(width as u32, height as u32).unwrap();
+        header.set_color(ColorType::Truecolor, 8).unwrap();
+        header.set_interlace_method(InterlaceMethod::Adam7).unwrap();
+        let mut options = Options::new();
+        options.set_chunk_size(32768).unwrap();
+
+        let mut encoder = Encoder::new(Vec::<u8>::new(), &options);
+        encoder.write_header(&header).unwrap();
+        assert!(encoder.chunks_total > 7, "passes should be split into chunks");
+        for row in data.chunks(width * 3) {
+            encoder.write_image_rows(row).unwrap();
+        }
+        let expected = encoder.finish().unwrap();
+
+        // Interlace method in the IHDR chunk.
+        assert_eq!(expected[28], 1);
+
+        let mut encoder = Encoder::new(Vec::<u8>::new(), &options);
+        encoder.write_header(&header).unwrap();
+        encoder.write_image_frame(Arc::new(data), width * 3).unwrap();
+        let actual = encoder.finish().unwrap();
+
+        assert!(actual == expected, "frame output should match row output");
+    }
+
+    // Split a PNG file into its chunks' tags and data.
+    fn read_chunks(png: &[u8]) -> Vec<(Vec<u8>, Vec<u8>)> {
+        let mut chunks = Vec::new();
+        let mut pos = 8;
+        while pos < png.len() {
+            let len = u32::from_be_bytes([png[pos], png[pos + 1], png[pos + 2], png[pos + 3]]) as usize;
+            chunks.push((png[pos + 4 .. pos + 8].to_vec(), png[pos + 8 .. pos + 8 + len].to_vec()));
+            pos += len + 12;
+        }
+        chunks
+    }
+
+    fn inflate(data: &[u8], expected_len: usize) -> Vec<u8> {
+        use std::mem;
+        use std::os::raw::*;
+        use ::libz_sys::*;
+
+        let mut output = vec![0u8; expected_len + 1];
+        unsafe {
+            let mut stream = Box::new(mem::MaybeUninit::<z_stream>::zeroed());
+            let raw = stream.as_mut_ptr();
+            let ret = inflateInit2_(raw,
+                                    15,
+                                    zlibVersion(),
+                                    mem::size_of::<z_stream>() as c_int);
+            assert_eq!(ret, Z_OK);
+            (*raw).next_in = data.as_ptr() as *mut u8;
+            (*raw).avail_in = data.len() as c_uint;
+            (*raw).next_out = output.as_mut_ptr();
+            (*raw).avail_out = output.len() as c_uint;
+            let ret = inflate(raw, Z_FINISH);
+            assert_eq!(ret, Z_STREAM_END);
+            output.truncate((*raw).total_out as usize);
+            inflateEnd(raw);
+        }
+        output
+    }
+
+    #[test]
+    fn test_animation() {
+        let width = 300u32;
+        let height = 200u32;
+
+        let mut header = Header::new();
+        header.set_size(width, height).unwrap();
+        header.set_color(ColorType::Truecolor, 8).unwrap();
+        let mut options = Options::new();
+        options.set_chunk_size(32768).unwrap();
+
+        let mut frames = Vec::new();
+        for &(w, h, x, y) in [(300, 200, 0, 0), (100, 50, 10, 20), (300, 200, 0, 0)].iter() {
+            let mut frame = FrameControl::new();
+            frame.set_size(w, h).unwrap();
+            frame.set_offset(x, y).unwrap();
+            frame.set_delay(1, 10).unwrap();
+            frames.push(frame);
+        }
+
+        let mut encoder = Encoder::new(Vec::<u8>::new(), &options);
+        encoder.write_header(&header).unwrap();
+        encoder.write_animation_control(frames.len() as u32, 0).unwrap();
+        for (i, frame) in frames.iter().enumerate() {
+            encoder.write_frame_control(frame).unwrap();
+            let data = vec![i as u8 * 50; frame.width() as usize * 3];
+            for _y in 0 .. frame.height() {
+                encoder.write_image_rows(&data).unwrap();
+            }
+            assert_eq!(encoder.is_finished(), false);
+        }
+        encoder.flush().unwrap();
+        assert_eq!(encoder.is_finished(), true);
+        let png = encoder.finish().unwrap();
+
+        // Frame controls ahead of each frame's IDAT or fdAT data,
+        // numbered in sequence together.
+        let chunks = read_chunks(&png);
+        let mut sequence = 0;
+        let mut data = Vec::<Vec<u8>>::new();
+        for &(ref tag, ref body) in chunks.iter() {
+            match &tag[..] {
+                b"fcTL" | b"fdAT" => {
+                    assert_eq!(&body[0 .. 4], &(sequence as u32).to_be_bytes());
+                    sequence += 1;
+                },
+                _ => {},
+            }
+            match &tag[..] {
+                b"fcTL" => data.push(Vec::new()),
+                b"IDAT" => data.last_mut().unwrap().extend_from_slice(body),
+                b"fdAT" => data.last_mut().unwrap().extend_from_slice(&body[4 ..]),
+                _ => {},
+            }
+        }
+        assert!(&chunks[1].0[..] == b"acTL");
+        assert!(&chunks[2].0[..] == b"fcTL");
+        assert!(&chunks[3].0[..] == b"IDAT");
+        assert_eq!(data.len(), frames.len());
+
+        for (i, (frame, data)) in frames.iter().zip(data.iter()).enumerate() {
+            let stride = frame.width() as usize * 3 + 1;
+            let filtered = inflate(data, stride * frame.height() as usize);
+            assert_eq!(filtered.len(), stride * frame.height() as usize);
+            // Solid colors filter to zeroes after the first pixel of the first row.
+            assert_eq!(filtered[1], i as u8 * 50);
+        }
+    }
+
+    #[test]
+    fn test_animation_errors() {
+        let mut header = Header::new();
+        header.set_size(64, 64).unwrap();
+        let options = Options::new();
+        let mut encoder = Encoder::new(Vec::<u8>::new(), &options);
+        encoder.write_header(&header).unwrap();
+
+        let mut frame = FrameControl::new();
+        frame.set_size(64, 64).unwrap();
+        assert!(encoder.write_frame_control(&frame).is_err(), "needs animation control first");
+
+        encoder.write_animation_control(2, 1).unwrap();
+        frame.set_size(32, 32).unwrap();
+        assert!(encoder.write_frame_control(&frame).is_err(), "first frame must be whole");
+
+        frame.set_size(64, 64).unwrap();
+        encoder.write_frame_control(&frame).unwrap();
+        encoder.write_image_rows(&[0u8; 64 * 4]).unwrap();
+
+        frame.set_size(32, 32).unwrap();
+        assert!(encoder.write_frame_control(&frame).is_err(), "last frame is incomplete");
+    }
+
+    #[test]
+    fn test_chunk_cache() {
+        let cache = ChunkCache::new();
+        let mut options = Options::new();
+        options.set_chunk_size(32768).unwrap();
+
+        let encode = |options: &Options, image: &[u8]| {
+            let mut header = Header::new();
+            header.set_size(1024, 1024).unwrap();
+            header.set_color(ColorType::Truecolor, 8).unwrap();
+            let mut encoder = Encoder::new(Vec::<u8>::new(), options);
+            encoder.write_header(&header).unwrap();
+            encoder.write_image_rows(image).unwrap();
+            encoder.finish().unwrap()
+        };
+
+        let stride = 1024 * 3;
+        let mut image: Vec<u8> = (0 .. stride * 1024).map(|i| {
+            ((i * 7) ^ (i >> 9)) as u8
+        }).collect();
+        let plain = options;
+        let uncached = encode(&plain, &image);
+
+        options.set_chunk_cache(&cache).unwrap();
+        assert!(encode(&options, &image) == uncached);
+        assert_eq!(cache.reused_chunks(), 0);
+
+        // The same again comes straight from the cache,
+        assert!(encode(&options, &image) == uncached);
+        assert_eq!(cache.reused_chunks(), 96);
+
+        // and changing a row in the middle of a chunk only needs
+        // that one and the next recompressed.
+        image[495 * stride + 100] ^= 0xff;
+        let expected = encode(&plain, &image);
+        assert!(encode(&options, &image) == expected);
+        assert_eq!(cache.reused_chunks(), 94);
+
+        // Nothing matches with other compression settings.
+        options.set_compression_level(CompressionLevel::Fast).unwrap();
+        encode(&options, &image);
+        assert_eq!(cache.reused_chunks(), 0);
+    }
+
+    #[test]
+    fn test_input_format() {
+        let (width, height) = (300, 200);
+        let encode = |options: &Options, interlace: InterlaceMethod, image: &[u8]| {
+            let mut header = Header::new();
+            header.set_size(width, height).unwrap();
+            header.set_color(ColorType::TruecolorAlpha, 8).unwrap();
+            header.set_interlace_method(interlace).unwrap();
+            let mut encoder = Encoder::new(Vec::<u8>::new(), options);
+            encoder.write_header(&header).unwrap();
+            encoder.write_image_rows(image).unwrap();
+            encoder.finish().unwrap()
+        };
+
+        // Alpha only 0 or 255, so premultiplying loses nothing.
+        let mut rgba = Vec::<u8>::new();
+        let mut bgra = Vec::<u8>::new();
+        for y in 0 .. height as usize {
+            for x in 0 .. width as usize {
+                let alpha = if (x / 7 + y / 5) % 3 == 0 { 0 } else { 255 };
+                let pixel = [(x * 3) as u8, (y * 5) as u8, (x ^ y) as u8];
+                let pixel = if alpha == 0 { [0, 0, 0] } else { pixel };
+                rgba.extend_from_slice(&[pixel[0], pixel[1], pixel[2], alpha]);
+                bgra.extend_from_slice(&[pixel[2], pixel[1], pixel[0], alpha]);
+            }
+            bgra.extend_from_slice(&[0xee; 12]);
+        }
+
+        let plain = Options::new();
+        let mut options = Options::new();
+        options.set_channel_order(ChannelOrder::Bgra).unwrap();
+        options.set_premultiplied_alpha(true).unwrap();
+        options.set_input_stride(width as usize * 4 + 12).unwrap();
+
+        for &interlace in [InterlaceMethod::Standard, InterlaceMethod::Adam7].iter() {
+            assert!(encode(&options, interlace, &bgra) == encode(&plain, interlace, &rgba));
+        }
+
+        // Formats that don't fit the image are refused.
+        let mut header = Header::new();
+        header.set_size(width, height).unwrap();
+        header.set_color(ColorType::Truecolor, 8).unwrap();
+        let mut encoder = Encoder::new(Vec::<u8>::new(), &options);
+        assert!(encoder.write_header(&header).is_err());
+    }
+
+    #[test]
+    fn test_color_reduction() {
+        let (width, height) = (300, 200);
+        let encode = |options: &Options, header: &Header, palette: Option<&[u8]>, image: &[u8]| {
+            let mut encoder = Encoder::new(Vec::<u8>::new(), options);
+            encoder.write_header(header).unwrap();
+            if let Some(palette) = palette {
+                encoder.write_palette(palette).unwrap();
+            }
+            encoder.write_image_rows(image).unwrap();
+            encoder.finish().unwrap()
+        };
+
+        // Three opaque colors in RGBA, and the same as 2-bit indices.
+        let colors = [[10u8, 20, 30], [200, 100, 0], [255, 255, 255]];
+        let mut rgba = Vec::<u8>::new();
+        let mut indices = Vec::<u8>::new();
+        for y in 0 .. height as usize {
+            for x in 0 .. width as usize {
+                let index = (x / 9 + y / 4) % 3;
+                rgba.extend_from_slice(&colors[index]);
+                rgba.push(255);
+                indices.push(index as u8);
+            }
+        }
+
+        for &interlace in [InterlaceMethod::Standard, InterlaceMethod::Adam7].iter() {
+            let mut header = Header::new();
+            header.set_size(width, height).unwrap();
+            header.set_color(ColorType::TruecolorAlpha, 8).unwrap();
+
+            let mut options = Options::new();
+            let reduction = ColorReduction::new(&header, &rgba, width as usize * 4, &options).unwrap();
+            options.set_color_reduction(&reduction).unwrap();
+
+            let mut reduced = reduction.header();
+            assert!(matches!(reduced.color_type, ColorType::IndexedColor));
+            assert_eq!(reduced.depth, 2);
+            assert!(reduction.transparency().is_none());
+            let palette = reduction.palette().unwrap();
+            assert_eq!(palette, &[10, 20, 30, 200, 100, 0, 255, 255, 255]);
+            reduced.set_interlace_method(interlace).unwrap();
+
+            let mut plain = Options::new();
+            plain.set_unpacked_samples(true).unwrap();
+            assert!(encode(&options, &reduced, Some(palette), &rgba) ==
+                    encode(&plain, &reduced, Some(palette), &indices));
+
+            // The header has to be the reduced one.
+            header.set_interlace_method(interlace).unwrap();
+            let mut encoder = Encoder::new(Vec::<u8>::new(), &options);
+            assert!(encoder.write_header(&header).is_err());
+
+            // Rows with a color the scan didn't see are an error,
+            // rather than a panic on a worker thread.
+            let mut unscanned = rgba.clone();
+            unscanned[width as usize * 4 * 150] = 11;
+            let mut encoder = Encoder::new(Vec::<u8>::new(), &options);
+            encoder.write_header(&reduced).unwrap();
+            encoder.write_palette(palette).unwrap();
+            assert!(encoder.write_image_rows(&unscanned).and_then(|_| encoder.finish()).is_err());
+        }
+    }
+
+    #[test]
+    fn test_memory_limit() {
+        let (width, height) = (1024, 2000);
+        let mut header = Header::new();
+        header.set_size(width, height).unwrap();
+        header.set_color(ColorType::TruecolorAlpha, 8).unwrap();
+
+        let mut image = Vec::<u8>::new();
+        for y in 0 .. height as usize {
+            for x in 0 .. width as usize * 4 {
+                image.push((x * 3 + y * 7 + (x * y) / 11) as u8);
+            }
+        }
+
+        let encode = |options: &Options, check: bool| {
+            let mut encoder = Encoder::new(Vec::<u8>::new(), options);
+            encoder.write_header(&header).unwrap();
+            let mut peak = 0;
+            for rows in image.chunks(width as usize * 4 * 16) {
+                encoder.write_image_rows(rows).unwrap();
+                peak = cmp::max(peak, encoder.memory_in_flight);
+            }
+            if check {
+                // Room for one chunk per thread, plus the extras queued.
+                assert_eq!(encoder.chunk_size(), 1024 * 1024 / 12);
+                assert!(peak > 0 && peak <= 1024 * 1024);
+            }
+            encoder.finish().unwrap()
+        };
+
+        let pool = ThreadPoolBuilder::new().num_threads(4).build().unwrap();
+        let mut options = Options::new();
+        options.set_thread_pool(&pool).unwrap();
+        options.set_streaming(true).unwrap();
+        let mut limited = options;
+        limited.set_memory_limit(1024 * 1024).unwrap();
+
+        // Same output either way, given the same chunks.
+        let output = encode(&limited, true);
+        options.set_chunk_size(1024 * 1024 / 12).unwrap();
+        assert!(output == encode(&options, false));
+    }
+
+    #[test]
+    fn test_buffer_func() {
+        let (width, height) = (1024, 256);
+        let mut header = Header::new();
+        header.set_size(width, height).unwrap();
+        header.set_color(ColorType::TruecolorAlpha, 8).unwrap();
+        let image: Vec<u8> = (0 .. width as usize * height as usize * 4).map(|i| (i % 251) as u8).collect();
+
+        for &streaming in [true, false].iter() {
+            let mut options = Options::new();
+            options.set_chunk_size(65536).unwrap();
+            options.set_streaming(streaming).unwrap();
+
+            let mut encoder = Encoder::new(Vec::<u8>::new(), &options);
+            encoder.write_header(&header).unwrap();
+            encoder.write_image_rows(&image).unwrap();
+            let expected = encoder.finish().unwrap();
+
+            let buffers = Arc::new(Mutex::new(Vec::<Arc<Vec<u8>>>::new()));
+            let handed = Arc::clone(&buffers);
+            let mut encoder = Encoder::new_seekable(Cursor::new(Vec::<u8>::new()), &options);
+            encoder.set_buffer_func(move |buffer| {
+                handed.lock().unwrap().push(buffer);
+                Ok(())
+            }).unwrap();
+            encoder.write_header(&header).unwrap();
+            assert!(encoder.set_buffer_func(|_buffer| Ok(())).is_err());
+            encoder.write_image_rows(&image).unwrap();
+            assert_eq!(encoder.finish().unwrap().into_inner().len(), 0);
+
+            // Compressed chunks each come in their own buffer when streaming.
+            let buffers = buffers.lock().unwrap();
+            let output: Vec<u8> = buffers.iter().flat_map(|buffer| buffer.iter().cloned()).collect();
+            assert!(output == expected);
+            if streaming {
+                assert!(buffers.len() > 16);
+            }
+        }
+    }
+
+    #[test]
+    fn test_stats() {
+        use super::super::stats::{Stage, Stats};
+        use std::time::Duration;
+
+        let (width, height) = (1024, 256);
+        let mut header = Header::new();
+        header.set_size(width, height).unwrap();
+        header.set_color(ColorType::TruecolorAlpha, 8).unwrap();
+        let image: Vec<u8> = (0 .. width as usize * height as usize * 4).map(|i| (i % 251) as u8).collect();
+
+        let stats = Stats::new();
+        let mut options = Options::new();
+        options.set_chunk_size(65536).unwrap();
+        options.set_stats(&stats).unwrap();
+
+        let spans = Arc::new(Mutex::new(Vec::new()));
+        let traced = Arc::clone(&spans);
+        let mut encoder = Encoder::new(Vec::<u8>::new(), &options);
+        encoder.set_trace_func(move |span| {
+            traced.lock().unwrap().push((span.stage, span.chunk));
+        });
+        encoder.write_header(&header).unwrap();
+        encoder.write_image_rows(&image).unwrap();
+        let chunks_total = encoder.chunks_total;
+        encoder.finish().unwrap();
+
+        let chunks = stats.chunks();
+        assert_eq!(chunks.len(), chunks_total);
+        for (index, chunk) in chunks.iter().enumerate() {
+            assert_eq!(chunk.index, index);
+            assert_eq!(chunk.filters.iter().sum::<usize>(), chunk.rows);
+            assert_eq!(chunk.bytes_in, chunk.rows * (header.stride() + 1));
+            assert!(chunk.bytes_out > 0);
+        }
+
+        let summary = stats.summary();
+        assert_eq!(summary.chunks, chunks_total);
+        assert_eq!(summary.filters.iter().sum::<usize>(), height as usize);
+        assert_eq!(summary.bytes_in, height as usize * (header.stride() + 1));
+        assert!(summary.threads > 0 && summary.elapsed > Duration::from_secs(0));
+
+        // Each chunk is filtered, compressed, and written once.
+        let spans = spans.lock().unwrap();
+        for &stage in [Stage::Filter, Stage::Deflate, Stage::Write].iter() {
+            let mut seen: Vec<usize> = spans.iter()
+                                            .filter(|span| span.0 == stage)
+                                            .map(|span| span.1)
+                                            .collect();
+            seen.sort_unstable();
+            assert!(seen == (0 .. chunks_total).collect::<Vec<usize>>());
+        }
+    }
+
+    #[test]
+    fn test_trace_after_header() {
+        use super::super::stats::Stage;
+
+        let (width, height) = (1024, 256);
+        let mut header = Header::new();
+        header.set_size(width, height).unwrap();
+        header.set_color(ColorType::TruecolorAlpha, 8).unwrap();
+        let image: Vec<u8> = (0 .. width as usize * height as usize * 4).map(|i| (i % 251) as u8).collect();
+
+        let mut options = Options::new();
+        options.set_chunk_size(65536).unwrap();
+
+        // The frame's deflate jobs are set up by write_header(), but
+        // should still pick up a callback set before any rows.
+        let spans = Arc::new(Mutex::new(Vec::new()));
+        let traced = Arc::clone(&spans);
+        let mut encoder = Encoder::new(Vec::<u8>::new(), &options);
+        encoder.write_header(&header).unwrap();
+        encoder.set_trace_func(move |span| {
+            traced.lock().unwrap().push((span.stage, span.chunk));
+        });
+        encoder.write_image_rows(&image).unwrap();
+        let chunks_total = encoder.chunks_total;
+        encoder.finish().unwrap();
+
+        let spans = spans.lock().unwrap();
+        let mut seen: Vec<usize> = spans.iter()
+                                        .filter(|span| span.0 == Stage::Deflate)
+                                        .map(|span| span.1)
+                                        .collect();
+        seen.sort_unstable();
+        assert!(seen == (0 .. chunks_total).collect::<Vec<usize>>());
+    }
 }
@@ -58,6 +58,29 @@ impl TryFrom<u8> for Filter {
     }
 }
 
+/// How the Adaptive filter mode guesses the best filter for each row.
+#[repr(u8)]
+#[derive(Copy, Clone)]
+pub enum Heuristic {
+    /// Sum of absolute filter deltas, as in libpng. Never picks None.
+    Complexity = 0,
+    /// Estimated entropy of each filter's output, including None.
+    /// Slower, but better on screenshots and line art.
+    Entropy = 1,
+}
+
+impl TryFrom<u8> for Heuristic {
+    type Error = io::Error;
+
+    fn try_from(val: u8) -> Result<Self, Self::Error> {
+        match val {
+            0 => Ok(Heuristic::Complexity),
+            1 => Ok(Heuristic::Entropy),
+            _ => Err(invalid_input("Invalid heuristic constant")),
+        }
+    }
+}
+
 //
 // Iterator helper for the filter functions.
 //
@@ -68,8 +91,12 @@ impl TryFrom<u8> for Filter {
 // the original pixels on decode based on the pixels decoded
 // so far plus the offset.
 //
+// Covers bytes start to end of the row, so the vector kernels
+// can share it for the edges they don't handle themselves.
+//
 #[inline(always)]
-fn filter_iter<F>(bpp: usize, prev: &[u8], src: &[u8], out: &mut [u8], func: F)
+pub fn filter_range<F>(bpp: usize, prev: &[u8], src: &[u8], out: &mut [u8],
+                       start: usize, end: usize, func: F)
     where F : Fn(u8, u8, u8, u8) -> u8
 {
     //
@@ -79,48 +106,36 @@ fn filter_iter<F>(bpp: usize, prev: &[u8], src: &[u8], out: &mut [u8], func: F)
     // optimization, and doesn't require the voodoo assertions.
     //
 
+    // The first pixel has no left neighbors.
+    let split = cmp::min(cmp::max(bpp, start), end);
     for (dest, cur, up) in
-        izip!(&mut out[0 .. bpp],
-              &src[0 .. bpp],
-              &prev[0 .. bpp]) {
+        izip!(&mut out[start .. split],
+              &src[start .. split],
+              &prev[start .. split]) {
         *dest = func(*cur, 0, *up, 0);
     }
 
-    let len = out.len();
-    for (dest, cur, left, up, above_left) in
-        izip!(&mut out[bpp .. len],
-              &src[bpp .. len],
-              &src[0 .. len - bpp],
-              &prev[bpp .. len],
-              &prev[0 .. len - bpp]) {
-        *dest = func(*cur, *left, *up, *above_left);
+    if split < end {
+        for (dest, cur, left, up, above_left) in
+            izip!(&mut out[split .. end],
+                  &src[split .. end],
+                  &src[split - bpp .. end - bpp],
+                  &prev[split .. end],
+                  &prev[split - bpp .. end - bpp]) {
+            *dest = func(*cur, *left, *up, *above_left);
+        }
     }
 }
 
-//
-// "None" filter copies the untouched source data.
-// Good for indexed color where there's no relation between pixel values.
-//
-// https://www.w3.org/TR/PNG/#9Filter-types
-//
-fn filter_none(_bpp: usize, _prev: &[u8], src: &[u8], dest: &mut [u8]) {
-    // Does not need specialization.
-    dest[0] = Filter::None as u8;
-    dest[1 ..].clone_from_slice(src);
-}
-
 //
 // "Sub" filter diffs each byte against its neighbor one pixel to the left.
 // Good for lines that smoothly vary, like horizontal gradients.
 //
 // https://www.w3.org/TR/PNG/#9Filter-types
 //
-fn filter_sub(bpp: usize, prev: &[u8], src: &[u8], dest: &mut [u8]) {
-    dest[0] = Filter::Sub as u8;
-
-    filter_iter(bpp, prev, src, &mut dest[1 ..], |val, left, _above, _upper_left| -> u8 {
-        val.wrapping_sub(left)
-    })
+#[inline(always)]
+pub fn sub_delta(val: u8, left: u8, _above: u8, _upper_left: u8) -> u8 {
+    val.wrapping_sub(left)
 }
 
 //
@@ -130,13 +145,9 @@ fn filter_sub(bpp: usize, prev: &[u8], src: &[u8], dest: &mut [u8]) {
 //
 // https://www.w3.org/TR/PNG/#9Filter-types
 //
-fn filter_up(bpp: usize, prev: &[u8], src: &[u8], dest: &mut [u8]) {
-    // Does not need specialization.
-    dest[0] = Filter::Up as u8;
-
-    filter_iter(bpp, prev, src, &mut dest[1 ..], |val, _left, above, _upper_left| -> u8 {
-        val.wrapping_sub(above)
-    })
+#[inline(always)]
+pub fn up_delta(val: u8, _left: u8, above: u8, _upper_left: u8) -> u8 {
+    val.wrapping_sub(above)
 }
 
 //
@@ -145,13 +156,10 @@ fn filter_up(bpp: usize, prev: &[u8], src: &[u8], dest: &mut [u8]) {
 //
 // https://www.w3.org/TR/PNG/#9Filter-type-3-Average
 //
-fn filter_average(bpp: usize, prev: &[u8], src: &[u8], dest: &mut [u8]) {
-    dest[0] = Filter::Average as u8;
-
-    filter_iter(bpp, prev, src, &mut dest[1 ..], |val, left, above, _upper_left| -> u8 {
-        let avg = ((i16::from(left) + i16::from(above)) / 2) as u8;
-        val.wrapping_sub(avg)
-    })
+#[inline(always)]
+pub fn average_delta(val: u8, left: u8, above: u8, _upper_left: u8) -> u8 {
+    let avg = ((i16::from(left) + i16::from(above)) / 2) as u8;
+    val.wrapping_sub(avg)
 }
 
 //
@@ -160,6 +168,7 @@ fn filter_average(bpp: usize, prev: &[u8], src: &[u8], dest: &mut [u8]) {
 //
 // https://www.w3.org/TR/PNG/#9Filter-type-4-Paeth
 //
+#[inline(always)]
 fn paeth_predictor(left: u8, above: u8, upper_left: u8) -> u8 {
     let a = i16::from(left);
     let b = i16::from(above);
@@ -190,14 +199,185 @@ fn paeth_predictor(left: u8, above: u8, upper_left: u8) -> u8 {
 //
 // https://www.w3.org/TR/PNG/#9Filter-type-4-Paeth
 //
-fn filter_paeth(bpp: usize, prev: &[u8], src: &[u8], dest: &mut [u8]) {
-    dest[0] = Filter::Paeth as u8;
+#[inline(always)]
+pub fn paeth_delta(val: u8, left: u8, above: u8, upper_left: u8) -> u8 {
+    val.wrapping_sub(paeth_predictor(left, above, upper_left))
+}
+
+//
+// Scalar filter implementations, for the bytes of a row
+// after the filter type byte.
+//
+
+//
+// "None" filter copies the untouched source data.
+// Good for indexed color where there's no relation between pixel values.
+//
+// https://www.w3.org/TR/PNG/#9Filter-types
+//
+fn filter_none(_bpp: usize, _prev: &[u8], src: &[u8], out: &mut [u8]) {
+    // Does not need specialization.
+    out.clone_from_slice(src);
+}
 
-    filter_iter(bpp, prev, src, &mut dest[1 ..], |val, left, above, upper_left| -> u8 {
-        val.wrapping_sub(paeth_predictor(left, above, upper_left))
-    })
+fn filter_sub(bpp: usize, prev: &[u8], src: &[u8], out: &mut [u8]) {
+    let len = out.len();
+    filter_range(bpp, prev, src, out, 0, len, sub_delta)
 }
 
+fn filter_up(bpp: usize, prev: &[u8], src: &[u8], out: &mut [u8]) {
+    let len = out.len();
+    filter_range(bpp, prev, src, out, 0, len, up_delta)
+}
+
+fn filter_average(bpp: usize, prev: &[u8], src: &[u8], out: &mut [u8]) {
+    let len = out.len();
+    filter_range(bpp, prev, src, out, 0, len, average_delta)
+}
+
+fn filter_paeth(bpp: usize, prev: &[u8], src: &[u8], out: &mut [u8]) {
+    let len = out.len();
+    filter_range(bpp, prev, src, out, 0, len, paeth_delta)
+}
+
+//
+// Reverse a row's filter, given the filtered bytes after the type
+// byte in src and the previous row unfiltered in prev (zeros for
+// the first row), writing the original bytes into out.
+//
+// Each byte depends on the one bpp before it, so unlike filtering
+// this runs strictly left to right.
+//
+// https://www.w3.org/TR/PNG/#9Filters
+//
+pub fn unfilter(filter: Filter, bpp: usize, prev: &[u8], src: &[u8], out: &mut [u8]) {
+    let len = out.len();
+    let bpp = cmp::min(bpp, len);
+    let prev = &prev[.. len];
+    let src = &src[.. len];
+    match filter {
+        Filter::None => {
+            out.copy_from_slice(src);
+        },
+        Filter::Sub => {
+            out[.. bpp].copy_from_slice(&src[.. bpp]);
+            for i in bpp .. len {
+                out[i] = src[i].wrapping_add(out[i - bpp]);
+            }
+        },
+        Filter::Up => {
+            for ((dest, &val), &above) in out.iter_mut().zip(src.iter()).zip(prev.iter()) {
+                *dest = val.wrapping_add(above);
+            }
+        },
+        Filter::Average => {
+            for i in 0 .. bpp {
+                out[i] = src[i].wrapping_add(prev[i] >> 1);
+            }
+            for i in bpp .. len {
+                let avg = (u16::from(out[i - bpp]) + u16::from(prev[i])) >> 1;
+                out[i] = src[i].wrapping_add(avg as u8);
+            }
+        },
+        Filter::Paeth => {
+            // With no pixel to the left, the predictor is the one above.
+            for i in 0 .. bpp {
+                out[i] = src[i].wrapping_add(prev[i]);
+            }
+            for i in bpp .. len {
+                let predicted = paeth_predictor(out[i - bpp], prev[i], prev[i - bpp]);
+                out[i] = src[i].wrapping_add(predicted);
+            }
+        },
+    }
+}
+
+//
+// A filter implementation, scalar or vector.
+// Vector versions are only safe to call if the CPU supports them.
+//
+type FilterFunc = unsafe fn(usize, &[u8], &[u8], &mut [u8]);
+
+//
+// Complexity scores of the Sub, Up, Average, and Paeth filters
+// for a row; see score_range().
+//
+type ScoreFunc = unsafe fn(usize, &[u8], &[u8]) -> [u32; 4];
+
+//
+// The set of filter implementations to use on this CPU.
+//
+// Resolved once up front rather than checking CPU features
+// on every row.
+//
+#[derive(Copy, Clone)]
+struct Kernels {
+    sub: FilterFunc,
+    up: FilterFunc,
+    average: FilterFunc,
+    paeth: FilterFunc,
+    score: ScoreFunc,
+}
+
+impl Kernels {
+    fn scalar() -> Kernels {
+        Kernels {
+            sub: filter_sub,
+            up: filter_up,
+            average: filter_average,
+            paeth: filter_paeth,
+            score,
+        }
+    }
+
+    #[allow(unreachable_code)]
+    fn detect() -> Kernels {
+        #[cfg(any(target_arch = "x86", target_arch = "x86_64"))]
+        {
+            use super::simd::x86::*;
+            if is_x86_feature_detected!("avx2") {
+                return Kernels {
+                    sub: filter_sub_avx2,
+                    up: filter_up_avx2,
+                    average: filter_average_avx2,
+                    paeth: filter_paeth_avx2,
+                    score: score_avx2,
+                };
+            }
+            if is_x86_feature_detected!("sse4.1") {
+                return Kernels {
+                    sub: filter_sub_sse41,
+                    up: filter_up_sse41,
+                    average: filter_average_sse41,
+                    paeth: filter_paeth_sse41,
+                    score: score_sse41,
+                };
+            }
+        }
+        #[cfg(target_arch = "aarch64")]
+        {
+            use super::simd::neon::*;
+            return Kernels {
+                sub: filter_sub_neon,
+                up: filter_up_neon,
+                average: filter_average_neon,
+                paeth: filter_paeth_neon,
+                score: score_neon,
+            };
+        }
+        Kernels::scalar()
+    }
+
+    fn get(&self, filter: Filter) -> FilterFunc {
+        match filter {
+            Filter::None    => filter_none,
+            Filter::Sub     => self.sub,
+            Filter::Up      => self.up,
+            Filter::Average => self.average,
+            Filter::Paeth   => self.paeth,
+        }
+    }
+}
 
 //
 // For the complexity/compressibility heuristic. Absolute value
@@ -218,237 +398,260 @@ fn complexity_max() -> u32 {
     u32::max_value() - 256
 }
 
-//
-// Any row with this number of bytes needs to check for overflow
-// of the complexity heuristic.
-//
-fn complexity_big_row(len: usize) -> bool {
-    len >= (1 << 24)
-}
-
 //
 // Complexity/compressibility heuristic recommended by the PNG spec
-// and used in libpng as well.
+// and used in libpng as well, for each of the Sub, Up, Average,
+// and Paeth filters over the bytes of a row from start to end.
+// Adds to the running sums, in that order.
 //
-// Note this doesn't produce useful results on the "none" filter
+// Runs all four filters together in one pass over the input rather
+// than filtering the row four times and summing each result. Only
+// the filter that wins gets run again to produce output.
 //
 // libpng tries to do this inline with the filter with a clever
 // early return if "too complex", but I find that's slower on large
 // files than just running the whole filter.
 //
-fn estimate_complexity(data: &[u8]) -> u32 {
-    let mut sum = 0u32;
-
-    //
-    // Very long rows could overflow the 32-bit complexity heuristic's
-    // accumulator, but it doesn't trigger until tens of millions
-    // of bytes per row. :)
-    //
-    // The check slows down the inner loop on more realistic sizes
-    // (say, ~31k bytes for a 7680 wide RGBA image) so we skip it.
-    //
-    if complexity_big_row(data.len()) {
-        for iter in data.iter() {
-            sum += filter_complexity_delta(*iter);
-            if sum > complexity_max() {
-                return complexity_max();
-            }
-        }
-    } else {
-        for iter in data.iter() {
-            sum += filter_complexity_delta(*iter);
-        }
+#[inline(always)]
+pub fn score_range(bpp: usize, prev: &[u8], src: &[u8],
+                   start: usize, end: usize, sums: &mut [u64; 4])
+{
+    #[inline(always)]
+    fn score_byte(sums: &mut [u64; 4], val: u8, left: u8, above: u8, upper_left: u8) {
+        sums[0] += u64::from(filter_complexity_delta(sub_delta(val, left, above, upper_left)));
+        sums[1] += u64::from(filter_complexity_delta(up_delta(val, left, above, upper_left)));
+        sums[2] += u64::from(filter_complexity_delta(average_delta(val, left, above, upper_left)));
+        sums[3] += u64::from(filter_complexity_delta(paeth_delta(val, left, above, upper_left)));
     }
 
-    sum
-}
-
-//
-// Holds a target row that can be filtered
-// Can be reused.
-//
-struct Filterator {
-    filter: Filter,
-    bpp: usize,
-    data: Vec<u8>,
-    complexity: u32,
-}
-
-impl Filterator {
-    fn new(filter: Filter, bpp: usize, stride: usize) -> Filterator {
-        Filterator {
-            filter,
-            bpp,
-            data: vec![0u8; stride + 1],
-            complexity: 0,
-        }
+    let split = cmp::min(cmp::max(bpp, start), end);
+    for (cur, up) in
+        izip!(&src[start .. split],
+              &prev[start .. split]) {
+        score_byte(sums, *cur, 0, *up, 0);
     }
 
-    #[inline(always)]
-    fn do_filter(&mut self, prev: &[u8], src: &[u8]) -> &[u8] {
-        match self.filter {
-            Filter::None    => filter_none(self.bpp, prev, src, &mut self.data),
-            Filter::Sub     => filter_sub(self.bpp, prev, src, &mut self.data),
-            Filter::Up      => filter_up(self.bpp, prev, src, &mut self.data),
-            Filter::Average => filter_average(self.bpp, prev, src, &mut self.data),
-            Filter::Paeth   => filter_paeth(self.bpp, prev, src, &mut self.data),
+    if split < end {
+        for (cur, left, up, above_left) in
+            izip!(&src[split .. end],
+                  &src[split - bpp .. end - bpp],
+                  &prev[split .. end],
+                  &prev[split - bpp .. end - bpp]) {
+            score_byte(sums, *cur, *left, *up, *above_left);
         }
-        self.complexity = estimate_complexity(&self.data[1..]);
-        &self.data
     }
+}
 
-    #[cfg(target_arch = "x86")]
-    #[target_feature(enable = "sse2")]
-    unsafe fn do_filter_sse2(&mut self, prev: &[u8], src: &[u8]) -> &[u8] {
-        self.do_filter(prev, src)
+//
+// Very long rows could overflow a 32-bit complexity heuristic, but
+// it doesn't trigger until tens of millions of bytes per row. :)
+// Sums are kept at 64 bits and clamped at the end.
+//
+pub fn score_total(sums: &[u64; 4]) -> [u32; 4] {
+    let max = u64::from(complexity_max());
+    let mut scores = [0u32; 4];
+    for (score, sum) in scores.iter_mut().zip(sums.iter()) {
+        *score = cmp::min(*sum, max) as u32;
     }
+    scores
+}
 
-    #[cfg(any(target_arch = "x86", target_arch = "x86_64"))]
-    #[target_feature(enable = "sse4.1")]
-    unsafe fn do_filter_sse41(&mut self, prev: &[u8], src: &[u8]) -> &[u8] {
-        self.do_filter(prev, src)
-    }
+fn score(bpp: usize, prev: &[u8], src: &[u8]) -> [u32; 4] {
+    let mut sums = [0u64; 4];
+    score_range(bpp, prev, src, 0, src.len(), &mut sums);
+    score_total(&sums)
+}
 
-    #[cfg(any(target_arch = "x86", target_arch = "x86_64"))]
-    #[target_feature(enable = "sse4.2")]
-    unsafe fn do_filter_sse42(&mut self, prev: &[u8], src: &[u8]) -> &[u8] {
-        self.do_filter(prev, src)
-    }
+//
+// Byte histograms of a row under the None, Sub, Up, Average,
+// and Paeth filters, in that order, built in one pass.
+//
+type Histograms = [[u32; 256]; 5];
 
-    #[cfg(any(target_arch = "x86", target_arch = "x86_64"))]
-    #[target_feature(enable = "avx")]
-    unsafe fn do_filter_avx(&mut self, prev: &[u8], src: &[u8]) -> &[u8] {
-        self.do_filter(prev, src)
+fn histogram_range(bpp: usize, prev: &[u8], src: &[u8],
+                   start: usize, end: usize, counts: &mut Histograms)
+{
+    #[inline(always)]
+    fn count_byte(counts: &mut Histograms, val: u8, left: u8, above: u8, upper_left: u8) {
+        counts[0][val as usize] += 1;
+        counts[1][sub_delta(val, left, above, upper_left) as usize] += 1;
+        counts[2][up_delta(val, left, above, upper_left) as usize] += 1;
+        counts[3][average_delta(val, left, above, upper_left) as usize] += 1;
+        counts[4][paeth_delta(val, left, above, upper_left) as usize] += 1;
     }
 
-    #[cfg(any(target_arch = "x86", target_arch = "x86_64"))]
-    #[target_feature(enable = "avx2")]
-    unsafe fn do_filter_avx2(&mut self, prev: &[u8], src: &[u8]) -> &[u8] {
-        self.do_filter(prev, src)
+    let split = cmp::min(cmp::max(bpp, start), end);
+    for (cur, up) in
+        izip!(&src[start .. split],
+              &prev[start .. split]) {
+        count_byte(counts, *cur, 0, *up, 0);
     }
 
-    fn filter(&mut self, prev: &[u8], src: &[u8]) -> &[u8] {
-        #[cfg(any(target_arch = "x86", target_arch = "x86_64"))]
-        {
-            if is_x86_feature_detected!("avx2") {
-                return unsafe {
-                    self.do_filter_avx2(prev, src)
-                };
-            }
-            if is_x86_feature_detected!("avx") {
-                return unsafe {
-                    self.do_filter_avx(prev, src)
-                };
-            }
-            if is_x86_feature_detected!("sse4.2") {
-                return unsafe {
-                    self.do_filter_sse42(prev, src)
-                };
-            }
-            if is_x86_feature_detected!("sse4.1") {
-                return unsafe {
-                    self.do_filter_sse41(prev, src)
-                };
-            }
+    if split < end {
+        for (cur, left, up, above_left) in
+            izip!(&src[split .. end],
+                  &src[split - bpp .. end - bpp],
+                  &prev[split .. end],
+                  &prev[split - bpp .. end - bpp]) {
+            count_byte(counts, *cur, *left, *up, *above_left);
         }
-        #[cfg(target_arch = "x86")]
-        {
-            // SSE2 is guaranteed on x86_64
-            // but may not be present on x86
-            if is_x86_feature_detected!("sse2") {
-                return unsafe {
-                    self.do_filter_sse2(prev, src)
-                };
-            }
-        }
-        self.do_filter(prev, src)
     }
+}
 
-    fn get_data(&self) -> &[u8] {
-        &self.data
+//
+// Order-0 Shannon entropy of the histogram, in total bits:
+// the sum of count * log2(len / count) over the byte values,
+// rearranged so there's one log per distinct value.
+//
+// This is roughly what a Huffman coder alone would spend on the
+// row. It knows nothing about repeated strings, but unlike the
+// sum of deltas it's meaningful for raw pixel values too, so it
+// can tell when "none" is the better choice.
+//
+fn entropy_bits(counts: &[u32; 256], len: usize) -> f64 {
+    if len == 0 {
+        return 0.0;
     }
-
-    fn get_complexity(&self) -> u32 {
-        self.complexity
+    let total = len as f64;
+    let mut bits = total * total.log2();
+    for &count in counts.iter() {
+        if count > 1 {
+            let count = f64::from(count);
+            bits -= count * count.log2();
+        }
     }
+    bits
 }
 
 pub struct AdaptiveFilter {
     mode: Mode<Filter>,
-    filter_none: Filterator,
-    filter_up: Filterator,
-    filter_sub: Filterator,
-    filter_average: Filterator,
-    filter_paeth: Filterator,
+    heuristic: Heuristic,
+    kernels: Kernels,
+    bpp: usize,
+    data: Vec<u8>,
+
+    // Scratch space for the entropy heuristic.
+    histograms: Option<Box<Histograms>>,
+
+    // Rows filtered with each filter type so far.
+    counts: [usize; 5],
 }
 
 impl AdaptiveFilter {
-    pub fn new(header: Header, mode: Mode<Filter>) -> AdaptiveFilter {
-        let stride = header.stride();
-        let bpp = header.bytes_per_pixel();
+    pub fn new(header: Header, mode: Mode<Filter>, heuristic: Heuristic) -> AdaptiveFilter {
         AdaptiveFilter {
             mode,
-            filter_none:    Filterator::new(Filter::None,    bpp, stride),
-            filter_up:      Filterator::new(Filter::Up,      bpp, stride),
-            filter_sub:     Filterator::new(Filter::Sub,     bpp, stride),
-            filter_average: Filterator::new(Filter::Average, bpp, stride),
-            filter_paeth:   Filterator::new(Filter::Paeth,   bpp, stride),
+            heuristic,
+            kernels: Kernels::detect(),
+            bpp: header.bytes_per_pixel(),
+            data: vec![0u8; header.stride() + 1],
+            histograms: match (mode, heuristic) {
+                (Adaptive, Heuristic::Entropy) => Some(Box::new([[0u32; 256]; 5])),
+                _                              => None,
+            },
+            counts: [0; 5],
+        }
+    }
+
+    //
+    // Number of rows filtered with each filter type, by Filter value.
+    //
+    pub fn filter_counts(&self) -> [usize; 5] {
+        self.counts
+    }
+
+    fn filter_fixed(&mut self, filter: Filter, prev: &[u8], src: &[u8]) -> &[u8] {
+        self.data[0] = filter as u8;
+        self.counts[filter as usize] += 1;
+        unsafe {
+            // Kernels::detect() only hands out functions this CPU supports.
+            (self.kernels.get(filter))(self.bpp, prev, src, &mut self.data[1 ..]);
         }
+        &self.data
     }
 
-    fn filter_adaptive(&mut self, prev: &[u8], src: &[u8]) -> &[u8] {
+    fn filter_complexity(&mut self, prev: &[u8], src: &[u8]) -> &[u8] {
         //
         // Note the "none" filter is often good for things like
         // line-art diagrams and screenshots that have lots of
         // sharp pixel edges and long runs of solid colors.
         //
-        // The adaptive filter algorithm doesn't work on it, however,
+        // The complexity heuristic doesn't work on it, however,
         // since it measures accumulated filter prediction offets and
         // that gives useless results on absolute color magnitudes.
-        //
-        // Compression could be improved for some files if a heuristic
-        // can be devised to check if the none filter will work well.
+        // See filter_entropy() for one that does.
         //
 
-        self.filter_sub.filter(prev, src);
-        let mut min = self.filter_sub.get_complexity();
+        let scores = unsafe {
+            (self.kernels.score)(self.bpp, prev, src)
+        };
 
-        self.filter_up.filter(prev, src);
-        min = cmp::min(min, self.filter_up.get_complexity());
+        // Lowest wins; ties go to the first.
+        let filters = [Filter::Sub, Filter::Up, Filter::Average, Filter::Paeth];
+        let mut best = 0;
+        for i in 1 .. filters.len() {
+            if scores[i] < scores[best] {
+                best = i;
+            }
+        }
+        self.filter_fixed(filters[best], prev, src)
+    }
 
-        self.filter_average.filter(prev, src);
-        min = cmp::min(min, self.filter_average.get_complexity());
+    fn filter_entropy(&mut self, prev: &[u8], src: &[u8]) -> &[u8] {
+        let mut bits = [0f64; 5];
+        {
+            let counts = self.histograms.as_mut().unwrap();
+            for histogram in counts.iter_mut() {
+                *histogram = [0u32; 256];
+            }
+            histogram_range(self.bpp, prev, src, 0, src.len(), counts);
+            for (estimate, histogram) in bits.iter_mut().zip(counts.iter()) {
+                *estimate = entropy_bits(histogram, src.len());
+            }
+        }
 
-        self.filter_paeth.filter(prev, src);
-        min = cmp::min(min, self.filter_paeth.get_complexity());
+        // Lowest wins; ties go to the first.
+        let filters = [Filter::None, Filter::Sub, Filter::Up, Filter::Average, Filter::Paeth];
+        let mut best = 0;
+        for i in 1 .. filters.len() {
+            if bits[i] < bits[best] {
+                best = i;
+            }
+        }
+        self.filter_fixed(filters[best], prev, src)
+    }
 
-        if min == self.filter_sub.get_complexity()  {
-            self.filter_sub.get_data()
-        } else if min == self.filter_up.get_complexity() {
-            self.filter_up.get_data()
-        } else if min == self.filter_average.get_complexity() {
-            self.filter_average.get_data()
-        } else /* if min == self.filter_paeth.get_complexity() */ {
-            self.filter_paeth.get_data()
+    //
+    // Just the complexity heuristic's scores for a row, for timing
+    // it apart from the filter it picks.
+    //
+    #[cfg(feature="bench")]
+    pub fn complexity_scores(&self, prev: &[u8], src: &[u8]) -> [u32; 4] {
+        unsafe {
+            (self.kernels.score)(self.bpp, prev, src)
         }
     }
 
     pub fn filter(&mut self, prev: &[u8], src: &[u8]) -> &[u8] {
-        match self.mode {
-            Fixed(Filter::None)    => self.filter_none.filter(prev, src),
-            Fixed(Filter::Sub)     => self.filter_sub.filter(prev, src),
-            Fixed(Filter::Up)      => self.filter_up.filter(prev, src),
-            Fixed(Filter::Average) => self.filter_average.filter(prev, src),
-            Fixed(Filter::Paeth)   => self.filter_paeth.filter(prev, src),
-            Adaptive               => self.filter_adaptive(prev, src),
+        match (self.mode, self.heuristic) {
+            (Fixed(filter), _)                => self.filter_fixed(filter, prev, src),
+            (Adaptive, Heuristic::Complexity) => self.filter_complexity(prev, src),
+            (Adaptive, Heuristic::Entropy)    => self.filter_entropy(prev, src),
         }
     }
 }
 
 #[cfg(test)]
 mod tests {
+    use std::convert::TryFrom;
+
     use super::AdaptiveFilter;
+    use super::Filter;
+    use super::Heuristic;
+    use super::Kernels;
     use super::Mode;
+    use super::filter_complexity_delta;
+    use super::unfilter;
     use super::super::Header;
     use super::super::ColorType;
 
@@ -457,7 +660,7 @@ mod tests {
         let mut header = Header::new();
         header.set_size(1024, 768).unwrap();
         header.set_color(ColorType::Truecolor, 8).unwrap();
-        let mut filter = AdaptiveFilter::new(header, Mode::Adaptive);
+        let mut filter = AdaptiveFilter::new(header, Mode::Adaptive, Heuristic::Complexity);
 
         let prev = vec![0u8; header.stride()];
         let row = vec![0u8; header.stride()];
@@ -465,16 +668,124 @@ mod tests {
         assert_eq!(filtered_data.len(), header.stride() + 1);
     }
 
+    #[test]
+    fn unfilter_works() {
+        let mut header = Header::new();
+        header.set_size(37, 2).unwrap();
+        header.set_color(ColorType::TruecolorAlpha, 8).unwrap();
+        let stride = header.stride();
+        let prev: Vec<u8> = (0 .. stride).map(|i| (i * 37 % 256) as u8).collect();
+        let row: Vec<u8> = (0 .. stride).map(|i| (i * 91 % 253) as u8).collect();
+
+        for &mode in [Filter::None, Filter::Sub, Filter::Up, Filter::Average, Filter::Paeth].iter() {
+            let mut filter = AdaptiveFilter::new(header, Mode::Fixed(mode), Heuristic::Complexity);
+            let filtered = filter.filter(&prev, &row).to_vec();
+            let mut out = vec![0u8; stride];
+            unfilter(Filter::try_from(filtered[0]).unwrap(), header.bytes_per_pixel(),
+                     &prev, &filtered[1 ..], &mut out);
+            assert!(out == row);
+        }
+    }
+
     #[test]
     fn it_works_16() {
         let mut header = Header::new();
         header.set_size(1024, 768).unwrap();
         header.set_color(ColorType::Truecolor, 16).unwrap();
-        let mut filter = AdaptiveFilter::new(header, Mode::Adaptive);
+        let mut filter = AdaptiveFilter::new(header, Mode::Adaptive, Heuristic::Complexity);
 
         let prev = vec![0u8; header.stride()];
         let row = vec![0u8; header.stride()];
         let filtered_data = filter.filter(&prev, &row);
         assert_eq!(filtered_data.len(), header.stride() + 1);
     }
+
+    #[test]
+    fn entropy_picks_none() {
+        let mut header = Header::new();
+        header.set_size(1024, 768).unwrap();
+        header.set_color(ColorType::Greyscale, 8).unwrap();
+        let mut filter = AdaptiveFilter::new(header, Mode::Adaptive, Heuristic::Entropy);
+
+        // Two colors scattered at random, like dithered line art;
+        // any prediction from neighbors only adds more symbols.
+        let mut seed = 12345u32;
+        let mut noise = || {
+            seed = seed.wrapping_mul(1103515245).wrapping_add(12345);
+            if seed & 0x10000 == 0 { 17u8 } else { 230u8 }
+        };
+        let prev: Vec<u8> = (0 .. header.stride()).map(|_| noise()).collect();
+        let row: Vec<u8> = (0 .. header.stride()).map(|_| noise()).collect();
+        assert_eq!(filter.filter(&prev, &row)[0], Filter::None as u8);
+
+        // A horizontal gradient is all the same delta under Sub.
+        let row: Vec<u8> = (0 .. header.stride()).map(|i| (i * 3) as u8).collect();
+        assert_eq!(filter.filter(&prev, &row)[0], Filter::Sub as u8);
+    }
+
+    #[test]
+    fn kernels_match_scalar() {
+        let scalar = Kernels::scalar();
+        let mut candidates = vec![scalar, Kernels::detect()];
+        #[cfg(any(target_arch = "x86", target_arch = "x86_64"))]
+        {
+            use super::super::simd::x86::*;
+            if is_x86_feature_detected!("sse4.1") {
+                candidates.push(Kernels {
+                    sub: filter_sub_sse41,
+                    up: filter_up_sse41,
+                    average: filter_average_sse41,
+                    paeth: filter_paeth_sse41,
+                    score: score_sse41,
+                });
+            }
+        }
+        let filters = [Filter::Sub, Filter::Up, Filter::Average, Filter::Paeth];
+
+        // Pseudo-random rows, long enough to cover vector bodies and tails.
+        let mut seed = 12345u32;
+        let mut noise = || {
+            seed = seed.wrapping_mul(1103515245).wrapping_add(12345);
+            (seed >> 16) as u8
+        };
+        let prev: Vec<u8> = (0 .. 301).map(|_| noise()).collect();
+        let src: Vec<u8> = (0 .. 301).map(|_| noise()).collect();
+
+        for &bpp in [1usize, 2, 3, 4, 6, 8].iter() {
+            for &len in [0usize, 1, 7, 16, 31, 32, 33, 100, 301].iter() {
+                // Reference scores sum up each filter's scalar output.
+                let mut expected_scores = [0u32; 4];
+                for (i, &filter) in filters.iter().enumerate() {
+                    let mut expected = vec![0u8; len];
+                    unsafe {
+                        (scalar.get(filter))(bpp, &prev[.. len], &src[.. len], &mut expected);
+                    }
+                    expected_scores[i] = expected.iter()
+                                                 .map(|&val| filter_complexity_delta(val))
+                                                 .sum();
+                }
+                for vector in candidates.iter() {
+                    let scores = unsafe {
+                        (vector.score)(bpp, &prev[.. len], &src[.. len])
+                    };
+                    assert_eq!(scores, expected_scores, "score mismatch at bpp {} len {}", bpp, len);
+                }
+
+                for &filter in filters.iter() {
+                    let mut expected = vec![0u8; len];
+                    unsafe {
+                        (scalar.get(filter))(bpp, &prev[.. len], &src[.. len], &mut expected);
+                    }
+                    for vector in candidates.iter() {
+                        let mut actual = vec![0u8; len];
+                        unsafe {
+                            (vector.get(filter))(bpp, &prev[.. len], &src[.. len], &mut actual);
+                        }
+                        assert!(actual == expected,
+                                "filter {} mismatch at bpp {} len {}", filter as u8, bpp, len);
+                    }
+                }
+            }
+        }
+    }
 }
@@ -0,0 +1,700 @@
+//
+// mtpng - a multithreaded parallel PNG encoder in Rust
+// inflate.rs - raw deflate decoding of pieces of a stream
+//
+// Copyright (c) 2018-2024 Brooke Vibber
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+//
+
+//
+// zlib can only inflate a stream from its start, on one thread, as
+// any part of it may copy from the 32 KiB of output before. A piece
+// of a stream that starts on a block boundary can be decoded on its
+// own except for those copies reaching back before its start.
+//
+// This decoder runs such a piece without knowing that window. Bytes
+// copied from before the piece are left as placeholders, with their
+// distance back from its start kept in a parallel array of marks,
+// and filled in by resolve() once the output before it is known.
+// Marks follow bytes through later copies, and stop being tracked
+// once 32 KiB of output goes by without any, as nothing after can
+// reach back to them.
+//
+// https://tools.ietf.org/html/rfc1951
+//
+
+use std::cmp;
+use std::convert::TryInto;
+use std::io;
+
+use super::utils::*;
+
+// Furthest back a copy may reach.
+pub const WINDOW_SIZE: usize = 32 * 1024;
+
+// Bits of input looked up at once when decoding Huffman codes;
+// longer codes, which are rare, are decoded a bit at a time.
+const FAST_BITS: u32 = 10;
+
+const LENGTH_BASE: [u16; 29] = [
+    3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+    35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258,
+];
+
+const LENGTH_EXTRA: [u8; 29] = [
+    0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+    3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0,
+];
+
+const DISTANCE_BASE: [u16; 30] = [
+    1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193,
+    257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145,
+    8193, 12289, 16385, 24577,
+];
+
+const DISTANCE_EXTRA: [u8; 30] = [
+    0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6,
+    7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13,
+];
+
+// Order the code length code lengths are sent in.
+const CODE_LENGTH_ORDER: [usize; 19] = [
+    16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15,
+];
+
+fn corrupt() -> io::Error {
+    invalid_input("Corrupt deflate data")
+}
+
+fn truncated() -> io::Error {
+    invalid_input("Truncated deflate data")
+}
+
+//
+// Reads bits least significant first, as deflate packs them.
+//
+// Reading past the end returns zeros, but still counts, so callers
+// check overrun() rather than every read checking the length.
+//
+struct Bits<'a> {
+    data: &'a [u8],
+    pos: usize,
+    buf: u64,
+    count: u32,
+}
+
+impl<'a> Bits<'a> {
+    fn new(data: &'a [u8]) -> Bits<'a> {
+        Bits {
+            data,
+            pos: 0,
+            buf: 0,
+            count: 0,
+        }
+    }
+
+    //
+    // Top up the buffer to at least 56 bits.
+    //
+    #[inline(always)]
+    fn refill(&mut self) {
+        if self.pos + 8 <= self.data.len() {
+            // Take as many whole bytes as fit from a single load.
+            let word = u64::from_le_bytes(self.data[self.pos .. self.pos + 8].try_into().unwrap());
+            self.buf |= word << self.count;
+            let bytes = (63 - self.count) >> 3;
+            self.pos += bytes as usize;
+            self.count += bytes << 3;
+        } else {
+            while self.count <= 56 {
+                let byte = if self.pos < self.data.len() {
+                    self.data[self.pos]
+                } else {
+                    0
+                };
+                self.buf |= u64::from(byte) << self.count;
+                self.pos += 1;
+                self.count += 8;
+            }
+        }
+    }
+
+    #[inline(always)]
+    fn consume(&mut self, n: u32) {
+        self.buf >>= n;
+        self.count -= n;
+    }
+
+    //
+    // Read n bits, up to 32.
+    //
+    #[inline(always)]
+    fn bits(&mut self, n: u32) -> usize {
+        if self.count < n {
+            self.refill();
+        }
+        let val = self.buf & ((1u64 << n) - 1);
+        self.consume(n);
+        val as usize
+    }
+
+    //
+    // Skip to the next byte boundary.
+    //
+    fn align(&mut self) {
+        let skip = self.count & 7;
+        self.consume(skip);
+    }
+
+    //
+    // Continue reading at the given byte, which must be on a
+    // byte boundary.
+    //
+    fn seek(&mut self, pos: usize) {
+        self.pos = pos;
+        self.buf = 0;
+        self.count = 0;
+    }
+
+    //
+    // Bits read so far.
+    //
+    fn position(&self) -> usize {
+        self.pos * 8 - self.count as usize
+    }
+
+    fn overrun(&self) -> bool {
+        self.position() > self.data.len() * 8
+    }
+}
+
+//
+// Decoding table for a canonical Huffman code.
+//
+struct Huffman {
+    // Indexed by the next FAST_BITS bits of input: the symbol
+    // shifted left 4 plus its code length, or 0 if longer.
+    fast: Vec<u16>,
+
+    // Number of codes of each length, and the symbols in order
+    // of their codes, for codes too long for the fast table.
+    counts: [u16; 16],
+    symbols: Vec<u16>,
+}
+
+impl Huffman {
+    fn new(lengths: &[u8]) -> io::Result<Huffman> {
+        let mut counts = [0u16; 16];
+        for &len in lengths {
+            counts[len as usize] += 1;
+        }
+        counts[0] = 0;
+
+        // Over-subscribed codes are invalid; incomplete ones are
+        // allowed, and fail only if a missing code turns up.
+        let mut left = 1i32;
+        for len in 1 .. 16 {
+            left <<= 1;
+            left -= i32::from(counts[len]);
+            if left < 0 {
+                return Err(corrupt());
+            }
+        }
+
+        let mut offsets = [0u16; 16];
+        for len in 1 .. 15 {
+            offsets[len + 1] = offsets[len] + counts[len];
+        }
+        let mut symbols = vec![0u16; lengths.len()];
+        for (symbol, &len) in lengths.iter().enumerate() {
+            if len != 0 {
+                symbols[offsets[len as usize] as usize] = symbol as u16;
+                offsets[len as usize] += 1;
+            }
+        }
+
+        // Codes are sent most significant bit first, so the table
+        // is indexed by their bits reversed.
+        let mut fast = vec![0u16; 1 << FAST_BITS];
+        let mut code = 0usize;
+        let mut next = 0usize;
+        for len in 1 .. 16 {
+            for _ in 0 .. counts[len] {
+                if len as u32 <= FAST_BITS {
+                    let symbol = symbols[next];
+                    let reversed = code.reverse_bits() >> (usize::BITS - len as u32);
+                    let entry = symbol << 4 | len as u16;
+                    let mut i = reversed;
+                    while i < fast.len() {
+                        fast[i] = entry;
+                        i += 1 << len;
+                    }
+                }
+                code += 1;
+                next += 1;
+            }
+            code <<= 1;
+        }
+
+        Ok(Huffman {
+            fast,
+            counts,
+            symbols,
+        })
+    }
+
+    fn fixed() -> (Huffman, Huffman) {
+        let mut lengths = [0u8; 288];
+        for (symbol, len) in lengths.iter_mut().enumerate() {
+            *len = match symbol {
+                0 ..= 143 => 8,
+                144 ..= 255 => 9,
+                256 ..= 279 => 7,
+                _ => 8,
+            };
+        }
+        let literals = Huffman::new(&lengths).unwrap();
+        let distances = Huffman::new(&[5u8; 30]).unwrap();
+        (literals, distances)
+    }
+
+    #[inline(always)]
+    fn decode(&self, bits: &mut Bits) -> io::Result<usize> {
+        if bits.count < 15 {
+            bits.refill();
+        }
+        let entry = self.fast[(bits.buf & ((1 << FAST_BITS) - 1)) as usize];
+        if entry != 0 {
+            bits.consume(u32::from(entry & 15));
+            return Ok((entry >> 4) as usize);
+        }
+
+        // Walk the code lengths one bit at a time.
+        let mut code = 0i32;
+        let mut first = 0i32;
+        let mut index = 0i32;
+        for len in 1 .. 16 {
+            code |= ((bits.buf >> (len - 1)) & 1) as i32;
+            let count = i32::from(self.counts[len]);
+            if code - count < first {
+                bits.consume(len as u32);
+                return Ok(self.symbols[(index + code - first) as usize] as usize);
+            }
+            index += count;
+            first += count;
+            first <<= 1;
+            code <<= 1;
+        }
+        Err(corrupt())
+    }
+}
+
+/// Output of inflate(): decoded data, with any bytes copied from
+/// before the start left as placeholders until resolve()d.
+pub struct Output {
+    pub data: Vec<u8>,
+
+    // For each of the first marks.len() bytes, zero if known,
+    // or how far before the start is the byte it copies.
+    marks: Vec<u16>,
+
+    // Whether marks are kept for each byte as it's output, and the
+    // output position after the last marked byte.
+    marking: bool,
+    marked_end: usize,
+
+    /// Whether the stream's final block was in this piece.
+    pub last: bool,
+}
+
+impl Output {
+    fn new(capacity: usize) -> Output {
+        Output {
+            data: Vec::with_capacity(capacity),
+            marks: Vec::with_capacity(WINDOW_SIZE),
+            marking: true,
+            marked_end: 0,
+            last: false,
+        }
+    }
+
+    /// Output decoded some other way, with nothing to fill in.
+    pub fn from_data(data: Vec<u8>) -> Output {
+        Output {
+            data,
+            marks: Vec::new(),
+            marking: false,
+            marked_end: 0,
+            last: false,
+        }
+    }
+
+    /// Whether no bytes are placeholders.
+    pub fn is_resolved(&self) -> bool {
+        self.marked_end == 0
+    }
+
+    //
+    // Once a whole window goes by past the last mark, copies can't
+    // reach any, nor before the start; stop keeping them.
+    //
+    #[inline(always)]
+    fn check_marking(&mut self) {
+        if self.data.len() >= self.marked_end + WINDOW_SIZE {
+            self.marking = false;
+            self.marks.truncate(self.marked_end);
+        }
+    }
+
+    #[inline(always)]
+    fn literal(&mut self, val: u8) {
+        self.data.push(val);
+        if self.marking {
+            self.marks.push(0);
+            self.check_marking();
+        }
+    }
+
+    fn extend(&mut self, bytes: &[u8]) {
+        self.data.extend_from_slice(bytes);
+        if self.marking {
+            self.marks.resize(self.data.len(), 0);
+            self.check_marking();
+        }
+    }
+
+    #[inline(always)]
+    fn copy(&mut self, distance: usize, len: usize) -> IoResult {
+        if self.marking {
+            self.copy_marked(distance, len);
+            return Ok(());
+        }
+
+        let pos = self.data.len();
+        if distance > pos {
+            return Err(corrupt());
+        }
+        let start = pos - distance;
+        if len <= distance {
+            self.data.extend_from_within(start .. start + len);
+        } else if distance == 1 {
+            let val = self.data[start];
+            self.data.resize(pos + len, val);
+        } else {
+            // Overlapping copies repeat the last distance bytes;
+            // copy the repeating part in doubling runs.
+            let mut remaining = len;
+            while remaining > 0 {
+                let run = cmp::min(remaining, self.data.len() - start);
+                self.data.extend_from_within(start .. start + run);
+                remaining -= run;
+            }
+        }
+        Ok(())
+    }
+
+    fn copy_marked(&mut self, distance: usize, len: usize) {
+        for _ in 0 .. len {
+            let pos = self.data.len();
+            let (val, mark) = if distance > pos {
+                // From before the start; at most WINDOW_SIZE back.
+                (0, (distance - pos) as u16)
+            } else {
+                (self.data[pos - distance], self.marks[pos - distance])
+            };
+            self.data.push(val);
+            self.marks.push(mark);
+            if mark != 0 {
+                self.marked_end = pos + 1;
+            }
+        }
+        self.check_marking();
+    }
+
+    /// Fill in bytes copied from before the start, given the end
+    /// of the output that came before it.
+    pub fn resolve(&mut self, window: &[u8]) -> IoResult {
+        for (val, &mark) in self.data.iter_mut().zip(self.marks.iter()) {
+            if mark != 0 {
+                let back = mark as usize;
+                if back > window.len() {
+                    return Err(invalid_input("Invalid deflate distance"));
+                }
+                *val = window[window.len() - back];
+            }
+        }
+        self.marks = Vec::new();
+        self.marking = false;
+        self.marked_end = 0;
+        Ok(())
+    }
+}
+
+//
+// Decode one compressed block's symbols up to its end marker.
+//
+fn inflate_block(bits: &mut Bits,
+                 literals: &Huffman,
+                 distances: &Huffman,
+                 output: &mut Output,
+                 limit: usize) -> IoResult
+{
+    loop {
+        let symbol = literals.decode(bits)?;
+        if symbol < 256 {
+            output.literal(symbol as u8);
+        } else if symbol == 256 {
+            return Ok(());
+        } else {
+            let symbol = symbol - 257;
+            if symbol >= LENGTH_BASE.len() {
+                return Err(corrupt());
+            }
+            let len = LENGTH_BASE[symbol] as usize + bits.bits(u32::from(LENGTH_EXTRA[symbol]));
+            let symbol = distances.decode(bits)?;
+            if symbol >= DISTANCE_BASE.len() {
+                return Err(corrupt());
+            }
+            let distance = DISTANCE_BASE[symbol] as usize + bits.bits(u32::from(DISTANCE_EXTRA[symbol]));
+            output.copy(distance, len)?;
+        }
+        if bits.overrun() {
+            return Err(truncated());
+        }
+        if output.data.len() > limit {
+            return Err(invalid_input("Too much image data"));
+        }
+    }
+}
+
+//
+// Read the code tables at the start of a dynamic Huffman block.
+//
+fn dynamic_tables(bits: &mut Bits) -> io::Result<(Huffman, Huffman)> {
+    let literal_count = bits.bits(5) + 257;
+    let distance_count = bits.bits(5) + 1;
+    let code_length_count = bits.bits(4) + 4;
+    if literal_count > 286 || distance_count > 30 {
+        return Err(corrupt());
+    }
+
+    let mut code_lengths = [0u8; 19];
+    for &symbol in CODE_LENGTH_ORDER[.. code_length_count].iter() {
+        code_lengths[symbol] = bits.bits(3) as u8;
+    }
+    let code_lengths = Huffman::new(&code_lengths)?;
+
+    let count = literal_count + distance_count;
+    let mut lengths = vec![0u8; count];
+    let mut i = 0;
+    while i < count {
+        let symbol = code_lengths.decode(bits)?;
+        let (val, repeat) = match symbol {
+            0 ..= 15 => (symbol as u8, 1),
+            16 => {
+                if i == 0 {
+                    return Err(corrupt());
+                }
+                (lengths[i - 1], 3 + bits.bits(2))
+            },
+            17 => (0, 3 + bits.bits(3)),
+            _ => (0, 11 + bits.bits(7)),
+        };
+        if i + repeat > count {
+            return Err(corrupt());
+        }
+        for len in lengths[i .. i + repeat].iter_mut() {
+            *len = val;
+        }
+        i += repeat;
+    }
+    if bits.overrun() {
+        return Err(truncated());
+    }
+    if lengths[256] == 0 {
+        // No end of block code.
+        return Err(corrupt());
+    }
+
+    let literals = Huffman::new(&lengths[.. literal_count])?;
+    let distances = Huffman::new(&lengths[literal_count ..])?;
+    Ok((literals, distances))
+}
+
+//
+// Decode a piece of raw deflate data that starts at the beginning
+// of a block, producing at most limit bytes.
+//
+// The piece must end either right after a block that isn't the
+// final one, such as a sync flush's empty stored block, or with the
+// final block and its padding to a byte boundary; anything else is
+// an error, including the piece turning out not to have started on
+// a block boundary after all.
+//
+pub fn inflate(input: &[u8], limit: usize) -> io::Result<Output> {
+    let mut bits = Bits::new(input);
+    let end = input.len() * 8;
+    let mut output = Output::new(cmp::min(limit, input.len() * 4));
+    let mut fixed = None;
+
+    loop {
+        let pos = bits.position();
+        if pos == end {
+            // Ended on a block boundary.
+            break;
+        }
+        if pos > end {
+            return Err(truncated());
+        }
+
+        let last = bits.bits(1) == 1;
+        match bits.bits(2) {
+            0 => {
+                // Stored block.
+                bits.align();
+                let len = bits.bits(16);
+                let nlen = bits.bits(16);
+                if len != !nlen & 0xffff {
+                    return Err(corrupt());
+                }
+                let start = bits.position() / 8;
+                if start + len > input.len() {
+                    return Err(truncated());
+                }
+                output.extend(&input[start .. start + len]);
+                bits.seek(start + len);
+            },
+            1 => {
+                if fixed.is_none() {
+                    fixed = Some(Huffman::fixed());
+                }
+                if let Some((ref literals, ref distances)) = fixed {
+                    inflate_block(&mut bits, literals, distances, &mut output, limit)?;
+                }
+            },
+            2 => {
+                let (literals, distances) = dynamic_tables(&mut bits)?;
+                inflate_block(&mut bits, &literals, &distances, &mut output, limit)?;
+            },
+            _ => return Err(corrupt()),
+        }
+        if bits.overrun() {
+            return Err(truncated());
+        }
+        if output.data.len() > limit {
+            return Err(invalid_input("Too much image data"));
+        }
+
+        if last {
+            bits.align();
+            if bits.position() != end {
+                return Err(invalid_input("Data after end of deflate stream"));
+            }
+            output.last = true;
+            break;
+        }
+    }
+
+    // Only the marked bytes need filling in.
+    output.marking = false;
+    output.marks.truncate(output.marked_end);
+    Ok(output)
+}
+
+#[cfg(test)]
+mod tests {
+    use super::inflate;
+    use super::WINDOW_SIZE;
+    use super::super::CompressionLevel;
+    use super::super::Strategy;
+    use super::super::deflate::compressor;
+    use super::super::deflate::Backend;
+
+    // Bytes with some repetition, some near and some far apart.
+    fn sample(len: usize, seed: usize) -> Vec<u8> {
+        (0 .. len).map(|i| {
+            let x = i + seed;
+            ((x / 7) ^ (x % 13) ^ (x / 5000) * 31) as u8
+        }).collect()
+    }
+
+    #[test]
+    fn it_works() {
+        for &backend in [Backend::Zlib, Backend::Rle].iter() {
+            let data = sample(300 * 1024, 0);
+            let compressed = compressor(backend).compress(CompressionLevel::Default, Strategy::Default,
+                                                          &[], &data, true, Vec::new()).unwrap();
+            let output = inflate(&compressed, data.len()).unwrap();
+            assert!(output.last);
+            assert!(output.is_resolved());
+            assert!(output.data == data);
+        }
+    }
+
+    #[test]
+    fn it_works_in_pieces() {
+        // Compressed as the encoder does, each piece primed with the
+        // tail of the last, then decoded without it and filled in.
+        let data = sample(200 * 1024, 3);
+        let splits = [0, 1000, 90 * 1024, 100 * 1024, data.len()];
+        for &backend in [Backend::Zlib, Backend::Rle].iter() {
+            for pair in splits.windows(2) {
+                let (start, end) = (pair[0], pair[1]);
+                let window_start = start.saturating_sub(WINDOW_SIZE);
+                let last = end == data.len();
+                let compressed = compressor(backend).compress(CompressionLevel::High, Strategy::Default,
+                                                              &data[window_start .. start],
+                                                              &data[start .. end],
+                                                              last, Vec::new()).unwrap();
+                if !last {
+                    assert_eq!(compressed[compressed.len() - 4 ..], [0, 0, 0xff, 0xff]);
+                }
+
+                let mut output = inflate(&compressed, data.len()).unwrap();
+                assert_eq!(output.last, last);
+                assert_eq!(output.data.len(), end - start);
+                output.resolve(&data[window_start .. start]).unwrap();
+                assert!(output.data[..] == data[start .. end]);
+            }
+        }
+    }
+
+    #[test]
+    fn it_fails() {
+        let data = sample(64 * 1024, 0);
+        let compressed = compressor(Backend::Zlib).compress(CompressionLevel::Default, Strategy::Default,
+                                                            &[], &data, true, Vec::new()).unwrap();
+
+        // Cut short, run on, or too big for the limit.
+        assert!(inflate(&compressed[.. compressed.len() / 2], data.len()).is_err());
+        let mut longer = compressed.clone();
+        longer.push(0);
+        assert!(inflate(&longer, data.len()).is_err());
+        assert!(inflate(&compressed, data.len() / 2).is_err());
+
+        // Copies from before the start with nothing there.
+        let compressed = compressor(Backend::Zlib).compress(CompressionLevel::Default, Strategy::Default,
+                                                            &data[.. 1024], &data[.. 1024], true,
+                                                            Vec::new()).unwrap();
+        let mut output = inflate(&compressed, data.len()).unwrap();
+        assert!(!output.is_resolved());
+        assert!(output.resolve(&[]).is_err());
+    }
+}
@@ -0,0 +1,197 @@
+//
+// mtpng - a multithreaded parallel PNG encoder in Rust
+// interlace.rs - Adam7 interlacing pass layout
+//
+// Copyright (c) 2018-2024 Brooke Vibber
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+//
+
+//
+// An Adam7 image is stored as seven smaller images one after another,
+// each taking every nth pixel of every nth row starting from an offset.
+// Each pass is filtered on its own, as if it were a whole image, but
+// they all go into the same deflate stream.
+//
+// https://www.w3.org/TR/PNG/#8Interlace
+//
+
+use super::Header;
+use super::InterlaceMethod;
+
+// Starting column and row, and spacing between them, for each pass.
+pub struct Pass {
+    pub x: usize,
+    pub y: usize,
+    pub dx: usize,
+    pub dy: usize,
+}
+
+pub const PASSES: [Pass; 7] = [
+    Pass { x: 0, y: 0, dx: 8, dy: 8 },
+    Pass { x: 4, y: 0, dx: 8, dy: 8 },
+    Pass { x: 0, y: 4, dx: 4, dy: 8 },
+    Pass { x: 2, y: 0, dx: 4, dy: 4 },
+    Pass { x: 0, y: 2, dx: 2, dy: 4 },
+    Pass { x: 1, y: 0, dx: 2, dy: 2 },
+    Pass { x: 0, y: 1, dx: 1, dy: 2 },
+];
+
+fn count(size: usize, start: usize, step: usize) -> usize {
+    if size > start {
+        (size - start + step - 1) / step
+    } else {
+        0
+    }
+}
+
+//
+// Header describing a pass as an image of its own, for filtering.
+// Returns None for passes with no pixels in small images, which
+// are left out of the file entirely.
+//
+pub fn pass_header(header: &Header, pass: usize) -> Option<Header> {
+    let p = &PASSES[pass];
+    let width = count(header.width as usize, p.x, p.dx);
+    let height = count(header.height as usize, p.y, p.dy);
+    if width == 0 || height == 0 {
+        None
+    } else {
+        let mut pass_header = *header;
+        pass_header.width = width as u32;
+        pass_header.height = height as u32;
+        pass_header.interlace_method = InterlaceMethod::Standard;
+        Some(pass_header)
+    }
+}
+
+//
+// Length of the image's filtered data, with a filter byte per row
+// of each pass.
+//
+pub fn filtered_len(header: &Header) -> usize {
+    match header.interlace_method {
+        InterlaceMethod::Standard => (header.stride() + 1) * header.height as usize,
+        InterlaceMethod::Adam7 => (0 .. PASSES.len()).filter_map(|pass| pass_header(header, pass))
+                                                     .map(|pass| (pass.stride() + 1) * pass.height as usize)
+                                                     .sum(),
+    }
+}
+
+// Row of the whole image that a pass row comes from.
+pub fn image_row(pass: usize, row: usize) -> usize {
+    PASSES[pass].y + row * PASSES[pass].dy
+}
+
+//
+// Gather a pass's width pixels from a row of the whole image into
+// out, which must be zeroed and the pass's stride in length.
+//
+pub fn extract_row(pass: usize, bits_per_pixel: usize, width: usize, src: &[u8], out: &mut [u8]) {
+    let p = &PASSES[pass];
+    if bits_per_pixel >= 8 {
+        let bpp = bits_per_pixel >> 3;
+        for (x, dest) in out.chunks_mut(bpp).enumerate() {
+            let start = (p.x + x * p.dx) * bpp;
+            dest.copy_from_slice(&src[start .. start + bpp]);
+        }
+    } else {
+        // Pixels are packed most significant bits first.
+        let mask = (1u8 << bits_per_pixel) - 1;
+        for x in 0 .. width {
+            let src_bit = (p.x + x * p.dx) * bits_per_pixel;
+            let val = (src[src_bit >> 3] >> (8 - bits_per_pixel - (src_bit & 7))) & mask;
+            let dest_bit = x * bits_per_pixel;
+            out[dest_bit >> 3] |= val << (8 - bits_per_pixel - (dest_bit & 7));
+        }
+    }
+}
+
+//
+// Scatter a pass's width pixels from src back to their places in a
+// row of the whole image, which must start zeroed.
+//
+pub fn insert_row(pass: usize, bits_per_pixel: usize, width: usize, src: &[u8], out: &mut [u8]) {
+    let p = &PASSES[pass];
+    if bits_per_pixel >= 8 {
+        let bpp = bits_per_pixel >> 3;
+        for (x, pixel) in src.chunks(bpp).take(width).enumerate() {
+            let start = (p.x + x * p.dx) * bpp;
+            out[start .. start + bpp].copy_from_slice(pixel);
+        }
+    } else {
+        let mask = (1u8 << bits_per_pixel) - 1;
+        for x in 0 .. width {
+            let src_bit = x * bits_per_pixel;
+            let val = (src[src_bit >> 3] >> (8 - bits_per_pixel - (src_bit & 7))) & mask;
+            let dest_bit = (p.x + x * p.dx) * bits_per_pixel;
+            out[dest_bit >> 3] |= val << (8 - bits_per_pixel - (dest_bit & 7));
+        }
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use super::super::ColorType;
+
+    #[test]
+    fn it_works() {
+        // Every pixel of an 8-bit image lands in exactly one pass.
+        let mut header = Header::new();
+        header.set_size(13, 11).unwrap();
+        header.set_color(ColorType::Greyscale, 8).unwrap();
+        let image: Vec<u8> = (0 .. 13 * 11).map(|i| i as u8).collect();
+
+        let mut seen = vec![0; image.len()];
+        for pass in 0 .. 7 {
+            let pass_header = pass_header(&header, pass).unwrap();
+            for row in 0 .. pass_header.height as usize {
+                let y = image_row(pass, row);
+                let mut out = vec![0u8; pass_header.stride()];
+                extract_row(pass, 8, pass_header.width as usize, &image[y * 13 .. y * 13 + 13], &mut out);
+                for val in out {
+                    seen[val as usize] += 1;
+                }
+            }
+        }
+        assert!(seen.iter().all(|&n| n == 1));
+
+        // Tiny images skip the passes with nothing in them.
+        header.set_size(1, 1).unwrap();
+        assert!(pass_header(&header, 0).is_some());
+        assert!((1 .. 7).all(|pass| pass_header(&header, pass).is_none()));
+    }
+
+    #[test]
+    fn it_works_packed() {
+        // Pass 6 takes the odd columns, which are the set bits.
+        let mut out = vec![0u8; 1];
+        extract_row(5, 1, 6, &[0b0101_0101, 0b0101_0000], &mut out);
+        assert_eq!(out[0], 0b1111_1100);
+
+        let mut out = vec![0u8; 2];
+        extract_row(5, 4, 3, &[0x12, 0x34, 0x56], &mut out);
+        assert_eq!(out, vec![0x24, 0x60]);
+
+        let mut row = vec![0u8; 3];
+        insert_row(5, 4, 3, &out, &mut row);
+        assert_eq!(row, vec![0x02, 0x04, 0x06]);
+    }
+}
@@ -30,19 +30,42 @@ extern crate crc;
 extern crate libz_sys;
 #[macro_use] extern crate itertools;
 
-#[cfg(feature="capi")]
+#[cfg(any(feature="capi", feature="mmap"))]
 extern crate libc;
 #[cfg(feature="capi")]
 pub mod capi;
 
+#[cfg(feature="bench")]
+#[doc(hidden)]
+pub mod bench;
+pub mod batch;
+mod buffer;
+mod cache;
+mod convert;
 mod deflate;
 mod filter;
+mod inflate;
+mod interlace;
+mod reader;
+mod reduce;
+mod rle;
+mod simd;
+pub mod decoder;
 pub mod encoder;
+#[cfg(all(feature="mmap", unix))]
+pub mod mmap;
+pub mod stats;
 mod utils;
 mod writer;
 
+pub type BufferPool = buffer::BufferPool;
+pub type ChunkCache = cache::ChunkCache;
+pub type ChannelOrder = convert::ChannelOrder;
+pub type ColorReduction = reduce::ColorReduction;
 pub type Strategy = deflate::Strategy;
+pub type Backend = deflate::Backend;
 pub type Filter = filter::Filter;
+pub type Heuristic = filter::Heuristic;
 
 use std::convert::TryFrom;
 use std::io;
@@ -138,8 +161,6 @@ pub enum FilterMethod {
 }
 
 /// PNG header interlace method representation.
-///
-/// Currently only Standard is supported; Adam7 interlacing will throw an error if used.
 #[derive(Copy, Clone)]
 #[repr(u8)]
 pub enum InterlaceMethod {
@@ -149,10 +170,28 @@ pub enum InterlaceMethod {
     Standard = 0,
     /// Adam7 interlacing.
     ///
-    /// Not yet supported.
+    /// The image is stored as seven passes of increasing detail, so
+    /// a partial download can show a rough preview of the whole.
+    /// Files come out larger and the whole image must be input before
+    /// any image data can be output.
     Adam7 = 1,
 }
 
+impl TryFrom<u8> for InterlaceMethod {
+    type Error = io::Error;
+
+    /// Validate and produce an InterlaceMethod from one of the PNG header constants.
+    ///
+    /// Will return an error on invalid input.
+    fn try_from(val: u8) -> Result<Self, Self::Error> {
+        match val {
+            0 => Ok(InterlaceMethod::Standard),
+            1 => Ok(InterlaceMethod::Adam7),
+            _ => Err(invalid_input("Invalid interlace method")),
+        }
+    }
+}
+
 /// PNG header representation.
 ///
 /// You must create one of these with image metadata when encoding,
@@ -245,7 +284,7 @@ impl Header {
 
         // And round up to nearest byte.
         let stride_bytes = stride_bits >> 3;
-        let remainder = stride_bits & 3;
+        let remainder = stride_bits & 7;
         if remainder > 0 {
             stride_bytes + 1
         } else {
@@ -306,13 +345,7 @@ impl Header {
     }
 
     /// Set the interlace method.
-    ///
-    /// Currently only Standard is supported; requesting Adam7 will return an error.
     pub fn set_interlace_method(&mut self, interlace_method: InterlaceMethod) -> io::Result<()> {
-        match interlace_method {
-            InterlaceMethod::Standard => {},
-            InterlaceMethod::Adam7 => return Err(invalid_input("Adam7 interlacing not yet")),
-        }
         self.interlace_method = interlace_method;
         Ok(())
     }
@@ -324,9 +357,185 @@ impl Default for Header {
     }
 }
 
-/// Representation of deflate compression level.
+/// APNG frame disposal, done to a frame's region before rendering the next.
 #[derive(Copy, Clone)]
+#[repr(u8)]
+pub enum DisposeOp {
+    /// Leave the frame as it is.
+    None = 0,
+    /// Clear the frame's region to fully transparent black.
+    Background = 1,
+    /// Revert the frame's region to what it was before this frame.
+    Previous = 2,
+}
+
+impl TryFrom<u8> for DisposeOp {
+    type Error = io::Error;
+
+    /// Validate and convert u8 to DisposeOp.
+    ///
+    /// Will return an error on invalid input.
+    fn try_from(val: u8) -> Result<Self, Self::Error> {
+        match val {
+            0 => Ok(DisposeOp::None),
+            1 => Ok(DisposeOp::Background),
+            2 => Ok(DisposeOp::Previous),
+            _ => Err(invalid_input("Invalid dispose op")),
+        }
+    }
+}
+
+/// APNG frame blending, for how a frame is drawn over the previous one.
+#[derive(Copy, Clone)]
+#[repr(u8)]
+pub enum BlendOp {
+    /// Replace the frame's region, including alpha.
+    Source = 0,
+    /// Alpha-blend the frame over what's there.
+    Over = 1,
+}
+
+impl TryFrom<u8> for BlendOp {
+    type Error = io::Error;
+
+    /// Validate and convert u8 to BlendOp.
+    ///
+    /// Will return an error on invalid input.
+    fn try_from(val: u8) -> Result<Self, Self::Error> {
+        match val {
+            0 => Ok(BlendOp::Source),
+            1 => Ok(BlendOp::Over),
+            _ => Err(invalid_input("Invalid blend op")),
+        }
+    }
+}
+
+/// APNG frame control representation.
+///
+/// Describes where one frame of an animation goes and for how long,
+/// for Encoder::write_frame_control().
+#[derive(Copy, Clone)]
+pub struct FrameControl {
+    width: u32,
+    height: u32,
+    x_offset: u32,
+    y_offset: u32,
+    delay_num: u16,
+    delay_den: u16,
+    dispose_op: DisposeOp,
+    blend_op: BlendOp,
+}
+
+impl FrameControl {
+    /// Create a new FrameControl struct with default settings.
+    ///
+    /// This will be 1x1 pixels at the top left, shown for no delay,
+    /// with no disposal and replacing its region.
+    /// You can mutate the state using the set_* methods.
+    pub fn new() -> FrameControl {
+        FrameControl {
+            width: 1,
+            height: 1,
+            x_offset: 0,
+            y_offset: 0,
+            delay_num: 0,
+            delay_den: 0,
+            dispose_op: DisposeOp::None,
+            blend_op: BlendOp::Source,
+        }
+    }
+
+    /// Get the pixel width of the frame.
+    pub fn width(&self) -> u32 {
+        self.width
+    }
+
+    /// Get the pixel height of the frame.
+    pub fn height(&self) -> u32 {
+        self.height
+    }
+
+    /// Get the horizontal position of the frame in the image.
+    pub fn x_offset(&self) -> u32 {
+        self.x_offset
+    }
+
+    /// Get the vertical position of the frame in the image.
+    pub fn y_offset(&self) -> u32 {
+        self.y_offset
+    }
+
+    /// Get the frame delay as a fraction of a second.
+    pub fn delay(&self) -> (u16, u16) {
+        (self.delay_num, self.delay_den)
+    }
+
+    /// Get the disposal done after the frame is shown.
+    pub fn dispose_op(&self) -> DisposeOp {
+        self.dispose_op
+    }
+
+    /// Get the blending done when the frame is drawn.
+    pub fn blend_op(&self) -> BlendOp {
+        self.blend_op
+    }
+
+    /// Set the pixel dimensions of the frame.
+    ///
+    /// Returns error if width or height are 0.
+    pub fn set_size(&mut self, width: u32, height: u32) -> io::Result<()> {
+        if width == 0 {
+            Err(invalid_input("width cannot be 0"))
+        } else if height == 0 {
+            Err(invalid_input("height cannot be 0"))
+        } else {
+            self.width = width;
+            self.height = height;
+            Ok(())
+        }
+    }
+
+    /// Set the position of the frame's top left corner in the image.
+    pub fn set_offset(&mut self, x_offset: u32, y_offset: u32) -> io::Result<()> {
+        self.x_offset = x_offset;
+        self.y_offset = y_offset;
+        Ok(())
+    }
+
+    /// Set how long to show the frame, as a fraction of a second.
+    ///
+    /// A denominator of 0 is taken as 100, for hundredths of a second.
+    pub fn set_delay(&mut self, delay_num: u16, delay_den: u16) -> io::Result<()> {
+        self.delay_num = delay_num;
+        self.delay_den = delay_den;
+        Ok(())
+    }
+
+    /// Set the disposal done after the frame is shown.
+    pub fn set_dispose_op(&mut self, dispose_op: DisposeOp) -> io::Result<()> {
+        self.dispose_op = dispose_op;
+        Ok(())
+    }
+
+    /// Set the blending done when the frame is drawn.
+    pub fn set_blend_op(&mut self, blend_op: BlendOp) -> io::Result<()> {
+        self.blend_op = blend_op;
+        Ok(())
+    }
+}
+
+impl Default for FrameControl {
+    fn default() -> Self {
+        Self::new()
+    }
+}
+
+/// Representation of deflate compression level.
+#[derive(Copy, Clone, PartialEq, Eq)]
 pub enum CompressionLevel {
+    /// Fastest, poorest compression, using the built-in run-length
+    /// encoder (zlib level 1 if the Zlib backend is forced).
+    Fastest,
     /// Fast but poor compression (zlib level 1).
     Fast,
     /// Good balance of speed and compression (zlib level 6).
@@ -343,6 +552,7 @@ impl TryFrom<u8> for CompressionLevel {
     /// Will return an error on invalid input.
     fn try_from(val: u8) -> Result<Self, Self::Error> {
         match val {
+            0 => Ok(CompressionLevel::Fastest),
             1 => Ok(CompressionLevel::Fast),
             6 => Ok(CompressionLevel::Default),
             9 => Ok(CompressionLevel::High),
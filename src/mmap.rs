@@ -0,0 +1,353 @@
+//
+// mtpng - a multithreaded parallel PNG encoder in Rust
+// mmap.rs - memory-mapped file input and output
+//
+// Copyright (c) 2018-2024 Brooke Vibber
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+//
+
+//
+// Reading a huge raw image into a Vec copies it out of the page
+// cache into the heap, and writing the PNG through a File copies
+// it back in again. Mapping the files instead lets filter jobs
+// read pixels straight out of the page cache, and output go
+// straight into it.
+//
+// Output is mapped with room for the whole compressed image up
+// front, sized from a deflate bound, so it rarely needs to grow;
+// the file is cut back to the bytes actually written at the end.
+//
+
+use std::fs::File;
+use std::fs::OpenOptions;
+
+use std::io;
+use std::io::{IoSlice, Seek, SeekFrom, Write};
+
+use std::os::unix::io::AsRawFd;
+
+use std::path::Path;
+
+use std::ptr;
+use std::slice;
+
+use super::Header;
+
+use super::deflate;
+use super::interlace;
+
+use super::utils::*;
+
+//
+// Map len bytes of a file, or nothing for an empty range, which
+// mmap would refuse.
+//
+fn map(file: &File, len: usize, writable: bool) -> io::Result<*mut u8> {
+    if len == 0 {
+        return Ok(ptr::null_mut());
+    }
+    let prot = if writable {
+        ::libc::PROT_READ | ::libc::PROT_WRITE
+    } else {
+        ::libc::PROT_READ
+    };
+    let addr = unsafe {
+        ::libc::mmap(ptr::null_mut(),
+                     len,
+                     prot,
+                     ::libc::MAP_SHARED,
+                     file.as_raw_fd(),
+                     0)
+    };
+    if addr == ::libc::MAP_FAILED {
+        Err(io::Error::last_os_error())
+    } else {
+        Ok(addr as *mut u8)
+    }
+}
+
+fn unmap(addr: *mut u8, len: usize) {
+    if !addr.is_null() {
+        unsafe {
+            ::libc::munmap(addr as *mut ::libc::c_void, len);
+        }
+    }
+}
+
+/// A file mapped read-only into memory, such as a raw image dump.
+///
+/// Can be passed to Encoder::write_image_frame() in an Arc, so filter
+/// jobs read rows straight out of the page cache without copying the
+/// file into memory first.
+///
+/// The file must not be truncated by anyone else while mapped;
+/// reading past its new end would crash the process.
+pub struct MappedFile {
+    addr: *mut u8,
+    len: usize,
+}
+
+// The mapping is read-only, so may be read from any thread.
+unsafe impl Send for MappedFile {}
+unsafe impl Sync for MappedFile {}
+
+impl MappedFile {
+    /// Map the whole of the file at the given path.
+    pub fn open<P: AsRef<Path>>(path: P) -> io::Result<MappedFile> {
+        MappedFile::from_file(&File::open(path)?)
+    }
+
+    /// Map the whole of an open file. The file may be closed
+    /// afterwards; the mapping stays valid.
+    pub fn from_file(file: &File) -> io::Result<MappedFile> {
+        let len = file.metadata()?.len();
+        if len > usize::MAX as u64 {
+            return Err(invalid_input("File is too large to map"));
+        }
+        let len = len as usize;
+        let addr = map(file, len, false)?;
+        if !addr.is_null() {
+            // Rows are read front to back; a hint to read ahead.
+            unsafe {
+                ::libc::madvise(addr as *mut ::libc::c_void, len, ::libc::MADV_SEQUENTIAL);
+            }
+        }
+        Ok(MappedFile {
+            addr: addr,
+            len: len,
+        })
+    }
+
+    /// Return the length of the mapped file in bytes.
+    pub fn len(&self) -> usize {
+        self.len
+    }
+
+    /// Whether the mapped file is empty.
+    pub fn is_empty(&self) -> bool {
+        self.len == 0
+    }
+}
+
+impl AsRef<[u8]> for MappedFile {
+    fn as_ref(&self) -> &[u8] {
+        if self.addr.is_null() {
+            &[]
+        } else {
+            unsafe {
+                slice::from_raw_parts(self.addr, self.len)
+            }
+        }
+    }
+}
+
+impl Drop for MappedFile {
+    fn drop(&mut self) {
+        unmap(self.addr, self.len);
+    }
+}
+
+/// Upper bound on the size of an encoded PNG for the header, for
+/// preallocating output.
+///
+/// Covers the signature, the header, palette, and transparency
+/// chunks, and the image data as a single compressed stream. Chunked
+/// compression and streaming mode each add a few bytes per chunk,
+/// and other metadata chunks aren't counted, so this is a good
+/// starting size rather than a guarantee.
+pub fn output_bound(header: &Header) -> usize {
+    let filtered = interlace::filtered_len(header);
+
+    // Signature, IHDR, PLTE, tRNS, and IEND, then the image data
+    // with some slack for chunk framing.
+    let headers = 8 + (12 + 13) + (12 + 768) + (12 + 256) + 12;
+    headers + deflate::max_bound(filtered) + 64 * 1024
+}
+
+/// A Write + Seek output writing into a memory-mapped file.
+///
+/// The file is mapped at a given capacity up front, and remapped
+/// larger if output runs past it. When finished, or dropped, the
+/// file is truncated to the bytes written.
+///
+/// Use with Encoder::new_seekable(), with a capacity from
+/// output_bound().
+pub struct MappedWriter {
+    file: File,
+    addr: *mut u8,
+    capacity: usize,
+    len: usize,
+    pos: usize,
+}
+
+// Only touched through &mut self.
+unsafe impl Send for MappedWriter {}
+
+impl MappedWriter {
+    /// Create or truncate the file at the given path, and map it
+    /// with room for capacity bytes of output.
+    pub fn create<P: AsRef<Path>>(path: P, capacity: usize) -> io::Result<MappedWriter> {
+        let file = OpenOptions::new().read(true)
+                                     .write(true)
+                                     .create(true)
+                                     .truncate(true)
+                                     .open(path)?;
+        MappedWriter::from_file(file, capacity)
+    }
+
+    /// Map an open file for output, which must be opened for both
+    /// reading and writing. Existing contents are overwritten.
+    pub fn from_file(file: File, capacity: usize) -> io::Result<MappedWriter> {
+        file.set_len(capacity as u64)?;
+        let addr = map(&file, capacity, true)?;
+        Ok(MappedWriter {
+            file: file,
+            addr: addr,
+            capacity: capacity,
+            len: 0,
+            pos: 0,
+        })
+    }
+
+    /// Truncate the file to the bytes written, and return it.
+    pub fn finish(mut self) -> io::Result<File> {
+        self.truncate()?;
+        let file = self.file.try_clone()?;
+        Ok(file)
+    }
+
+    fn truncate(&mut self) -> io::Result<()> {
+        unmap(self.addr, self.capacity);
+        self.addr = ptr::null_mut();
+        self.capacity = 0;
+        self.file.set_len(self.len as u64)
+    }
+
+    //
+    // Make room for output up to the given end, at least doubling
+    // the mapping each time so growth costs stay linear.
+    //
+    fn reserve(&mut self, end: usize) -> io::Result<()> {
+        if end <= self.capacity {
+            return Ok(());
+        }
+        let capacity = end.max(self.capacity * 2);
+        unmap(self.addr, self.capacity);
+        self.addr = ptr::null_mut();
+        self.capacity = 0;
+        self.file.set_len(capacity as u64)?;
+        self.addr = map(&self.file, capacity, true)?;
+        self.capacity = capacity;
+        Ok(())
+    }
+
+    fn copy(&mut self, buf: &[u8]) {
+        unsafe {
+            ptr::copy_nonoverlapping(buf.as_ptr(), self.addr.add(self.pos), buf.len());
+        }
+        self.pos += buf.len();
+        self.len = self.len.max(self.pos);
+    }
+}
+
+impl Write for MappedWriter {
+    fn write(&mut self, buf: &[u8]) -> io::Result<usize> {
+        self.write_vectored(&[IoSlice::new(buf)])
+    }
+
+    fn write_vectored(&mut self, bufs: &[IoSlice]) -> io::Result<usize> {
+        let total: usize = bufs.iter().map(|buf| buf.len()).sum();
+        if total == 0 {
+            return Ok(0);
+        }
+        let end = self.pos.checked_add(total)
+                          .ok_or_else(|| invalid_input("Output position overflows"))?;
+        self.reserve(end)?;
+        for buf in bufs {
+            self.copy(buf);
+        }
+        Ok(total)
+    }
+
+    fn flush(&mut self) -> io::Result<()> {
+        // Written pages are already in the page cache.
+        Ok(())
+    }
+}
+
+impl Seek for MappedWriter {
+    fn seek(&mut self, pos: SeekFrom) -> io::Result<u64> {
+        let pos = match pos {
+            SeekFrom::Start(offset) => offset as i128,
+            SeekFrom::End(offset) => self.len as i128 + offset as i128,
+            SeekFrom::Current(offset) => self.pos as i128 + offset as i128,
+        };
+        if pos < 0 || pos > usize::MAX as i128 {
+            return Err(invalid_input("Invalid seek position"));
+        }
+        self.pos = pos as usize;
+        Ok(pos as u64)
+    }
+}
+
+impl Drop for MappedWriter {
+    fn drop(&mut self) {
+        if self.capacity != 0 {
+            let _ = self.truncate();
+        }
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    use std::env;
+    use std::fs;
+    use std::io::Read;
+    use std::process;
+
+    #[test]
+    fn it_works() {
+        let path = env::temp_dir().join(format!("mtpng-mmap-{}", process::id()));
+
+        // Start small so writing has to grow the mapping.
+        let mut writer = MappedWriter::create(&path, 4).unwrap();
+        writer.write_all(b"xxxx hello").unwrap();
+        writer.write_all(&[7u8; 1000]).unwrap();
+        writer.seek(SeekFrom::Start(0)).unwrap();
+        writer.write_all(b"abcd").unwrap();
+        writer.seek(SeekFrom::End(0)).unwrap();
+        writer.write_all(b"!").unwrap();
+        let mut file = writer.finish().unwrap();
+
+        let mut written = Vec::new();
+        file.seek(SeekFrom::Start(0)).unwrap();
+        file.read_to_end(&mut written).unwrap();
+        assert_eq!(written.len(), 1011);
+        assert_eq!(&written[.. 10], b"abcd hello");
+        assert_eq!(written[1010], b'!');
+
+        let mapped = MappedFile::open(&path).unwrap();
+        assert_eq!(mapped.as_ref(), &written[..]);
+
+        fs::remove_file(&path).unwrap();
+    }
+}
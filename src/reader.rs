@@ -0,0 +1,202 @@
+//
+// mtpng - a multithreaded parallel PNG encoder in Rust
+// reader.rs - low-level PNG chunk reader
+//
+// Copyright (c) 2018-2024 Brooke Vibber
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+//
+
+use std::convert::TryFrom;
+
+use std::io;
+use std::io::Read;
+
+use super::ColorType;
+use super::Header;
+use super::InterlaceMethod;
+
+use super::deflate;
+
+use super::utils::*;
+
+const SIGNATURE: [u8; 8] = [137, 80, 78, 71, 13, 10, 26, 10];
+
+// Largest chunk length allowed by the spec.
+const MAX_CHUNK_LENGTH: u32 = 0x7fff_ffff;
+
+//
+// A chunk's four-byte tag and its data.
+//
+pub type Chunk = ([u8; 4], Vec<u8>);
+
+//
+// Whether a chunk must be understood to decode the image,
+// rather than being safe to skip.
+//
+// https://www.w3.org/TR/PNG/#5Chunk-naming-conventions
+//
+pub fn is_critical(tag: &[u8; 4]) -> bool {
+    tag[0] & 0x20 == 0
+}
+
+pub struct Reader<R: Read> {
+    input: R,
+}
+
+impl<R: Read> Reader<R> {
+    //
+    // Creates a new PNG chunk stream reader.
+    // Consumes the input Read object, but will
+    // give it back to you via Reader::into_inner().
+    //
+    pub fn new(input: R) -> Reader<R> {
+        Reader {
+            input,
+        }
+    }
+
+    pub fn into_inner(self) -> R {
+        self.input
+    }
+
+    //
+    // Read and check the PNG file signature.
+    //
+    pub fn read_signature(&mut self) -> IoResult {
+        let mut bytes = [0u8; 8];
+        self.input.read_exact(&mut bytes)?;
+        if bytes != SIGNATURE {
+            return Err(invalid_input("Not a PNG file"));
+        }
+        Ok(())
+    }
+
+    //
+    // Read the next chunk from the input stream, checking its CRC.
+    //
+    // https://www.w3.org/TR/PNG/#5DataRep
+    //
+    pub fn read_chunk(&mut self) -> io::Result<Chunk> {
+        let mut prefix = [0u8; 8];
+        self.input.read_exact(&mut prefix)?;
+        let len = u32::from_be_bytes([prefix[0], prefix[1], prefix[2], prefix[3]]);
+        if len > MAX_CHUNK_LENGTH {
+            return Err(invalid_input("Invalid chunk length"));
+        }
+        let tag = [prefix[4], prefix[5], prefix[6], prefix[7]];
+
+        // Read through take() rather than sizing a buffer up front,
+        // so a bogus length in a truncated file doesn't allocate it all.
+        let mut data = Vec::new();
+        (&mut self.input).take(u64::from(len)).read_to_end(&mut data)?;
+        if data.len() != len as usize {
+            return Err(io::Error::new(io::ErrorKind::UnexpectedEof, "Truncated chunk"));
+        }
+
+        let mut trailer = [0u8; 4];
+        self.input.read_exact(&mut trailer)?;
+        let checksum = deflate::crc32(deflate::crc32(deflate::crc32_initial(), &tag), &data);
+        if checksum != u32::from_be_bytes(trailer) {
+            return Err(invalid_input("Bad chunk checksum"));
+        }
+
+        Ok((tag, data))
+    }
+}
+
+//
+// Parse the data of an IHDR chunk.
+//
+// https://www.w3.org/TR/PNG/#11IHDR
+//
+pub fn parse_header(data: &[u8]) -> io::Result<Header> {
+    if data.len() != 13 {
+        return Err(invalid_input("Invalid header length"));
+    }
+    let width = u32::from_be_bytes([data[0], data[1], data[2], data[3]]);
+    let height = u32::from_be_bytes([data[4], data[5], data[6], data[7]]);
+    let depth = data[8];
+    let color_type = ColorType::try_from(data[9])?;
+    if data[10] != 0 {
+        return Err(invalid_input("Invalid compression method"));
+    }
+    if data[11] != 0 {
+        return Err(invalid_input("Invalid filter method"));
+    }
+    let interlace_method = InterlaceMethod::try_from(data[12])?;
+
+    let mut header = Header::new();
+    header.set_size(width, height)?;
+    header.set_color(color_type, depth)?;
+    header.set_interlace_method(interlace_method)?;
+    Ok(header)
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use super::super::writer::Writer;
+
+    #[test]
+    fn it_works() {
+        let mut header = Header::new();
+        header.set_size(640, 480).unwrap();
+        header.set_color(ColorType::IndexedColor, 4).unwrap();
+        header.set_interlace_method(InterlaceMethod::Adam7).unwrap();
+
+        let mut output = Vec::<u8>::new();
+        {
+            let mut writer = Writer::new(&mut output);
+            writer.write_signature().unwrap();
+            writer.write_header(header).unwrap();
+            writer.write_chunk(b"IDAT", b"01234567890123456789").unwrap();
+            writer.write_chunk(b"IEND", b"").unwrap();
+        }
+
+        let mut reader = Reader::new(&output[..]);
+        reader.read_signature().unwrap();
+        let (tag, data) = reader.read_chunk().unwrap();
+        assert_eq!(&tag, b"IHDR");
+        let parsed = parse_header(&data).unwrap();
+        assert_eq!(parsed.width(), 640);
+        assert_eq!(parsed.height(), 480);
+        assert_eq!(parsed.depth(), 4);
+        assert_eq!(parsed.color_type() as u8, ColorType::IndexedColor as u8);
+        assert_eq!(parsed.interlace_method() as u8, InterlaceMethod::Adam7 as u8);
+
+        let (tag, data) = reader.read_chunk().unwrap();
+        assert_eq!(&tag, b"IDAT");
+        assert_eq!(&data[..], b"01234567890123456789");
+        assert!(is_critical(&tag));
+
+        let (tag, _) = reader.read_chunk().unwrap();
+        assert_eq!(&tag, b"IEND");
+        assert!(reader.read_chunk().is_err());
+
+        // A flipped bit fails the checksum.
+        output[40] ^= 1;
+        let mut reader = Reader::new(&output[..]);
+        reader.read_signature().unwrap();
+        reader.read_chunk().unwrap();
+        assert!(reader.read_chunk().is_err());
+
+        assert!(Reader::new(&b"GIF89a.."[..]).read_signature().is_err());
+    }
+}
@@ -0,0 +1,707 @@
+//
+// mtpng - a multithreaded parallel PNG encoder in Rust
+// reduce.rs - lossless color type and bit depth reduction
+//
+// Copyright (c) 2018-2024 Brooke Vibber
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+//
+
+//
+// Images often come in as truecolor with alpha whatever they hold:
+// fully opaque, all grey, a handful of colors, or 16-bit samples that
+// were widened from 8. Writing them in the smallest color type and
+// depth that still holds every pixel exactly shrinks the input to
+// every later stage, often by several times.
+//
+// The whole image has to be scanned before the header can be written,
+// so this is done up front, in parallel over chunks of rows. The rows
+// are converted later on the worker threads, as each chunk is filtered.
+//
+
+use std::cmp;
+
+use std::collections::HashMap;
+use std::collections::HashSet;
+
+use std::io;
+
+use std::sync::Arc;
+
+use rayon::Scope;
+
+use super::ColorType;
+use super::Header;
+
+use super::convert::InputFormat;
+use super::encoder::Options;
+
+use super::utils::*;
+
+// Most colors a palette can hold.
+const MAX_COLORS: usize = 256;
+
+//
+// Read a pixel's samples as red, green, blue, and alpha,
+// at the image's depth.
+//
+#[inline(always)]
+fn pixel(color_type: ColorType, depth: u8, row: &[u8], x: usize) -> [u16; 4] {
+    let sample = |i: usize| -> u16 {
+        if depth == 16 {
+            u16::from(row[i * 2]) << 8 | u16::from(row[i * 2 + 1])
+        } else {
+            u16::from(row[i])
+        }
+    };
+    let max = if depth == 16 { 65535 } else { 255 };
+    let base = x * color_type.channels();
+    match color_type {
+        ColorType::Greyscale => {
+            let grey = sample(base);
+            [grey, grey, grey, max]
+        },
+        ColorType::GreyscaleAlpha => {
+            let grey = sample(base);
+            [grey, grey, grey, sample(base + 1)]
+        },
+        ColorType::Truecolor => [sample(base), sample(base + 1), sample(base + 2), max],
+        ColorType::TruecolorAlpha => [sample(base), sample(base + 1), sample(base + 2), sample(base + 3)],
+        ColorType::IndexedColor => panic!("Tried to read palette indices as colors"),
+    }
+}
+
+//
+// A pixel as 8-bit red, green, blue, and alpha, for palette lookups.
+// Only meaningful where 16-bit samples fit in 8 bits.
+//
+#[inline(always)]
+fn rgba8(pixel: [u16; 4], depth: u8) -> u32 {
+    let shift = if depth == 16 { 8 } else { 0 };
+    u32::from(pixel[0] >> shift) << 24 |
+    u32::from(pixel[1] >> shift) << 16 |
+    u32::from(pixel[2] >> shift) << 8 |
+    u32::from(pixel[3] >> shift)
+}
+
+//
+// Fewest bits that hold an 8-bit grey level exactly: at depth d
+// the levels are the multiples of 255 / (2^d - 1).
+//
+fn grey_depth(level: u16) -> u8 {
+    if level % 255 == 0 {
+        1
+    } else if level % 85 == 0 {
+        2
+    } else if level % 17 == 0 {
+        4
+    } else {
+        8
+    }
+}
+
+fn palette_depth(colors: usize) -> u8 {
+    match colors {
+        0 ..= 2  => 1,
+        3 ..= 4  => 2,
+        5 ..= 16 => 4,
+        _        => 8,
+    }
+}
+
+//
+// What a chunk of rows, or the whole image, turns out to need.
+//
+struct Stats {
+    // Every alpha sample is fully opaque.
+    opaque: bool,
+
+    // Every pixel has equal red, green, and blue.
+    grey: bool,
+
+    // Every 16-bit sample has equal high and low bytes,
+    // so loses nothing at 8 bits.
+    fits_8: bool,
+
+    // Fewest bits that hold every grey level, at 8 bits.
+    grey_depth: u8,
+
+    // Distinct colors, until there are too many for a palette.
+    colors: Option<HashSet<u32>>,
+}
+
+impl Stats {
+    fn new() -> Stats {
+        Stats {
+            opaque: true,
+            grey: true,
+            fits_8: true,
+            grey_depth: 1,
+            colors: Some(HashSet::new()),
+        }
+    }
+
+    fn scan_row(&mut self, header: &Header, row: &[u8]) {
+        let color_type = header.color_type;
+        let depth = header.depth;
+        let max = if depth == 16 { 65535 } else { 255 };
+
+        // Neighboring pixels are very often the same.
+        let mut last = None;
+        for x in 0 .. header.width as usize {
+            let pixel = pixel(color_type, depth, row, x);
+            if last == Some(pixel) {
+                continue;
+            }
+            last = Some(pixel);
+
+            if pixel[3] != max {
+                self.opaque = false;
+            }
+            if pixel[0] != pixel[1] || pixel[1] != pixel[2] {
+                self.grey = false;
+            }
+            if depth == 16 && pixel.iter().any(|&sample| sample >> 8 != sample & 0xff) {
+                self.fits_8 = false;
+            }
+            if self.grey && self.grey_depth < 8 {
+                let level = if depth == 16 { pixel[0] >> 8 } else { pixel[0] };
+                self.grey_depth = cmp::max(self.grey_depth, grey_depth(level));
+            }
+
+            let overflow = match self.colors {
+                Some(ref mut colors) => {
+                    colors.insert(rgba8(pixel, depth));
+                    colors.len() > MAX_COLORS
+                },
+                None => false,
+            };
+            if overflow {
+                self.colors = None;
+            }
+        }
+    }
+
+    fn merge(&mut self, other: Stats) {
+        self.opaque &= other.opaque;
+        self.grey &= other.grey;
+        self.fits_8 &= other.fits_8;
+        self.grey_depth = cmp::max(self.grey_depth, other.grey_depth);
+        self.colors = match (self.colors.take(), other.colors) {
+            (Some(mut colors), Some(other)) => {
+                colors.extend(other);
+                if colors.len() > MAX_COLORS {
+                    None
+                } else {
+                    Some(colors)
+                }
+            },
+            _ => None,
+        }
+    }
+}
+
+//
+// Scan the image's rows in parallel chunks.
+//
+fn scan(header: &Header, frame: &[u8], frame_stride: usize, options: &Options) -> Stats {
+    let height = header.height as usize;
+    let jobs = cmp::max(1, cmp::min(height, options.threads() * 4));
+
+    let mut results: Vec<Stats> = (0 .. jobs).map(|_| Stats::new()).collect();
+    match options.thread_pool() {
+        Some(pool) => pool.scope(|scope| spawn_scans(scope, &mut results, header, frame, frame_stride)),
+        None => ::rayon::scope(|scope| spawn_scans(scope, &mut results, header, frame, frame_stride)),
+    }
+
+    let mut stats = Stats::new();
+    for result in results {
+        stats.merge(result);
+    }
+    stats
+}
+
+fn spawn_scans<'s>(scope: &Scope<'s>,
+                   results: &'s mut [Stats],
+                   header: &'s Header,
+                   frame: &'s [u8],
+                   frame_stride: usize)
+{
+    let height = header.height as usize;
+    let stride = header.stride();
+    let jobs = results.len();
+    for (index, stats) in results.iter_mut().enumerate() {
+        let start_row = index * height / jobs;
+        let end_row = (index + 1) * height / jobs;
+        scope.spawn(move |_| {
+            for y in start_row .. end_row {
+                let start = y * frame_stride;
+                stats.scan_row(header, &frame[start .. start + stride]);
+            }
+        });
+    }
+}
+
+//
+// Packs samples of any depth into a row, most significant bits first.
+//
+struct Packer<'a> {
+    out: &'a mut [u8],
+    depth: u8,
+    pos: usize,
+    bits: u16,
+    len: u8,
+}
+
+impl<'a> Packer<'a> {
+    fn new(out: &'a mut [u8], depth: u8) -> Packer<'a> {
+        Packer {
+            out,
+            depth,
+            pos: 0,
+            bits: 0,
+            len: 0,
+        }
+    }
+
+    #[inline(always)]
+    fn put(&mut self, sample: u16) {
+        match self.depth {
+            16 => {
+                self.out[self.pos] = (sample >> 8) as u8;
+                self.out[self.pos + 1] = sample as u8;
+                self.pos += 2;
+            },
+            8 => {
+                self.out[self.pos] = sample as u8;
+                self.pos += 1;
+            },
+            depth => {
+                self.bits = self.bits << depth | sample;
+                self.len += depth;
+                if self.len == 8 {
+                    self.out[self.pos] = self.bits as u8;
+                    self.pos += 1;
+                    self.bits = 0;
+                    self.len = 0;
+                }
+            },
+        }
+    }
+
+    fn finish(self) {
+        if self.len > 0 {
+            self.out[self.pos] = (self.bits << (8 - self.len)) as u8;
+        }
+    }
+}
+
+struct ReductionState {
+    source: Header,
+    header: Header,
+    palette: Vec<u8>,
+    transparency: Vec<u8>,
+    lookup: HashMap<u32, u8>,
+}
+
+/// A smaller color type and bit depth that holds every pixel of an
+/// image exactly, found by scanning it in parallel, along with the
+/// palette and transparency data that needs.
+///
+/// Fully opaque images lose their alpha channel, grey ones their
+/// color channels, 16-bit samples that fit in 8 bits are narrowed,
+/// images with 256 colors or fewer become indexed, and grey levels
+/// or palette indices are packed down to 1, 2, or 4 bits where
+/// they fit.
+///
+/// To use it, attach it to encoder::Options with set_color_reduction(),
+/// write header() in place of the original header, then palette() and
+/// transparency() if present, then the original image: its rows are
+/// converted to the reduced format on the worker threads.
+#[derive(Clone)]
+pub struct ColorReduction {
+    state: Arc<ReductionState>,
+}
+
+impl ColorReduction {
+    /// Scan an image held in memory, with rows every frame_stride
+    /// bytes, using the thread pool from the given options.
+    ///
+    /// Input must be in PNG byte order. Indexed color images and
+    /// those below 8 bits per sample are left as they are.
+    pub fn new(header: &Header, frame: &[u8], frame_stride: usize, options: &Options) -> io::Result<ColorReduction> {
+        let stride = header.stride();
+        if frame_stride < stride {
+            return Err(invalid_input("Frame stride must be at least the row length"));
+        }
+        let height = header.height as usize;
+        let len = frame_stride.checked_mul(height - 1)
+                              .and_then(|len| len.checked_add(stride))
+                              .ok_or_else(|| invalid_input("Frame size overflows"))?;
+        if frame.len() < len {
+            return Err(invalid_input("Frame buffer is too small for the image"));
+        }
+
+        let mut reduced = ReductionState {
+            source: *header,
+            header: *header,
+            palette: Vec::new(),
+            transparency: Vec::new(),
+            lookup: HashMap::new(),
+        };
+        if header.depth < 8 || matches!(header.color_type, ColorType::IndexedColor) {
+            return Ok(ColorReduction {
+                state: Arc::new(reduced),
+            });
+        }
+
+        let stats = scan(header, frame, frame_stride, options);
+
+        //
+        // Pick whichever valid layout takes the fewest bits per pixel,
+        // favoring the earlier ones on a tie.
+        //
+        let depth = if header.depth == 16 && !stats.fits_8 { 16 } else { 8 };
+        let mut best = (header.color_type, header.depth);
+        let mut best_bits = header.color_type.channels() * header.depth as usize;
+        {
+            let mut consider = |color_type: ColorType, depth: u8| {
+                let bits = color_type.channels() * depth as usize;
+                if bits < best_bits {
+                    best = (color_type, depth);
+                    best_bits = bits;
+                }
+            };
+            if stats.grey && stats.opaque {
+                consider(ColorType::Greyscale, if depth == 8 { stats.grey_depth } else { 16 });
+            }
+            if stats.grey {
+                consider(ColorType::GreyscaleAlpha, depth);
+            }
+            if stats.opaque {
+                consider(ColorType::Truecolor, depth);
+            }
+            consider(ColorType::TruecolorAlpha, depth);
+            if let (8, Some(ref colors)) = (depth, &stats.colors) {
+                consider(ColorType::IndexedColor, palette_depth(colors.len()));
+            }
+        }
+        reduced.header.set_color(best.0, best.1)?;
+
+        if let (ColorType::IndexedColor, Some(colors)) = (best.0, stats.colors) {
+            //
+            // Translucent colors go first so the transparency chunk
+            // can stop at the last of them.
+            //
+            let mut colors: Vec<u32> = colors.into_iter().collect();
+            colors.sort_by_key(|&color| (color & 0xff == 0xff, color));
+            for (index, &color) in colors.iter().enumerate() {
+                reduced.palette.extend_from_slice(&[(color >> 24) as u8,
+                                                    (color >> 16) as u8,
+                                                    (color >> 8) as u8]);
+                if color & 0xff != 0xff {
+                    reduced.transparency.push(color as u8);
+                }
+                reduced.lookup.insert(color, index as u8);
+            }
+        }
+
+        Ok(ColorReduction {
+            state: Arc::new(reduced),
+        })
+    }
+
+    /// Return the header to write, with the reduced color type
+    /// and depth.
+    pub fn header(&self) -> Header {
+        self.state.header
+    }
+
+    /// Return the palette to write, for indexed color output.
+    pub fn palette(&self) -> Option<&[u8]> {
+        if self.state.palette.is_empty() {
+            None
+        } else {
+            Some(&self.state.palette)
+        }
+    }
+
+    /// Return the transparency data to write, for indexed color
+    /// output with translucent colors.
+    pub fn transparency(&self) -> Option<&[u8]> {
+        if self.state.transparency.is_empty() {
+            None
+        } else {
+            Some(&self.state.transparency)
+        }
+    }
+
+    /// Check whether the color type or depth changed at all.
+    pub fn is_reduced(&self) -> bool {
+        let state = &*self.state;
+        state.header.color_type as u8 != state.source.color_type as u8 ||
+        state.header.depth != state.source.depth
+    }
+
+    //
+    // Check the encoder's header and input format go with the reduction.
+    //
+    pub(crate) fn validate(&self, header: &Header, format: &InputFormat) -> io::Result<()> {
+        let reduced = &self.state.header;
+        if header.width != reduced.width ||
+           header.height != reduced.height ||
+           header.color_type as u8 != reduced.color_type as u8 ||
+           header.depth != reduced.depth {
+            return Err(invalid_input("Header must match the color reduction's header"));
+        }
+        if format.needs_conversion() {
+            return Err(invalid_input("Color reduction needs input in PNG byte order"));
+        }
+        if format.stride != 0 && format.stride < self.row_bytes(header.width as usize) {
+            return Err(invalid_input("Input stride must be at least the row length"));
+        }
+        Ok(())
+    }
+
+    //
+    // Length of an input row of the given width, in the original format.
+    //
+    pub(crate) fn row_bytes(&self, width: usize) -> usize {
+        let mut source = self.state.source;
+        source.width = width as u32;
+        source.stride()
+    }
+
+    //
+    // Convert a row of the original image to the reduced format.
+    // The output must be the reduced stride in length.
+    //
+    // Rows are given separately from the image that was scanned, so
+    // one can hold a pixel the reduced format can't; that's an error.
+    //
+    pub(crate) fn convert_row(&self, width: usize, src: &[u8], out: &mut [u8]) -> IoResult {
+        let state = &*self.state;
+        let color_type = state.source.color_type;
+        let depth = state.source.depth;
+        let out_depth = state.header.depth;
+        let max = if depth == 16 { 65535 } else { 255 };
+        let step = match state.header.color_type {
+            ColorType::Greyscale if out_depth < 8 => 255 / ((1 << out_depth) - 1),
+            _ => 1,
+        };
+
+        let mismatch = || invalid_input("Row does not match the scanned image");
+        let narrow = |sample: u16| -> io::Result<u16> {
+            if depth == 16 && out_depth < 16 {
+                if sample >> 8 != sample & 0xff {
+                    return Err(mismatch());
+                }
+                Ok(sample >> 8)
+            } else {
+                Ok(sample)
+            }
+        };
+        let rescale = |sample: u16| -> io::Result<u16> {
+            let sample = narrow(sample)?;
+            if sample % step != 0 {
+                return Err(mismatch());
+            }
+            Ok(sample / step)
+        };
+
+        let mut packer = Packer::new(out, out_depth);
+        let mut last = None;
+        for x in 0 .. width {
+            let pixel = pixel(color_type, depth, src, x);
+            let grey = pixel[0] == pixel[1] && pixel[1] == pixel[2];
+            let opaque = pixel[3] == max;
+            match state.header.color_type {
+                ColorType::Greyscale => {
+                    if !grey || !opaque {
+                        return Err(mismatch());
+                    }
+                    packer.put(rescale(pixel[0])?);
+                },
+                ColorType::GreyscaleAlpha => {
+                    if !grey {
+                        return Err(mismatch());
+                    }
+                    packer.put(rescale(pixel[0])?);
+                    packer.put(rescale(pixel[3])?);
+                },
+                ColorType::Truecolor => {
+                    if !opaque {
+                        return Err(mismatch());
+                    }
+                    packer.put(rescale(pixel[0])?);
+                    packer.put(rescale(pixel[1])?);
+                    packer.put(rescale(pixel[2])?);
+                },
+                ColorType::TruecolorAlpha => {
+                    for &sample in pixel.iter() {
+                        packer.put(rescale(sample)?);
+                    }
+                },
+                ColorType::IndexedColor => {
+                    for &sample in pixel.iter() {
+                        narrow(sample)?;
+                    }
+                    let color = rgba8(pixel, depth);
+                    let index = match last {
+                        Some((last_color, index)) if last_color == color => index,
+                        _ => match state.lookup.get(&color) {
+                            Some(&index) => index,
+                            None => return Err(mismatch()),
+                        },
+                    };
+                    last = Some((color, index));
+                    packer.put(u16::from(index));
+                },
+            }
+        }
+        packer.finish();
+        Ok(())
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    fn reduce(color_type: ColorType, depth: u8, pixels: &[u8]) -> (ColorReduction, Vec<u8>) {
+        let mut header = Header::new();
+        let bytes_per_pixel = color_type.channels() * depth as usize / 8;
+        header.set_size((pixels.len() / bytes_per_pixel) as u32, 1).unwrap();
+        header.set_color(color_type, depth).unwrap();
+
+        let reduction = ColorReduction::new(&header, pixels, pixels.len(), &Options::new()).unwrap();
+        let mut out = vec![0u8; reduction.header().stride()];
+        reduction.convert_row(header.width as usize, pixels, &mut out).unwrap();
+        (reduction, out)
+    }
+
+    #[test]
+    fn it_works() {
+        // Opaque grey at levels 4 bits can hold, favored over
+        // a palette of the same depth.
+        let (reduction, out) = reduce(ColorType::TruecolorAlpha, 8, &[0x11, 0x11, 0x11, 255,
+                                                                      0x22, 0x22, 0x22, 255,
+                                                                      0xff, 0xff, 0xff, 255,
+                                                                      0x00, 0x00, 0x00, 255,
+                                                                      0x33, 0x33, 0x33, 255]);
+        assert!(matches!(reduction.header().color_type, ColorType::Greyscale));
+        assert_eq!(reduction.header().depth, 4);
+        assert!(reduction.palette().is_none());
+        assert_eq!(out, vec![0x12, 0xf0, 0x30]);
+
+        // Two colors, one of them translucent, first in the palette.
+        let (reduction, out) = reduce(ColorType::TruecolorAlpha, 8, &[200, 10, 10, 255,
+                                                                      10, 200, 10, 128,
+                                                                      200, 10, 10, 255]);
+        assert!(matches!(reduction.header().color_type, ColorType::IndexedColor));
+        assert_eq!(reduction.header().depth, 1);
+        assert_eq!(reduction.palette().unwrap(), &[10, 200, 10, 200, 10, 10]);
+        assert_eq!(reduction.transparency().unwrap(), &[128]);
+        assert_eq!(out, vec![0b1010_0000]);
+
+        // 16-bit samples with equal bytes narrow to 8, here with
+        // too many colors for a palette.
+        let mut pixels = Vec::new();
+        for i in 0 .. 300 {
+            let grey = (i % 256) as u8;
+            let alpha = (i / 256 * 100 + 50) as u8;
+            pixels.extend_from_slice(&[grey, grey, alpha, alpha]);
+        }
+        let (reduction, out) = reduce(ColorType::GreyscaleAlpha, 16, &pixels);
+        assert!(matches!(reduction.header().color_type, ColorType::GreyscaleAlpha));
+        assert_eq!(reduction.header().depth, 8);
+        assert_eq!(&out[.. 4], &[0, 50, 1, 50]);
+        assert_eq!(&out[512 .. 514], &[0, 150]);
+
+        // And nothing to be gained leaves it as it is.
+        let levels: Vec<u8> = (0 ..= 255).collect();
+        let (reduction, _) = reduce(ColorType::Greyscale, 8, &levels);
+        assert!(!reduction.is_reduced());
+    }
+
+    #[test]
+    fn rejects_unscanned_rows() {
+        let check = |color_type: ColorType, depth: u8, pixels: &[u8], other: &[u8], reduced: ColorType| {
+            let (reduction, _) = reduce(color_type, depth, pixels);
+            assert!(reduction.header().color_type as u8 == reduced as u8);
+            let width = pixels.len() / (color_type.channels() * depth as usize / 8);
+            let mut out = vec![0u8; reduction.header().stride()];
+            assert!(reduction.convert_row(width, other, &mut out).is_err());
+        };
+
+        // 300 distinct levels, too many for a palette.
+        let greys: Vec<u8> = (0 .. 300).flat_map(|i| {
+            let level = (i % 256) as u8;
+            vec![level, level, level, 255]
+        }).collect();
+        let mut colored = greys.clone();
+        colored[1] ^= 1;
+        check(ColorType::TruecolorAlpha, 8, &greys, &colored, ColorType::Greyscale);
+        let mut translucent = greys.clone();
+        translucent[3] = 128;
+        check(ColorType::TruecolorAlpha, 8, &greys, &translucent, ColorType::Greyscale);
+
+        // Grey with alpha loses color.
+        let mut grey_alpha = greys.clone();
+        for (i, pixel) in grey_alpha.chunks_mut(4).enumerate() {
+            pixel[3] = (i % 3 * 100) as u8;
+        }
+        let mut colored = grey_alpha.clone();
+        colored[2] ^= 1;
+        check(ColorType::TruecolorAlpha, 8, &grey_alpha, &colored, ColorType::GreyscaleAlpha);
+
+        // Opaque color loses alpha.
+        let truecolor: Vec<u8> = (0 .. 300).flat_map(|i| {
+            vec![(i % 256) as u8, (i / 2) as u8, 7, 255]
+        }).collect();
+        let mut translucent = truecolor.clone();
+        translucent[7] = 0;
+        check(ColorType::TruecolorAlpha, 8, &truecolor, &translucent, ColorType::Truecolor);
+
+        // 16-bit samples narrowed to 8 lose their low byte.
+        let wide: Vec<u8> = (0 .. 300).flat_map(|i| {
+            let (r, g) = ((i % 256) as u8, (i / 2) as u8);
+            vec![r, r, g, g, 7, 7, (i % 2) as u8, (i % 2) as u8]
+        }).collect();
+        let mut uneven = wide.clone();
+        uneven[1] ^= 1;
+        check(ColorType::TruecolorAlpha, 16, &wide, &uneven, ColorType::TruecolorAlpha);
+
+        // Grey packed below 8 bits loses levels between the steps.
+        let levels: [u8; 6] = [0x00, 0x11, 0x22, 0x33, 0x44, 0xff];
+        let mut between = levels;
+        between[1] = 0x12;
+        check(ColorType::Greyscale, 8, &levels, &between, ColorType::Greyscale);
+
+        // A color missing from the palette.
+        let two: [u8; 8] = [200, 10, 10, 255, 10, 200, 10, 128];
+        let mut third = two;
+        third[0] = 100;
+        check(ColorType::TruecolorAlpha, 8, &two, &third, ColorType::IndexedColor);
+        let mut uneven: [u8; 8] = [200, 200, 10, 10, 10, 10, 255, 255];
+        let even = uneven;
+        uneven[1] = 201;
+        check(ColorType::TruecolorAlpha, 16, &even, &uneven, ColorType::IndexedColor);
+    }
+}
@@ -0,0 +1,538 @@
+//
+// mtpng - a multithreaded parallel PNG encoder in Rust
+// simd.rs - vector kernels for the PNG filters
+//
+// Copyright (c) 2018-2024 Brooke Vibber
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+//
+
+//
+// When encoding, the filters only ever look at source pixels, never
+// at previously filtered output, so there's no serial dependency on
+// the left pixel as there is when decoding. Every output byte can be
+// computed independently, which lets a single kernel handle any
+// number of bytes per pixel by loading the left and upper-left
+// neighbors from bpp bytes back.
+//
+// Each filter kernel filters the bytes of one row, not including the
+// filter type byte. Each score kernel runs all four of the Sub, Up,
+// Average, and Paeth filters together over a row, summing up their
+// complexity heuristics without storing the output. The first pixel,
+// which has no left neighbor, and any leftover bytes at the end that
+// don't fill a vector go through the scalar code.
+//
+// These are only safe to call on CPUs with the relevant features;
+// see filter::Kernels for the runtime selection.
+//
+
+#[cfg(any(target_arch = "x86", target_arch = "x86_64"))]
+pub mod x86 {
+    #[cfg(target_arch = "x86")]
+    use std::arch::x86::*;
+    #[cfg(target_arch = "x86_64")]
+    use std::arch::x86_64::*;
+
+    use std::cmp;
+
+    use super::super::filter::{filter_range, score_range, score_total};
+    use super::super::filter::{sub_delta, up_delta, average_delta, paeth_delta};
+
+    #[inline(always)]
+    unsafe fn load128(bytes: &[u8], i: usize) -> __m128i {
+        _mm_loadu_si128(bytes.as_ptr().add(i) as *const __m128i)
+    }
+
+    #[inline(always)]
+    unsafe fn store128(bytes: &mut [u8], i: usize, val: __m128i) {
+        _mm_storeu_si128(bytes.as_mut_ptr().add(i) as *mut __m128i, val)
+    }
+
+    #[inline(always)]
+    unsafe fn load256(bytes: &[u8], i: usize) -> __m256i {
+        _mm256_loadu_si256(bytes.as_ptr().add(i) as *const __m256i)
+    }
+
+    #[inline(always)]
+    unsafe fn store256(bytes: &mut [u8], i: usize, val: __m256i) {
+        _mm256_storeu_si256(bytes.as_mut_ptr().add(i) as *mut __m256i, val)
+    }
+
+    //
+    // Paeth predictor on 16-bit lanes.
+    // Same comparisons as filter::paeth_predictor.
+    //
+    #[inline(always)]
+    unsafe fn paeth_epi16_sse41(a: __m128i, b: __m128i, c: __m128i) -> __m128i {
+        let pa = _mm_abs_epi16(_mm_sub_epi16(b, c));
+        let pb = _mm_abs_epi16(_mm_sub_epi16(a, c));
+        let pc = _mm_abs_epi16(_mm_add_epi16(_mm_sub_epi16(a, c), _mm_sub_epi16(b, c)));
+        let not_a = _mm_or_si128(_mm_cmpgt_epi16(pa, pb), _mm_cmpgt_epi16(pa, pc));
+        let not_b = _mm_cmpgt_epi16(pb, pc);
+        _mm_blendv_epi8(a, _mm_blendv_epi8(b, c, not_b), not_a)
+    }
+
+    #[inline(always)]
+    unsafe fn paeth_epi16_avx2(a: __m256i, b: __m256i, c: __m256i) -> __m256i {
+        let pa = _mm256_abs_epi16(_mm256_sub_epi16(b, c));
+        let pb = _mm256_abs_epi16(_mm256_sub_epi16(a, c));
+        let pc = _mm256_abs_epi16(_mm256_add_epi16(_mm256_sub_epi16(a, c), _mm256_sub_epi16(b, c)));
+        let not_a = _mm256_or_si256(_mm256_cmpgt_epi16(pa, pb), _mm256_cmpgt_epi16(pa, pc));
+        let not_b = _mm256_cmpgt_epi16(pb, pc);
+        _mm256_blendv_epi8(a, _mm256_blendv_epi8(b, c, not_b), not_a)
+    }
+
+    //
+    // Filter deltas for 16 bytes at a time.
+    //
+
+    #[inline(always)]
+    unsafe fn average_sse41(val: __m128i, left: __m128i, above: __m128i) -> __m128i {
+        // avg_epu8 rounds up; knock off the odd bit to round down.
+        let round = _mm_and_si128(_mm_xor_si128(left, above), _mm_set1_epi8(1));
+        let avg = _mm_sub_epi8(_mm_avg_epu8(left, above), round);
+        _mm_sub_epi8(val, avg)
+    }
+
+    #[inline(always)]
+    unsafe fn paeth_sse41(val: __m128i, left: __m128i, above: __m128i, upper_left: __m128i) -> __m128i {
+        let zero = _mm_setzero_si128();
+        let lo = paeth_epi16_sse41(_mm_unpacklo_epi8(left, zero),
+                                   _mm_unpacklo_epi8(above, zero),
+                                   _mm_unpacklo_epi8(upper_left, zero));
+        let hi = paeth_epi16_sse41(_mm_unpackhi_epi8(left, zero),
+                                   _mm_unpackhi_epi8(above, zero),
+                                   _mm_unpackhi_epi8(upper_left, zero));
+        _mm_sub_epi8(val, _mm_packus_epi16(lo, hi))
+    }
+
+    //
+    // Add the complexity heuristic of 16 deltas to two 64-bit sums.
+    //
+    #[inline(always)]
+    unsafe fn complexity_sse41(sum: __m128i, delta: __m128i) -> __m128i {
+        _mm_add_epi64(sum, _mm_sad_epu8(_mm_abs_epi8(delta), _mm_setzero_si128()))
+    }
+
+    #[inline(always)]
+    unsafe fn total_sse41(sum: __m128i) -> u64 {
+        let mut lanes = [0u64; 2];
+        _mm_storeu_si128(lanes.as_mut_ptr() as *mut __m128i, sum);
+        lanes[0] + lanes[1]
+    }
+
+    //
+    // Kernels for 16 bytes at a time.
+    //
+
+    #[target_feature(enable = "sse4.1")]
+    pub unsafe fn filter_sub_sse41(bpp: usize, prev: &[u8], src: &[u8], out: &mut [u8]) {
+        let len = out.len();
+        assert!(src.len() >= len && prev.len() >= len);
+
+        let mut i = cmp::min(bpp, len);
+        filter_range(bpp, prev, src, out, 0, i, sub_delta);
+        while i + 16 <= len {
+            let val = load128(src, i);
+            let left = load128(src, i - bpp);
+            store128(out, i, _mm_sub_epi8(val, left));
+            i += 16;
+        }
+        filter_range(bpp, prev, src, out, i, len, sub_delta);
+    }
+
+    #[target_feature(enable = "sse4.1")]
+    pub unsafe fn filter_up_sse41(bpp: usize, prev: &[u8], src: &[u8], out: &mut [u8]) {
+        let len = out.len();
+        assert!(src.len() >= len && prev.len() >= len);
+
+        let mut i = 0;
+        while i + 16 <= len {
+            let val = load128(src, i);
+            let above = load128(prev, i);
+            store128(out, i, _mm_sub_epi8(val, above));
+            i += 16;
+        }
+        filter_range(bpp, prev, src, out, i, len, up_delta);
+    }
+
+    #[target_feature(enable = "sse4.1")]
+    pub unsafe fn filter_average_sse41(bpp: usize, prev: &[u8], src: &[u8], out: &mut [u8]) {
+        let len = out.len();
+        assert!(src.len() >= len && prev.len() >= len);
+
+        let mut i = cmp::min(bpp, len);
+        filter_range(bpp, prev, src, out, 0, i, average_delta);
+        while i + 16 <= len {
+            let val = load128(src, i);
+            let left = load128(src, i - bpp);
+            let above = load128(prev, i);
+            store128(out, i, average_sse41(val, left, above));
+            i += 16;
+        }
+        filter_range(bpp, prev, src, out, i, len, average_delta);
+    }
+
+    #[target_feature(enable = "sse4.1")]
+    pub unsafe fn filter_paeth_sse41(bpp: usize, prev: &[u8], src: &[u8], out: &mut [u8]) {
+        let len = out.len();
+        assert!(src.len() >= len && prev.len() >= len);
+
+        let mut i = cmp::min(bpp, len);
+        filter_range(bpp, prev, src, out, 0, i, paeth_delta);
+        while i + 16 <= len {
+            let val = load128(src, i);
+            let left = load128(src, i - bpp);
+            let above = load128(prev, i);
+            let upper_left = load128(prev, i - bpp);
+            store128(out, i, paeth_sse41(val, left, above, upper_left));
+            i += 16;
+        }
+        filter_range(bpp, prev, src, out, i, len, paeth_delta);
+    }
+
+    #[target_feature(enable = "sse4.1")]
+    pub unsafe fn score_sse41(bpp: usize, prev: &[u8], src: &[u8]) -> [u32; 4] {
+        let len = src.len();
+        assert!(prev.len() >= len);
+
+        let mut sums = [0u64; 4];
+        let mut sub = _mm_setzero_si128();
+        let mut up = _mm_setzero_si128();
+        let mut average = _mm_setzero_si128();
+        let mut paeth = _mm_setzero_si128();
+
+        let mut i = cmp::min(bpp, len);
+        score_range(bpp, prev, src, 0, i, &mut sums);
+        while i + 16 <= len {
+            let val = load128(src, i);
+            let left = load128(src, i - bpp);
+            let above = load128(prev, i);
+            let upper_left = load128(prev, i - bpp);
+            sub = complexity_sse41(sub, _mm_sub_epi8(val, left));
+            up = complexity_sse41(up, _mm_sub_epi8(val, above));
+            average = complexity_sse41(average, average_sse41(val, left, above));
+            paeth = complexity_sse41(paeth, paeth_sse41(val, left, above, upper_left));
+            i += 16;
+        }
+        score_range(bpp, prev, src, i, len, &mut sums);
+
+        sums[0] += total_sse41(sub);
+        sums[1] += total_sse41(up);
+        sums[2] += total_sse41(average);
+        sums[3] += total_sse41(paeth);
+        score_total(&sums)
+    }
+
+    //
+    // Filter deltas for 32 bytes at a time.
+    //
+    // The AVX2 unpack and pack instructions work within each 128-bit
+    // half, so a round trip through 16-bit lanes keeps bytes in order.
+    //
+
+    #[inline(always)]
+    unsafe fn average_avx2(val: __m256i, left: __m256i, above: __m256i) -> __m256i {
+        let round = _mm256_and_si256(_mm256_xor_si256(left, above), _mm256_set1_epi8(1));
+        let avg = _mm256_sub_epi8(_mm256_avg_epu8(left, above), round);
+        _mm256_sub_epi8(val, avg)
+    }
+
+    #[inline(always)]
+    unsafe fn paeth_avx2(val: __m256i, left: __m256i, above: __m256i, upper_left: __m256i) -> __m256i {
+        let zero = _mm256_setzero_si256();
+        let lo = paeth_epi16_avx2(_mm256_unpacklo_epi8(left, zero),
+                                  _mm256_unpacklo_epi8(above, zero),
+                                  _mm256_unpacklo_epi8(upper_left, zero));
+        let hi = paeth_epi16_avx2(_mm256_unpackhi_epi8(left, zero),
+                                  _mm256_unpackhi_epi8(above, zero),
+                                  _mm256_unpackhi_epi8(upper_left, zero));
+        _mm256_sub_epi8(val, _mm256_packus_epi16(lo, hi))
+    }
+
+    #[inline(always)]
+    unsafe fn complexity_avx2(sum: __m256i, delta: __m256i) -> __m256i {
+        _mm256_add_epi64(sum, _mm256_sad_epu8(_mm256_abs_epi8(delta), _mm256_setzero_si256()))
+    }
+
+    #[inline(always)]
+    unsafe fn total_avx2(sum: __m256i) -> u64 {
+        let mut lanes = [0u64; 4];
+        _mm256_storeu_si256(lanes.as_mut_ptr() as *mut __m256i, sum);
+        lanes[0] + lanes[1] + lanes[2] + lanes[3]
+    }
+
+    //
+    // Kernels for 32 bytes at a time.
+    //
+
+    #[target_feature(enable = "avx2")]
+    pub unsafe fn filter_sub_avx2(bpp: usize, prev: &[u8], src: &[u8], out: &mut [u8]) {
+        let len = out.len();
+        assert!(src.len() >= len && prev.len() >= len);
+
+        let mut i = cmp::min(bpp, len);
+        filter_range(bpp, prev, src, out, 0, i, sub_delta);
+        while i + 32 <= len {
+            let val = load256(src, i);
+            let left = load256(src, i - bpp);
+            store256(out, i, _mm256_sub_epi8(val, left));
+            i += 32;
+        }
+        filter_range(bpp, prev, src, out, i, len, sub_delta);
+    }
+
+    #[target_feature(enable = "avx2")]
+    pub unsafe fn filter_up_avx2(bpp: usize, prev: &[u8], src: &[u8], out: &mut [u8]) {
+        let len = out.len();
+        assert!(src.len() >= len && prev.len() >= len);
+
+        let mut i = 0;
+        while i + 32 <= len {
+            let val = load256(src, i);
+            let above = load256(prev, i);
+            store256(out, i, _mm256_sub_epi8(val, above));
+            i += 32;
+        }
+        filter_range(bpp, prev, src, out, i, len, up_delta);
+    }
+
+    #[target_feature(enable = "avx2")]
+    pub unsafe fn filter_average_avx2(bpp: usize, prev: &[u8], src: &[u8], out: &mut [u8]) {
+        let len = out.len();
+        assert!(src.len() >= len && prev.len() >= len);
+
+        let mut i = cmp::min(bpp, len);
+        filter_range(bpp, prev, src, out, 0, i, average_delta);
+        while i + 32 <= len {
+            let val = load256(src, i);
+            let left = load256(src, i - bpp);
+            let above = load256(prev, i);
+            store256(out, i, average_avx2(val, left, above));
+            i += 32;
+        }
+        filter_range(bpp, prev, src, out, i, len, average_delta);
+    }
+
+    #[target_feature(enable = "avx2")]
+    pub unsafe fn filter_paeth_avx2(bpp: usize, prev: &[u8], src: &[u8], out: &mut [u8]) {
+        let len = out.len();
+        assert!(src.len() >= len && prev.len() >= len);
+
+        let mut i = cmp::min(bpp, len);
+        filter_range(bpp, prev, src, out, 0, i, paeth_delta);
+        while i + 32 <= len {
+            let val = load256(src, i);
+            let left = load256(src, i - bpp);
+            let above = load256(prev, i);
+            let upper_left = load256(prev, i - bpp);
+            store256(out, i, paeth_avx2(val, left, above, upper_left));
+            i += 32;
+        }
+        filter_range(bpp, prev, src, out, i, len, paeth_delta);
+    }
+
+    #[target_feature(enable = "avx2")]
+    pub unsafe fn score_avx2(bpp: usize, prev: &[u8], src: &[u8]) -> [u32; 4] {
+        let len = src.len();
+        assert!(prev.len() >= len);
+
+        let mut sums = [0u64; 4];
+        let mut sub = _mm256_setzero_si256();
+        let mut up = _mm256_setzero_si256();
+        let mut average = _mm256_setzero_si256();
+        let mut paeth = _mm256_setzero_si256();
+
+        let mut i = cmp::min(bpp, len);
+        score_range(bpp, prev, src, 0, i, &mut sums);
+        while i + 32 <= len {
+            let val = load256(src, i);
+            let left = load256(src, i - bpp);
+            let above = load256(prev, i);
+            let upper_left = load256(prev, i - bpp);
+            sub = complexity_avx2(sub, _mm256_sub_epi8(val, left));
+            up = complexity_avx2(up, _mm256_sub_epi8(val, above));
+            average = complexity_avx2(average, average_avx2(val, left, above));
+            paeth = complexity_avx2(paeth, paeth_avx2(val, left, above, upper_left));
+            i += 32;
+        }
+        score_range(bpp, prev, src, i, len, &mut sums);
+
+        sums[0] += total_avx2(sub);
+        sums[1] += total_avx2(up);
+        sums[2] += total_avx2(average);
+        sums[3] += total_avx2(paeth);
+        score_total(&sums)
+    }
+}
+
+//
+// NEON is always present on aarch64, so these need no runtime check.
+//
+#[cfg(target_arch = "aarch64")]
+pub mod neon {
+    use std::arch::aarch64::*;
+
+    use std::cmp;
+
+    use super::super::filter::{filter_range, score_range, score_total};
+    use super::super::filter::{sub_delta, up_delta, average_delta, paeth_delta};
+
+    #[inline(always)]
+    unsafe fn load(bytes: &[u8], i: usize) -> uint8x16_t {
+        vld1q_u8(bytes.as_ptr().add(i))
+    }
+
+    #[inline(always)]
+    unsafe fn store(bytes: &mut [u8], i: usize, val: uint8x16_t) {
+        vst1q_u8(bytes.as_mut_ptr().add(i), val)
+    }
+
+    //
+    // Paeth predictor on eight bytes, with the distances widened
+    // to 16 bits. Same comparisons as filter::paeth_predictor.
+    //
+    #[inline(always)]
+    unsafe fn paeth_u8x8(a: uint8x8_t, b: uint8x8_t, c: uint8x8_t) -> uint8x8_t {
+        let da = vreinterpretq_s16_u16(vsubl_u8(a, c));
+        let db = vreinterpretq_s16_u16(vsubl_u8(b, c));
+        let pa = vabsq_s16(db);
+        let pb = vabsq_s16(da);
+        let pc = vabsq_s16(vaddq_s16(da, db));
+        let not_a = vmovn_u16(vorrq_u16(vcgtq_s16(pa, pb), vcgtq_s16(pa, pc)));
+        let not_b = vmovn_u16(vcgtq_s16(pb, pc));
+        vbsl_u8(not_a, vbsl_u8(not_b, c, b), a)
+    }
+
+    #[inline(always)]
+    unsafe fn paeth(val: uint8x16_t, left: uint8x16_t, above: uint8x16_t, upper_left: uint8x16_t) -> uint8x16_t {
+        let lo = paeth_u8x8(vget_low_u8(left),
+                            vget_low_u8(above),
+                            vget_low_u8(upper_left));
+        let hi = paeth_u8x8(vget_high_u8(left),
+                            vget_high_u8(above),
+                            vget_high_u8(upper_left));
+        vsubq_u8(val, vcombine_u8(lo, hi))
+    }
+
+    //
+    // Add the complexity heuristic of 16 deltas to two 64-bit sums.
+    // abs(-128) wraps to 0x80, which is still right read as unsigned.
+    //
+    #[inline(always)]
+    unsafe fn complexity(sum: uint64x2_t, delta: uint8x16_t) -> uint64x2_t {
+        let abs = vreinterpretq_u8_s8(vabsq_s8(vreinterpretq_s8_u8(delta)));
+        vpadalq_u32(sum, vpaddlq_u16(vpaddlq_u8(abs)))
+    }
+
+    pub unsafe fn filter_sub_neon(bpp: usize, prev: &[u8], src: &[u8], out: &mut [u8]) {
+        let len = out.len();
+        assert!(src.len() >= len && prev.len() >= len);
+
+        let mut i = cmp::min(bpp, len);
+        filter_range(bpp, prev, src, out, 0, i, sub_delta);
+        while i + 16 <= len {
+            let val = load(src, i);
+            let left = load(src, i - bpp);
+            store(out, i, vsubq_u8(val, left));
+            i += 16;
+        }
+        filter_range(bpp, prev, src, out, i, len, sub_delta);
+    }
+
+    pub unsafe fn filter_up_neon(bpp: usize, prev: &[u8], src: &[u8], out: &mut [u8]) {
+        let len = out.len();
+        assert!(src.len() >= len && prev.len() >= len);
+
+        let mut i = 0;
+        while i + 16 <= len {
+            let val = load(src, i);
+            let above = load(prev, i);
+            store(out, i, vsubq_u8(val, above));
+            i += 16;
+        }
+        filter_range(bpp, prev, src, out, i, len, up_delta);
+    }
+
+    pub unsafe fn filter_average_neon(bpp: usize, prev: &[u8], src: &[u8], out: &mut [u8]) {
+        let len = out.len();
+        assert!(src.len() >= len && prev.len() >= len);
+
+        let mut i = cmp::min(bpp, len);
+        filter_range(bpp, prev, src, out, 0, i, average_delta);
+        while i + 16 <= len {
+            let val = load(src, i);
+            let left = load(src, i - bpp);
+            let above = load(prev, i);
+            // Halving add rounds down, as the filter wants.
+            store(out, i, vsubq_u8(val, vhaddq_u8(left, above)));
+            i += 16;
+        }
+        filter_range(bpp, prev, src, out, i, len, average_delta);
+    }
+
+    pub unsafe fn filter_paeth_neon(bpp: usize, prev: &[u8], src: &[u8], out: &mut [u8]) {
+        let len = out.len();
+        assert!(src.len() >= len && prev.len() >= len);
+
+        let mut i = cmp::min(bpp, len);
+        filter_range(bpp, prev, src, out, 0, i, paeth_delta);
+        while i + 16 <= len {
+            let val = load(src, i);
+            let left = load(src, i - bpp);
+            let above = load(prev, i);
+            let upper_left = load(prev, i - bpp);
+            store(out, i, paeth(val, left, above, upper_left));
+            i += 16;
+        }
+        filter_range(bpp, prev, src, out, i, len, paeth_delta);
+    }
+
+    pub unsafe fn score_neon(bpp: usize, prev: &[u8], src: &[u8]) -> [u32; 4] {
+        let len = src.len();
+        assert!(prev.len() >= len);
+
+        let mut sums = [0u64; 4];
+        let mut sub = vdupq_n_u64(0);
+        let mut up = vdupq_n_u64(0);
+        let mut average = vdupq_n_u64(0);
+        let mut paeth_sum = vdupq_n_u64(0);
+
+        let mut i = cmp::min(bpp, len);
+        score_range(bpp, prev, src, 0, i, &mut sums);
+        while i + 16 <= len {
+            let val = load(src, i);
+            let left = load(src, i - bpp);
+            let above = load(prev, i);
+            let upper_left = load(prev, i - bpp);
+            sub = complexity(sub, vsubq_u8(val, left));
+            up = complexity(up, vsubq_u8(val, above));
+            average = complexity(average, vsubq_u8(val, vhaddq_u8(left, above)));
+            paeth_sum = complexity(paeth_sum, paeth(val, left, above, upper_left));
+            i += 16;
+        }
+        score_range(bpp, prev, src, i, len, &mut sums);
+
+        sums[0] += vaddvq_u64(sub);
+        sums[1] += vaddvq_u64(up);
+        sums[2] += vaddvq_u64(average);
+        sums[3] += vaddvq_u64(paeth_sum);
+        score_total(&sums)
+    }
+}
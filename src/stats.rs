@@ -0,0 +1,270 @@
+//
+// mtpng - a multithreaded parallel PNG encoder in Rust
+// stats.rs - per-chunk timings and trace spans
+//
+// Copyright (c) 2018-2024 Brooke Vibber
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+//
+
+//
+// Each chunk passes through several hands on its way out: it waits
+// to be dispatched, is filtered on one worker, waits on its neighbor,
+// is compressed on another, waits for the chunks before it, and is
+// written by the encoder's thread. The timestamps are cheap to take,
+// so each chunk carries its own through the pipeline, and they're
+// gathered up here as it's written out.
+//
+
+use std::sync::Arc;
+use std::sync::Mutex;
+
+use std::time::{Duration, Instant};
+
+/// A stage of encoding, for trace spans.
+#[repr(u8)]
+#[derive(Copy, Clone, PartialEq, Eq, Debug)]
+pub enum Stage {
+    /// Filtering a chunk's rows, on a worker thread.
+    Filter = 0,
+    /// Compressing a chunk, on a worker thread.
+    Deflate = 1,
+    /// Writing a chunk's output, on the encoder's thread.
+    Write = 2,
+    /// Blocked on the encoder's thread, waiting for the workers to
+    /// make room for more input or to finish.
+    Wait = 3,
+}
+
+/// A span of time one stage took, for Encoder::set_trace_func().
+#[derive(Copy, Clone, Debug)]
+pub struct Span {
+    pub stage: Stage,
+    /// Index of the chunk, counting across animation frames; for
+    /// Wait, the next chunk to be input.
+    pub chunk: usize,
+    pub start: Instant,
+    pub duration: Duration,
+}
+
+/// Timings and sizes for one chunk of image data.
+#[derive(Copy, Clone, Debug, Default)]
+pub struct ChunkStats {
+    /// Index of the chunk, counting across animation frames.
+    pub index: usize,
+    pub rows: usize,
+
+    /// Filtered bytes, including the filter type bytes.
+    pub bytes_in: usize,
+    /// Compressed bytes.
+    pub bytes_out: usize,
+
+    /// From all the chunk's rows coming in until a worker started
+    /// filtering them; includes waiting for room among the jobs in
+    /// flight, and for a free worker.
+    pub queue_wait: Duration,
+    pub filter_time: Duration,
+    /// From filtering until a worker started compressing; includes
+    /// waiting for the previous chunk's filtering to finish, as the
+    /// dictionary comes from it.
+    pub handoff_wait: Duration,
+    pub deflate_time: Duration,
+    /// From compressing until written out, waiting on chunks before it.
+    pub output_wait: Duration,
+    pub write_time: Duration,
+
+    /// Rows filtered with each filter type, indexed by Filter value.
+    pub filters: [usize; 5],
+
+    /// Whether the compressed data came from a chunk cache.
+    pub reused: bool,
+}
+
+/// Totals for an encode.
+#[derive(Copy, Clone, Debug, Default)]
+pub struct Summary {
+    /// Chunks written out so far.
+    pub chunks: usize,
+    pub threads: usize,
+
+    /// From writing the header until the last chunk was written out.
+    pub elapsed: Duration,
+
+    /// Sums over the chunks; see ChunkStats.
+    pub bytes_in: usize,
+    pub bytes_out: usize,
+    pub queue_wait: Duration,
+    pub filter_time: Duration,
+    pub handoff_wait: Duration,
+    pub deflate_time: Duration,
+    pub output_wait: Duration,
+    pub write_time: Duration,
+    pub filters: [usize; 5],
+    pub reused: usize,
+
+    /// Time the encoder's thread spent blocked on the workers, either
+    /// in taking more input or while flushing and finishing.
+    pub blocked_time: Duration,
+
+    /// Thread time over the elapsed time not spent filtering or
+    /// compressing, on all threads together.
+    pub worker_idle: Duration,
+}
+
+struct StatsState {
+    threads: usize,
+    started: Option<Instant>,
+    last_output: Option<Instant>,
+    blocked_time: Duration,
+    chunks: Vec<ChunkStats>,
+}
+
+/// Collects timings of each stage of each chunk, to find out where
+/// the time goes in an encode and tune chunk size and thread count.
+///
+/// Attach to encoder::Options with set_stats(). Each encode starts
+/// the stats afresh when it writes its header, and adds each chunk
+/// as it's written out, so they may be read during an encode or
+/// after. Share one between encoders running at the same time only
+/// if you don't mind their chunks being mixed together.
+#[derive(Clone)]
+pub struct Stats {
+    state: Arc<Mutex<StatsState>>,
+}
+
+impl Stats {
+    /// Create a new empty set of stats.
+    pub fn new() -> Stats {
+        Stats {
+            state: Arc::new(Mutex::new(StatsState {
+                threads: 0,
+                started: None,
+                last_output: None,
+                blocked_time: Duration::default(),
+                chunks: Vec::new(),
+            })),
+        }
+    }
+
+    /// Return the stats of each chunk written out so far, in order.
+    pub fn chunks(&self) -> Vec<ChunkStats> {
+        match self.state.lock() {
+            Ok(state) => state.chunks.clone(),
+            Err(_) => Vec::new(),
+        }
+    }
+
+    /// Return the totals over all chunks written out so far.
+    pub fn summary(&self) -> Summary {
+        let state = match self.state.lock() {
+            Ok(state) => state,
+            Err(_) => return Summary::default(),
+        };
+        let mut summary = Summary {
+            chunks: state.chunks.len(),
+            threads: state.threads,
+            blocked_time: state.blocked_time,
+            ..Summary::default()
+        };
+        if let (Some(started), Some(last_output)) = (state.started, state.last_output) {
+            summary.elapsed = last_output.saturating_duration_since(started);
+        }
+        for chunk in state.chunks.iter() {
+            summary.bytes_in += chunk.bytes_in;
+            summary.bytes_out += chunk.bytes_out;
+            summary.queue_wait += chunk.queue_wait;
+            summary.filter_time += chunk.filter_time;
+            summary.handoff_wait += chunk.handoff_wait;
+            summary.deflate_time += chunk.deflate_time;
+            summary.output_wait += chunk.output_wait;
+            summary.write_time += chunk.write_time;
+            for (total, count) in summary.filters.iter_mut().zip(chunk.filters.iter()) {
+                *total += count;
+            }
+            if chunk.reused {
+                summary.reused += 1;
+            }
+        }
+        let capacity = summary.elapsed * summary.threads as u32;
+        let busy = summary.filter_time + summary.deflate_time;
+        summary.worker_idle = capacity.checked_sub(busy).unwrap_or_default();
+        summary
+    }
+
+    /// Drop all collected stats.
+    pub fn clear(&self) {
+        if let Ok(mut state) = self.state.lock() {
+            state.started = None;
+            state.last_output = None;
+            state.blocked_time = Duration::default();
+            state.chunks = Vec::new();
+        }
+    }
+
+    //
+    // Start over for a new encode.
+    //
+    pub(crate) fn start(&self, threads: usize) {
+        self.clear();
+        if let Ok(mut state) = self.state.lock() {
+            state.threads = threads;
+            state.started = Some(Instant::now());
+        }
+    }
+
+    pub(crate) fn add_chunk(&self, chunk: ChunkStats) {
+        if let Ok(mut state) = self.state.lock() {
+            state.last_output = Some(Instant::now());
+            state.chunks.push(chunk);
+        }
+    }
+
+    pub(crate) fn add_blocked(&self, duration: Duration) {
+        if let Ok(mut state) = self.state.lock() {
+            state.blocked_time += duration;
+        }
+    }
+}
+
+impl Default for Stats {
+    fn default() -> Self {
+        Self::new()
+    }
+}
+
+/// Callback for Encoder::set_trace_func(), called on the worker
+/// threads and the encoder's thread as each stage finishes.
+pub type TraceFunc = Arc<dyn Fn(&Span) + Send + Sync>;
+
+//
+// Report a span running from start until now, if tracing, and
+// return its length.
+//
+pub(crate) fn trace(func: &Option<TraceFunc>, stage: Stage, chunk: usize, start: Instant) -> Duration {
+    let duration = start.elapsed();
+    if let Some(ref func) = *func {
+        func(&Span {
+            stage,
+            chunk,
+            start,
+            duration,
+        });
+    }
+    duration
+}
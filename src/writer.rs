@@ -27,14 +27,83 @@ use crc::crc32;
 use crc::Hasher32;
 
 use std::io;
-use std::io::Write;
+use std::io::{IoSlice, Seek, SeekFrom, Write};
 
+use std::mem;
+
+use std::sync::Arc;
+
+use super::FrameControl;
 use super::Header;
 
+use super::deflate;
+use super::encoder::BufferFunc;
+
 use super::utils::*;
 
+//
+// Function that overwrites bytes earlier in the output, at the given
+// offset relative to the current position, then returns to where it
+// was. Used to fill in the length of a chunk after writing its data.
+//
+pub type PatchFunc<W> = fn(&mut W, i64, &[u8]) -> IoResult;
+
+//
+// PatchFunc implementation for seekable outputs.
+//
+pub fn seek_patch<W: Write + Seek>(output: &mut W, offset: i64, bytes: &[u8]) -> IoResult {
+    output.seek(SeekFrom::Current(offset))?;
+    output.write_all(bytes)?;
+    output.seek(SeekFrom::Current(-offset - bytes.len() as i64))?;
+    Ok(())
+}
+
+//
+// Write all the given pieces in as few calls as the output allows,
+// so each chunk's length, tag, data, and checksum can go out in one
+// writev() rather than four writes.
+//
+pub fn write_all_vectored<W: Write>(output: &mut W, parts: &[&[u8]]) -> IoResult {
+    let mut parts: Vec<&[u8]> = parts.iter().cloned().filter(|part| !part.is_empty()).collect();
+    let mut start = 0;
+    while start < parts.len() {
+        let slices: Vec<IoSlice> = parts[start ..].iter().map(|part| IoSlice::new(part)).collect();
+        let mut written = match output.write_vectored(&slices) {
+            Ok(0) => return Err(io::Error::new(io::ErrorKind::WriteZero, "failed to write whole buffer")),
+            Ok(n) => n,
+            Err(ref e) if e.kind() == io::ErrorKind::Interrupted => continue,
+            Err(e) => return Err(e),
+        };
+
+        // Skip past whatever went out, which may end mid-piece.
+        while written > 0 {
+            let len = parts[start].len();
+            if written >= len {
+                written -= len;
+                start += 1;
+            } else {
+                parts[start] = &parts[start][written ..];
+                written = 0;
+            }
+        }
+    }
+    Ok(())
+}
+
+// State of a chunk being written in pieces.
+struct OpenChunk {
+    crc32: u32,
+    len: usize,
+}
+
 pub struct Writer<W: Write> {
     output: W,
+    open_chunk: Option<OpenChunk>,
+
+    // If set, takes all output as buffers instead of the Write sink;
+    // the bytes between shared buffers collect in pending.
+    buffer_func: Option<BufferFunc>,
+    pending: Vec<u8>,
 }
 
 impl<W: Write> Writer<W> {
@@ -46,9 +115,21 @@ impl<W: Write> Writer<W> {
     pub fn new(output: W) -> Writer<W> {
         Writer {
             output,
+            open_chunk: None,
+            buffer_func: None,
+            pending: Vec::new(),
         }
     }
 
+    //
+    // Hand all further output to the function as buffers in order,
+    // instead of writing it to the output. Output can't be patched
+    // after that.
+    //
+    pub fn set_buffer_func(&mut self, func: BufferFunc) {
+        self.buffer_func = Some(func);
+    }
+
     //
     // Close out the writer and return the Write
     // passed in originally so it can be used for
@@ -80,11 +161,54 @@ impl<W: Write> Writer<W> {
     }
 
     fn write_be32(&mut self, val: u32) -> IoResult {
-        write_be32(&mut self.output, val)
+        self.write_parts(&[&val.to_be_bytes()])
     }
 
     fn write_bytes(&mut self, data: &[u8]) -> IoResult {
-        self.output.write_all(data)
+        self.write_parts(&[data])
+    }
+
+    fn write_parts(&mut self, parts: &[&[u8]]) -> IoResult {
+        if self.buffer_func.is_some() {
+            for part in parts {
+                self.pending.extend_from_slice(part);
+            }
+            Ok(())
+        } else {
+            write_all_vectored(&mut self.output, parts)
+        }
+    }
+
+    //
+    // Write a buffer shared with the rest of the encoder. With a
+    // buffer function set it's handed over as is, after anything
+    // pending, instead of being copied.
+    //
+    fn write_shared(&mut self, head: &[u8], data: &Arc<Vec<u8>>, tail: &[u8]) -> IoResult {
+        match self.buffer_func {
+            Some(ref mut func) => {
+                self.pending.extend_from_slice(head);
+                if !self.pending.is_empty() {
+                    func(Arc::new(mem::take(&mut self.pending)))?;
+                }
+                func(Arc::clone(data))?;
+                self.pending.extend_from_slice(tail);
+                Ok(())
+            },
+            None => write_all_vectored(&mut self.output, &[head, data, tail]),
+        }
+    }
+
+    //
+    // Hand anything pending over to the buffer function.
+    //
+    fn write_pending(&mut self) -> IoResult {
+        if let Some(ref mut func) = self.buffer_func {
+            if !self.pending.is_empty() {
+                func(Arc::new(mem::take(&mut self.pending)))?;
+            }
+        }
+        Ok(())
     }
 
     //
@@ -100,6 +224,9 @@ impl<W: Write> Writer<W> {
         if data.len() > u32::max_value() as usize {
             return Err(invalid_input("Data chunks cannot exceed 4 GiB - 1 byte"));
         }
+        if self.open_chunk.is_some() {
+            return Err(invalid_input("Cannot write a chunk while another is open"));
+        }
 
         // CRC covers both tag and data.
         let mut digest = crc32::Digest::new(crc32::IEEE);
@@ -108,10 +235,121 @@ impl<W: Write> Writer<W> {
         let checksum = digest.sum32();
 
         // Write data...
-        self.write_be32(data.len() as u32)?;
-        self.write_bytes(tag)?;
-        self.write_bytes(data)?;
-        self.write_be32(checksum)
+        self.write_parts(&[&(data.len() as u32).to_be_bytes(),
+                           tag,
+                           data,
+                           &checksum.to_be_bytes()])
+    }
+
+    //
+    // Write a chunk holding a shared buffer, between an optional
+    // prefix and trailer, given the CRC-32 of the buffer already
+    // computed elsewhere, such as on a worker thread. With a buffer
+    // function set, the buffer goes out without being copied.
+    //
+    pub fn write_shared_chunk(&mut self,
+                              tag: &[u8],
+                              prefix: &[u8],
+                              data: &Arc<Vec<u8>>,
+                              data_crc: u32,
+                              trailer: &[u8]) -> IoResult {
+        if tag.len() != 4 {
+            return Err(invalid_input("Chunk tags must be 4 bytes"));
+        }
+        let len = prefix.len() + data.len() + trailer.len();
+        if len > u32::max_value() as usize {
+            return Err(invalid_input("Data chunks cannot exceed 4 GiB - 1 byte"));
+        }
+        if self.open_chunk.is_some() {
+            return Err(invalid_input("Cannot write a chunk while another is open"));
+        }
+
+        // CRC covers the tag, prefix, data, and trailer.
+        let mut checksum = deflate::crc32(deflate::crc32_initial(), tag);
+        checksum = deflate::crc32(checksum, prefix);
+        checksum = deflate::crc32_combine(checksum, data_crc, data.len());
+        checksum = deflate::crc32(checksum, trailer);
+
+        let mut head = Vec::<u8>::with_capacity(8 + prefix.len());
+        write_be32(&mut head, len as u32)?;
+        head.extend_from_slice(tag);
+        head.extend_from_slice(prefix);
+
+        let mut tail = Vec::<u8>::with_capacity(trailer.len() + 4);
+        tail.extend_from_slice(trailer);
+        write_be32(&mut tail, checksum)?;
+
+        self.write_shared(&head, data, &tail)
+    }
+
+    //
+    // Start writing a chunk whose length isn't known yet.
+    // A placeholder length is written, to be filled in later
+    // by end_chunk(). Only one chunk may be open at a time.
+    //
+    pub fn start_chunk(&mut self, tag: &[u8]) -> IoResult {
+        if tag.len() != 4 {
+            return Err(invalid_input("Chunk tags must be 4 bytes"));
+        }
+        if self.open_chunk.is_some() {
+            return Err(invalid_input("Cannot start a chunk while another is open"));
+        }
+
+        self.write_parts(&[&[0u8; 4], tag])?;
+        self.open_chunk = Some(OpenChunk {
+            crc32: deflate::crc32(deflate::crc32_initial(), tag),
+            len: 0,
+        });
+        Ok(())
+    }
+
+    //
+    // Append data to the open chunk.
+    //
+    pub fn write_chunk_data(&mut self, data: &[u8]) -> IoResult {
+        let data_crc = deflate::crc32(deflate::crc32_initial(), data);
+        self.write_chunk_data_with_crc(data, data_crc)
+    }
+
+    //
+    // Append data to the open chunk, given the CRC-32 of
+    // the data already computed elsewhere.
+    //
+    pub fn write_chunk_data_with_crc(&mut self, data: &[u8], data_crc: u32) -> IoResult {
+        match self.open_chunk {
+            Some(ref mut chunk) => {
+                if data.len() > u32::max_value() as usize - chunk.len {
+                    return Err(invalid_input("Data chunks cannot exceed 4 GiB - 1 byte"));
+                }
+                chunk.crc32 = deflate::crc32_combine(chunk.crc32, data_crc, data.len());
+                chunk.len += data.len();
+            },
+            None => return Err(invalid_input("No chunk is open")),
+        }
+        self.write_bytes(data)
+    }
+
+    //
+    // Finish the open chunk, going back to fill in its length
+    // with the given patch function.
+    //
+    pub fn end_chunk(&mut self, patch: PatchFunc<W>) -> IoResult {
+        if self.buffer_func.is_some() {
+            return Err(other("Cannot patch output handed over as buffers"));
+        }
+        match self.open_chunk.take() {
+            Some(chunk) => {
+                let mut len = Vec::<u8>::new();
+                write_be32(&mut len, chunk.len as u32)?;
+
+                // Length field is before the tag and data.
+                let offset = -(chunk.len as i64 + 8);
+                patch(&mut self.output, offset, &len)?;
+
+                self.write_be32(chunk.crc32)
+            },
+            None => Err(invalid_input("No chunk is open")),
+        }
     }
 
     //
@@ -131,6 +369,51 @@ impl<W: Write> Writer<W> {
         self.write_chunk(b"IHDR", &data)
     }
 
+    //
+    // acTL - APNG animation control, before any image data.
+    // https://wiki.mozilla.org/APNG_Specification#.60acTL.60:_The_Animation_Control_Chunk
+    //
+    pub fn write_animation_control(&mut self, num_frames: u32, num_plays: u32) -> IoResult {
+        let mut data = Vec::<u8>::new();
+        write_be32(&mut data, num_frames)?;
+        write_be32(&mut data, num_plays)?;
+
+        self.write_chunk(b"acTL", &data)
+    }
+
+    //
+    // fcTL - APNG frame control, before each frame's data.
+    // https://wiki.mozilla.org/APNG_Specification#.60fcTL.60:_The_Frame_Control_Chunk
+    //
+    pub fn write_frame_control(&mut self, sequence: u32, frame: &FrameControl) -> IoResult {
+        let mut data = Vec::<u8>::new();
+        write_be32(&mut data, sequence)?;
+        write_be32(&mut data, frame.width)?;
+        write_be32(&mut data, frame.height)?;
+        write_be32(&mut data, frame.x_offset)?;
+        write_be32(&mut data, frame.y_offset)?;
+        write_be16(&mut data, frame.delay_num)?;
+        write_be16(&mut data, frame.delay_den)?;
+        write_byte(&mut data, frame.dispose_op as u8)?;
+        write_byte(&mut data, frame.blend_op as u8)?;
+
+        self.write_chunk(b"fcTL", &data)
+    }
+
+    //
+    // fdAT - APNG frame data, like IDAT but with a sequence number,
+    // given the CRC-32 of the data already computed elsewhere.
+    // The trailer, if any, is appended after the data.
+    // https://wiki.mozilla.org/APNG_Specification#.60fdAT.60:_The_Frame_Data_Chunk
+    //
+    pub fn write_frame_data_with_crc(&mut self,
+                                     sequence: u32,
+                                     data: &Arc<Vec<u8>>,
+                                     data_crc: u32,
+                                     trailer: &[u8]) -> IoResult {
+        self.write_shared_chunk(b"fdAT", &sequence.to_be_bytes(), data, data_crc, trailer)
+    }
+
     //
     // IEND - last chunk in the file.
     // https://www.w3.org/TR/PNG/#11IEND
@@ -143,6 +426,7 @@ impl<W: Write> Writer<W> {
     // Flush output.
     //
     pub fn flush(&mut self) -> IoResult {
+        self.write_pending()?;
         self.output.flush()
     }
 }
@@ -150,9 +434,14 @@ impl<W: Write> Writer<W> {
 #[cfg(test)]
 mod tests {
     use std::io;
+    use std::io::{Cursor, IoSlice, Write};
+
+    use std::sync::{Arc, Mutex};
 
     use super::Writer;
     use super::IoResult;
+    use super::seek_patch;
+    use super::deflate;
 
     fn test_writer<F, G>(test_func: F, assert_func: G)
         where F: Fn(&mut Writer<Vec<u8>>) -> IoResult,
@@ -226,4 +515,121 @@ mod tests {
             assert_eq!(output[20..24], b"\xa3\x0a\x15\xe3"[..], "expected crc32");
         })
     }
+
+    #[test]
+    fn precomputed_crc_works() {
+        let one_pixel = b"\x08\x99\x63\x60\x60\x60\x00\x00\x00\x04\x00\x01";
+        test_writer(|writer| {
+            // Combine the checksums of two separately-summed pieces.
+            let crc_a = deflate::crc32(deflate::crc32_initial(), &one_pixel[0 .. 5]);
+            let crc_b = deflate::crc32(deflate::crc32_initial(), &one_pixel[5 ..]);
+            let data_crc = deflate::crc32_combine(crc_a, crc_b, one_pixel.len() - 5);
+            writer.write_shared_chunk(b"IDAT", &[], &Arc::new(one_pixel.to_vec()), data_crc, &[])
+        }, |output| {
+            assert_eq!(output[0..4], b"\x00\x00\x00\x0c"[..], "expected length 12");
+            assert_eq!(output[20..24], b"\xa3\x0a\x15\xe3"[..], "expected crc32");
+        })
+    }
+
+    #[test]
+    fn open_chunk_works() {
+        let one_pixel = b"\x08\x99\x63\x60\x60\x60\x00\x00\x00\x04\x00\x01";
+
+        let mut writer = Writer::new(Cursor::new(Vec::<u8>::new()));
+        writer.write_signature().unwrap();
+        writer.start_chunk(b"IDAT").unwrap();
+        writer.write_chunk_data(&one_pixel[0 .. 5]).unwrap();
+        writer.write_chunk_data(&one_pixel[5 ..]).unwrap();
+        writer.end_chunk(seek_patch).unwrap();
+        let output = writer.finish().unwrap().into_inner();
+
+        assert_eq!(output.len(), 8 + 24);
+        assert_eq!(output[8..12], b"\x00\x00\x00\x0c"[..], "expected length 12");
+        assert_eq!(output[12..16], b"IDAT"[..], "expected IDAT");
+        assert_eq!(output[16..28], one_pixel[..], "expected data payload");
+        assert_eq!(output[28..32], b"\xa3\x0a\x15\xe3"[..], "expected crc32");
+    }
+
+    // Takes at most limit bytes per call, counting the calls.
+    struct Trickle {
+        data: Vec<u8>,
+        calls: usize,
+        limit: usize,
+    }
+
+    impl Write for Trickle {
+        fn write(&mut self, buf: &[u8]) -> io::Result<usize> {
+            self.write_vectored(&[IoSlice::new(buf)])
+        }
+
+        fn write_vectored(&mut self, bufs: &[IoSlice]) -> io::Result<usize> {
+            self.calls += 1;
+            let mut written = 0;
+            for buf in bufs {
+                let len = std::cmp::min(buf.len(), self.limit - written);
+                self.data.extend_from_slice(&buf[.. len]);
+                written += len;
+                if written == self.limit {
+                    break;
+                }
+            }
+            Ok(written)
+        }
+
+        fn flush(&mut self) -> io::Result<()> {
+            Ok(())
+        }
+    }
+
+    #[test]
+    fn vectored_works() {
+        let data = b"01234567890123456789";
+        let mut expected = Vec::<u8>::new();
+        Writer::new(&mut expected).write_chunk(b"IDAT", data).unwrap();
+
+        // One call for the whole chunk when the output takes it all.
+        let mut writer = Writer::new(Trickle { data: Vec::new(), calls: 0, limit: 100 });
+        writer.write_chunk(b"IDAT", data).unwrap();
+        let output = writer.finish().unwrap();
+        assert_eq!(output.calls, 1);
+        assert_eq!(output.data, expected);
+
+        // And short writes pick up where they left off.
+        let mut writer = Writer::new(Trickle { data: Vec::new(), calls: 0, limit: 7 });
+        writer.write_chunk(b"IDAT", data).unwrap();
+        let output = writer.finish().unwrap();
+        assert_eq!(output.calls, 5);
+        assert_eq!(output.data, expected);
+    }
+
+    #[test]
+    fn buffer_func_works() {
+        let data = Arc::new(b"01234567890123456789".to_vec());
+        let crc = deflate::crc32(deflate::crc32_initial(), &data);
+        let mut expected = Vec::<u8>::new();
+        {
+            let mut writer = Writer::new(&mut expected);
+            writer.write_signature().unwrap();
+            writer.write_chunk(b"IDAT", &data).unwrap();
+            writer.write_end().unwrap();
+        }
+
+        let buffers = Arc::new(Mutex::new(Vec::<Arc<Vec<u8>>>::new()));
+        let handed = Arc::clone(&buffers);
+        let mut writer = Writer::new(Vec::<u8>::new());
+        writer.set_buffer_func(Box::new(move |buffer| {
+            handed.lock().unwrap().push(buffer);
+            Ok(())
+        }));
+        writer.write_signature().unwrap();
+        writer.write_shared_chunk(b"IDAT", &[], &data, crc, &[]).unwrap();
+        writer.write_end().unwrap();
+        assert_eq!(writer.finish().unwrap().len(), 0);
+
+        // The data goes over as the same buffer, between the rest.
+        let buffers = buffers.lock().unwrap();
+        assert_eq!(buffers.len(), 3);
+        assert!(Arc::ptr_eq(&buffers[1], &data));
+        assert_eq!(buffers.iter().flat_map(|buffer| buffer.iter().cloned()).collect::<Vec<u8>>(), expected);
+    }
 }